@@ -0,0 +1,154 @@
+// This sample renders independent map tiles on every core with cpu.h and reports how
+// throughput scales with the number of threads. Each thread owns its device context and
+// brushes, while the geometries, gradient stop collection and bitmap are created once
+// and shared by all threads without any locking. A fence publishes the shared pattern
+// bitmap before any thread draws with it.
+//
+// Compile: cl /nologo /W4 /EHsc /O2 CpuTiles.cpp
+// Elsewhere: g++ -std=c++11 -O2 CpuTiles.cpp -lpthread
+
+#include "../cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace KennyKerr;
+using namespace KennyKerr::Cpu;
+
+unsigned const TILE_SIZE = 256;
+unsigned const TILES_PER_THREAD = 64;
+
+struct SharedScene
+{
+    PathGeometry Road;
+    EllipseGeometry Park;
+    GradientStopCollection Water;
+    Bitmap Pattern;
+    Fence Ready;
+};
+
+static auto CreateRoad() -> PathGeometry
+{
+    auto road = CreatePathGeometry();
+    auto sink = road.Open();
+    sink.BeginFigure(Point2F(0.0f, 40.0f), FigureBegin::Filled);
+    sink.AddBezier(BezierSegment(Point2F(80.0f, 0.0f), Point2F(160.0f, 240.0f), Point2F(256.0f, 200.0f)));
+    sink.AddLine(Point2F(256.0f, 216.0f));
+    sink.AddBezier(BezierSegment(Point2F(160.0f, 256.0f), Point2F(80.0f, 16.0f), Point2F(0.0f, 56.0f)));
+    sink.EndFigure(FigureEnd::Closed);
+    sink.Close();
+    return road;
+}
+
+static void FillPattern(Bitmap const & pattern)
+{
+    auto const size = pattern.GetPixelSize();
+    std::vector<std::uint32_t> pixels(size.Width * size.Height);
+
+    for (unsigned y = 0; y != size.Height; ++y)
+    {
+        for (unsigned x = 0; x != size.Width; ++x)
+        {
+            pixels[y * size.Width + x] = (x / 4 + y / 4) % 2 ? 0xff2e7d32 : 0xff388e3c;
+        }
+    }
+
+    pattern.CopyFromMemory(pixels.data(), size.Width * 4);
+    pattern.SetImmutable();
+}
+
+static void RenderTile(DeviceContext const & context,
+                       SharedScene const & scene,
+                       unsigned const tile)
+{
+    auto const offset = static_cast<float>(tile % 16) * 4.0f;
+
+    auto const building = context.CreateSolidColorBrush(Color(0.8f, 0.78f, 0.74f), ResourceLifetime::Transient);
+    auto const road = context.CreateSolidColorBrush(Color(0.98f, 0.75f, 0.2f), ResourceLifetime::Transient);
+    auto const water = context.CreateLinearGradientBrush(LinearGradientBrushProperties(Point2F(0.0f, 160.0f), Point2F(0.0f, 256.0f)),
+                                                         scene.Water,
+                                                         ResourceLifetime::Transient);
+    auto const park = context.CreateBitmapBrush(scene.Pattern,
+                                                BitmapBrushProperties(ExtendMode::Wrap, ExtendMode::Wrap),
+                                                ResourceLifetime::Transient);
+
+    context.BeginDraw();
+    context.Clear(Color(0.93f, 0.91f, 0.85f));
+    context.FillRectangle(RectF(0.0f, 160.0f + offset, 256.0f, 256.0f), water);
+    context.SetTransform(Matrix3x2F::Translation(offset, 0.0f));
+    context.FillGeometry(scene.Park, park);
+    context.FillGeometry(scene.Road, road);
+    context.SetTransform(Matrix3x2F());
+
+    for (unsigned i = 0; i != 8; ++i)
+    {
+        auto const left = 12.0f + i * 30.0f;
+        context.FillRectangle(RectF(left, 100.0f + offset, left + 20.0f, 130.0f + offset), building);
+    }
+    HR(context.EndDraw());
+}
+
+static auto Measure(SharedScene const & scene,
+                    unsigned const threadCount) -> double
+{
+    std::vector<std::thread> threads;
+    auto const start = std::chrono::steady_clock::now();
+
+    for (unsigned i = 0; i != threadCount; ++i)
+    {
+        threads.emplace_back([&scene]
+        {
+            auto const context = CreateDeviceContext();
+            context.SetTarget(CreateBitmap(SizeU(TILE_SIZE, TILE_SIZE)));
+            scene.Ready.Wait(1);
+
+            for (unsigned tile = 0; tile != TILES_PER_THREAD; ++tile)
+            {
+                RenderTile(context, scene, tile);
+            }
+        });
+    }
+
+    for (auto & thread : threads)
+    {
+        thread.join();
+    }
+
+    auto const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return threadCount * TILES_PER_THREAD / seconds;
+}
+
+// Run: CpuTiles [maximum thread count]
+int main(int argc, char ** argv)
+{
+    GradientStop const stops[] =
+    {
+        GradientStop(0.0f, Color(0.56f, 0.79f, 0.98f)),
+        GradientStop(1.0f, Color(0.1f, 0.46f, 0.82f)),
+    };
+
+    SharedScene scene;
+    scene.Road = CreateRoad();
+    scene.Park = CreateEllipseGeometry(Ellipse(Point2F(150.0f, 90.0f), 60.0f, 40.0f));
+    scene.Water = CreateDeviceContext().CreateGradientStopCollection(stops);
+    scene.Pattern = CreateBitmap(SizeU(64, 64));
+    scene.Ready = CreateFence();
+
+    std::thread publisher([&scene]
+    {
+        FillPattern(scene.Pattern);
+        scene.Ready.Signal(1);
+    });
+
+    publisher.join();
+
+    auto const hardware = 1 < argc ? static_cast<unsigned>(atoi(argv[1])) : (std::max)(1u, std::thread::hardware_concurrency());
+    auto const single = Measure(scene, 1);
+    printf("threads  tiles/s  speedup\n");
+    printf("%7u %8.0f %8.2f\n", 1u, single, 1.0);
+
+    for (auto threadCount = 2u; threadCount <= hardware; threadCount *= 2)
+    {
+        auto const rate = Measure(scene, threadCount);
+        printf("%7u %8.0f %8.2f\n", threadCount, rate, rate / single);
+    }
+}
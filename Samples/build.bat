@@ -13,5 +13,6 @@ cl /nologo /W4 LinearGradient.cpp
 cl /nologo /W4 RadialGradient.cpp
 cl /nologo /W4 WicBitmapRenderTarget.cpp
 cl /nologo /W4 /EHsc 3DCube.cpp
+cl /nologo /W4 /EHsc /O2 CpuTiles.cpp
 
 del *.obj
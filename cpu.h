@@ -0,0 +1,19552 @@
+#pragma once
+
+// Portable CPU implementations of dx.h functionality.
+// On Windows this builds on dx.h. Elsewhere it provides the subset of the
+// dx.h types it relies on so that the same code compiles unchanged.
+
+#ifdef _WIN32
+#include "dx.h"
+#else
+#include <cassert>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifndef KENNYKERR_CPU_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KENNYKERR_CPU_SSE2
+#endif
+#if defined(__SSSE3__) || defined(__AVX__)
+#define KENNYKERR_CPU_SSSE3
+#endif
+#if defined(__AVX2__)
+#define KENNYKERR_CPU_AVX2
+#endif
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define KENNYKERR_CPU_F16C
+#endif
+#endif
+
+#ifdef KENNYKERR_CPU_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef KENNYKERR_CPU_SSSE3
+#include <tmmintrin.h>
+#endif
+#if defined(KENNYKERR_CPU_AVX2) || defined(KENNYKERR_CPU_F16C)
+#include <immintrin.h>
+#endif
+
+#ifndef _WIN32
+
+#ifndef ASSERT
+#define ASSERT(expression) assert(expression)
+#endif
+
+#ifndef VERIFY
+#ifdef NDEBUG
+#define VERIFY(expression) (expression)
+#else
+#define VERIFY(expression) ASSERT(expression)
+#endif
+#endif
+
+#ifndef TRACE
+#define TRACE(...) ((void)0)
+#endif
+
+namespace KennyKerr
+{
+    typedef std::int32_t HRESULT;
+
+    HRESULT const S_OK                                = 0;
+    HRESULT const S_FALSE                             = 1;
+    HRESULT const E_FAIL                              = static_cast<HRESULT>(0x80004005);
+    HRESULT const E_INVALIDARG                        = static_cast<HRESULT>(0x80070057);
+    HRESULT const E_OUTOFMEMORY                       = static_cast<HRESULT>(0x8007000E);
+    HRESULT const E_NOTIMPL                           = static_cast<HRESULT>(0x80004001);
+    HRESULT const WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT = static_cast<HRESULT>(0x88982F80);
+    HRESULT const WINCODEC_ERR_UNSUPPORTEDVERSION     = static_cast<HRESULT>(0x88982F0B);
+    HRESULT const WINCODEC_ERR_BADHEADER              = static_cast<HRESULT>(0x88982F61);
+    HRESULT const D2DERR_WRONG_STATE                  = static_cast<HRESULT>(0x88990001);
+    HRESULT const D2DERR_PUSH_POP_UNBALANCED          = static_cast<HRESULT>(0x88990016);
+    HRESULT const D2DERR_POP_CALL_DID_NOT_MATCH_PUSH  = static_cast<HRESULT>(0x88990017);
+    HRESULT const DWRITE_E_FILEFORMAT                 = static_cast<HRESULT>(0x88985000);
+
+    struct Exception
+    {
+        HRESULT result;
+        explicit Exception(HRESULT const value) : result(value) {}
+    };
+
+    inline void HR(HRESULT const result)
+    {
+        ASSERT(S_OK == result);
+        if (S_OK != result) throw Exception(result);
+    }
+
+    enum class AlphaMode
+    {
+        Unknown       = 0,
+        Premultiplied = 1,
+        Straight      = 2,
+        Ignore        = 3,
+    };
+
+    namespace Dxgi
+    {
+        enum class Format
+        {
+            Unknown                    = 0,
+            R32G32B32A32_TYPELESS      = 1,
+            R32G32B32A32_FLOAT         = 2,
+            R32G32B32A32_UINT          = 3,
+            R32G32B32A32_SINT          = 4,
+            R32G32B32_TYPELESS         = 5,
+            R32G32B32_FLOAT            = 6,
+            R32G32B32_UINT             = 7,
+            R32G32B32_SINT             = 8,
+            R16G16B16A16_TYPELESS      = 9,
+            R16G16B16A16_FLOAT         = 10,
+            R16G16B16A16_UNORM         = 11,
+            R16G16B16A16_UINT          = 12,
+            R16G16B16A16_SNORM         = 13,
+            R16G16B16A16_SINT          = 14,
+            R32G32_TYPELESS            = 15,
+            R32G32_FLOAT               = 16,
+            R32G32_UINT                = 17,
+            R32G32_SINT                = 18,
+            R32G8X24_TYPELESS          = 19,
+            D32_FLOAT_S8X24_UINT       = 20,
+            R32_FLOAT_X8X24_TYPELESS   = 21,
+            X32_TYPELESS_G8X24_UINT    = 22,
+            R10G10B10A2_TYPELESS       = 23,
+            R10G10B10A2_UNORM          = 24,
+            R10G10B10A2_UINT           = 25,
+            R11G11B10_FLOAT            = 26,
+            R8G8B8A8_TYPELESS          = 27,
+            R8G8B8A8_UNORM             = 28,
+            R8G8B8A8_UNORM_SRGB        = 29,
+            R8G8B8A8_UINT              = 30,
+            R8G8B8A8_SNORM             = 31,
+            R8G8B8A8_SINT              = 32,
+            R16G16_TYPELESS            = 33,
+            R16G16_FLOAT               = 34,
+            R16G16_UNORM               = 35,
+            R16G16_UINT                = 36,
+            R16G16_SNORM               = 37,
+            R16G16_SINT                = 38,
+            R32_TYPELESS               = 39,
+            D32_FLOAT                  = 40,
+            R32_FLOAT                  = 41,
+            R32_UINT                   = 42,
+            R32_SINT                   = 43,
+            R24G8_TYPELESS             = 44,
+            D24_UNORM_S8_UINT          = 45,
+            R24_UNORM_X8_TYPELESS      = 46,
+            X24_TYPELESS_G8_UINT       = 47,
+            R8G8_TYPELESS              = 48,
+            R8G8_UNORM                 = 49,
+            R8G8_UINT                  = 50,
+            R8G8_SNORM                 = 51,
+            R8G8_SINT                  = 52,
+            R16_TYPELESS               = 53,
+            R16_FLOAT                  = 54,
+            D16_UNORM                  = 55,
+            R16_UNORM                  = 56,
+            R16_UINT                   = 57,
+            R16_SNORM                  = 58,
+            R16_SINT                   = 59,
+            R8_TYPELESS                = 60,
+            R8_UNORM                   = 61,
+            R8_UINT                    = 62,
+            R8_SNORM                   = 63,
+            R8_SINT                    = 64,
+            A8_UNORM                   = 65,
+            R1_UNORM                   = 66,
+            R9G9B9E5_SHAREDEXP         = 67,
+            R8G8_B8G8_UNORM            = 68,
+            G8R8_G8B8_UNORM            = 69,
+            BC1_TYPELESS               = 70,
+            BC1_UNORM                  = 71,
+            BC1_UNORM_SRGB             = 72,
+            BC2_TYPELESS               = 73,
+            BC2_UNORM                  = 74,
+            BC2_UNORM_SRGB             = 75,
+            BC3_TYPELESS               = 76,
+            BC3_UNORM                  = 77,
+            BC3_UNORM_SRGB             = 78,
+            BC4_TYPELESS               = 79,
+            BC4_UNORM                  = 80,
+            BC4_SNORM                  = 81,
+            BC5_TYPELESS               = 82,
+            BC5_UNORM                  = 83,
+            BC5_SNORM                  = 84,
+            B5G6R5_UNORM               = 85,
+            B5G5R5A1_UNORM             = 86,
+            B8G8R8A8_UNORM             = 87,
+            B8G8R8X8_UNORM             = 88,
+            R10G10B10_XR_BIAS_A2_UNORM = 89,
+            B8G8R8A8_TYPELESS          = 90,
+            B8G8R8A8_UNORM_SRGB        = 91,
+            B8G8R8X8_TYPELESS          = 92,
+            B8G8R8X8_UNORM_SRGB        = 93,
+            BC6H_TYPELESS              = 94,
+            BC6H_UF16                  = 95,
+            BC6H_SF16                  = 96,
+            BC7_TYPELESS               = 97,
+            BC7_UNORM                  = 98,
+            BC7_UNORM_SRGB             = 99,
+            AYUV                       = 100,
+            Y410                       = 101,
+            Y416                       = 102,
+            NV12                       = 103,
+            P010                       = 104,
+            P016                       = 105,
+            OPAQUE_420                 = 106,
+            YUY2                       = 107,
+            Y210                       = 108,
+            Y216                       = 109,
+            NV11                       = 110,
+            AI44                       = 111,
+            IA44                       = 112,
+            P8                         = 113,
+            A8P8                       = 114,
+            B4G4R4A4_UNORM             = 115,
+        };
+
+    } // Dxgi
+
+    struct SizeU
+    {
+        explicit SizeU(unsigned const width  = 0,
+                       unsigned const height = 0) :
+            Width(width),
+            Height(height)
+        {}
+
+        unsigned Width;
+        unsigned Height;
+    };
+
+    struct SizeF
+    {
+        explicit SizeF(float const width  = 0.0f,
+                       float const height = 0.0f) :
+            Width(width),
+            Height(height)
+        {}
+
+        float Width;
+        float Height;
+    };
+
+    struct Point2F
+    {
+        explicit Point2F(float const x = 0.0f,
+                         float const y = 0.0f) :
+            X(x),
+            Y(y)
+        {}
+
+        float X;
+        float Y;
+    };
+
+    struct Point2U
+    {
+        explicit Point2U(unsigned const x = 0,
+                         unsigned const y = 0) :
+            X(x),
+            Y(y)
+        {}
+
+        unsigned X;
+        unsigned Y;
+    };
+
+    struct RectF
+    {
+        static RectF Infinite()
+        {
+            return RectF(-FLT_MAX,
+                         -FLT_MAX,
+                         FLT_MAX,
+                         FLT_MAX);
+        }
+
+        explicit RectF(float const left   = 0.0f,
+                       float const top    = 0.0f,
+                       float const right  = 0.0f,
+                       float const bottom = 0.0f) :
+            Left(left),
+            Top(top),
+            Right(right),
+            Bottom(bottom)
+        {}
+
+        auto Width() const -> float
+        {
+            return Right - Left;
+        }
+
+        auto Height() const -> float
+        {
+            return Bottom - Top;
+        }
+
+        float Left;
+        float Top;
+        float Right;
+        float Bottom;
+    };
+
+    struct RectU
+    {
+        explicit RectU(unsigned const left   = 0,
+                       unsigned const top    = 0,
+                       unsigned const right  = 0,
+                       unsigned const bottom = 0) :
+            Left(left),
+            Top(top),
+            Right(right),
+            Bottom(bottom)
+        {}
+
+        auto Width() const -> unsigned
+        {
+            return Right - Left;
+        }
+
+        auto Height() const -> unsigned
+        {
+            return Bottom - Top;
+        }
+
+        unsigned Left;
+        unsigned Top;
+        unsigned Right;
+        unsigned Bottom;
+    };
+
+    struct Color
+    {
+        explicit Color(float const red   = 0.0f,
+                       float const green = 0.0f,
+                       float const blue  = 0.0f,
+                       float const alpha = 1.0f) :
+            Red(red),
+            Green(green),
+            Blue(blue),
+            Alpha(alpha)
+        {}
+
+        float Red;
+        float Green;
+        float Blue;
+        float Alpha;
+    };
+
+    struct PixelFormat
+    {
+        explicit PixelFormat(Dxgi::Format const format          = Dxgi::Format::Unknown,
+                             KennyKerr::AlphaMode const mode    = KennyKerr::AlphaMode::Unknown) :
+            Format(format),
+            AlphaMode(mode)
+        {}
+
+        Dxgi::Format Format;
+        KennyKerr::AlphaMode AlphaMode;
+    };
+
+} // KennyKerr
+
+#endif
+
+namespace KennyKerr
+{
+    namespace Cpu
+    {
+        namespace Details // code in Details namespace is for internal use within the library
+        {
+            // ThreadPool runs batches of independent work items on a fixed set of
+            // worker threads. The submitting thread participates in the batch.
+            // Nested or concurrent submissions simply run on the calling thread.
+            class ThreadPool
+            {
+                std::vector<std::thread> m_threads;
+                std::mutex m_submit;
+                std::mutex m_lock;
+                std::condition_variable m_wake;
+                std::condition_variable m_done;
+                std::function<void(unsigned)> const * m_work;
+                std::atomic<unsigned> m_next;
+                std::atomic<unsigned> m_pending;
+                std::atomic<bool> m_running;
+                unsigned m_count;
+                unsigned m_generation;
+                unsigned m_active;
+                bool m_exit;
+
+                static auto IsWorker() -> bool &
+                {
+                    static thread_local bool worker = false;
+                    return worker;
+                }
+
+                void Drain()
+                {
+                    for (;;)
+                    {
+                        auto const index = m_next++;
+
+                        if (index >= m_count)
+                        {
+                            break;
+                        }
+
+                        (*m_work)(index);
+
+                        if (1 == m_pending--)
+                        {
+                            std::lock_guard<std::mutex> lock(m_lock);
+                            m_done.notify_all();
+                        }
+                    }
+                }
+
+                void Worker()
+                {
+                    IsWorker() = true;
+                    unsigned seen = 0;
+
+                    for (;;)
+                    {
+                        std::unique_lock<std::mutex> lock(m_lock);
+                        m_wake.wait(lock, [&] { return m_exit || seen != m_generation; });
+
+                        if (m_exit)
+                        {
+                            return;
+                        }
+
+                        seen = m_generation;
+                        ++m_active;
+                        lock.unlock();
+
+                        Drain();
+
+                        lock.lock();
+
+                        if (0 == --m_active)
+                        {
+                            m_done.notify_all();
+                        }
+                    }
+                }
+
+                ThreadPool() :
+                    m_work(nullptr),
+                    m_next(0),
+                    m_pending(0),
+                    m_running(false),
+                    m_count(0),
+                    m_generation(0),
+                    m_active(0),
+                    m_exit(false)
+                {
+                    auto const hardware = std::thread::hardware_concurrency();
+
+                    for (unsigned i = 1; i < hardware; ++i)
+                    {
+                        m_threads.emplace_back([this] { Worker(); });
+                    }
+                }
+
+                ThreadPool(ThreadPool const &);
+                ThreadPool & operator=(ThreadPool const &);
+
+            public:
+
+                ~ThreadPool()
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(m_lock);
+                        m_exit = true;
+                    }
+
+                    m_wake.notify_all();
+
+                    for (auto & thread : m_threads)
+                    {
+                        thread.join();
+                    }
+                }
+
+                static auto Instance() -> ThreadPool &
+                {
+                    static ThreadPool pool;
+                    return pool;
+                }
+
+                auto GetThreadCount() const -> unsigned
+                {
+                    return static_cast<unsigned>(m_threads.size()) + 1;
+                }
+
+                // Threads that each draw with their own device context mostly find the pool
+                // running, and check that without writing to the shared submit lock.
+                void Run(unsigned const count,
+                         std::function<void(unsigned)> const & work)
+                {
+                    if (count < 2 || m_threads.empty() || IsWorker() || m_running.load(std::memory_order_relaxed) || !m_submit.try_lock())
+                    {
+                        for (unsigned i = 0; i != count; ++i)
+                        {
+                            work(i);
+                        }
+
+                        return;
+                    }
+
+                    std::lock_guard<std::mutex> submit(m_submit, std::adopt_lock);
+                    m_running.store(true, std::memory_order_relaxed);
+
+                    {
+                        std::unique_lock<std::mutex> lock(m_lock);
+                        m_done.wait(lock, [&] { return 0 == m_active; });
+                        m_work = &work;
+                        m_count = count;
+                        m_next = 0;
+                        m_pending = count;
+                        ++m_generation;
+                    }
+
+                    m_wake.notify_all();
+                    Drain();
+
+                    std::unique_lock<std::mutex> lock(m_lock);
+                    m_done.wait(lock, [&] { return 0 == m_pending && 0 == m_active; });
+                    m_work = nullptr;
+                    m_running.store(false, std::memory_order_relaxed);
+                }
+            };
+
+            // Splits [0, count) into contiguous ranges of at least grain items and
+            // calls body(begin, end) for each range across the thread pool.
+            template <typename Body>
+            void ParallelFor(unsigned const count,
+                             unsigned const grain,
+                             Body const & body)
+            {
+                auto & pool = ThreadPool::Instance();
+                auto const maximum = pool.GetThreadCount() * 4;
+                auto chunks = (count + grain - 1) / (std::max)(grain, 1u);
+                chunks = (std::min)(chunks, maximum);
+
+                if (chunks < 2)
+                {
+                    if (count) body(0u, count);
+                    return;
+                }
+
+                auto const size = (count + chunks - 1) / chunks;
+
+                pool.Run(chunks, [&] (unsigned const chunk)
+                {
+                    auto const begin = chunk * size;
+                    auto const end = (std::min)(begin + size, count);
+                    if (begin < end) body(begin, end);
+                });
+            }
+
+            inline auto HalfToFloat(std::uint16_t const half) -> float
+            {
+                std::uint32_t const shiftedExponent = 0x7c00 << 13;
+                std::uint32_t bits = (half & 0x7fffu) << 13;
+                auto const exponent = shiftedExponent & bits;
+                bits += (127 - 15) << 23;
+
+                if (exponent == shiftedExponent)
+                {
+                    bits += (128 - 16) << 23;
+                }
+                else if (0 == exponent)
+                {
+                    std::uint32_t const magicBits = 113 << 23;
+                    float magic;
+                    float value;
+                    bits += 1 << 23;
+                    memcpy(&magic, &magicBits, sizeof(float));
+                    memcpy(&value, &bits, sizeof(float));
+                    value -= magic;
+                    memcpy(&bits, &value, sizeof(float));
+                }
+
+                bits |= (half & 0x8000u) << 16;
+                float result;
+                memcpy(&result, &bits, sizeof(float));
+                return result;
+            }
+
+            inline auto FloatToHalf(float const value) -> std::uint16_t
+            {
+                std::uint32_t bits;
+                memcpy(&bits, &value, sizeof(float));
+                auto const sign = bits & 0x80000000u;
+                bits ^= sign;
+                std::uint32_t result;
+
+                if (bits >= (127u + 16) << 23)
+                {
+                    result = bits > 255u << 23 ? 0x7e00 : 0x7c00;
+                }
+                else if (bits < 113u << 23)
+                {
+                    std::uint32_t const magicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+                    float magic;
+                    float scaled;
+                    memcpy(&magic, &magicBits, sizeof(float));
+                    memcpy(&scaled, &bits, sizeof(float));
+                    scaled += magic;
+                    memcpy(&result, &scaled, sizeof(float));
+                    result -= magicBits;
+                }
+                else
+                {
+                    auto const odd = (bits >> 13) & 1;
+                    bits += (static_cast<std::uint32_t>(15 - 127) << 23) + 0xfff;
+                    bits += odd;
+                    result = bits >> 13;
+                }
+
+                return static_cast<std::uint16_t>(result | (sign >> 16));
+            }
+
+            inline auto SrgbToLinear(float const value) -> float
+            {
+                return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+            }
+
+            inline auto LinearToSrgb(float const value) -> float
+            {
+                return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+            }
+
+            // Lookup tables shared by the 8-bit conversion kernels.
+            struct ColorTables
+            {
+                std::uint32_t Reciprocal[256]; // 16.16 fixed-point 255 / alpha for unpremultiplying
+                std::uint8_t SrgbToLinear[256];
+                std::uint8_t LinearToSrgb[256];
+
+                ColorTables()
+                {
+                    Reciprocal[0] = 0;
+
+                    for (unsigned alpha = 1; alpha != 256; ++alpha)
+                    {
+                        Reciprocal[alpha] = ((255u << 16) + alpha / 2) / alpha;
+                    }
+
+                    for (unsigned i = 0; i != 256; ++i)
+                    {
+                        auto const value = i / 255.0f;
+                        SrgbToLinear[i] = static_cast<std::uint8_t>(Details::SrgbToLinear(value) * 255.0f + 0.5f);
+                        LinearToSrgb[i] = static_cast<std::uint8_t>(Details::LinearToSrgb(value) * 255.0f + 0.5f);
+                    }
+                }
+
+                static auto Instance() -> ColorTables const &
+                {
+                    static ColorTables const tables;
+                    return tables;
+                }
+            };
+
+            inline auto MultiplyAlpha(unsigned const color, unsigned const alpha) -> std::uint8_t
+            {
+                auto const product = color * alpha + 128;
+                return static_cast<std::uint8_t>((product + (product >> 8)) >> 8);
+            }
+
+            // Storage layouts the converter understands. Several Dxgi formats share a
+            // layout and differ only in how the values are interpreted (sRGB, alpha).
+            enum class PixelLayout
+            {
+                Unsupported,
+                Bgra8,
+                Bgrx8,
+                Rgba8,
+                B5G6R5,
+                B5G5R5A1,
+                B4G4R4A4,
+                A8,
+                R10G10B10A2,
+                Rgba16F,
+            };
+
+            struct FormatTraits
+            {
+                PixelLayout Layout;
+                unsigned BytesPerPixel;
+                bool Srgb;
+                bool HasAlpha;
+                bool Wide; // more than eight bits of precision per channel
+            };
+
+            inline auto GetFormatTraits(Dxgi::Format const format) -> FormatTraits
+            {
+                switch (format)
+                {
+                case Dxgi::Format::B8G8R8A8_UNORM:      return { PixelLayout::Bgra8,       4, false, true,  false };
+                case Dxgi::Format::B8G8R8A8_UNORM_SRGB: return { PixelLayout::Bgra8,       4, true,  true,  false };
+                case Dxgi::Format::B8G8R8X8_UNORM:      return { PixelLayout::Bgrx8,       4, false, false, false };
+                case Dxgi::Format::B8G8R8X8_UNORM_SRGB: return { PixelLayout::Bgrx8,       4, true,  false, false };
+                case Dxgi::Format::R8G8B8A8_UNORM:      return { PixelLayout::Rgba8,       4, false, true,  false };
+                case Dxgi::Format::R8G8B8A8_UNORM_SRGB: return { PixelLayout::Rgba8,       4, true,  true,  false };
+                case Dxgi::Format::B5G6R5_UNORM:        return { PixelLayout::B5G6R5,      2, false, false, false };
+                case Dxgi::Format::B5G5R5A1_UNORM:      return { PixelLayout::B5G5R5A1,    2, false, true,  false };
+                case Dxgi::Format::B4G4R4A4_UNORM:      return { PixelLayout::B4G4R4A4,    2, false, true,  false };
+                case Dxgi::Format::A8_UNORM:            return { PixelLayout::A8,          1, false, true,  false };
+                case Dxgi::Format::R10G10B10A2_UNORM:   return { PixelLayout::R10G10B10A2, 4, false, true,  true  };
+                case Dxgi::Format::R16G16B16A16_FLOAT:  return { PixelLayout::Rgba16F,     8, false, true,  true  };
+                default:                                return { PixelLayout::Unsupported, 0, false, false, false };
+                }
+            }
+
+            // Formats without an alpha channel always behave as Ignore, and Unknown
+            // resolves to Direct2D's default of premultiplied alpha.
+            inline auto ResolveAlphaMode(FormatTraits const & traits,
+                                         AlphaMode const mode) -> AlphaMode
+            {
+                if (!traits.HasAlpha)
+                {
+                    return AlphaMode::Ignore;
+                }
+
+                return AlphaMode::Unknown == mode ? AlphaMode::Premultiplied : mode;
+            }
+
+            inline void SwapRedBlue(std::uint8_t const * source,
+                                    std::uint8_t * target,
+                                    unsigned const count)
+            {
+                unsigned i = 0;
+
+                #ifdef KENNYKERR_CPU_AVX2
+                __m256i const shuffle256 = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                                            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+                for (; i + 8 <= count; i += 8)
+                {
+                    auto const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source + i * 4));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i * 4), _mm256_shuffle_epi8(pixels, shuffle256));
+                }
+                #endif
+
+                #ifdef KENNYKERR_CPU_SSSE3
+                __m128i const shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+                for (; i + 4 <= count; i += 4)
+                {
+                    auto const pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + i * 4));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i * 4), _mm_shuffle_epi8(pixels, shuffle));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    auto const b = source[i * 4 + 0];
+                    auto const g = source[i * 4 + 1];
+                    auto const r = source[i * 4 + 2];
+                    auto const a = source[i * 4 + 3];
+                    target[i * 4 + 0] = r;
+                    target[i * 4 + 1] = g;
+                    target[i * 4 + 2] = b;
+                    target[i * 4 + 3] = a;
+                }
+            }
+
+            inline void SetOpaque(std::uint8_t * pixels,
+                                  unsigned const count)
+            {
+                unsigned i = 0;
+
+                #ifdef KENNYKERR_CPU_SSE2
+                auto const alpha = _mm_set1_epi32(static_cast<int>(0xff000000));
+
+                for (; i + 4 <= count; i += 4)
+                {
+                    auto const p = reinterpret_cast<__m128i *>(pixels + i * 4);
+                    _mm_storeu_si128(p, _mm_or_si128(_mm_loadu_si128(p), alpha));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    pixels[i * 4 + 3] = 255;
+                }
+            }
+
+            #ifdef KENNYKERR_CPU_SSE2
+            // Multiplies the 16-bit color lanes by the broadcast alpha lanes and divides by 255 with rounding.
+            inline auto Premultiply16(__m128i const colors) -> __m128i
+            {
+                auto const alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(colors, 0xff), 0xff);
+                auto const product = _mm_add_epi16(_mm_mullo_epi16(colors, alpha), _mm_set1_epi16(128));
+                return _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+            }
+            #endif
+
+            #ifdef KENNYKERR_CPU_AVX2
+            inline auto Premultiply16(__m256i const colors) -> __m256i
+            {
+                auto const alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(colors, 0xff), 0xff);
+                auto const product = _mm256_add_epi16(_mm256_mullo_epi16(colors, alpha), _mm256_set1_epi16(128));
+                return _mm256_srli_epi16(_mm256_add_epi16(product, _mm256_srli_epi16(product, 8)), 8);
+            }
+            #endif
+
+            inline void Premultiply(std::uint8_t * pixels,
+                                    unsigned const count)
+            {
+                unsigned i = 0;
+
+                #ifdef KENNYKERR_CPU_AVX2
+                auto const zero256 = _mm256_setzero_si256();
+                auto const alphaMask256 = _mm256_set1_epi32(static_cast<int>(0xff000000));
+
+                for (; i + 8 <= count; i += 8)
+                {
+                    auto const p = reinterpret_cast<__m256i *>(pixels + i * 4);
+                    auto const source = _mm256_loadu_si256(p);
+                    auto const lo = Premultiply16(_mm256_unpacklo_epi8(source, zero256));
+                    auto const hi = Premultiply16(_mm256_unpackhi_epi8(source, zero256));
+                    auto const result = _mm256_packus_epi16(lo, hi);
+                    _mm256_storeu_si256(p, _mm256_or_si256(_mm256_andnot_si256(alphaMask256, result),
+                                                           _mm256_and_si256(alphaMask256, source)));
+                }
+                #endif
+
+                #ifdef KENNYKERR_CPU_SSE2
+                auto const zero = _mm_setzero_si128();
+                auto const alphaMask = _mm_set1_epi32(static_cast<int>(0xff000000));
+
+                for (; i + 4 <= count; i += 4)
+                {
+                    auto const p = reinterpret_cast<__m128i *>(pixels + i * 4);
+                    auto const source = _mm_loadu_si128(p);
+                    auto const lo = Premultiply16(_mm_unpacklo_epi8(source, zero));
+                    auto const hi = Premultiply16(_mm_unpackhi_epi8(source, zero));
+                    auto const result = _mm_packus_epi16(lo, hi);
+                    _mm_storeu_si128(p, _mm_or_si128(_mm_andnot_si128(alphaMask, result),
+                                                     _mm_and_si128(alphaMask, source)));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    auto const pixel = pixels + i * 4;
+                    auto const alpha = pixel[3];
+                    pixel[0] = MultiplyAlpha(pixel[0], alpha);
+                    pixel[1] = MultiplyAlpha(pixel[1], alpha);
+                    pixel[2] = MultiplyAlpha(pixel[2], alpha);
+                }
+            }
+
+            inline void Unpremultiply(std::uint8_t * pixels,
+                                      unsigned const count)
+            {
+                auto const & reciprocal = ColorTables::Instance().Reciprocal;
+                unsigned i = 0;
+
+                while (i != count)
+                {
+                    #ifdef KENNYKERR_CPU_SSE2
+                    // Skip runs of fully opaque pixels four at a time.
+                    if (i + 4 <= count)
+                    {
+                        auto const source = _mm_loadu_si128(reinterpret_cast<__m128i const *>(pixels + i * 4));
+                        auto const alpha = _mm_srli_epi32(source, 24);
+
+                        if (0xffff == _mm_movemask_epi8(_mm_cmpeq_epi32(alpha, _mm_set1_epi32(255))))
+                        {
+                            i += 4;
+                            continue;
+                        }
+                    }
+                    #endif
+
+                    auto const pixel = pixels + i * 4;
+                    auto const alpha = pixel[3];
+
+                    if (255 != alpha)
+                    {
+                        auto const scale = reciprocal[alpha];
+                        pixel[0] = static_cast<std::uint8_t>((std::min)(255u, (pixel[0] * scale + 0x8000) >> 16));
+                        pixel[1] = static_cast<std::uint8_t>((std::min)(255u, (pixel[1] * scale + 0x8000) >> 16));
+                        pixel[2] = static_cast<std::uint8_t>((std::min)(255u, (pixel[2] * scale + 0x8000) >> 16));
+                    }
+
+                    ++i;
+                }
+            }
+
+            inline void Transfer(std::uint8_t * pixels,
+                                 unsigned const count,
+                                 std::uint8_t const (&table)[256])
+            {
+                for (unsigned i = 0; i != count; ++i)
+                {
+                    auto const pixel = pixels + i * 4;
+                    pixel[0] = table[pixel[0]];
+                    pixel[1] = table[pixel[1]];
+                    pixel[2] = table[pixel[2]];
+                }
+            }
+
+            inline auto Expand5(unsigned const value) -> std::uint8_t { return static_cast<std::uint8_t>((value << 3) | (value >> 2)); }
+            inline auto Expand6(unsigned const value) -> std::uint8_t { return static_cast<std::uint8_t>((value << 2) | (value >> 4)); }
+            inline auto Expand4(unsigned const value) -> std::uint8_t { return static_cast<std::uint8_t>(value * 17); }
+            inline auto Reduce(unsigned const value, unsigned const maximum) -> unsigned { return (value * maximum + 127) / 255; }
+
+            // Decodes a row of any 8-bit layout into B8G8R8A8 order.
+            inline void DecodeRow8(PixelLayout const layout,
+                                   void const * source,
+                                   std::uint8_t * target,
+                                   unsigned const count)
+            {
+                auto const bytes = static_cast<std::uint8_t const *>(source);
+                auto const words = static_cast<std::uint16_t const *>(source);
+
+                switch (layout)
+                {
+                case PixelLayout::Bgra8:
+                    if (bytes != target) memmove(target, bytes, count * 4);
+                    break;
+
+                case PixelLayout::Bgrx8:
+                    if (bytes != target) memmove(target, bytes, count * 4);
+                    SetOpaque(target, count);
+                    break;
+
+                case PixelLayout::Rgba8:
+                    SwapRedBlue(bytes, target, count);
+                    break;
+
+                case PixelLayout::B5G6R5:
+                    for (unsigned i = count; i--; )
+                    {
+                        unsigned const value = words[i];
+                        target[i * 4 + 0] = Expand5(value & 0x1f);
+                        target[i * 4 + 1] = Expand6((value >> 5) & 0x3f);
+                        target[i * 4 + 2] = Expand5(value >> 11);
+                        target[i * 4 + 3] = 255;
+                    }
+                    break;
+
+                case PixelLayout::B5G5R5A1:
+                    for (unsigned i = count; i--; )
+                    {
+                        unsigned const value = words[i];
+                        target[i * 4 + 0] = Expand5(value & 0x1f);
+                        target[i * 4 + 1] = Expand5((value >> 5) & 0x1f);
+                        target[i * 4 + 2] = Expand5((value >> 10) & 0x1f);
+                        target[i * 4 + 3] = (value & 0x8000) ? 255 : 0;
+                    }
+                    break;
+
+                case PixelLayout::B4G4R4A4:
+                    for (unsigned i = count; i--; )
+                    {
+                        unsigned const value = words[i];
+                        target[i * 4 + 0] = Expand4(value & 0xf);
+                        target[i * 4 + 1] = Expand4((value >> 4) & 0xf);
+                        target[i * 4 + 2] = Expand4((value >> 8) & 0xf);
+                        target[i * 4 + 3] = Expand4(value >> 12);
+                    }
+                    break;
+
+                case PixelLayout::A8:
+                    for (unsigned i = count; i--; )
+                    {
+                        auto const alpha = bytes[i];
+                        target[i * 4 + 0] = 0;
+                        target[i * 4 + 1] = 0;
+                        target[i * 4 + 2] = 0;
+                        target[i * 4 + 3] = alpha;
+                    }
+                    break;
+
+                default:
+                    ASSERT(false);
+                }
+            }
+
+            // Encodes a row of B8G8R8A8 pixels into any 8-bit layout.
+            inline void EncodeRow8(PixelLayout const layout,
+                                   std::uint8_t const * source,
+                                   void * target,
+                                   unsigned const count)
+            {
+                auto const bytes = static_cast<std::uint8_t *>(target);
+                auto const words = static_cast<std::uint16_t *>(target);
+
+                switch (layout)
+                {
+                case PixelLayout::Bgra8:
+                    if (bytes != source) memmove(bytes, source, count * 4);
+                    break;
+
+                case PixelLayout::Bgrx8:
+                    if (bytes != source) memmove(bytes, source, count * 4);
+                    SetOpaque(bytes, count);
+                    break;
+
+                case PixelLayout::Rgba8:
+                    SwapRedBlue(source, bytes, count);
+                    break;
+
+                case PixelLayout::B5G6R5:
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const pixel = source + i * 4;
+                        words[i] = static_cast<std::uint16_t>(Reduce(pixel[0], 31) |
+                                                              Reduce(pixel[1], 63) << 5 |
+                                                              Reduce(pixel[2], 31) << 11);
+                    }
+                    break;
+
+                case PixelLayout::B5G5R5A1:
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const pixel = source + i * 4;
+                        words[i] = static_cast<std::uint16_t>(Reduce(pixel[0], 31) |
+                                                              Reduce(pixel[1], 31) << 5 |
+                                                              Reduce(pixel[2], 31) << 10 |
+                                                              (pixel[3] >= 128 ? 0x8000u : 0u));
+                    }
+                    break;
+
+                case PixelLayout::B4G4R4A4:
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const pixel = source + i * 4;
+                        words[i] = static_cast<std::uint16_t>(Reduce(pixel[0], 15) |
+                                                              Reduce(pixel[1], 15) << 4 |
+                                                              Reduce(pixel[2], 15) << 8 |
+                                                              Reduce(pixel[3], 15) << 12);
+                    }
+                    break;
+
+                case PixelLayout::A8:
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        bytes[i] = source[i * 4 + 3];
+                    }
+                    break;
+
+                default:
+                    ASSERT(false);
+                }
+            }
+
+            // Decodes a row into straight RGBA floats (in whatever alpha mode the source uses).
+            inline void DecodeRowFloat(PixelLayout const layout,
+                                       void const * source,
+                                       float * target,
+                                       unsigned const count,
+                                       std::uint8_t * scratch)
+            {
+                unsigned i = 0;
+
+                if (PixelLayout::Rgba16F == layout)
+                {
+                    auto const halves = static_cast<std::uint16_t const *>(source);
+
+                    #ifdef KENNYKERR_CPU_F16C
+                    for (; i + 8 <= count * 4; i += 8)
+                    {
+                        auto const packed = _mm_loadu_si128(reinterpret_cast<__m128i const *>(halves + i));
+                        _mm256_storeu_ps(target + i, _mm256_cvtph_ps(packed));
+                    }
+                    #endif
+
+                    for (; i != count * 4; ++i)
+                    {
+                        target[i] = HalfToFloat(halves[i]);
+                    }
+                }
+                else if (PixelLayout::R10G10B10A2 == layout)
+                {
+                    auto const packed = static_cast<std::uint32_t const *>(source);
+
+                    for (; i != count; ++i)
+                    {
+                        auto const value = packed[i];
+                        target[i * 4 + 0] = (value & 0x3ff) / 1023.0f;
+                        target[i * 4 + 1] = ((value >> 10) & 0x3ff) / 1023.0f;
+                        target[i * 4 + 2] = ((value >> 20) & 0x3ff) / 1023.0f;
+                        target[i * 4 + 3] = (value >> 30) / 3.0f;
+                    }
+                }
+                else
+                {
+                    DecodeRow8(layout, source, scratch, count);
+
+                    #ifdef KENNYKERR_CPU_SSE2
+                    auto const zero = _mm_setzero_si128();
+                    auto const scale = _mm_set1_ps(1.0f / 255.0f);
+
+                    for (; i != count; ++i)
+                    {
+                        std::int32_t pixel;
+                        memcpy(&pixel, scratch + i * 4, sizeof(pixel));
+                        auto const wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+                        auto const bgra = _mm_mul_ps(_mm_cvtepi32_ps(wide), scale);
+                        _mm_storeu_ps(target + i * 4, _mm_shuffle_ps(bgra, bgra, _MM_SHUFFLE(3, 0, 1, 2)));
+                    }
+                    #else
+                    for (; i != count; ++i)
+                    {
+                        target[i * 4 + 0] = scratch[i * 4 + 2] / 255.0f;
+                        target[i * 4 + 1] = scratch[i * 4 + 1] / 255.0f;
+                        target[i * 4 + 2] = scratch[i * 4 + 0] / 255.0f;
+                        target[i * 4 + 3] = scratch[i * 4 + 3] / 255.0f;
+                    }
+                    #endif
+                }
+            }
+
+            inline void EncodeRowFloat(PixelLayout const layout,
+                                       float const * source,
+                                       void * target,
+                                       unsigned const count,
+                                       std::uint8_t * scratch)
+            {
+                unsigned i = 0;
+
+                if (PixelLayout::Rgba16F == layout)
+                {
+                    auto const halves = static_cast<std::uint16_t *>(target);
+
+                    #ifdef KENNYKERR_CPU_F16C
+                    for (; i + 8 <= count * 4; i += 8)
+                    {
+                        auto const packed = _mm256_cvtps_ph(_mm256_loadu_ps(source + i), 0);
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(halves + i), packed);
+                    }
+                    #endif
+
+                    for (; i != count * 4; ++i)
+                    {
+                        halves[i] = FloatToHalf(source[i]);
+                    }
+                }
+                else if (PixelLayout::R10G10B10A2 == layout)
+                {
+                    auto const packed = static_cast<std::uint32_t *>(target);
+
+                    for (; i != count; ++i)
+                    {
+                        auto const pixel = source + i * 4;
+                        auto const r = static_cast<std::uint32_t>((std::min)((std::max)(pixel[0], 0.0f), 1.0f) * 1023.0f + 0.5f);
+                        auto const g = static_cast<std::uint32_t>((std::min)((std::max)(pixel[1], 0.0f), 1.0f) * 1023.0f + 0.5f);
+                        auto const b = static_cast<std::uint32_t>((std::min)((std::max)(pixel[2], 0.0f), 1.0f) * 1023.0f + 0.5f);
+                        auto const a = static_cast<std::uint32_t>((std::min)((std::max)(pixel[3], 0.0f), 1.0f) * 3.0f + 0.5f);
+                        packed[i] = r | g << 10 | b << 20 | a << 30;
+                    }
+                }
+                else
+                {
+                    #ifdef KENNYKERR_CPU_SSE2
+                    auto const zero = _mm_setzero_ps();
+                    auto const one = _mm_set1_ps(1.0f);
+                    auto const scale = _mm_set1_ps(255.0f);
+
+                    for (; i != count; ++i)
+                    {
+                        auto rgba = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(source + i * 4), zero), one);
+                        auto const bgra = _mm_shuffle_ps(rgba, rgba, _MM_SHUFFLE(3, 0, 1, 2));
+                        auto const words = _mm_cvtps_epi32(_mm_mul_ps(bgra, scale));
+                        auto const packed = _mm_packus_epi16(_mm_packs_epi32(words, words), _mm_setzero_si128());
+                        auto const pixel = _mm_cvtsi128_si32(packed);
+                        memcpy(scratch + i * 4, &pixel, sizeof(pixel));
+                    }
+                    #else
+                    for (; i != count; ++i)
+                    {
+                        auto const pixel = source + i * 4;
+                        scratch[i * 4 + 0] = static_cast<std::uint8_t>((std::min)((std::max)(pixel[2], 0.0f), 1.0f) * 255.0f + 0.5f);
+                        scratch[i * 4 + 1] = static_cast<std::uint8_t>((std::min)((std::max)(pixel[1], 0.0f), 1.0f) * 255.0f + 0.5f);
+                        scratch[i * 4 + 2] = static_cast<std::uint8_t>((std::min)((std::max)(pixel[0], 0.0f), 1.0f) * 255.0f + 0.5f);
+                        scratch[i * 4 + 3] = static_cast<std::uint8_t>((std::min)((std::max)(pixel[3], 0.0f), 1.0f) * 255.0f + 0.5f);
+                    }
+                    #endif
+
+                    EncodeRow8(layout, scratch, target, count);
+                }
+            }
+
+            // The work needed to convert between two formats, resolved once up front.
+            struct ConversionPlan
+            {
+                FormatTraits Source;
+                FormatTraits Target;
+                AlphaMode SourceAlpha;
+                AlphaMode TargetAlpha;
+                bool Copy;
+                bool Wide;
+                bool Unpremultiply;
+                bool Premultiply;
+                bool Opaque;
+                int Transfer; // +1 encodes linear as sRGB, -1 decodes sRGB to linear
+
+                ConversionPlan() :
+                    Source(GetFormatTraits(Dxgi::Format::Unknown)),
+                    Target(Source),
+                    SourceAlpha(AlphaMode::Unknown),
+                    TargetAlpha(AlphaMode::Unknown),
+                    Copy(false),
+                    Wide(false),
+                    Unpremultiply(false),
+                    Premultiply(false),
+                    Opaque(false),
+                    Transfer(0)
+                {}
+
+                ConversionPlan(PixelFormat const & source,
+                               PixelFormat const & target) :
+                    Source(GetFormatTraits(source.Format)),
+                    Target(GetFormatTraits(target.Format)),
+                    SourceAlpha(ResolveAlphaMode(Source, source.AlphaMode)),
+                    TargetAlpha(ResolveAlphaMode(Target, target.AlphaMode)),
+                    Wide(Source.Wide || Target.Wide),
+                    Transfer(Source.Srgb == Target.Srgb ? 0 : Target.Srgb ? 1 : -1)
+                {
+                    auto const straightened = AlphaMode::Premultiplied == SourceAlpha &&
+                                              (0 != Transfer || AlphaMode::Straight == TargetAlpha);
+
+                    Unpremultiply = straightened;
+                    Premultiply = AlphaMode::Premultiplied == TargetAlpha &&
+                                  (AlphaMode::Straight == SourceAlpha || straightened);
+                    Opaque = Target.HasAlpha &&
+                             (AlphaMode::Ignore == SourceAlpha || AlphaMode::Ignore == TargetAlpha);
+
+                    Copy = Source.Layout == Target.Layout &&
+                           0 == Transfer &&
+                           !Unpremultiply &&
+                           !Premultiply &&
+                           !Opaque;
+                }
+
+                auto IsValid() const -> bool
+                {
+                    return PixelLayout::Unsupported != Source.Layout &&
+                           PixelLayout::Unsupported != Target.Layout;
+                }
+
+                auto GetScratchSize(unsigned const width) const -> size_t
+                {
+                    return Wide ? width * (sizeof(float) * 4 + 4) : width * 4;
+                }
+
+                void ConvertRow(void const * source,
+                                void * target,
+                                unsigned const width,
+                                std::uint8_t * scratch) const
+                {
+                    if (Copy)
+                    {
+                        if (source != target) memmove(target, source, width * Source.BytesPerPixel);
+                    }
+                    else if (Wide)
+                    {
+                        ConvertRowFloat(source, target, width, scratch);
+                    }
+                    else
+                    {
+                        auto const work = PixelLayout::Bgra8 == Target.Layout ? static_cast<std::uint8_t *>(target) : scratch;
+                        DecodeRow8(Source.Layout, source, work, width);
+
+                        if (Opaque) SetOpaque(work, width);
+                        if (Unpremultiply) Details::Unpremultiply(work, width);
+
+                        if (Transfer)
+                        {
+                            auto const & tables = ColorTables::Instance();
+                            Details::Transfer(work, width, 0 < Transfer ? tables.LinearToSrgb : tables.SrgbToLinear);
+                        }
+
+                        if (Premultiply) Details::Premultiply(work, width);
+
+                        if (work != target)
+                        {
+                            EncodeRow8(Target.Layout, work, target, width);
+                        }
+                    }
+                }
+
+                void ConvertRowFloat(void const * source,
+                                     void * target,
+                                     unsigned const width,
+                                     std::uint8_t * scratch) const
+                {
+                    auto const work = reinterpret_cast<float *>(scratch + width * 4);
+                    DecodeRowFloat(Source.Layout, source, work, width, scratch);
+
+                    for (unsigned i = 0; i != width; ++i)
+                    {
+                        auto const pixel = work + i * 4;
+
+                        if (Opaque)
+                        {
+                            pixel[3] = 1.0f;
+                        }
+
+                        if (Unpremultiply && 0.0f < pixel[3])
+                        {
+                            auto const scale = 1.0f / pixel[3];
+                            pixel[0] *= scale;
+                            pixel[1] *= scale;
+                            pixel[2] *= scale;
+                        }
+
+                        if (0 < Transfer)
+                        {
+                            pixel[0] = LinearToSrgb(pixel[0]);
+                            pixel[1] = LinearToSrgb(pixel[1]);
+                            pixel[2] = LinearToSrgb(pixel[2]);
+                        }
+                        else if (0 > Transfer)
+                        {
+                            pixel[0] = SrgbToLinear(pixel[0]);
+                            pixel[1] = SrgbToLinear(pixel[1]);
+                            pixel[2] = SrgbToLinear(pixel[2]);
+                        }
+
+                        if (Premultiply)
+                        {
+                            pixel[0] *= pixel[3];
+                            pixel[1] *= pixel[3];
+                            pixel[2] *= pixel[3];
+                        }
+                    }
+
+                    EncodeRowFloat(Target.Layout, work, target, width, scratch);
+                }
+            };
+
+        } // Details
+
+        // FormatConverter is a portable replacement for Wic::FormatConverter keyed on
+        // Dxgi formats. Rows are converted in parallel for large images.
+        class FormatConverter
+        {
+            Details::ConversionPlan m_plan;
+
+        public:
+
+            FormatConverter() {}
+
+            FormatConverter(PixelFormat const & source,
+                            PixelFormat const & target)
+            {
+                Initialize(source, target);
+            }
+
+            static auto CanConvert(PixelFormat const & source,
+                                   PixelFormat const & target) -> bool;
+
+            void Initialize(PixelFormat const & source,
+                            PixelFormat const & target);
+
+            void Convert(SizeU const & size,
+                         void const * source,
+                         unsigned sourcePitch,
+                         void * target,
+                         unsigned targetPitch) const;
+        };
+
+        inline auto FormatConverter::CanConvert(PixelFormat const & source,
+                                                PixelFormat const & target) -> bool
+        {
+            return Details::ConversionPlan(source, target).IsValid();
+        }
+
+        inline void FormatConverter::Initialize(PixelFormat const & source,
+                                                PixelFormat const & target)
+        {
+            Details::ConversionPlan plan(source, target);
+
+            if (!plan.IsValid())
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            m_plan = plan;
+        }
+
+        inline void FormatConverter::Convert(SizeU const & size,
+                                             void const * source,
+                                             unsigned const sourcePitch,
+                                             void * target,
+                                             unsigned const targetPitch) const
+        {
+            ASSERT(m_plan.IsValid());
+            ASSERT(source && target);
+
+            auto const sourceBytes = static_cast<std::uint8_t const *>(source);
+            auto const targetBytes = static_cast<std::uint8_t *>(target);
+            auto const grain = (std::max)(1u, 16384u / (std::max)(size.Width, 1u));
+
+            Details::ParallelFor(size.Height, grain, [&] (unsigned const begin, unsigned const end)
+            {
+                std::vector<std::uint8_t> scratch(m_plan.GetScratchSize(size.Width));
+
+                for (auto row = begin; row != end; ++row)
+                {
+                    m_plan.ConvertRow(sourceBytes + static_cast<size_t>(row) * sourcePitch,
+                                      targetBytes + static_cast<size_t>(row) * targetPitch,
+                                      size.Width,
+                                      scratch.data());
+                }
+            });
+        }
+
+        inline void ConvertPixels(SizeU const & size,
+                                  PixelFormat const & sourceFormat,
+                                  void const * source,
+                                  unsigned const sourcePitch,
+                                  PixelFormat const & targetFormat,
+                                  void * target,
+                                  unsigned const targetPitch)
+        {
+            FormatConverter(sourceFormat, targetFormat).Convert(size,
+                                                                source,
+                                                                sourcePitch,
+                                                                target,
+                                                                targetPitch);
+        }
+
+        enum class BlockCompressionQuality
+        {
+            Fast,   // BC7 mode 6 only
+            Normal, // BC7 modes 1, 3/7, 5 and 6 with the most promising partitions
+            High,   // every BC7 mode, wider partition search and endpoint refinement
+        };
+
+        namespace Details
+        {
+            enum class BlockFormat
+            {
+                Unsupported,
+                Bc1,
+                Bc2,
+                Bc3,
+                Bc4,
+                Bc5,
+                Bc7,
+            };
+
+            struct BlockTraits
+            {
+                BlockFormat Format;
+                unsigned BlockSize;
+                bool Srgb;
+                bool HasAlpha;
+            };
+
+            inline auto GetBlockTraits(Dxgi::Format const format) -> BlockTraits
+            {
+                switch (format)
+                {
+                case Dxgi::Format::BC1_UNORM:      return { BlockFormat::Bc1,          8, false, true  };
+                case Dxgi::Format::BC1_UNORM_SRGB: return { BlockFormat::Bc1,          8, true,  true  };
+                case Dxgi::Format::BC2_UNORM:      return { BlockFormat::Bc2,         16, false, true  };
+                case Dxgi::Format::BC2_UNORM_SRGB: return { BlockFormat::Bc2,         16, true,  true  };
+                case Dxgi::Format::BC3_UNORM:      return { BlockFormat::Bc3,         16, false, true  };
+                case Dxgi::Format::BC3_UNORM_SRGB: return { BlockFormat::Bc3,         16, true,  true  };
+                case Dxgi::Format::BC4_UNORM:      return { BlockFormat::Bc4,          8, false, false };
+                case Dxgi::Format::BC5_UNORM:      return { BlockFormat::Bc5,         16, false, false };
+                case Dxgi::Format::BC7_UNORM:      return { BlockFormat::Bc7,         16, false, true  };
+                case Dxgi::Format::BC7_UNORM_SRGB: return { BlockFormat::Bc7,         16, true,  true  };
+                default:                           return { BlockFormat::Unsupported,  0, false, false };
+                }
+            }
+
+            // A 4x4 block as planes of floats so that sixteen pixels map onto four SSE registers.
+            struct BlockPlanes
+            {
+                alignas(16) float Value[4][16];
+
+                explicit BlockPlanes(std::uint8_t const (&rgba)[16][4])
+                {
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        for (unsigned c = 0; c != 4; ++c)
+                        {
+                            Value[c][i] = rgba[i][c];
+                        }
+                    }
+                }
+            };
+
+            // Finds the nearest palette entry for each pixel with a nonzero weight and
+            // returns the total squared error of those pixels.
+            inline auto SelectIndices(BlockPlanes const & block,
+                                      float const (&weights)[16],
+                                      unsigned const channels,
+                                      float const (*palette)[4],
+                                      unsigned const count,
+                                      std::uint8_t (&indices)[16]) -> float
+            {
+                #ifdef KENNYKERR_CPU_SSE2
+                auto total = _mm_setzero_ps();
+
+                for (unsigned group = 0; group != 16; group += 4)
+                {
+                    auto bestError = _mm_set1_ps(FLT_MAX);
+                    auto bestIndex = _mm_setzero_ps();
+
+                    for (unsigned entry = 0; entry != count; ++entry)
+                    {
+                        auto error = _mm_setzero_ps();
+
+                        for (unsigned c = 0; c != channels; ++c)
+                        {
+                            auto const difference = _mm_sub_ps(_mm_load_ps(block.Value[c] + group), _mm_set1_ps(palette[entry][c]));
+                            error = _mm_add_ps(error, _mm_mul_ps(difference, difference));
+                        }
+
+                        auto const better = _mm_cmplt_ps(error, bestError);
+                        bestError = _mm_min_ps(error, bestError);
+                        bestIndex = _mm_or_ps(_mm_and_ps(better, _mm_set1_ps(static_cast<float>(entry))),
+                                              _mm_andnot_ps(better, bestIndex));
+                    }
+
+                    total = _mm_add_ps(total, _mm_mul_ps(bestError, _mm_loadu_ps(weights + group)));
+                    auto const packed = _mm_cvttps_epi32(bestIndex);
+
+                    alignas(16) std::int32_t lanes[4];
+                    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), packed);
+
+                    for (unsigned i = 0; i != 4; ++i)
+                    {
+                        if (0.0f != weights[group + i])
+                        {
+                            indices[group + i] = static_cast<std::uint8_t>(lanes[i]);
+                        }
+                    }
+                }
+
+                alignas(16) float sums[4];
+                _mm_store_ps(sums, total);
+                return sums[0] + sums[1] + sums[2] + sums[3];
+                #else
+                auto total = 0.0f;
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    if (0.0f == weights[i])
+                    {
+                        continue;
+                    }
+
+                    auto bestError = FLT_MAX;
+
+                    for (unsigned entry = 0; entry != count; ++entry)
+                    {
+                        auto error = 0.0f;
+
+                        for (unsigned c = 0; c != channels; ++c)
+                        {
+                            auto const difference = block.Value[c][i] - palette[entry][c];
+                            error += difference * difference;
+                        }
+
+                        if (error < bestError)
+                        {
+                            bestError = error;
+                            indices[i] = static_cast<std::uint8_t>(entry);
+                        }
+                    }
+
+                    total += bestError * weights[i];
+                }
+
+                return total;
+                #endif
+            }
+
+            // Fits a line through the weighted pixels along their principal axis and
+            // returns its extent as two endpoints.
+            inline void FitLine(BlockPlanes const & block,
+                                float const (&weights)[16],
+                                unsigned const channels,
+                                float (&first)[4],
+                                float (&last)[4])
+            {
+                auto total = 0.0f;
+                float mean[4] = {};
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    total += weights[i];
+
+                    for (unsigned c = 0; c != channels; ++c)
+                    {
+                        mean[c] += weights[i] * block.Value[c][i];
+                    }
+                }
+
+                if (0.0f == total)
+                {
+                    for (unsigned c = 0; c != 4; ++c)
+                    {
+                        first[c] = last[c] = 0.0f;
+                    }
+
+                    return;
+                }
+
+                for (unsigned c = 0; c != channels; ++c)
+                {
+                    mean[c] /= total;
+                }
+
+                float covariance[4][4] = {};
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    for (unsigned c = 0; c != channels; ++c)
+                    {
+                        for (unsigned d = c; d != channels; ++d)
+                        {
+                            covariance[c][d] += weights[i] * (block.Value[c][i] - mean[c]) * (block.Value[d][i] - mean[d]);
+                        }
+                    }
+                }
+
+                for (unsigned c = 0; c != channels; ++c)
+                {
+                    for (unsigned d = 0; d != c; ++d)
+                    {
+                        covariance[c][d] = covariance[d][c];
+                    }
+                }
+
+                float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+                auto eigenvalue = 0.0f;
+
+                for (unsigned iteration = 0; iteration != 8; ++iteration)
+                {
+                    float next[4] = {};
+                    auto length = 0.0f;
+
+                    for (unsigned c = 0; c != channels; ++c)
+                    {
+                        for (unsigned d = 0; d != channels; ++d)
+                        {
+                            next[c] += covariance[c][d] * axis[d];
+                        }
+
+                        length += next[c] * next[c];
+                    }
+
+                    if (length < 1e-12f)
+                    {
+                        break;
+                    }
+
+                    eigenvalue = std::sqrt(length);
+
+                    for (unsigned c = 0; c != channels; ++c)
+                    {
+                        axis[c] = next[c] / eigenvalue;
+                    }
+                }
+
+                auto minimum = FLT_MAX;
+                auto maximum = -FLT_MAX;
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    if (0.0f == weights[i])
+                    {
+                        continue;
+                    }
+
+                    auto projection = 0.0f;
+
+                    for (unsigned c = 0; c != channels; ++c)
+                    {
+                        projection += (block.Value[c][i] - mean[c]) * axis[c];
+                    }
+
+                    minimum = (std::min)(minimum, projection);
+                    maximum = (std::max)(maximum, projection);
+                }
+
+                if (0.0f == eigenvalue)
+                {
+                    minimum = maximum = 0.0f;
+                }
+
+                for (unsigned c = 0; c != 4; ++c)
+                {
+                    first[c] = c < channels ? (std::min)((std::max)(mean[c] + axis[c] * minimum, 0.0f), 255.0f) : 255.0f;
+                    last[c] = c < channels ? (std::min)((std::max)(mean[c] + axis[c] * maximum, 0.0f), 255.0f) : 255.0f;
+                }
+            }
+
+            // Solves for the endpoints that minimize the squared error for the given
+            // interpolation weights (0-64) of each pixel.
+            inline auto RefineEndpoints(BlockPlanes const & block,
+                                        float const (&weights)[16],
+                                        unsigned const channels,
+                                        unsigned const (&interpolation)[16],
+                                        float (&first)[4],
+                                        float (&last)[4]) -> bool
+            {
+                auto aa = 0.0f;
+                auto ab = 0.0f;
+                auto bb = 0.0f;
+                float ax[4] = {};
+                float bx[4] = {};
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    if (0.0f == weights[i])
+                    {
+                        continue;
+                    }
+
+                    auto const t = interpolation[i] / 64.0f;
+                    auto const s = 1.0f - t;
+                    aa += s * s;
+                    ab += s * t;
+                    bb += t * t;
+
+                    for (unsigned c = 0; c != channels; ++c)
+                    {
+                        ax[c] += s * block.Value[c][i];
+                        bx[c] += t * block.Value[c][i];
+                    }
+                }
+
+                auto const determinant = aa * bb - ab * ab;
+
+                if (std::fabs(determinant) < 1e-6f)
+                {
+                    return false;
+                }
+
+                for (unsigned c = 0; c != channels; ++c)
+                {
+                    first[c] = (std::min)((std::max)((bb * ax[c] - ab * bx[c]) / determinant, 0.0f), 255.0f);
+                    last[c] = (std::min)((std::max)((aa * bx[c] - ab * ax[c]) / determinant, 0.0f), 255.0f);
+                }
+
+                return true;
+            }
+
+            inline auto Pack565(float const (&color)[4]) -> unsigned
+            {
+                auto const r = static_cast<unsigned>(color[0] * 31.0f / 255.0f + 0.5f);
+                auto const g = static_cast<unsigned>(color[1] * 63.0f / 255.0f + 0.5f);
+                auto const b = static_cast<unsigned>(color[2] * 31.0f / 255.0f + 0.5f);
+                return r << 11 | g << 5 | b;
+            }
+
+            inline void Unpack565(unsigned const value,
+                                  float (&color)[4])
+            {
+                color[0] = Expand5(value >> 11);
+                color[1] = Expand6((value >> 5) & 0x3f);
+                color[2] = Expand5(value & 0x1f);
+                color[3] = 255.0f;
+            }
+
+            inline void GetColorPalette(unsigned const color0,
+                                        unsigned const color1,
+                                        bool const fourColors,
+                                        float (&palette)[4][4])
+            {
+                Unpack565(color0, palette[0]);
+                Unpack565(color1, palette[1]);
+
+                for (unsigned c = 0; c != 3; ++c)
+                {
+                    auto const a = static_cast<unsigned>(palette[0][c]);
+                    auto const b = static_cast<unsigned>(palette[1][c]);
+
+                    if (fourColors)
+                    {
+                        palette[2][c] = static_cast<float>((2 * a + b + 1) / 3);
+                        palette[3][c] = static_cast<float>((a + 2 * b + 1) / 3);
+                    }
+                    else
+                    {
+                        palette[2][c] = static_cast<float>((a + b + 1) / 2);
+                        palette[3][c] = 0.0f;
+                    }
+                }
+
+                palette[2][3] = 255.0f;
+                palette[3][3] = fourColors ? 255.0f : 0.0f;
+            }
+
+            // Encodes the 8-byte color block shared by BC1, BC2 and BC3 with a range fit.
+            // Only BC1 may use the three-color mode to mark transparent pixels.
+            inline void EncodeColorBlock(std::uint8_t const (&rgba)[16][4],
+                                         bool const allowTransparent,
+                                         bool const refine,
+                                         std::uint8_t * output)
+            {
+                BlockPlanes const block(rgba);
+                float weights[16];
+                auto transparent = false;
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    auto const opaque = !allowTransparent || 128 <= rgba[i][3];
+                    weights[i] = opaque ? 1.0f : 0.0f;
+                    transparent |= !opaque;
+                }
+
+                float first[4];
+                float last[4];
+                FitLine(block, weights, 3, first, last);
+
+                auto color0 = Pack565(last);
+                auto color1 = Pack565(first);
+                std::uint8_t indices[16] = {};
+                float palette[4][4];
+                auto error = FLT_MAX;
+
+                auto const evaluate = [&] (unsigned a, unsigned b, std::uint8_t (&result)[16]) -> float
+                {
+                    if (transparent ? a > b : a < b)
+                    {
+                        std::swap(a, b);
+                    }
+
+                    color0 = a;
+                    color1 = b;
+                    GetColorPalette(a, b, !transparent, palette);
+                    return SelectIndices(block, weights, 3, palette, transparent ? 3 : a == b ? 1 : 4, result);
+                };
+
+                error = evaluate(color0, color1, indices);
+
+                if (refine && 0.0f < error)
+                {
+                    static unsigned const fourWeights[] = { 0, 64, 21, 43 };
+                    static unsigned const threeWeights[] = { 0, 64, 32, 0 };
+                    unsigned interpolation[16];
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        interpolation[i] = (transparent ? threeWeights : fourWeights)[indices[i]];
+                    }
+
+                    if (RefineEndpoints(block, weights, 3, interpolation, first, last))
+                    {
+                        auto const previous0 = color0;
+                        auto const previous1 = color1;
+                        std::uint8_t refined[16] = {};
+                        auto const refinedError = evaluate(Pack565(first), Pack565(last), refined);
+
+                        if (refinedError < error)
+                        {
+                            memcpy(indices, refined, sizeof(indices));
+                        }
+                        else
+                        {
+                            color0 = previous0;
+                            color1 = previous1;
+                        }
+                    }
+                }
+
+                std::uint32_t bits = 0;
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    auto const index = 0.0f == weights[i] ? 3u : indices[i];
+                    bits |= index << (i * 2);
+                }
+
+                output[0] = static_cast<std::uint8_t>(color0);
+                output[1] = static_cast<std::uint8_t>(color0 >> 8);
+                output[2] = static_cast<std::uint8_t>(color1);
+                output[3] = static_cast<std::uint8_t>(color1 >> 8);
+                memcpy(output + 4, &bits, sizeof(bits));
+            }
+
+            inline void DecodeColorBlock(std::uint8_t const * input,
+                                         bool const allowTransparent,
+                                         std::uint8_t (&rgba)[16][4])
+            {
+                auto const color0 = input[0] | input[1] << 8u;
+                auto const color1 = input[2] | input[3] << 8u;
+                float palette[4][4];
+                GetColorPalette(color0, color1, !allowTransparent || color0 > color1, palette);
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    auto const index = (input[4 + i / 4] >> ((i % 4) * 2)) & 3;
+
+                    for (unsigned c = 0; c != 4; ++c)
+                    {
+                        rgba[i][c] = static_cast<std::uint8_t>(palette[index][c]);
+                    }
+                }
+            }
+
+            inline void GetSingleChannelPalette(unsigned const value0,
+                                                unsigned const value1,
+                                                unsigned (&palette)[8])
+            {
+                palette[0] = value0;
+                palette[1] = value1;
+
+                if (value0 > value1)
+                {
+                    for (unsigned i = 2; i != 8; ++i)
+                    {
+                        palette[i] = ((8 - i) * value0 + (i - 1) * value1 + 3) / 7;
+                    }
+                }
+                else
+                {
+                    for (unsigned i = 2; i != 6; ++i)
+                    {
+                        palette[i] = ((6 - i) * value0 + (i - 1) * value1 + 2) / 5;
+                    }
+
+                    palette[6] = 0;
+                    palette[7] = 255;
+                }
+            }
+
+            // Encodes the 8-byte single channel block used by BC3 alpha, BC4 and BC5.
+            inline void EncodeSingleChannelBlock(std::uint8_t const (&rgba)[16][4],
+                                                 unsigned const channel,
+                                                 std::uint8_t * output)
+            {
+                std::uint8_t values[16];
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    values[i] = rgba[i][channel];
+                }
+
+                unsigned minimum;
+                unsigned maximum;
+
+                #ifdef KENNYKERR_CPU_SSE2
+                auto low = _mm_loadu_si128(reinterpret_cast<__m128i const *>(values));
+                auto high = low;
+                low = _mm_min_epu8(low, _mm_srli_si128(low, 8));
+                high = _mm_max_epu8(high, _mm_srli_si128(high, 8));
+                low = _mm_min_epu8(low, _mm_srli_si128(low, 4));
+                high = _mm_max_epu8(high, _mm_srli_si128(high, 4));
+                low = _mm_min_epu8(low, _mm_srli_si128(low, 2));
+                high = _mm_max_epu8(high, _mm_srli_si128(high, 2));
+                low = _mm_min_epu8(low, _mm_srli_si128(low, 1));
+                high = _mm_max_epu8(high, _mm_srli_si128(high, 1));
+                minimum = _mm_cvtsi128_si32(low) & 0xff;
+                maximum = _mm_cvtsi128_si32(high) & 0xff;
+                #else
+                minimum = *std::min_element(values, values + 16);
+                maximum = *std::max_element(values, values + 16);
+                #endif
+
+                unsigned palette[8];
+                GetSingleChannelPalette(maximum, minimum, palette);
+                std::uint64_t bits = 0;
+
+                if (minimum != maximum)
+                {
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        unsigned best = 0;
+                        auto bestError = 256u;
+
+                        for (unsigned entry = 0; entry != 8; ++entry)
+                        {
+                            auto const error = static_cast<unsigned>(std::abs(static_cast<int>(palette[entry]) - values[i]));
+
+                            if (error < bestError)
+                            {
+                                bestError = error;
+                                best = entry;
+                            }
+                        }
+
+                        bits |= static_cast<std::uint64_t>(best) << (i * 3);
+                    }
+                }
+
+                output[0] = static_cast<std::uint8_t>(maximum);
+                output[1] = static_cast<std::uint8_t>(minimum);
+
+                for (unsigned i = 0; i != 6; ++i)
+                {
+                    output[2 + i] = static_cast<std::uint8_t>(bits >> (i * 8));
+                }
+            }
+
+            inline void DecodeSingleChannelBlock(std::uint8_t const * input,
+                                                 unsigned const channel,
+                                                 std::uint8_t (&rgba)[16][4])
+            {
+                unsigned palette[8];
+                GetSingleChannelPalette(input[0], input[1], palette);
+                std::uint64_t bits = 0;
+
+                for (unsigned i = 0; i != 6; ++i)
+                {
+                    bits |= static_cast<std::uint64_t>(input[2 + i]) << (i * 8);
+                }
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    rgba[i][channel] = static_cast<std::uint8_t>(palette[(bits >> (i * 3)) & 7]);
+                }
+            }
+
+            struct Bc7Mode
+            {
+                unsigned Subsets;
+                unsigned PartitionBits;
+                unsigned RotationBits;
+                unsigned IndexSelectionBits;
+                unsigned ColorBits;
+                unsigned AlphaBits;
+                unsigned EndpointPBits;
+                unsigned SharedPBits;
+                unsigned IndexBits;
+                unsigned IndexBits2;
+            };
+
+            inline auto GetBc7Mode(unsigned const mode) -> Bc7Mode const &
+            {
+                static Bc7Mode const modes[] =
+                {
+                    { 3, 4, 0, 0, 4, 0, 1, 0, 3, 0 },
+                    { 2, 6, 0, 0, 6, 0, 0, 1, 3, 0 },
+                    { 3, 6, 0, 0, 5, 0, 0, 0, 2, 0 },
+                    { 2, 6, 0, 0, 7, 0, 1, 0, 2, 0 },
+                    { 1, 0, 2, 1, 5, 6, 0, 0, 2, 3 },
+                    { 1, 0, 2, 0, 7, 8, 0, 0, 2, 2 },
+                    { 1, 0, 0, 0, 7, 7, 1, 0, 4, 0 },
+                    { 2, 6, 0, 0, 5, 5, 1, 0, 2, 0 },
+                };
+
+                return modes[mode];
+            }
+
+            inline auto GetBc7Subset(unsigned const subsets,
+                                     unsigned const partition,
+                                     unsigned const pixel) -> unsigned
+            {
+                static std::uint16_t const two[] =
+                {
+                    0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80,
+                    0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+                    0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce,
+                    0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+                    0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a,
+                    0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+                    0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c,
+                    0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22,
+                };
+
+                static std::uint32_t const three[] =
+                {
+                    0xaa685050, 0x6a5a5040, 0x5a5a4200, 0x5450a0a8, 0xa5a50000, 0xa0a05050,
+                    0x5555a0a0, 0x5a5a5050, 0xaa550000, 0xaa555500, 0xaaaa5500, 0x90909090,
+                    0x94949494, 0xa4a4a4a4, 0xa9a59450, 0x2a0a4250, 0xa5945040, 0x0a425054,
+                    0xa5a5a500, 0x55a0a0a0, 0xa8a85454, 0x6a6a4040, 0xa4a45000, 0x1a1a0500,
+                    0x0050a4a4, 0xaaa59090, 0x14696914, 0x69691400, 0xa08585a0, 0xaa821414,
+                    0x50a4a450, 0x6a5a0200, 0xa9a58000, 0x5090a0a8, 0xa8a09050, 0x24242424,
+                    0x00aa5500, 0x24924924, 0x24499224, 0x50a50a50, 0x500aa550, 0xaaaa4444,
+                    0x66660000, 0xa5a0a5a0, 0x50a050a0, 0x69286928, 0x44aaaa44, 0x66666600,
+                    0xaa444444, 0x54a854a8, 0x95809580, 0x96969600, 0xa85454a8, 0x80959580,
+                    0xaa141414, 0x96960000, 0xaaaa1414, 0xa05050a0, 0xa0a5a5a0, 0x96000000,
+                    0x40804080, 0xa9a8a9a8, 0xaaaaaa44, 0x2a4a5254,
+                };
+
+                switch (subsets)
+                {
+                case 2:  return (two[partition] >> pixel) & 1;
+                case 3:  return (three[partition] >> (pixel * 2)) & 3;
+                default: return 0;
+                }
+            }
+
+            inline auto GetBc7Anchor(unsigned const subsets,
+                                     unsigned const partition,
+                                     unsigned const subset) -> unsigned
+            {
+                static std::uint8_t const twoSecond[] =
+                {
+                    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+                    15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+                    15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+                     6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15,
+                };
+
+                static std::uint8_t const threeSecond[] =
+                {
+                     3,  3, 15, 15,  8,  3, 15, 15,  8,  8,  6,  6,  6,  5,  3,  3,
+                     3,  3,  8, 15,  3,  3,  6, 10,  5,  8,  8,  6,  8,  5, 15, 15,
+                     8, 15,  3,  5,  6, 10,  8, 15, 15,  3, 15,  5, 15, 15, 15, 15,
+                     3, 15,  5,  5,  5,  8,  5, 10,  5, 10,  8, 13, 15, 12,  3,  3,
+                };
+
+                static std::uint8_t const threeThird[] =
+                {
+                    15,  8,  8,  3, 15, 15,  3,  8, 15, 15, 15, 15, 15, 15, 15,  8,
+                    15,  8, 15,  3, 15,  8, 15,  8,  3, 15,  6, 10, 15, 15, 10,  8,
+                    15,  3, 15, 10, 10,  8,  9, 10,  6, 15,  8, 15,  3,  6,  6,  8,
+                    15,  3, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  3, 15, 15,  8,
+                };
+
+                if (0 == subset)
+                {
+                    return 0;
+                }
+
+                if (2 == subsets)
+                {
+                    return twoSecond[partition];
+                }
+
+                return 1 == subset ? threeSecond[partition] : threeThird[partition];
+            }
+
+            inline auto GetBc7Weights(unsigned const bits) -> unsigned const *
+            {
+                static unsigned const two[] = { 0, 21, 43, 64 };
+                static unsigned const three[] = { 0, 9, 18, 27, 37, 46, 55, 64 };
+                static unsigned const four[] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+                return 2 == bits ? two : 3 == bits ? three : four;
+            }
+
+            inline auto Bc7Interpolate(unsigned const first,
+                                       unsigned const last,
+                                       unsigned const weight) -> unsigned
+            {
+                return ((64 - weight) * first + weight * last + 32) >> 6;
+            }
+
+            inline auto Bc7Unquantize(unsigned value,
+                                      unsigned const bits) -> unsigned
+            {
+                value <<= 8 - bits;
+                return value | value >> bits;
+            }
+
+            class Bc7BitReader
+            {
+                std::uint8_t const * m_bytes;
+                unsigned m_position;
+
+            public:
+
+                explicit Bc7BitReader(std::uint8_t const * bytes) :
+                    m_bytes(bytes),
+                    m_position(0)
+                {}
+
+                auto Read(unsigned const count) -> unsigned
+                {
+                    unsigned value = 0;
+
+                    for (unsigned i = 0; i != count; ++i, ++m_position)
+                    {
+                        value |= ((m_bytes[m_position / 8] >> (m_position % 8)) & 1u) << i;
+                    }
+
+                    return value;
+                }
+            };
+
+            class Bc7BitWriter
+            {
+                std::uint8_t * m_bytes;
+                unsigned m_position;
+
+            public:
+
+                explicit Bc7BitWriter(std::uint8_t * bytes) :
+                    m_bytes(bytes),
+                    m_position(0)
+                {
+                    memset(bytes, 0, 16);
+                }
+
+                void Write(unsigned const value,
+                           unsigned const count)
+                {
+                    for (unsigned i = 0; i != count; ++i, ++m_position)
+                    {
+                        m_bytes[m_position / 8] |= static_cast<std::uint8_t>(((value >> i) & 1u) << (m_position % 8));
+                    }
+                }
+            };
+
+            inline void DecodeBc7Block(std::uint8_t const * input,
+                                       std::uint8_t (&rgba)[16][4])
+            {
+                unsigned mode = 0;
+
+                while (mode != 8 && 0 == ((input[0] >> mode) & 1))
+                {
+                    ++mode;
+                }
+
+                if (8 == mode)
+                {
+                    memset(rgba, 0, sizeof(rgba));
+                    return;
+                }
+
+                auto const & info = GetBc7Mode(mode);
+                Bc7BitReader bits(input);
+                bits.Read(mode + 1);
+
+                auto const partition = bits.Read(info.PartitionBits);
+                auto const rotation = bits.Read(info.RotationBits);
+                auto const indexSelection = bits.Read(info.IndexSelectionBits);
+                unsigned endpoints[3][2][4] = {};
+
+                for (unsigned c = 0; c != 3; ++c)
+                {
+                    for (unsigned s = 0; s != info.Subsets; ++s)
+                    {
+                        endpoints[s][0][c] = bits.Read(info.ColorBits);
+                        endpoints[s][1][c] = bits.Read(info.ColorBits);
+                    }
+                }
+
+                for (unsigned s = 0; s != info.Subsets; ++s)
+                {
+                    endpoints[s][0][3] = bits.Read(info.AlphaBits);
+                    endpoints[s][1][3] = bits.Read(info.AlphaBits);
+                }
+
+                auto colorBits = info.ColorBits;
+                auto alphaBits = info.AlphaBits;
+
+                if (info.EndpointPBits || info.SharedPBits)
+                {
+                    for (unsigned s = 0; s != info.Subsets; ++s)
+                    {
+                        auto const shared = info.SharedPBits ? bits.Read(1) : 0;
+
+                        for (unsigned e = 0; e != 2; ++e)
+                        {
+                            auto const pbit = info.SharedPBits ? shared : bits.Read(1);
+
+                            for (unsigned c = 0; c != 4; ++c)
+                            {
+                                endpoints[s][e][c] = endpoints[s][e][c] << 1 | pbit;
+                            }
+                        }
+                    }
+
+                    ++colorBits;
+                    if (alphaBits) ++alphaBits;
+                }
+
+                for (unsigned s = 0; s != info.Subsets; ++s)
+                {
+                    for (unsigned e = 0; e != 2; ++e)
+                    {
+                        for (unsigned c = 0; c != 3; ++c)
+                        {
+                            endpoints[s][e][c] = Bc7Unquantize(endpoints[s][e][c], colorBits);
+                        }
+
+                        endpoints[s][e][3] = alphaBits ? Bc7Unquantize(endpoints[s][e][3], alphaBits) : 255;
+                    }
+                }
+
+                unsigned indices[16];
+                unsigned indices2[16] = {};
+                unsigned subsets[16];
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    subsets[i] = GetBc7Subset(info.Subsets, partition, i);
+                    auto const anchor = i == GetBc7Anchor(info.Subsets, partition, subsets[i]);
+                    indices[i] = bits.Read(info.IndexBits - anchor);
+                }
+
+                if (info.IndexBits2)
+                {
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        indices2[i] = bits.Read(info.IndexBits2 - (0 == i));
+                    }
+                }
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    auto const & endpoint = endpoints[subsets[i]];
+                    auto colorIndex = indices[i];
+                    auto colorIndexBits = info.IndexBits;
+                    auto alphaIndex = indices[i];
+                    auto alphaIndexBits = info.IndexBits;
+
+                    if (info.IndexBits2)
+                    {
+                        if (indexSelection)
+                        {
+                            colorIndex = indices2[i];
+                            colorIndexBits = info.IndexBits2;
+                        }
+                        else
+                        {
+                            alphaIndex = indices2[i];
+                            alphaIndexBits = info.IndexBits2;
+                        }
+                    }
+
+                    unsigned pixel[4];
+
+                    for (unsigned c = 0; c != 3; ++c)
+                    {
+                        pixel[c] = Bc7Interpolate(endpoint[0][c], endpoint[1][c], GetBc7Weights(colorIndexBits)[colorIndex]);
+                    }
+
+                    pixel[3] = Bc7Interpolate(endpoint[0][3], endpoint[1][3], GetBc7Weights(alphaIndexBits)[alphaIndex]);
+
+                    if (rotation)
+                    {
+                        std::swap(pixel[3], pixel[rotation - 1]);
+                    }
+
+                    for (unsigned c = 0; c != 4; ++c)
+                    {
+                        rgba[i][c] = static_cast<std::uint8_t>(pixel[c]);
+                    }
+                }
+            }
+
+            // Quantizes an endpoint channel to the given number of bits, optionally with a
+            // fixed low p-bit, and returns the stored value (without the p-bit).
+            inline auto Bc7Quantize(float const value,
+                                    unsigned const bits,
+                                    int const pbit) -> unsigned
+            {
+                auto const total = bits + (0 <= pbit);
+                auto const scale = static_cast<float>((1u << total) - 1) / 255.0f;
+                auto estimate = static_cast<int>(0 <= pbit ? (value * scale - pbit) * 0.5f + 0.5f : value * scale + 0.5f);
+                auto best = 0u;
+                auto bestError = FLT_MAX;
+
+                for (auto candidate = estimate - 1; candidate <= estimate + 1; ++candidate)
+                {
+                    if (candidate < 0 || candidate >= (1 << bits))
+                    {
+                        continue;
+                    }
+
+                    auto const stored = 0 <= pbit ? static_cast<unsigned>(candidate) << 1 | pbit : static_cast<unsigned>(candidate);
+                    auto const error = std::fabs(Bc7Unquantize(stored, total) - value);
+
+                    if (error < bestError)
+                    {
+                        bestError = error;
+                        best = static_cast<unsigned>(candidate);
+                    }
+                }
+
+                return best;
+            }
+
+            // One subset's quantized endpoints and indices.
+            struct Bc7Subset
+            {
+                unsigned Stored[2][4]; // endpoint values as written to the block (without p-bits)
+                unsigned PBit[2];
+                std::uint8_t Indices[16];
+                float Error;
+            };
+
+            struct Bc7Options
+            {
+                unsigned Refinements;
+                bool ExhaustivePBits;
+            };
+
+            // Quantizes a pair of float endpoints for the mode, selects indices for the
+            // weighted pixels and returns the error. Channels beyond 'channels' are
+            // treated as fully opaque alpha.
+            inline void Bc7Evaluate(BlockPlanes const & block,
+                                    float const (&weights)[16],
+                                    Bc7Mode const & info,
+                                    unsigned const channels,
+                                    unsigned const indexBits,
+                                    float const (&first)[4],
+                                    float const (&last)[4],
+                                    int const pbit0,
+                                    int const pbit1,
+                                    Bc7Subset & result)
+            {
+                float palette[16][4];
+                unsigned unquantized[2][4];
+                auto const hasPBits = 0 <= pbit0;
+
+                for (unsigned e = 0; e != 2; ++e)
+                {
+                    auto const & source = 0 == e ? first : last;
+                    auto const pbit = 0 == e ? pbit0 : pbit1;
+                    result.PBit[e] = hasPBits ? static_cast<unsigned>(pbit) : 0;
+
+                    for (unsigned c = 0; c != 4; ++c)
+                    {
+                        auto const bits = c < 3 ? info.ColorBits : info.AlphaBits;
+
+                        if (0 == bits || c >= channels)
+                        {
+                            result.Stored[e][c] = 0;
+                            unquantized[e][c] = 255;
+                            continue;
+                        }
+
+                        result.Stored[e][c] = Bc7Quantize(source[c], bits, pbit);
+                        auto const stored = hasPBits ? result.Stored[e][c] << 1 | pbit : result.Stored[e][c];
+                        unquantized[e][c] = Bc7Unquantize(stored, bits + hasPBits);
+                    }
+                }
+
+                auto const count = 1u << indexBits;
+                auto const weightTable = GetBc7Weights(indexBits);
+
+                for (unsigned i = 0; i != count; ++i)
+                {
+                    for (unsigned c = 0; c != 4; ++c)
+                    {
+                        palette[i][c] = static_cast<float>(Bc7Interpolate(unquantized[0][c], unquantized[1][c], weightTable[i]));
+                    }
+                }
+
+                memset(result.Indices, 0, sizeof(result.Indices));
+                result.Error = SelectIndices(block, weights, (std::max)(channels, info.AlphaBits ? 4u : 3u), palette, count, result.Indices);
+
+                if (!info.AlphaBits && 3 == channels)
+                {
+                    // Modes without alpha always decode as opaque.
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        auto const difference = 255.0f - block.Value[3][i];
+                        result.Error += weights[i] * difference * difference;
+                    }
+                }
+            }
+
+            inline void Bc7FitSubset(BlockPlanes const & block,
+                                     float const (&weights)[16],
+                                     Bc7Mode const & info,
+                                     unsigned const channels,
+                                     unsigned const indexBits,
+                                     Bc7Options const & options,
+                                     Bc7Subset & best)
+            {
+                float first[4];
+                float last[4];
+                FitLine(block, weights, channels, first, last);
+                best.Error = FLT_MAX;
+
+                for (unsigned iteration = 0; iteration <= options.Refinements; ++iteration)
+                {
+                    Bc7Subset candidate;
+
+                    if (info.SharedPBits || (info.EndpointPBits && options.ExhaustivePBits))
+                    {
+                        for (unsigned combination = 0; combination != 4; ++combination)
+                        {
+                            auto const pbit0 = static_cast<int>(combination & 1);
+                            auto const pbit1 = static_cast<int>(combination >> 1);
+
+                            if (info.SharedPBits && pbit0 != pbit1)
+                            {
+                                continue;
+                            }
+
+                            Bc7Evaluate(block, weights, info, channels, indexBits, first, last, pbit0, pbit1, candidate);
+
+                            if (candidate.Error < best.Error)
+                            {
+                                best = candidate;
+                            }
+                        }
+                    }
+                    else if (info.EndpointPBits)
+                    {
+                        // Pick each endpoint's p-bit by the parity that best matches its own channels.
+                        int pbits[2];
+
+                        for (unsigned e = 0; e != 2; ++e)
+                        {
+                            auto const & source = 0 == e ? first : last;
+                            float errors[2] = {};
+
+                            for (unsigned p = 0; p != 2; ++p)
+                            {
+                                for (unsigned c = 0; c != channels; ++c)
+                                {
+                                    auto const bits = c < 3 ? info.ColorBits : info.AlphaBits;
+                                    auto const stored = Bc7Quantize(source[c], bits, static_cast<int>(p)) << 1 | p;
+                                    auto const difference = Bc7Unquantize(stored, bits + 1) - source[c];
+                                    errors[p] += difference * difference;
+                                }
+                            }
+
+                            pbits[e] = errors[1] < errors[0] ? 1 : 0;
+                        }
+
+                        Bc7Evaluate(block, weights, info, channels, indexBits, first, last, pbits[0], pbits[1], candidate);
+
+                        if (candidate.Error < best.Error)
+                        {
+                            best = candidate;
+                        }
+                    }
+                    else
+                    {
+                        Bc7Evaluate(block, weights, info, channels, indexBits, first, last, -1, -1, candidate);
+
+                        if (candidate.Error < best.Error)
+                        {
+                            best = candidate;
+                        }
+                    }
+
+                    if (iteration == options.Refinements || 0.0f == best.Error)
+                    {
+                        break;
+                    }
+
+                    unsigned interpolation[16];
+                    auto const weightTable = GetBc7Weights(indexBits);
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        interpolation[i] = weightTable[best.Indices[i]];
+                    }
+
+                    if (!RefineEndpoints(block, weights, channels, interpolation, first, last))
+                    {
+                        break;
+                    }
+                }
+            }
+
+            // Swaps a subset's endpoints when its anchor index would need its top bit.
+            inline void Bc7FixAnchor(Bc7Subset & subset,
+                                     float const (&weights)[16],
+                                     unsigned const anchor,
+                                     unsigned const indexBits,
+                                     bool const colorOnly = false,
+                                     bool const alphaOnly = false)
+            {
+                auto const maximum = (1u << indexBits) - 1;
+
+                if (subset.Indices[anchor] <= maximum / 2)
+                {
+                    return;
+                }
+
+                for (unsigned c = 0; c != 4; ++c)
+                {
+                    if ((colorOnly && 3 == c) || (alphaOnly && 3 != c))
+                    {
+                        continue;
+                    }
+
+                    std::swap(subset.Stored[0][c], subset.Stored[1][c]);
+                }
+
+                std::swap(subset.PBit[0], subset.PBit[1]);
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    if (0.0f != weights[i])
+                    {
+                        subset.Indices[i] = static_cast<std::uint8_t>(maximum - subset.Indices[i]);
+                    }
+                }
+            }
+
+            inline void Bc7EncodePartitioned(BlockPlanes const & block,
+                                             unsigned const mode,
+                                             unsigned const partition,
+                                             Bc7Options const & options,
+                                             float & bestError,
+                                             std::uint8_t * output)
+            {
+                auto const & info = GetBc7Mode(mode);
+                auto const channels = info.AlphaBits ? 4u : 3u;
+                Bc7Subset subsets[3];
+                float weights[3][16];
+                auto error = 0.0f;
+
+                for (unsigned s = 0; s != info.Subsets; ++s)
+                {
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        weights[s][i] = s == GetBc7Subset(info.Subsets, partition, i) ? 1.0f : 0.0f;
+                    }
+
+                    Bc7FitSubset(block, weights[s], info, channels, info.IndexBits, options, subsets[s]);
+                    error += subsets[s].Error;
+
+                    if (error >= bestError)
+                    {
+                        return;
+                    }
+                }
+
+                bestError = error;
+                std::uint8_t indices[16];
+
+                for (unsigned s = 0; s != info.Subsets; ++s)
+                {
+                    Bc7FixAnchor(subsets[s], weights[s], GetBc7Anchor(info.Subsets, partition, s), info.IndexBits);
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        if (0.0f != weights[s][i])
+                        {
+                            indices[i] = subsets[s].Indices[i];
+                        }
+                    }
+                }
+
+                Bc7BitWriter bits(output);
+                bits.Write(1u << mode, mode + 1);
+                bits.Write(partition, info.PartitionBits);
+
+                for (unsigned c = 0; c != 3; ++c)
+                {
+                    for (unsigned s = 0; s != info.Subsets; ++s)
+                    {
+                        bits.Write(subsets[s].Stored[0][c], info.ColorBits);
+                        bits.Write(subsets[s].Stored[1][c], info.ColorBits);
+                    }
+                }
+
+                for (unsigned s = 0; s != info.Subsets; ++s)
+                {
+                    bits.Write(subsets[s].Stored[0][3], info.AlphaBits);
+                    bits.Write(subsets[s].Stored[1][3], info.AlphaBits);
+                }
+
+                for (unsigned s = 0; s != info.Subsets; ++s)
+                {
+                    if (info.SharedPBits)
+                    {
+                        bits.Write(subsets[s].PBit[0], 1);
+                    }
+                    else if (info.EndpointPBits)
+                    {
+                        bits.Write(subsets[s].PBit[0], 1);
+                        bits.Write(subsets[s].PBit[1], 1);
+                    }
+                }
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    auto const subset = GetBc7Subset(info.Subsets, partition, i);
+                    auto const anchor = i == GetBc7Anchor(info.Subsets, partition, subset);
+                    bits.Write(indices[i], info.IndexBits - anchor);
+                }
+            }
+
+            // Modes 4 and 5 encode color and alpha separately, optionally rotating one color
+            // channel into the alpha slot.
+            inline void Bc7EncodeSeparateAlpha(std::uint8_t const (&rgba)[16][4],
+                                               unsigned const mode,
+                                               unsigned const rotation,
+                                               unsigned const indexSelection,
+                                               Bc7Options const & options,
+                                               float & bestError,
+                                               std::uint8_t * output)
+            {
+                auto const & info = GetBc7Mode(mode);
+                std::uint8_t rotated[16][4];
+                memcpy(rotated, rgba, sizeof(rotated));
+
+                if (rotation)
+                {
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        std::swap(rotated[i][3], rotated[i][rotation - 1]);
+                    }
+                }
+
+                BlockPlanes const block(rotated);
+                float const weights[16] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+                auto const colorIndexBits = indexSelection ? info.IndexBits2 : info.IndexBits;
+                auto const alphaIndexBits = indexSelection ? info.IndexBits : info.IndexBits2;
+
+                Bc7Mode colorInfo = info;
+                colorInfo.AlphaBits = 0;
+                Bc7Subset color;
+                Bc7FitSubset(block, weights, colorInfo, 3, colorIndexBits, options, color);
+
+                // Drop the opaque-alpha penalty that Bc7Evaluate adds for color-only modes.
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    auto const difference = 255.0f - block.Value[3][i];
+                    color.Error -= difference * difference;
+                }
+
+                if (color.Error >= bestError)
+                {
+                    return;
+                }
+
+                auto alphaMinimum = 255.0f;
+                auto alphaMaximum = 0.0f;
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    alphaMinimum = (std::min)(alphaMinimum, block.Value[3][i]);
+                    alphaMaximum = (std::max)(alphaMaximum, block.Value[3][i]);
+                }
+
+                Bc7Subset alpha;
+                alpha.Error = FLT_MAX;
+                float first[4] = { 0, 0, 0, alphaMinimum };
+                float last[4] = { 0, 0, 0, alphaMaximum };
+
+                for (unsigned iteration = 0; iteration <= options.Refinements; ++iteration)
+                {
+                    unsigned unquantized[2];
+                    Bc7Subset candidate = {};
+
+                    for (unsigned e = 0; e != 2; ++e)
+                    {
+                        candidate.Stored[e][3] = Bc7Quantize((0 == e ? first : last)[3], info.AlphaBits, -1);
+                        unquantized[e] = Bc7Unquantize(candidate.Stored[e][3], info.AlphaBits);
+                    }
+
+                    auto const weightTable = GetBc7Weights(alphaIndexBits);
+                    auto const count = 1u << alphaIndexBits;
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        auto bestAlpha = FLT_MAX;
+
+                        for (unsigned entry = 0; entry != count; ++entry)
+                        {
+                            auto const difference = Bc7Interpolate(unquantized[0], unquantized[1], weightTable[entry]) - block.Value[3][i];
+
+                            if (difference * difference < bestAlpha)
+                            {
+                                bestAlpha = difference * difference;
+                                candidate.Indices[i] = static_cast<std::uint8_t>(entry);
+                            }
+                        }
+
+                        candidate.Error += bestAlpha;
+                    }
+
+                    if (candidate.Error < alpha.Error)
+                    {
+                        alpha = candidate;
+                    }
+
+                    if (iteration == options.Refinements || 0.0f == alpha.Error)
+                    {
+                        break;
+                    }
+
+                    unsigned interpolation[16];
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        interpolation[i] = weightTable[alpha.Indices[i]];
+                    }
+
+                    float refinedFirst[4];
+                    float refinedLast[4];
+                    BlockPlanes alphaOnly(rotated);
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        alphaOnly.Value[0][i] = block.Value[3][i];
+                    }
+
+                    if (!RefineEndpoints(alphaOnly, weights, 1, interpolation, refinedFirst, refinedLast))
+                    {
+                        break;
+                    }
+
+                    first[3] = refinedFirst[0];
+                    last[3] = refinedLast[0];
+                }
+
+                auto const error = color.Error + alpha.Error;
+
+                if (error >= bestError)
+                {
+                    return;
+                }
+
+                bestError = error;
+                Bc7FixAnchor(color, weights, 0, colorIndexBits, true);
+                Bc7FixAnchor(alpha, weights, 0, alphaIndexBits, false, true);
+
+                auto const & primary = indexSelection ? alpha.Indices : color.Indices;
+                auto const & secondary = indexSelection ? color.Indices : alpha.Indices;
+
+                Bc7BitWriter bits(output);
+                bits.Write(1u << mode, mode + 1);
+                bits.Write(rotation, info.RotationBits);
+                bits.Write(indexSelection, info.IndexSelectionBits);
+
+                for (unsigned c = 0; c != 3; ++c)
+                {
+                    bits.Write(color.Stored[0][c], info.ColorBits);
+                    bits.Write(color.Stored[1][c], info.ColorBits);
+                }
+
+                bits.Write(alpha.Stored[0][3], info.AlphaBits);
+                bits.Write(alpha.Stored[1][3], info.AlphaBits);
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    bits.Write(primary[i], info.IndexBits - (0 == i));
+                }
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    bits.Write(secondary[i], info.IndexBits2 - (0 == i));
+                }
+            }
+
+            // Ranks the partitions of a mode by how well lines fit their subsets. The
+            // per-pixel moments are computed once so that each candidate subset only
+            // sums them and runs a few power iterations on its covariance.
+            inline void Bc7RankPartitions(BlockPlanes const & block,
+                                          unsigned const subsets,
+                                          unsigned const channels,
+                                          unsigned const available,
+                                          unsigned const count,
+                                          unsigned * partitions)
+            {
+                float moments[16][14];
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    auto moment = moments[i];
+
+                    for (unsigned c = 0; c != 4; ++c)
+                    {
+                        *moment++ = c < channels ? block.Value[c][i] : 0.0f;
+                    }
+
+                    for (unsigned c = 0; c != 4; ++c)
+                    {
+                        for (unsigned d = c; d != 4; ++d)
+                        {
+                            *moment++ = c < channels && d < channels ? block.Value[c][i] * block.Value[d][i] : 0.0f;
+                        }
+                    }
+                }
+
+                std::pair<float, unsigned> ranked[64];
+
+                for (unsigned partition = 0; partition != available; ++partition)
+                {
+                    float sums[3][14] = {};
+                    float counts[3] = {};
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        auto const s = GetBc7Subset(subsets, partition, i);
+                        counts[s] += 1.0f;
+
+                        for (unsigned m = 0; m != 14; ++m)
+                        {
+                            sums[s][m] += moments[i][m];
+                        }
+                    }
+
+                    auto residual = 0.0f;
+
+                    for (unsigned s = 0; s != subsets; ++s)
+                    {
+                        float covariance[4][4];
+                        auto moment = sums[s] + 4;
+                        auto trace = 0.0f;
+
+                        for (unsigned c = 0; c != 4; ++c)
+                        {
+                            for (unsigned d = c; d != 4; ++d)
+                            {
+                                covariance[c][d] = covariance[d][c] = *moment++ - sums[s][c] * sums[s][d] / counts[s];
+                            }
+
+                            trace += covariance[c][c];
+                        }
+
+                        float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+                        auto eigenvalue = 0.0f;
+
+                        for (unsigned iteration = 0; iteration != 4; ++iteration)
+                        {
+                            float next[4] = {};
+                            auto length = 0.0f;
+
+                            for (unsigned c = 0; c != 4; ++c)
+                            {
+                                for (unsigned d = 0; d != 4; ++d)
+                                {
+                                    next[c] += covariance[c][d] * axis[d];
+                                }
+
+                                length += next[c] * next[c];
+                            }
+
+                            if (length < 1e-12f)
+                            {
+                                break;
+                            }
+
+                            eigenvalue = std::sqrt(length);
+
+                            for (unsigned c = 0; c != 4; ++c)
+                            {
+                                axis[c] = next[c] / eigenvalue;
+                            }
+                        }
+
+                        residual += (std::max)(trace - eigenvalue, 0.0f);
+                    }
+
+                    ranked[partition] = std::make_pair(residual, partition);
+                }
+
+                std::partial_sort(ranked, ranked + count, ranked + available);
+
+                for (unsigned i = 0; i != count; ++i)
+                {
+                    partitions[i] = ranked[i].second;
+                }
+            }
+
+            inline void EncodeBc7Block(std::uint8_t const (&rgba)[16][4],
+                                       BlockCompressionQuality const quality,
+                                       std::uint8_t * output)
+            {
+                BlockPlanes const block(rgba);
+                auto opaque = true;
+
+                for (unsigned i = 0; i != 16; ++i)
+                {
+                    opaque &= 255 == rgba[i][3];
+                }
+
+                auto const high = BlockCompressionQuality::High == quality;
+                Bc7Options const options = { BlockCompressionQuality::Fast == quality ? 0u : high ? 2u : 1u, high };
+                auto bestError = FLT_MAX;
+
+                Bc7EncodePartitioned(block, 6, 0, options, bestError, output);
+
+                if (BlockCompressionQuality::Fast == quality || 0.0f == bestError)
+                {
+                    return;
+                }
+
+                std::uint8_t candidate[16];
+
+                auto const consider = [&] (float const error)
+                {
+                    if (error < bestError)
+                    {
+                        bestError = error;
+                        memcpy(output, candidate, sizeof(candidate));
+                    }
+                };
+
+                for (unsigned rotation = 0; rotation != 4; ++rotation)
+                {
+                    auto error = bestError;
+                    Bc7EncodeSeparateAlpha(rgba, 5, rotation, 0, options, error, candidate);
+                    consider(error);
+
+                    if (high)
+                    {
+                        for (unsigned indexSelection = 0; indexSelection != 2; ++indexSelection)
+                        {
+                            error = bestError;
+                            Bc7EncodeSeparateAlpha(rgba, 4, rotation, indexSelection, options, error, candidate);
+                            consider(error);
+                        }
+                    }
+                }
+
+                unsigned partitions[64];
+                auto const twoSubsetCount = high ? 16u : 4u;
+                unsigned const twoSubsetModes[] = { 1, opaque ? 3u : 7u, 7 };
+
+                Bc7RankPartitions(block, 2, opaque ? 3 : 4, 64, twoSubsetCount, partitions);
+
+                for (unsigned m = 0; m != (high ? 3u : 2u); ++m)
+                {
+                    for (unsigned p = 0; p != twoSubsetCount; ++p)
+                    {
+                        auto error = bestError;
+                        Bc7EncodePartitioned(block, twoSubsetModes[m], partitions[p], options, error, candidate);
+                        consider(error);
+                    }
+                }
+
+                if (high && opaque)
+                {
+                    // Mode 0 only addresses the first sixteen three-subset partitions.
+                    for (unsigned mode = 0; mode <= 2; mode += 2)
+                    {
+                        Bc7RankPartitions(block, 3, 3, 0 == mode ? 16 : 64, 8, partitions);
+
+                        for (unsigned p = 0; p != 8; ++p)
+                        {
+                            auto error = bestError;
+                            Bc7EncodePartitioned(block, mode, partitions[p], options, error, candidate);
+                            consider(error);
+                        }
+                    }
+                }
+            }
+
+            inline void EncodeBlock(BlockFormat const format,
+                                    std::uint8_t const (&rgba)[16][4],
+                                    BlockCompressionQuality const quality,
+                                    std::uint8_t * output)
+            {
+                auto const refine = BlockCompressionQuality::Fast != quality;
+
+                switch (format)
+                {
+                case BlockFormat::Bc1:
+                    EncodeColorBlock(rgba, true, refine, output);
+                    break;
+
+                case BlockFormat::Bc2:
+                    for (unsigned i = 0; i != 8; ++i)
+                    {
+                        output[i] = static_cast<std::uint8_t>(Reduce(rgba[i * 2][3], 15) | Reduce(rgba[i * 2 + 1][3], 15) << 4);
+                    }
+
+                    EncodeColorBlock(rgba, false, refine, output + 8);
+                    break;
+
+                case BlockFormat::Bc3:
+                    EncodeSingleChannelBlock(rgba, 3, output);
+                    EncodeColorBlock(rgba, false, refine, output + 8);
+                    break;
+
+                case BlockFormat::Bc4:
+                    EncodeSingleChannelBlock(rgba, 0, output);
+                    break;
+
+                case BlockFormat::Bc5:
+                    EncodeSingleChannelBlock(rgba, 0, output);
+                    EncodeSingleChannelBlock(rgba, 1, output + 8);
+                    break;
+
+                case BlockFormat::Bc7:
+                    EncodeBc7Block(rgba, quality, output);
+                    break;
+
+                default:
+                    ASSERT(false);
+                }
+            }
+
+            inline void DecodeBlock(BlockFormat const format,
+                                    std::uint8_t const * input,
+                                    std::uint8_t (&rgba)[16][4])
+            {
+                switch (format)
+                {
+                case BlockFormat::Bc1:
+                    DecodeColorBlock(input, true, rgba);
+                    break;
+
+                case BlockFormat::Bc2:
+                    DecodeColorBlock(input + 8, false, rgba);
+
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        rgba[i][3] = Expand4((input[i / 2] >> ((i % 2) * 4)) & 0xf);
+                    }
+                    break;
+
+                case BlockFormat::Bc3:
+                    DecodeColorBlock(input + 8, false, rgba);
+                    DecodeSingleChannelBlock(input, 3, rgba);
+                    break;
+
+                case BlockFormat::Bc4:
+                case BlockFormat::Bc5:
+                    for (unsigned i = 0; i != 16; ++i)
+                    {
+                        rgba[i][1] = rgba[i][2] = 0;
+                        rgba[i][3] = 255;
+                    }
+
+                    DecodeSingleChannelBlock(input, 0, rgba);
+                    if (BlockFormat::Bc5 == format) DecodeSingleChannelBlock(input + 8, 1, rgba);
+                    break;
+
+                case BlockFormat::Bc7:
+                    DecodeBc7Block(input, rgba);
+                    break;
+
+                default:
+                    ASSERT(false);
+                }
+            }
+
+            // The uncompressed format that a block format's texels are exchanged through.
+            inline auto GetBlockPixelFormat(BlockTraits const & traits,
+                                            AlphaMode const mode) -> PixelFormat
+            {
+                return PixelFormat(traits.Srgb ? Dxgi::Format::R8G8B8A8_UNORM_SRGB : Dxgi::Format::R8G8B8A8_UNORM,
+                                   traits.HasAlpha ? mode : AlphaMode::Ignore);
+            }
+
+        } // Details
+
+        inline auto IsBlockCompressed(Dxgi::Format const format) -> bool
+        {
+            return Details::BlockFormat::Unsupported != Details::GetBlockTraits(format).Format;
+        }
+
+        // Returns the number of bytes in one row of 4x4 blocks.
+        inline auto GetBlockCompressedPitch(Dxgi::Format const format,
+                                            unsigned const width) -> unsigned
+        {
+            return (width + 3) / 4 * Details::GetBlockTraits(format).BlockSize;
+        }
+
+        // Decodes a single 4x4 block into R8G8B8A8 texels as stored, which is all that
+        // CPU sampling of a compressed texture needs.
+        inline void DecompressBlock(Dxgi::Format const format,
+                                    void const * block,
+                                    std::uint8_t (&rgba)[16][4])
+        {
+            auto const traits = Details::GetBlockTraits(format);
+
+            if (Details::BlockFormat::Unsupported == traits.Format)
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            Details::DecodeBlock(traits.Format, static_cast<std::uint8_t const *>(block), rgba);
+        }
+
+        inline void CompressBlocks(SizeU const & size,
+                                   PixelFormat const & sourceFormat,
+                                   void const * source,
+                                   unsigned const sourcePitch,
+                                   PixelFormat const & targetFormat,
+                                   void * target,
+                                   unsigned const targetPitch,
+                                   BlockCompressionQuality const quality = BlockCompressionQuality::Normal)
+        {
+            auto const traits = Details::GetBlockTraits(targetFormat.Format);
+
+            if (Details::BlockFormat::Unsupported == traits.Format)
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            FormatConverter const converter(sourceFormat, Details::GetBlockPixelFormat(traits, targetFormat.AlphaMode));
+            auto const sourceBytes = static_cast<std::uint8_t const *>(source);
+            auto const targetBytes = static_cast<std::uint8_t *>(target);
+            auto const blocksWide = (size.Width + 3) / 4;
+            auto const blocksHigh = (size.Height + 3) / 4;
+
+            Details::ParallelFor(blocksHigh, 1, [&] (unsigned const begin, unsigned const end)
+            {
+                std::vector<std::uint8_t> rows(size.Width * 4 * 4);
+                std::uint8_t rgba[16][4];
+
+                for (auto blockRow = begin; blockRow != end; ++blockRow)
+                {
+                    auto const top = blockRow * 4;
+                    auto const height = (std::min)(4u, size.Height - top);
+
+                    converter.Convert(SizeU(size.Width, height),
+                                      sourceBytes + static_cast<size_t>(top) * sourcePitch,
+                                      sourcePitch,
+                                      rows.data(),
+                                      size.Width * 4);
+
+                    auto output = targetBytes + static_cast<size_t>(blockRow) * targetPitch;
+
+                    for (unsigned blockColumn = 0; blockColumn != blocksWide; ++blockColumn)
+                    {
+                        for (unsigned i = 0; i != 16; ++i)
+                        {
+                            // Edge blocks repeat the last row and column.
+                            auto const x = (std::min)(blockColumn * 4 + i % 4, size.Width - 1);
+                            auto const y = (std::min)(i / 4, height - 1);
+                            memcpy(rgba[i], rows.data() + (y * size.Width + x) * 4, 4);
+                        }
+
+                        Details::EncodeBlock(traits.Format, rgba, quality, output);
+                        output += traits.BlockSize;
+                    }
+                }
+            });
+        }
+
+        inline void DecompressBlocks(SizeU const & size,
+                                     PixelFormat const & sourceFormat,
+                                     void const * source,
+                                     unsigned const sourcePitch,
+                                     PixelFormat const & targetFormat,
+                                     void * target,
+                                     unsigned const targetPitch)
+        {
+            auto const traits = Details::GetBlockTraits(sourceFormat.Format);
+
+            if (Details::BlockFormat::Unsupported == traits.Format)
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            FormatConverter const converter(Details::GetBlockPixelFormat(traits, sourceFormat.AlphaMode), targetFormat);
+            auto const sourceBytes = static_cast<std::uint8_t const *>(source);
+            auto const targetBytes = static_cast<std::uint8_t *>(target);
+            auto const blocksWide = (size.Width + 3) / 4;
+            auto const blocksHigh = (size.Height + 3) / 4;
+
+            Details::ParallelFor(blocksHigh, 4, [&] (unsigned const begin, unsigned const end)
+            {
+                std::vector<std::uint8_t> rows(blocksWide * 4 * 4 * 4);
+                std::uint8_t rgba[16][4];
+
+                for (auto blockRow = begin; blockRow != end; ++blockRow)
+                {
+                    auto input = sourceBytes + static_cast<size_t>(blockRow) * sourcePitch;
+
+                    for (unsigned blockColumn = 0; blockColumn != blocksWide; ++blockColumn)
+                    {
+                        Details::DecodeBlock(traits.Format, input, rgba);
+                        input += traits.BlockSize;
+
+                        for (unsigned y = 0; y != 4; ++y)
+                        {
+                            memcpy(rows.data() + (y * blocksWide * 4 + blockColumn * 4) * 4, rgba[y * 4], 16);
+                        }
+                    }
+
+                    auto const top = blockRow * 4;
+
+                    converter.Convert(SizeU(size.Width, (std::min)(4u, size.Height - top)),
+                                      rows.data(),
+                                      blocksWide * 4 * 4,
+                                      targetBytes + static_cast<size_t>(top) * targetPitch,
+                                      targetPitch);
+                }
+            });
+        }
+
+        enum class YuvMatrix
+        {
+            Bt601,
+            Bt709,
+            Bt2020,
+        };
+
+        enum class YuvRange
+        {
+            Limited, // 16-235 luma and 16-240 chroma (scaled for wider samples)
+            Full,
+        };
+
+        // Describes decoded video memory. Packed formats (YUY2, Y210, Y216 and AYUV) only
+        // use the luma plane. When Chroma is null for NV12, P010 and P016 the chroma plane
+        // is assumed to follow the luma plane directly, as most decoders lay them out.
+        struct YuvSurface
+        {
+            explicit YuvSurface(Dxgi::Format const format  = Dxgi::Format::Unknown,
+                                SizeU const & size         = SizeU(),
+                                void const * luma          = nullptr,
+                                unsigned const lumaPitch   = 0,
+                                void const * chroma        = nullptr,
+                                unsigned const chromaPitch = 0,
+                                YuvMatrix const matrix     = YuvMatrix::Bt709,
+                                YuvRange const range       = YuvRange::Limited) :
+                Format(format),
+                Size(size),
+                Luma(luma),
+                LumaPitch(lumaPitch),
+                Chroma(chroma),
+                ChromaPitch(chromaPitch),
+                Matrix(matrix),
+                Range(range)
+            {}
+
+            Dxgi::Format Format;
+            SizeU Size;
+            void const * Luma;
+            unsigned LumaPitch;
+            void const * Chroma;
+            unsigned ChromaPitch;
+            YuvMatrix Matrix;
+            YuvRange Range;
+        };
+
+        namespace Details
+        {
+            // Samples are widened to 16 bits and halved so that they fit a signed 16-bit
+            // lane. The factors are applied with a high 16-bit multiply and produce 8-bit
+            // channels with three fractional bits.
+            struct YuvCoefficients
+            {
+                std::int16_t LumaOffset;
+                std::int16_t Luma;
+                std::int16_t RedV;
+                std::int16_t GreenU;
+                std::int16_t GreenV;
+                std::int16_t BlueU;
+            };
+
+            inline auto GetYuvCoefficients(YuvMatrix const matrix,
+                                           YuvRange const range) -> YuvCoefficients
+            {
+                auto kr = 0.2126f;
+                auto kb = 0.0722f;
+
+                if (YuvMatrix::Bt601 == matrix)
+                {
+                    kr = 0.299f;
+                    kb = 0.114f;
+                }
+                else if (YuvMatrix::Bt2020 == matrix)
+                {
+                    kr = 0.2627f;
+                    kb = 0.0593f;
+                }
+
+                auto const kg = 1.0f - kr - kb;
+                auto const limited = YuvRange::Limited == range;
+                auto const luma = limited ? 255.0f / 219.0f : 1.0f;
+                auto const chroma = limited ? 255.0f / 224.0f : 1.0f;
+
+                auto const fixed = [] (float const value)
+                {
+                    return static_cast<std::int16_t>(std::floor(value * 4096.0f + 0.5f));
+                };
+
+                YuvCoefficients result;
+                result.LumaOffset = limited ? 16 << 7 : 0;
+                result.Luma = fixed(luma);
+                result.RedV = fixed(2.0f * (1.0f - kr) * chroma);
+                result.GreenU = fixed(-2.0f * kb * (1.0f - kb) / kg * chroma);
+                result.GreenV = fixed(-2.0f * kr * (1.0f - kr) / kg * chroma);
+                result.BlueU = fixed(2.0f * (1.0f - kb) * chroma);
+                return result;
+            }
+
+            inline auto MultiplyHigh(int const value,
+                                     int const factor) -> int
+            {
+                return (value * factor) >> 16;
+            }
+
+            inline auto LoadWord(std::uint8_t const * bytes,
+                                 unsigned const index) -> unsigned
+            {
+                std::uint16_t value;
+                memcpy(&value, bytes + index * 2, sizeof(value));
+                return value;
+            }
+
+            // Each source describes how to widen one format's samples. Rows is the number of
+            // luma rows that share a row of chroma samples and BytesPerPixel is the luma
+            // stride, which for these formats also locates a pixel's chroma.
+
+            struct Nv12Source
+            {
+                static unsigned const BytesPerPixel = 1;
+                static unsigned const Rows = 2;
+                static bool const HasAlpha = false;
+
+                static auto Luma(std::uint8_t const * luma, unsigned const x) -> int { return luma[x] << 7; }
+                static auto U(std::uint8_t const * chroma, unsigned const x) -> int { return chroma[x & ~1u] << 7; }
+                static auto V(std::uint8_t const * chroma, unsigned const x) -> int { return chroma[x | 1u] << 7; }
+                static auto Alpha(std::uint8_t const *, unsigned) -> int { return 255; }
+            };
+
+            struct P016Source
+            {
+                static unsigned const BytesPerPixel = 2;
+                static unsigned const Rows = 2;
+                static bool const HasAlpha = false;
+
+                static auto Luma(std::uint8_t const * luma, unsigned const x) -> int { return LoadWord(luma, x) >> 1; }
+                static auto U(std::uint8_t const * chroma, unsigned const x) -> int { return LoadWord(chroma, x & ~1u) >> 1; }
+                static auto V(std::uint8_t const * chroma, unsigned const x) -> int { return LoadWord(chroma, x | 1u) >> 1; }
+                static auto Alpha(std::uint8_t const *, unsigned) -> int { return 255; }
+            };
+
+            struct Yuy2Source
+            {
+                static unsigned const BytesPerPixel = 2;
+                static unsigned const Rows = 1;
+                static bool const HasAlpha = false;
+
+                static auto Luma(std::uint8_t const * luma, unsigned const x) -> int { return luma[x * 2] << 7; }
+                static auto U(std::uint8_t const * chroma, unsigned const x) -> int { return chroma[x / 2 * 4 + 1] << 7; }
+                static auto V(std::uint8_t const * chroma, unsigned const x) -> int { return chroma[x / 2 * 4 + 3] << 7; }
+                static auto Alpha(std::uint8_t const *, unsigned) -> int { return 255; }
+            };
+
+            struct Y216Source
+            {
+                static unsigned const BytesPerPixel = 4;
+                static unsigned const Rows = 1;
+                static bool const HasAlpha = false;
+
+                static auto Luma(std::uint8_t const * luma, unsigned const x) -> int { return LoadWord(luma, x * 2) >> 1; }
+                static auto U(std::uint8_t const * chroma, unsigned const x) -> int { return LoadWord(chroma, x / 2 * 4 + 1) >> 1; }
+                static auto V(std::uint8_t const * chroma, unsigned const x) -> int { return LoadWord(chroma, x / 2 * 4 + 3) >> 1; }
+                static auto Alpha(std::uint8_t const *, unsigned) -> int { return 255; }
+            };
+
+            struct AyuvSource
+            {
+                static unsigned const BytesPerPixel = 4;
+                static unsigned const Rows = 1;
+                static bool const HasAlpha = true;
+
+                static auto Luma(std::uint8_t const * luma, unsigned const x) -> int { return luma[x * 4 + 2] << 7; }
+                static auto U(std::uint8_t const * chroma, unsigned const x) -> int { return chroma[x * 4 + 1] << 7; }
+                static auto V(std::uint8_t const * chroma, unsigned const x) -> int { return chroma[x * 4] << 7; }
+                static auto Alpha(std::uint8_t const * luma, unsigned const x) -> int { return luma[x * 4 + 3]; }
+            };
+
+            #ifdef KENNYKERR_CPU_AVX2
+            // Sixteen pixels at a time. Each 128-bit lane holds eight consecutive pixels so
+            // that the results can be interleaved into B8G8R8A8 without crossing lanes.
+
+            inline auto DuplicateU(__m256i const uv) -> __m256i
+            {
+                return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, _MM_SHUFFLE(2, 2, 0, 0)), _MM_SHUFFLE(2, 2, 0, 0));
+            }
+
+            inline auto DuplicateV(__m256i const uv) -> __m256i
+            {
+                return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(uv, _MM_SHUFFLE(3, 3, 1, 1)), _MM_SHUFFLE(3, 3, 1, 1));
+            }
+
+            // Narrows two registers of eight 32-bit values each into sixteen 16-bit values in pixel order.
+            inline auto PackPixels(__m256i const first,
+                                   __m256i const second) -> __m256i
+            {
+                return _mm256_permute4x64_epi64(_mm256_packus_epi32(first, second), _MM_SHUFFLE(3, 1, 2, 0));
+            }
+
+            inline auto LoadLuma16(Nv12Source, std::uint8_t const * luma) -> __m256i
+            {
+                return _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(luma))), 7);
+            }
+
+            inline void LoadChroma16(Nv12Source, std::uint8_t const * chroma, __m256i & u, __m256i & v)
+            {
+                auto const uv = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<__m128i const *>(chroma))), 7);
+                u = DuplicateU(uv);
+                v = DuplicateV(uv);
+            }
+
+            inline auto LoadLuma16(P016Source, std::uint8_t const * luma) -> __m256i
+            {
+                return _mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(luma)), 1);
+            }
+
+            inline void LoadChroma16(P016Source, std::uint8_t const * chroma, __m256i & u, __m256i & v)
+            {
+                auto const uv = _mm256_srli_epi16(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(chroma)), 1);
+                u = DuplicateU(uv);
+                v = DuplicateV(uv);
+            }
+
+            inline auto LoadLuma16(Yuy2Source, std::uint8_t const * luma) -> __m256i
+            {
+                auto const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(luma));
+                return _mm256_slli_epi16(_mm256_and_si256(pixels, _mm256_set1_epi16(0xff)), 7);
+            }
+
+            inline void LoadChroma16(Yuy2Source, std::uint8_t const * chroma, __m256i & u, __m256i & v)
+            {
+                auto const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(chroma));
+                auto const uv = _mm256_slli_epi16(_mm256_srli_epi16(pixels, 8), 7);
+                u = DuplicateU(uv);
+                v = DuplicateV(uv);
+            }
+
+            inline auto LoadLuma16(Y216Source, std::uint8_t const * luma) -> __m256i
+            {
+                auto const mask = _mm256_set1_epi32(0xffff);
+                auto const first = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(luma)), mask);
+                auto const second = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(luma + 32)), mask);
+                return _mm256_srli_epi16(PackPixels(first, second), 1);
+            }
+
+            inline void LoadChroma16(Y216Source, std::uint8_t const * chroma, __m256i & u, __m256i & v)
+            {
+                auto const first = _mm256_srli_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(chroma)), 16);
+                auto const second = _mm256_srli_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(chroma + 32)), 16);
+                auto const uv = _mm256_srli_epi16(PackPixels(first, second), 1);
+                u = DuplicateU(uv);
+                v = DuplicateV(uv);
+            }
+
+            // Extracts one byte of each AYUV pixel (0 = V, 1 = U, 2 = Y, 3 = A).
+            inline auto LoadAyuvChannel(std::uint8_t const * pixels, int const channel) -> __m256i
+            {
+                auto const shift = _mm_cvtsi32_si128(channel * 8);
+                auto const mask = _mm256_set1_epi32(0xff);
+                auto const first = _mm256_and_si256(_mm256_srl_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(pixels)), shift), mask);
+                auto const second = _mm256_and_si256(_mm256_srl_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(pixels + 32)), shift), mask);
+                return PackPixels(first, second);
+            }
+
+            inline auto LoadLuma16(AyuvSource, std::uint8_t const * luma) -> __m256i
+            {
+                return _mm256_slli_epi16(LoadAyuvChannel(luma, 2), 7);
+            }
+
+            inline void LoadChroma16(AyuvSource, std::uint8_t const * chroma, __m256i & u, __m256i & v)
+            {
+                u = _mm256_slli_epi16(LoadAyuvChannel(chroma, 1), 7);
+                v = _mm256_slli_epi16(LoadAyuvChannel(chroma, 0), 7);
+            }
+
+            template <typename Source>
+            auto LoadAlpha16(Source, std::uint8_t const *) -> __m256i
+            {
+                return _mm256_set1_epi16(255);
+            }
+
+            inline auto LoadAlpha16(AyuvSource, std::uint8_t const * luma) -> __m256i
+            {
+                return LoadAyuvChannel(luma, 3);
+            }
+
+            // Combines luma with the chroma terms, rounds away the fractional bits and stores
+            // sixteen B8G8R8A8 pixels.
+            inline void StoreYuvPixels16(std::uint8_t * target,
+                                         __m256i const luma,
+                                         __m256i const red,
+                                         __m256i const green,
+                                         __m256i const blue,
+                                         __m256i const alpha)
+            {
+                auto const r = _mm256_srai_epi16(_mm256_adds_epi16(luma, red), 3);
+                auto const g = _mm256_srai_epi16(_mm256_adds_epi16(luma, green), 3);
+                auto const b = _mm256_srai_epi16(_mm256_adds_epi16(luma, blue), 3);
+
+                auto const br = _mm256_packus_epi16(b, r);
+                auto const ga = _mm256_packus_epi16(g, alpha);
+                auto const bg = _mm256_unpacklo_epi8(br, ga);
+                auto const ra = _mm256_unpackhi_epi8(br, ga);
+                auto const low = _mm256_unpacklo_epi16(bg, ra);
+                auto const high = _mm256_unpackhi_epi16(bg, ra);
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(target), _mm256_permute2x128_si256(low, high, 0x20));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + 32), _mm256_permute2x128_si256(low, high, 0x31));
+            }
+            #endif
+
+            inline auto ClampByte(int const value) -> std::uint8_t
+            {
+                return static_cast<std::uint8_t>((std::min)((std::max)(value, 0), 255));
+            }
+
+            // Converts one or two luma rows that share a chroma row. The chroma terms are
+            // computed once and applied to both rows.
+            template <typename Source>
+            void ConvertYuvRows(YuvCoefficients const & k,
+                                std::uint8_t const * luma0,
+                                std::uint8_t const * luma1,
+                                std::uint8_t const * chroma,
+                                std::uint8_t * target0,
+                                std::uint8_t * target1,
+                                unsigned const width)
+            {
+                unsigned x = 0;
+
+                #ifdef KENNYKERR_CPU_AVX2
+                auto const lumaOffset = _mm256_set1_epi16(k.LumaOffset);
+                auto const lumaFactor = _mm256_set1_epi16(k.Luma);
+                auto const redV = _mm256_set1_epi16(k.RedV);
+                auto const greenU = _mm256_set1_epi16(k.GreenU);
+                auto const greenV = _mm256_set1_epi16(k.GreenV);
+                auto const blueU = _mm256_set1_epi16(k.BlueU);
+                auto const center = _mm256_set1_epi16(16384);
+                auto const round = _mm256_set1_epi16(4);
+
+                for (; x + 16 <= width; x += 16)
+                {
+                    __m256i u;
+                    __m256i v;
+                    LoadChroma16(Source(), chroma + x * Source::BytesPerPixel, u, v);
+                    u = _mm256_sub_epi16(u, center);
+                    v = _mm256_sub_epi16(v, center);
+
+                    auto const red = _mm256_mulhi_epi16(v, redV);
+                    auto const green = _mm256_add_epi16(_mm256_mulhi_epi16(u, greenU), _mm256_mulhi_epi16(v, greenV));
+                    auto const blue = _mm256_mulhi_epi16(u, blueU);
+
+                    auto luma = _mm256_mulhi_epi16(_mm256_sub_epi16(LoadLuma16(Source(), luma0 + x * Source::BytesPerPixel), lumaOffset), lumaFactor);
+                    StoreYuvPixels16(target0 + x * 4, _mm256_add_epi16(luma, round), red, green, blue, LoadAlpha16(Source(), luma0 + x * Source::BytesPerPixel));
+
+                    if (luma1)
+                    {
+                        luma = _mm256_mulhi_epi16(_mm256_sub_epi16(LoadLuma16(Source(), luma1 + x * Source::BytesPerPixel), lumaOffset), lumaFactor);
+                        StoreYuvPixels16(target1 + x * 4, _mm256_add_epi16(luma, round), red, green, blue, LoadAlpha16(Source(), luma1 + x * Source::BytesPerPixel));
+                    }
+                }
+                #endif
+
+                for (; x != width; ++x)
+                {
+                    auto const u = Source::U(chroma, x) - 16384;
+                    auto const v = Source::V(chroma, x) - 16384;
+                    auto const red = MultiplyHigh(v, k.RedV);
+                    auto const green = MultiplyHigh(u, k.GreenU) + MultiplyHigh(v, k.GreenV);
+                    auto const blue = MultiplyHigh(u, k.BlueU);
+
+                    for (unsigned row = 0; row != 2; ++row)
+                    {
+                        auto const luma = row ? luma1 : luma0;
+
+                        if (!luma)
+                        {
+                            break;
+                        }
+
+                        auto const y = MultiplyHigh(Source::Luma(luma, x) - k.LumaOffset, k.Luma) + 4;
+                        auto const pixel = (row ? target1 : target0) + x * 4;
+                        pixel[0] = ClampByte((y + blue) >> 3);
+                        pixel[1] = ClampByte((y + green) >> 3);
+                        pixel[2] = ClampByte((y + red) >> 3);
+                        pixel[3] = static_cast<std::uint8_t>(Source::Alpha(luma, x));
+                    }
+                }
+
+                if (Source::HasAlpha)
+                {
+                    Premultiply(target0, width);
+
+                    if (target1)
+                    {
+                        Premultiply(target1, width);
+                    }
+                }
+            }
+
+            template <typename Source>
+            void ConvertYuvSurface(YuvSurface const & source,
+                                   std::uint8_t * target,
+                                   unsigned const targetPitch)
+            {
+                auto const k = GetYuvCoefficients(source.Matrix, source.Range);
+                auto const luma = static_cast<std::uint8_t const *>(source.Luma);
+                auto chroma = static_cast<std::uint8_t const *>(source.Chroma);
+                auto chromaPitch = source.ChromaPitch;
+
+                if (!chroma)
+                {
+                    chroma = 2 == Source::Rows ? luma + static_cast<size_t>(source.LumaPitch) * source.Size.Height : luma;
+                    chromaPitch = source.LumaPitch;
+                }
+
+                auto const rows = (source.Size.Height + Source::Rows - 1) / Source::Rows;
+                auto const grain = (std::max)(1u, 8192u / (std::max)(source.Size.Width, 1u));
+
+                ParallelFor(rows, grain, [&] (unsigned const begin, unsigned const end)
+                {
+                    for (auto row = begin; row != end; ++row)
+                    {
+                        auto const top = row * Source::Rows;
+                        auto const pair = 2 == Source::Rows && top + 1 < source.Size.Height;
+
+                        ConvertYuvRows<Source>(k,
+                                               luma + static_cast<size_t>(top) * source.LumaPitch,
+                                               pair ? luma + static_cast<size_t>(top + 1) * source.LumaPitch : nullptr,
+                                               chroma + static_cast<size_t>(row) * chromaPitch,
+                                               target + static_cast<size_t>(top) * targetPitch,
+                                               pair ? target + static_cast<size_t>(top + 1) * targetPitch : nullptr,
+                                               source.Size.Width);
+                    }
+                });
+            }
+
+        } // Details
+
+        inline auto CanConvertYuv(Dxgi::Format const format) -> bool
+        {
+            switch (format)
+            {
+            case Dxgi::Format::NV12:
+            case Dxgi::Format::P010:
+            case Dxgi::Format::P016:
+            case Dxgi::Format::YUY2:
+            case Dxgi::Format::Y210:
+            case Dxgi::Format::Y216:
+            case Dxgi::Format::AYUV:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        // Converts video memory to premultiplied B8G8R8A8 pixels.
+        inline void ConvertYuvPixels(YuvSurface const & source,
+                                     void * target,
+                                     unsigned const targetPitch)
+        {
+            ASSERT(source.Luma && target);
+            auto const bytes = static_cast<std::uint8_t *>(target);
+
+            switch (source.Format)
+            {
+            case Dxgi::Format::NV12:
+                Details::ConvertYuvSurface<Details::Nv12Source>(source, bytes, targetPitch);
+                break;
+
+            case Dxgi::Format::P010:
+            case Dxgi::Format::P016:
+                Details::ConvertYuvSurface<Details::P016Source>(source, bytes, targetPitch);
+                break;
+
+            case Dxgi::Format::YUY2:
+                Details::ConvertYuvSurface<Details::Yuy2Source>(source, bytes, targetPitch);
+                break;
+
+            case Dxgi::Format::Y210:
+            case Dxgi::Format::Y216:
+                Details::ConvertYuvSurface<Details::Y216Source>(source, bytes, targetPitch);
+                break;
+
+            case Dxgi::Format::AYUV:
+                Details::ConvertYuvSurface<Details::AyuvSource>(source, bytes, targetPitch);
+                break;
+
+            default:
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+        }
+
+        namespace Details
+        {
+            // Bump allocates resources that live for a frame. The arena owns them rather
+            // than their handles, so they are not reference counted, and Reset destroys
+            // them all at once and keeps the blocks for the next frame.
+            class FrameArena
+            {
+                struct alignas(16) Block
+                {
+                    size_t Size;
+                    size_t Used;
+
+                    auto GetBits() -> std::uint8_t *
+                    {
+                        return reinterpret_cast<std::uint8_t *>(this + 1);
+                    }
+                };
+
+                struct Object
+                {
+                    void * Pointer;
+                    void (*Destroy)(void *);
+                };
+
+                static size_t const BlockSize = 16 * 1024;
+
+                std::vector<Block *> m_blocks;
+                std::vector<Block *> m_free;
+                std::vector<Object> m_objects;
+
+                FrameArena(FrameArena const &);
+                FrameArena & operator=(FrameArena const &);
+
+                static auto CreateBlock(size_t const size) -> Block *
+                {
+                    auto const block = static_cast<Block *>(::operator new(sizeof(Block) + size));
+                    block->Size = size;
+                    block->Used = 0;
+                    return block;
+                }
+
+                template <typename T>
+                static void Destroy(void * pointer)
+                {
+                    static_cast<T *>(pointer)->~T();
+                }
+
+                auto Allocate(size_t const size) -> void *
+                {
+                    auto const needed = (size + 15) & ~size_t(15);
+
+                    if (m_blocks.empty() || m_blocks.back()->Size - m_blocks.back()->Used < needed)
+                    {
+                        if (needed > BlockSize)
+                        {
+                            m_blocks.push_back(CreateBlock(needed));
+                        }
+                        else if (!m_free.empty())
+                        {
+                            m_blocks.push_back(m_free.back());
+                            m_free.pop_back();
+                        }
+                        else
+                        {
+                            m_blocks.push_back(CreateBlock(BlockSize));
+                        }
+                    }
+
+                    auto const block = m_blocks.back();
+                    auto const bits = block->GetBits() + block->Used;
+                    block->Used += needed;
+                    return bits;
+                }
+
+            public:
+
+                FrameArena()
+                {}
+
+                ~FrameArena()
+                {
+                    Reset();
+
+                    for (auto const block : m_free)
+                    {
+                        ::operator delete(block);
+                    }
+                }
+
+                template <typename T, typename ... Args>
+                auto Create(Args && ... args) -> T *
+                {
+                    m_objects.reserve(m_objects.size() + 1);
+                    auto const object = new (Allocate(sizeof(T))) T(std::forward<Args>(args) ...);
+                    Object const entry = { object, &Destroy<T> };
+                    m_objects.push_back(entry);
+                    return object;
+                }
+
+                // Called at the end of each frame.
+                void Reset()
+                {
+                    while (!m_objects.empty())
+                    {
+                        auto const entry = m_objects.back();
+                        m_objects.pop_back();
+                        entry.Destroy(entry.Pointer);
+                    }
+
+                    for (auto const block : m_blocks)
+                    {
+                        if (BlockSize == block->Size)
+                        {
+                            block->Used = 0;
+                            m_free.push_back(block);
+                        }
+                        else
+                        {
+                            ::operator delete(block);
+                        }
+                    }
+
+                    m_blocks.clear();
+                }
+            };
+
+            // Reference counts are atomic, so that handles may be copied and released on
+            // any thread. Programs that only hand resources to other threads through
+            // their own synchronization, much like a single threaded factory, may define
+            // KENNYKERR_CPU_SINGLE_THREADED to count without interlocked instructions.
+            struct AtomicReferenceCount
+            {
+                static void Increment(std::atomic<unsigned> & count)
+                {
+                    count.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                static auto Decrement(std::atomic<unsigned> & count) -> bool
+                {
+                    return 1 == count.fetch_sub(1, std::memory_order_acq_rel);
+                }
+            };
+
+            // Relaxed loads and stores compile to plain moves.
+            struct PlainReferenceCount
+            {
+                static void Increment(std::atomic<unsigned> & count)
+                {
+                    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                }
+
+                static auto Decrement(std::atomic<unsigned> & count) -> bool
+                {
+                    auto const value = count.load(std::memory_order_relaxed) - 1;
+                    count.store(value, std::memory_order_relaxed);
+                    return 0 == value;
+                }
+            };
+
+            #ifdef KENNYKERR_CPU_SINGLE_THREADED
+            typedef PlainReferenceCount ReferenceCount;
+            #else
+            typedef AtomicReferenceCount ReferenceCount;
+            #endif
+
+            // CPU resources are reference counted implementations that the handle
+            // classes below share, much as the dx.h classes share COM interfaces.
+            // The count lives in the resource itself, so no control block is needed.
+            // Recorders hold on to the resources a draw call refers to.
+            struct Resource
+            {
+                mutable std::atomic<unsigned> References;
+
+                // Owned by a frame arena rather than its handles, which don't count it.
+                bool Transient;
+
+                Resource() :
+                    References(0),
+                    Transient(false)
+                {}
+
+                Resource(Resource const &) :
+                    References(0),
+                    Transient(false)
+                {}
+
+                auto operator=(Resource const &) -> Resource &
+                {
+                    return *this;
+                }
+
+                virtual ~Resource() {}
+
+                void AddRef() const
+                {
+                    ReferenceCount::Increment(References);
+                }
+
+                void Release() const
+                {
+                    if (ReferenceCount::Decrement(References))
+                    {
+                        delete this;
+                    }
+                }
+            };
+
+            // Owns a reference to a resource, much as ComPtr owns a COM interface.
+            // Transient resources belong to their frame arena, so pointers to them
+            // only borrow them and never touch the object to count references.
+            template <typename T>
+            class Pointer
+            {
+                template <typename U> friend class Pointer;
+
+                T * m_ptr;
+                bool m_owner;
+
+                void InternalAddRef() const
+                {
+                    if (m_owner)
+                    {
+                        m_ptr->AddRef();
+                    }
+                }
+
+                void InternalRelease() const
+                {
+                    if (m_owner)
+                    {
+                        m_ptr->Release();
+                    }
+                }
+
+            public:
+
+                Pointer() :
+                    m_ptr(nullptr),
+                    m_owner(false)
+                {}
+
+                Pointer(std::nullptr_t) :
+                    m_ptr(nullptr),
+                    m_owner(false)
+                {}
+
+                explicit Pointer(T * other) :
+                    m_ptr(other),
+                    m_owner(other && !other->Transient)
+                {
+                    InternalAddRef();
+                }
+
+                Pointer(Pointer const & other) :
+                    m_ptr(other.m_ptr),
+                    m_owner(other.m_owner)
+                {
+                    InternalAddRef();
+                }
+
+                template <typename U>
+                Pointer(Pointer<U> const & other) :
+                    m_ptr(other.m_ptr),
+                    m_owner(other.m_owner)
+                {
+                    InternalAddRef();
+                }
+
+                Pointer(Pointer && other) :
+                    m_ptr(other.m_ptr),
+                    m_owner(other.m_owner)
+                {
+                    other.m_ptr = nullptr;
+                    other.m_owner = false;
+                }
+
+                template <typename U>
+                Pointer(Pointer<U> && other) :
+                    m_ptr(other.m_ptr),
+                    m_owner(other.m_owner)
+                {
+                    other.m_ptr = nullptr;
+                    other.m_owner = false;
+                }
+
+                ~Pointer()
+                {
+                    InternalRelease();
+                }
+
+                auto operator=(Pointer other) -> Pointer &
+                {
+                    Swap(other);
+                    return *this;
+                }
+
+                explicit operator bool() const { return nullptr != m_ptr; }
+                auto operator->() const -> T * { return m_ptr; }
+                auto operator*() const -> T & { return *m_ptr; }
+                auto Get() const -> T * { return m_ptr; }
+                void Reset() { Pointer().Swap(*this); }
+                void Swap(Pointer & other) { std::swap(m_ptr, other.m_ptr); std::swap(m_owner, other.m_owner); }
+
+                // Takes over a pointer without adding a reference, or gives one up
+                // without releasing it.
+                void Attach(T * other)
+                {
+                    Pointer().Swap(*this);
+                    m_ptr = other;
+                    m_owner = other && !other->Transient;
+                }
+
+                auto Detach() -> T *
+                {
+                    auto const result = m_ptr;
+                    m_ptr = nullptr;
+                    m_owner = false;
+                    return result;
+                }
+            };
+
+            template <typename T>
+            auto operator==(Pointer<T> const & left,
+                            std::nullptr_t) -> bool
+            {
+                return nullptr == left.Get();
+            }
+
+            template <typename T>
+            auto operator!=(Pointer<T> const & left,
+                            std::nullptr_t) -> bool
+            {
+                return nullptr != left.Get();
+            }
+
+            template <typename T>
+            auto operator==(std::nullptr_t,
+                            Pointer<T> const & right) -> bool
+            {
+                return nullptr == right.Get();
+            }
+
+            template <typename T>
+            auto operator!=(std::nullptr_t,
+                            Pointer<T> const & right) -> bool
+            {
+                return nullptr != right.Get();
+            }
+
+            template <typename T, typename... Arguments>
+            auto Make(Arguments && ... arguments) -> Pointer<T>
+            {
+                return Pointer<T>(new T(std::forward<Arguments>(arguments)...));
+            }
+
+            // Allocates from a frame arena, or from the heap without one.
+            template <typename T, typename... Arguments>
+            auto MakeIn(FrameArena * arena,
+                        Arguments && ... arguments) -> Pointer<T>
+            {
+                if (!arena)
+                {
+                    return Make<T>(std::forward<Arguments>(arguments)...);
+                }
+
+                auto const resource = arena->Create<T>(std::forward<Arguments>(arguments)...);
+                resource->Transient = true;
+                return Pointer<T>(resource);
+            }
+
+            template <typename T, typename U>
+            auto StaticPointerCast(Pointer<U> const & other) -> Pointer<T>
+            {
+                return Pointer<T>(static_cast<T *>(other.Get()));
+            }
+
+            class Object
+            {
+                template <typename T> friend class Borrowed;
+
+                bool operator==(Object const &);
+                bool operator!=(Object const &);
+
+            protected:
+
+                Pointer<Resource> m_ptr;
+
+                Object() {}
+                Object(Pointer<Resource> other) : m_ptr(std::move(other)) {}
+                Object(Object const & other) : m_ptr(other.m_ptr) {}
+                Object(Object && other) : m_ptr(std::move(other.m_ptr)) {}
+                void Copy(Object const & other) { m_ptr = other.m_ptr; }
+                void Move(Object && other) { m_ptr = std::move(other.m_ptr); }
+
+            public:
+
+                explicit operator bool() const { return nullptr != m_ptr.Get(); }
+                void Reset() { m_ptr.Reset(); }
+            };
+
+            // A handle that refers to a resource without holding a reference to it, for
+            // getters on hot paths. It is only valid while the object it came from keeps
+            // the resource, and converts to an owning handle when one is needed.
+            template <typename T>
+            class Borrowed
+            {
+                T m_value;
+
+                Borrowed & operator=(Borrowed const &);
+
+            public:
+
+                explicit Borrowed(Resource * resource)
+                {
+                    m_value.m_ptr.Attach(resource);
+                }
+
+                Borrowed(Borrowed const & other)
+                {
+                    m_value.m_ptr.Attach(other.m_value.m_ptr.Get());
+                }
+
+                ~Borrowed()
+                {
+                    m_value.m_ptr.Detach();
+                }
+
+                operator T const & () const { return m_value; }
+                auto operator->() const -> T const * { return &m_value; }
+                auto Get() const -> T const & { return m_value; }
+            };
+
+            #define KENNYKERR_CPU_DEFINE_CLASS(THIS_CLASS, BASE_CLASS, IMPLEMENTATION)                                  \
+            THIS_CLASS() {}                                                                                           \
+            THIS_CLASS(THIS_CLASS const & other) : BASE_CLASS(other) {}                                               \
+            THIS_CLASS(THIS_CLASS && other)      : BASE_CLASS(std::move(other)) {}                                    \
+            explicit THIS_CLASS(Details::Pointer<IMPLEMENTATION> other) : BASE_CLASS(std::move(other)) {}           \
+            THIS_CLASS & operator=(THIS_CLASS const & other) { Copy(other);            return *this; }                \
+            THIS_CLASS & operator=(THIS_CLASS && other)      { Move(std::move(other)); return *this; }                \
+            auto operator->() const -> IMPLEMENTATION * { return Get(); }                                             \
+            auto Get() const -> IMPLEMENTATION *        { return static_cast<IMPLEMENTATION *>(m_ptr.Get()); }        \
+            auto Share() const -> Details::Pointer<IMPLEMENTATION> { return Details::StaticPointerCast<IMPLEMENTATION>(m_ptr); }
+
+            // Anything that can be drawn with DrawImage.
+            struct ImageImpl : Resource
+            {
+            };
+
+            // Pixels lent out by a pool, which keeps a reference to them. They are free
+            // again once that is the only one left.
+            struct PooledPixels : Resource
+            {
+                std::unique_ptr<std::uint8_t[]> Bits;
+
+                explicit PooledPixels(size_t const size) :
+                    Bits(new std::uint8_t[size])
+                {}
+
+                auto IsFree() const -> bool
+                {
+                    return 1 == References.load(std::memory_order_acquire);
+                }
+            };
+
+            struct BitmapImpl : ImageImpl
+            {
+                SizeU Size;
+                PixelFormat Format;
+                unsigned Pitch;
+                std::uint8_t * Bits;
+                std::unique_ptr<std::uint8_t[]> Storage;
+
+                // Pixels borrowed from a pool, which gets them back when this is released.
+                Pointer<PooledPixels> Pooled;
+
+                // Fills the pixels on first access for bitmaps created from a lazy source.
+                std::function<void(std::uint8_t *, unsigned)> Pending;
+                std::mutex PendingLock;
+                std::atomic<bool> Ready;
+
+                // Set once the pixels may no longer change, so threads can share them.
+                std::atomic<bool> Immutable;
+
+                BitmapImpl(SizeU const & size,
+                           PixelFormat const & format,
+                           unsigned const pitch,
+                           std::uint8_t * bits) :
+                    Size(size),
+                    Format(format),
+                    Pitch(pitch),
+                    Bits(bits),
+                    Ready(true),
+                    Immutable(false)
+                {}
+
+                auto GetBits() -> std::uint8_t *
+                {
+                    if (!Ready.load(std::memory_order_acquire))
+                    {
+                        std::lock_guard<std::mutex> lock(PendingLock);
+
+                        if (Pending)
+                        {
+                            Pending(Bits, Pitch);
+                            Pending = nullptr;
+                            Ready.store(true, std::memory_order_release);
+                        }
+                    }
+
+                    return Bits;
+                }
+            };
+
+            inline auto GetBytesPerPixel(Dxgi::Format const format) -> unsigned
+            {
+                return (std::max)(GetFormatTraits(format).BytesPerPixel, 1u);
+            }
+
+        } // Details
+
+        struct MappedRect
+        {
+            explicit MappedRect(unsigned const pitch = 0,
+                                std::uint8_t * bits  = nullptr) :
+                Pitch(pitch),
+                Bits(bits)
+            {}
+
+            unsigned Pitch;
+            std::uint8_t * Bits;
+        };
+
+        using Details::Borrowed;
+
+        struct Image : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Image, Details::Object, Details::ImageImpl)
+        };
+
+        struct Bitmap : Image
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Bitmap, Image, Details::BitmapImpl)
+
+            auto GetSize() const -> SizeF;
+            auto GetPixelSize() const -> SizeU;
+            auto GetPixelFormat() const -> PixelFormat;
+
+            // Returns the pixels, converting a lazy source the first time it is called.
+            auto Map() const -> MappedRect;
+
+            void CopyFromMemory(void const * data,
+                                unsigned pitch) const;
+
+            void CopyFromMemory(RectU const & rect,
+                                void const * data,
+                                unsigned pitch) const;
+
+            // Immutable bitmaps may be drawn by any number of threads without locks.
+            // Call this once nothing draws into the bitmap. Lazy sources are converted
+            // now, and the pixels can no longer be copied into or targeted.
+            void SetImmutable() const;
+            auto IsImmutable() const -> bool;
+        };
+
+        inline auto Bitmap::GetSize() const -> SizeF
+        {
+            return SizeF(static_cast<float>((*this)->Size.Width),
+                         static_cast<float>((*this)->Size.Height));
+        }
+
+        inline auto Bitmap::GetPixelSize() const -> SizeU
+        {
+            return (*this)->Size;
+        }
+
+        inline auto Bitmap::GetPixelFormat() const -> PixelFormat
+        {
+            return (*this)->Format;
+        }
+
+        inline auto Bitmap::Map() const -> MappedRect
+        {
+            return MappedRect((*this)->Pitch, (*this)->GetBits());
+        }
+
+        inline void Bitmap::CopyFromMemory(void const * data,
+                                           unsigned const pitch) const
+        {
+            CopyFromMemory(RectU(0, 0, (*this)->Size.Width, (*this)->Size.Height), data, pitch);
+        }
+
+        inline void Bitmap::CopyFromMemory(RectU const & rect,
+                                           void const * data,
+                                           unsigned const pitch) const
+        {
+            ASSERT(rect.Right <= (*this)->Size.Width && rect.Bottom <= (*this)->Size.Height);
+
+            if (IsImmutable())
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            auto const bytes = Details::GetBytesPerPixel((*this)->Format.Format) * (rect.Right - rect.Left);
+            auto const mapped = Map();
+            auto source = static_cast<std::uint8_t const *>(data);
+
+            for (auto row = rect.Top; row < rect.Bottom; ++row, source += pitch)
+            {
+                memcpy(mapped.Bits + static_cast<size_t>(row) * mapped.Pitch + rect.Left * Details::GetBytesPerPixel((*this)->Format.Format),
+                       source,
+                       bytes);
+            }
+        }
+
+        inline void Bitmap::SetImmutable() const
+        {
+            (*this)->GetBits();
+            (*this)->Immutable.store(true, std::memory_order_release);
+        }
+
+        inline auto Bitmap::IsImmutable() const -> bool
+        {
+            return (*this)->Immutable.load(std::memory_order_acquire);
+        }
+
+        inline auto CreateBitmap(SizeU const & size,
+                                 PixelFormat const & format = PixelFormat(Dxgi::Format::B8G8R8A8_UNORM, AlphaMode::Premultiplied)) -> Bitmap
+        {
+            auto const pitch = (size.Width * Details::GetBytesPerPixel(format.Format) + 15) & ~15u;
+            std::unique_ptr<std::uint8_t[]> storage(new std::uint8_t[static_cast<size_t>(pitch) * size.Height]());
+            auto const impl = Details::Make<Details::BitmapImpl>(size, format, pitch, storage.get());
+            impl->Storage = std::move(storage);
+            return Bitmap(impl);
+        }
+
+        inline auto CreateBitmap(SizeU const & size,
+                                 void const * data,
+                                 unsigned const pitch,
+                                 PixelFormat const & format = PixelFormat(Dxgi::Format::B8G8R8A8_UNORM, AlphaMode::Premultiplied)) -> Bitmap
+        {
+            auto bitmap = CreateBitmap(size, format);
+            bitmap.CopyFromMemory(data, pitch);
+            return bitmap;
+        }
+
+        // Wraps caller-owned pixels without copying them. The memory must outlive the bitmap.
+        inline auto CreateSharedBitmap(SizeU const & size,
+                                       void * data,
+                                       unsigned const pitch,
+                                       PixelFormat const & format = PixelFormat(Dxgi::Format::B8G8R8A8_UNORM, AlphaMode::Premultiplied)) -> Bitmap
+        {
+            return Bitmap(Details::Make<Details::BitmapImpl>(size, format, pitch, static_cast<std::uint8_t *>(data)));
+        }
+
+        // Creates a premultiplied B8G8R8A8 bitmap from video memory. The conversion is
+        // deferred until the bitmap is first mapped or drawn, so the video memory must
+        // remain valid until then.
+        inline auto CreateBitmap(YuvSurface const & source) -> Bitmap
+        {
+            if (!CanConvertYuv(source.Format))
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            auto const size = source.Size;
+            auto const pitch = size.Width * 4;
+            std::unique_ptr<std::uint8_t[]> storage(new std::uint8_t[static_cast<size_t>(pitch) * size.Height]);
+            auto const impl = Details::Make<Details::BitmapImpl>(size, PixelFormat(Dxgi::Format::B8G8R8A8_UNORM, AlphaMode::Premultiplied), pitch, storage.get());
+            impl->Storage = std::move(storage);
+            impl->Pending = [source] (std::uint8_t * bits, unsigned const targetPitch)
+            {
+                ConvertYuvPixels(source, bits, targetPitch);
+            };
+            impl->Ready = false;
+            return Bitmap(impl);
+        }
+
+        // Converts video memory into a caller-owned buffer, which the bitmap then wraps
+        // without copying. This lets a video pipeline reuse one buffer per frame.
+        inline auto CreateBitmap(YuvSurface const & source,
+                                 void * target,
+                                 unsigned const targetPitch) -> Bitmap
+        {
+            ConvertYuvPixels(source, target, targetPitch);
+
+            return CreateSharedBitmap(source.Size,
+                                      target,
+                                      targetPitch,
+                                      PixelFormat(Dxgi::Format::B8G8R8A8_UNORM, AlphaMode::Premultiplied));
+        }
+
+        namespace Details
+        {
+            struct FenceImpl : Resource
+            {
+                std::atomic<std::uint64_t> Value;
+                std::mutex Lock;
+                std::condition_variable Changed;
+
+                explicit FenceImpl(std::uint64_t const value) :
+                    Value(value)
+                {}
+            };
+
+        } // Details
+
+        // Device contexts on different threads share geometries, gradient stop collections
+        // and immutable bitmaps without any locking. A resource that one thread changes
+        // while others draw with it, such as a brush or a bitmap's pixels, must be fenced:
+        // the writer signals a new value once it is done and readers wait for that value
+        // before drawing, signaling fences of their own if the writer must wait for them
+        // in turn. Values only ever increase.
+        struct Fence : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Fence, Details::Object, Details::FenceImpl)
+
+            void Signal(std::uint64_t value) const;
+            auto GetCompletedValue() const -> std::uint64_t;
+            void Wait(std::uint64_t value) const;
+        };
+
+        inline void Fence::Signal(std::uint64_t const value) const
+        {
+            {
+                std::lock_guard<std::mutex> lock((*this)->Lock);
+
+                if (value <= (*this)->Value.load(std::memory_order_relaxed))
+                {
+                    return;
+                }
+
+                (*this)->Value.store(value, std::memory_order_release);
+            }
+
+            (*this)->Changed.notify_all();
+        }
+
+        inline auto Fence::GetCompletedValue() const -> std::uint64_t
+        {
+            return (*this)->Value.load(std::memory_order_acquire);
+        }
+
+        inline void Fence::Wait(std::uint64_t const value) const
+        {
+            if (value <= GetCompletedValue())
+            {
+                return;
+            }
+
+            std::unique_lock<std::mutex> lock((*this)->Lock);
+
+            (*this)->Changed.wait(lock, [&]
+            {
+                return value <= (*this)->Value.load(std::memory_order_acquire);
+            });
+        }
+
+        inline auto CreateFence(std::uint64_t const initialValue = 0) -> Fence
+        {
+            return Fence(Details::Make<Details::FenceImpl>(initialValue));
+        }
+
+        enum class AntialiasMode
+        {
+            PerPrimitive = 0,
+            Aliased      = 1,
+        };
+
+        enum class TextAntialiasMode
+        {
+            Default   = 0,
+            ClearType = 1,
+            Grayscale = 2,
+            Aliased   = 3,
+        };
+
+        enum class ExtendMode
+        {
+            Clamp  = 0,
+            Wrap   = 1,
+            Mirror = 2,
+        };
+
+        enum class BitmapInterpolationMode
+        {
+            NearestNeighbor = 0,
+            Linear          = 1,
+        };
+
+        enum class OpacityMaskContent
+        {
+            Graphics          = 0,
+            TextNatural       = 1,
+            TextGdiCompatible = 2,
+        };
+
+        // Scratch targets give their surface back to the pool as soon as they are
+        // released. Their bitmap must not be used after that.
+        enum class CompatibleRenderTargetOptions
+        {
+            None    = 0,
+            Scratch = 2,
+        };
+
+        // Transient resources are allocated from memory the render target recycles at
+        // the end of each frame and are not reference counted. The target destroys
+        // them at EndDraw, so they must not be used after the frame they were created
+        // in, though their handles may be released later. Command lists that record
+        // them keep copies.
+        enum class ResourceLifetime
+        {
+            Default   = 0,
+            Transient = 1,
+        };
+
+        struct Matrix3x2F
+        {
+            explicit Matrix3x2F(float const m11 = 1.0f,
+                                float const m12 = 0.0f,
+                                float const m21 = 0.0f,
+                                float const m22 = 1.0f,
+                                float const m31 = 0.0f,
+                                float const m32 = 0.0f) :
+                _11(m11), _12(m12),
+                _21(m21), _22(m22),
+                _31(m31), _32(m32)
+            {}
+
+            static auto Identity() -> Matrix3x2F
+            {
+                return Matrix3x2F();
+            }
+
+            static auto Translation(float const x,
+                                    float const y) -> Matrix3x2F
+            {
+                return Matrix3x2F(1.0f, 0.0f, 0.0f, 1.0f, x, y);
+            }
+
+            static auto Scale(float const x,
+                              float const y,
+                              Point2F const & center = Point2F()) -> Matrix3x2F
+            {
+                return Matrix3x2F(x, 0.0f, 0.0f, y, center.X - x * center.X, center.Y - y * center.Y);
+            }
+
+            // The angle is in degrees, clockwise in a y-down coordinate system.
+            static auto Rotation(float const angle,
+                                 Point2F const & center = Point2F()) -> Matrix3x2F
+            {
+                auto const radians = angle * 3.14159265358979f / 180.0f;
+                auto const sine = std::sin(radians);
+                auto const cosine = std::cos(radians);
+
+                return Matrix3x2F(cosine,
+                                  sine,
+                                  -sine,
+                                  cosine,
+                                  center.X - cosine * center.X + sine * center.Y,
+                                  center.Y - sine * center.X - cosine * center.Y);
+            }
+
+            auto Determinant() const -> float
+            {
+                return _11 * _22 - _12 * _21;
+            }
+
+            auto IsIdentity() const -> bool
+            {
+                return 1.0f == _11 && 0.0f == _12 && 0.0f == _21 && 1.0f == _22 && 0.0f == _31 && 0.0f == _32;
+            }
+
+            auto IsInvertible() const -> bool
+            {
+                return 0.0f != Determinant();
+            }
+
+            // Only scales and translates, so rectangles stay rectangles.
+            auto IsAxisAligned() const -> bool
+            {
+                return 0.0f == _12 && 0.0f == _21;
+            }
+
+            auto Invert() -> bool
+            {
+                auto const determinant = Determinant();
+
+                if (0.0f == determinant)
+                {
+                    return false;
+                }
+
+                auto const inverse = 1.0f / determinant;
+
+                *this = Matrix3x2F(_22 * inverse,
+                                   -_12 * inverse,
+                                   -_21 * inverse,
+                                   _11 * inverse,
+                                   (_21 * _32 - _22 * _31) * inverse,
+                                   (_12 * _31 - _11 * _32) * inverse);
+
+                return true;
+            }
+
+            auto TransformPoint(Point2F const & point) const -> Point2F
+            {
+                return Point2F(point.X * _11 + point.Y * _21 + _31,
+                               point.X * _12 + point.Y * _22 + _32);
+            }
+
+            float _11, _12;
+            float _21, _22;
+            float _31, _32;
+        };
+
+        inline auto operator*(Matrix3x2F const & left,
+                              Matrix3x2F const & right) -> Matrix3x2F
+        {
+            return Matrix3x2F(left._11 * right._11 + left._12 * right._21,
+                              left._11 * right._12 + left._12 * right._22,
+                              left._21 * right._11 + left._22 * right._21,
+                              left._21 * right._12 + left._22 * right._22,
+                              left._31 * right._11 + left._32 * right._21 + right._31,
+                              left._31 * right._12 + left._32 * right._22 + right._32);
+        }
+
+        struct GradientStop
+        {
+            explicit GradientStop(float const position        = 0.0f,
+                                  KennyKerr::Color const & color = KennyKerr::Color()) :
+                Position(position),
+                Color(color)
+            {}
+
+            float Position;
+            KennyKerr::Color Color;
+        };
+
+        struct BrushProperties
+        {
+            explicit BrushProperties(float const opacity            = 1.0f,
+                                     Matrix3x2F const & transform   = Matrix3x2F()) :
+                Opacity(opacity),
+                Transform(transform)
+            {}
+
+            float Opacity;
+            Matrix3x2F Transform;
+        };
+
+        struct BitmapBrushProperties
+        {
+            explicit BitmapBrushProperties(ExtendMode const extendModeX                    = ExtendMode::Clamp,
+                                           ExtendMode const extendModeY                    = ExtendMode::Clamp,
+                                           BitmapInterpolationMode const interpolationMode = BitmapInterpolationMode::Linear) :
+                ExtendModeX(extendModeX),
+                ExtendModeY(extendModeY),
+                InterpolationMode(interpolationMode)
+            {}
+
+            ExtendMode ExtendModeX;
+            ExtendMode ExtendModeY;
+            BitmapInterpolationMode InterpolationMode;
+        };
+
+        struct LinearGradientBrushProperties
+        {
+            explicit LinearGradientBrushProperties(Point2F const & startPoint = Point2F(),
+                                                   Point2F const & endPoint   = Point2F()) :
+                StartPoint(startPoint),
+                EndPoint(endPoint)
+            {}
+
+            Point2F StartPoint;
+            Point2F EndPoint;
+        };
+
+        struct RadialGradientBrushProperties
+        {
+            explicit RadialGradientBrushProperties(Point2F const & center = Point2F(),
+                                                   Point2F const & offset = Point2F(),
+                                                   float const radiusX    = 0.0f,
+                                                   float const radiusY    = 0.0f) :
+                Center(center),
+                Offset(offset),
+                RadiusX(radiusX),
+                RadiusY(radiusY)
+            {}
+
+            Point2F Center;
+            Point2F Offset;
+            float RadiusX;
+            float RadiusY;
+        };
+
+        namespace Details
+        {
+            // Premultiplied B8G8R8A8 pixels are handled as 32-bit values, blue in the low byte.
+
+            inline auto PackColor(Color const & color,
+                                  float const opacity = 1.0f) -> std::uint32_t
+            {
+                auto const clamp = [] (float const value)
+                {
+                    return (std::min)((std::max)(value, 0.0f), 1.0f);
+                };
+
+                auto const alpha = clamp(color.Alpha * opacity);
+
+                auto const channel = [&] (float const value)
+                {
+                    return static_cast<std::uint32_t>(clamp(value) * alpha * 255.0f + 0.5f);
+                };
+
+                return channel(color.Blue)
+                     | channel(color.Green) << 8
+                     | channel(color.Red) << 16
+                     | static_cast<std::uint32_t>(alpha * 255.0f + 0.5f) << 24;
+            }
+
+            // Scales all four channels by a value from 0 to 255.
+            inline auto MultiplyPixel(std::uint32_t const pixel,
+                                      unsigned const factor) -> std::uint32_t
+            {
+                auto rb = (pixel & 0xff00ff) * factor + 0x800080;
+                rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+                auto ag = ((pixel >> 8) & 0xff00ff) * factor + 0x800080;
+                ag = (ag + ((ag >> 8) & 0xff00ff)) & 0xff00ff00;
+                return rb | ag;
+            }
+
+            inline auto SourceOver(std::uint32_t const target,
+                                   std::uint32_t const source) -> std::uint32_t
+            {
+                return source + MultiplyPixel(target, 255 - (source >> 24));
+            }
+
+            #ifdef KENNYKERR_CPU_SSE2
+            inline auto Divide255(__m128i const value) -> __m128i
+            {
+                auto const rounded = _mm_add_epi16(value, _mm_set1_epi16(128));
+                return _mm_srli_epi16(_mm_add_epi16(rounded, _mm_srli_epi16(rounded, 8)), 8);
+            }
+
+            inline auto BroadcastAlpha(__m128i const value) -> __m128i
+            {
+                return _mm_shufflehi_epi16(_mm_shufflelo_epi16(value, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            }
+
+            // Blends two pixels widened to 16-bit channels.
+            inline auto BlendWide(__m128i const target,
+                                  __m128i source,
+                                  __m128i const coverage) -> __m128i
+            {
+                source = Divide255(_mm_mullo_epi16(source, coverage));
+                auto const inverse = _mm_sub_epi16(_mm_set1_epi16(255), BroadcastAlpha(source));
+                return _mm_add_epi16(source, Divide255(_mm_mullo_epi16(target, inverse)));
+            }
+
+            // Source-over of four pixels, each scaled by its coverage byte.
+            inline auto BlendPixels(__m128i const target,
+                                    __m128i const source,
+                                    std::uint8_t const * coverage) -> __m128i
+            {
+                auto const zero = _mm_setzero_si128();
+                std::int32_t packed;
+                memcpy(&packed, coverage, sizeof(packed));
+                auto spread = _mm_cvtsi32_si128(packed);
+                spread = _mm_unpacklo_epi8(spread, spread);
+                spread = _mm_unpacklo_epi16(spread, spread);
+
+                auto const low = BlendWide(_mm_unpacklo_epi8(target, zero), _mm_unpacklo_epi8(source, zero), _mm_unpacklo_epi8(spread, zero));
+                auto const high = BlendWide(_mm_unpackhi_epi8(target, zero), _mm_unpackhi_epi8(source, zero), _mm_unpackhi_epi8(spread, zero));
+                return _mm_packus_epi16(low, high);
+            }
+            #endif
+
+            #ifdef KENNYKERR_CPU_AVX2
+            inline auto Divide255(__m256i const value) -> __m256i
+            {
+                auto const rounded = _mm256_add_epi16(value, _mm256_set1_epi16(128));
+                return _mm256_srli_epi16(_mm256_add_epi16(rounded, _mm256_srli_epi16(rounded, 8)), 8);
+            }
+
+            inline auto BlendWide(__m256i const target,
+                                  __m256i source,
+                                  __m256i const coverage) -> __m256i
+            {
+                source = Divide255(_mm256_mullo_epi16(source, coverage));
+                auto const alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                auto const inverse = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+                return _mm256_add_epi16(source, Divide255(_mm256_mullo_epi16(target, inverse)));
+            }
+
+            inline auto BlendPixels(__m256i const target,
+                                    __m256i const source,
+                                    std::uint8_t const * coverage) -> __m256i
+            {
+                auto const zero = _mm256_setzero_si256();
+                auto const spread = _mm256_shuffle_epi8(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(coverage))),
+                                                        _mm256_setr_epi8(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12,
+                                                                         0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12));
+
+                auto const low = BlendWide(_mm256_unpacklo_epi8(target, zero), _mm256_unpacklo_epi8(source, zero), _mm256_unpacklo_epi8(spread, zero));
+                auto const high = BlendWide(_mm256_unpackhi_epi8(target, zero), _mm256_unpackhi_epi8(source, zero), _mm256_unpackhi_epi8(spread, zero));
+                return _mm256_packus_epi16(low, high);
+            }
+            #endif
+
+            inline auto IsFullCoverage(std::uint8_t const * coverage,
+                                       unsigned const count) -> bool
+            {
+                for (unsigned i = 0; i != count; ++i)
+                {
+                    if (255 != coverage[i]) return false;
+                }
+
+                return true;
+            }
+
+            inline auto IsZeroCoverage(std::uint8_t const * coverage,
+                                       unsigned const count) -> bool
+            {
+                unsigned i = 0;
+
+                for (; i + 8 <= count; i += 8)
+                {
+                    std::uint64_t group;
+                    memcpy(&group, coverage + i, sizeof(group));
+
+                    if (0 != group) return false;
+                }
+
+                for (; i != count; ++i)
+                {
+                    if (0 != coverage[i]) return false;
+                }
+
+                return true;
+            }
+
+            // Narrows [first, last) to the coverage between its leading and trailing zeros,
+            // leaving first equal to last if there's none at all.
+            inline void TrimZeroCoverage(std::uint8_t const * coverage,
+                                         unsigned & first,
+                                         unsigned & last)
+            {
+                for (std::uint64_t group; first + 8 <= last; first += 8)
+                {
+                    memcpy(&group, coverage + first, sizeof(group));
+
+                    if (0 != group) break;
+                }
+
+                while (first != last && 0 == coverage[first])
+                {
+                    ++first;
+                }
+
+                while (first != last && 0 == coverage[last - 1])
+                {
+                    --last;
+                }
+            }
+
+            // Keeps the larger of each byte of coverage, as where glyphs overlap.
+            inline void MaxCoverage(std::uint8_t * target,
+                                    std::uint8_t const * source,
+                                    unsigned const count)
+            {
+                unsigned i = 0;
+
+                #ifdef KENNYKERR_CPU_SSE2
+                for (; i + 16 <= count; i += 16)
+                {
+                    auto const existing = _mm_loadu_si128(reinterpret_cast<__m128i const *>(target + i));
+                    auto const added = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + i));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), _mm_max_epu8(existing, added));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    target[i] = (std::max)(target[i], source[i]);
+                }
+            }
+
+            inline void FillPixels(std::uint32_t * target,
+                                   unsigned const count,
+                                   std::uint32_t const color)
+            {
+                unsigned i = 0;
+
+                #ifdef KENNYKERR_CPU_SSE2
+                auto const value = _mm_set1_epi32(static_cast<int>(color));
+
+                for (; i + 4 <= count; i += 4)
+                {
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), value);
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    target[i] = color;
+                }
+            }
+
+            // Source-over of a solid premultiplied color through optional coverage. The
+            // common cases of an opaque color over full coverage and of empty coverage
+            // reduce to a fill and to nothing at all.
+            inline void BlendSolid(std::uint32_t * target,
+                                   unsigned const count,
+                                   std::uint32_t const color,
+                                   std::uint8_t const * coverage)
+            {
+                if (0 == color)
+                {
+                    return;
+                }
+
+                auto const opaque = 0xff000000 == (color & 0xff000000);
+
+                if (!coverage)
+                {
+                    if (opaque)
+                    {
+                        FillPixels(target, count, color);
+                        return;
+                    }
+
+                    unsigned i = 0;
+
+                    #if defined(KENNYKERR_CPU_AVX2)
+                    auto const zero256 = _mm256_setzero_si256();
+                    auto const source256 = _mm256_unpacklo_epi8(_mm256_set1_epi32(static_cast<int>(color)), zero256);
+                    auto const inverse256 = _mm256_set1_epi16(static_cast<short>(255 - (color >> 24)));
+
+                    for (; i + 8 <= count; i += 8)
+                    {
+                        auto const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(target + i));
+                        auto const low = _mm256_add_epi16(source256, Divide255(_mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, zero256), inverse256)));
+                        auto const high = _mm256_add_epi16(source256, Divide255(_mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, zero256), inverse256)));
+                        _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i), _mm256_packus_epi16(low, high));
+                    }
+                    #elif defined(KENNYKERR_CPU_SSE2)
+                    auto const zero = _mm_setzero_si128();
+                    auto const source = _mm_unpacklo_epi8(_mm_set1_epi32(static_cast<int>(color)), zero);
+                    auto const inverse = _mm_set1_epi16(static_cast<short>(255 - (color >> 24)));
+
+                    for (; i + 4 <= count; i += 4)
+                    {
+                        auto const pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(target + i));
+                        auto const low = _mm_add_epi16(source, Divide255(_mm_mullo_epi16(_mm_unpacklo_epi8(pixels, zero), inverse)));
+                        auto const high = _mm_add_epi16(source, Divide255(_mm_mullo_epi16(_mm_unpackhi_epi8(pixels, zero), inverse)));
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), _mm_packus_epi16(low, high));
+                    }
+                    #endif
+
+                    for (; i != count; ++i)
+                    {
+                        target[i] = SourceOver(target[i], color);
+                    }
+
+                    return;
+                }
+
+                unsigned i = 0;
+
+                #if defined(KENNYKERR_CPU_AVX2)
+                auto const source256 = _mm256_set1_epi32(static_cast<int>(color));
+
+                for (; i + 8 <= count; i += 8)
+                {
+                    std::uint64_t group;
+                    memcpy(&group, coverage + i, sizeof(group));
+
+                    if (0 == group)
+                    {
+                        continue;
+                    }
+
+                    if (opaque && ~0ull == group)
+                    {
+                        _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i), source256);
+                        continue;
+                    }
+
+                    auto const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(target + i));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i), BlendPixels(pixels, source256, coverage + i));
+                }
+                #elif defined(KENNYKERR_CPU_SSE2)
+                auto const source = _mm_set1_epi32(static_cast<int>(color));
+
+                for (; i + 4 <= count; i += 4)
+                {
+                    std::uint32_t group;
+                    memcpy(&group, coverage + i, sizeof(group));
+
+                    if (0 == group)
+                    {
+                        continue;
+                    }
+
+                    if (opaque && ~0u == group)
+                    {
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), source);
+                        continue;
+                    }
+
+                    auto const pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(target + i));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), BlendPixels(pixels, source, coverage + i));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    if (coverage[i])
+                    {
+                        target[i] = SourceOver(target[i], 255 == coverage[i] ? color : MultiplyPixel(color, coverage[i]));
+                    }
+                }
+            }
+
+            // Source-over of a span of premultiplied pixels through optional coverage.
+            inline void BlendSpan(std::uint32_t * target,
+                                  unsigned const count,
+                                  std::uint32_t const * source,
+                                  std::uint8_t const * coverage)
+            {
+                unsigned i = 0;
+
+                #if defined(KENNYKERR_CPU_SSE2)
+                static std::uint8_t const full[8] = { 255, 255, 255, 255, 255, 255, 255, 255 };
+                #endif
+
+                #if defined(KENNYKERR_CPU_AVX2)
+                for (; i + 8 <= count; i += 8)
+                {
+                    auto const mask = coverage ? coverage + i : full;
+                    std::uint64_t group;
+                    memcpy(&group, mask, sizeof(group));
+
+                    if (0 == group)
+                    {
+                        continue;
+                    }
+
+                    auto const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source + i));
+                    auto const alpha = _mm256_srli_epi32(pixels, 24);
+
+                    if (~0ull == group && _mm256_testc_si256(alpha, _mm256_set1_epi32(0xff)))
+                    {
+                        _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i), pixels);
+                        continue;
+                    }
+
+                    auto const existing = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(target + i));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i), BlendPixels(existing, pixels, mask));
+                }
+                #elif defined(KENNYKERR_CPU_SSE2)
+                for (; i + 4 <= count; i += 4)
+                {
+                    auto const mask = coverage ? coverage + i : full;
+                    std::uint32_t group;
+                    memcpy(&group, mask, sizeof(group));
+
+                    if (0 == group)
+                    {
+                        continue;
+                    }
+
+                    auto const pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + i));
+                    auto const existing = _mm_loadu_si128(reinterpret_cast<__m128i const *>(target + i));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), BlendPixels(existing, pixels, mask));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    auto const value = coverage ? coverage[i] : 255u;
+
+                    if (value)
+                    {
+                        target[i] = SourceOver(target[i], 255 == value ? source[i] : MultiplyPixel(source[i], value));
+                    }
+                }
+            }
+
+            // Source-over of one pixel with a coverage byte for each channel, laid out as
+            // the channels of the pixel are. The alpha of the source is spread over each
+            // channel of the target as its color is.
+            inline auto SourceOverChannels(std::uint32_t const target,
+                                           std::uint32_t const source,
+                                           std::uint32_t const coverage) -> std::uint32_t
+            {
+                auto const divide = [] (unsigned const value)
+                {
+                    return (value + 128 + ((value + 128) >> 8)) >> 8;
+                };
+
+                auto const alpha = source >> 24;
+                std::uint32_t result = 0;
+
+                for (unsigned shift = 0; shift != 32; shift += 8)
+                {
+                    auto const factor = coverage >> shift & 0xff;
+                    auto const blended = divide((source >> shift & 0xff) * factor) +
+                                         divide((target >> shift & 0xff) * (255 - divide(alpha * factor)));
+
+                    result |= (std::min)(blended, 255u) << shift;
+                }
+
+                return result;
+            }
+
+            #ifdef KENNYKERR_CPU_SSE2
+            // Blends two pixels widened to 16-bit channels, each channel with its own coverage.
+            inline auto BlendWideChannels(__m128i const target,
+                                          __m128i const source,
+                                          __m128i const coverage) -> __m128i
+            {
+                auto const alpha = Divide255(_mm_mullo_epi16(BroadcastAlpha(source), coverage));
+                auto const inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+                return _mm_add_epi16(Divide255(_mm_mullo_epi16(source, coverage)), Divide255(_mm_mullo_epi16(target, inverse)));
+            }
+            #endif
+
+            #ifdef KENNYKERR_CPU_AVX2
+            inline auto BlendWideChannels(__m256i const target,
+                                          __m256i const source,
+                                          __m256i const coverage) -> __m256i
+            {
+                auto const spread = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                auto const alpha = Divide255(_mm256_mullo_epi16(spread, coverage));
+                auto const inverse = _mm256_sub_epi16(_mm256_set1_epi16(255), alpha);
+                return _mm256_add_epi16(Divide255(_mm256_mullo_epi16(source, coverage)), Divide255(_mm256_mullo_epi16(target, inverse)));
+            }
+            #endif
+
+            // Source-over of a span of premultiplied pixels through coverage for each of
+            // their channels, as LCD text has. Pixels without coverage are left alone.
+            inline void BlendSpanChannels(std::uint32_t * target,
+                                          unsigned const count,
+                                          std::uint32_t const * source,
+                                          std::uint32_t const * coverage)
+            {
+                unsigned i = 0;
+
+                #if defined(KENNYKERR_CPU_AVX2)
+                auto const zero256 = _mm256_setzero_si256();
+
+                for (; i + 8 <= count; i += 8)
+                {
+                    auto const mask = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(coverage + i));
+
+                    if (_mm256_testz_si256(mask, mask))
+                    {
+                        continue;
+                    }
+
+                    auto const pixels = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(source + i));
+                    auto const existing = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(target + i));
+                    auto const low = BlendWideChannels(_mm256_unpacklo_epi8(existing, zero256), _mm256_unpacklo_epi8(pixels, zero256), _mm256_unpacklo_epi8(mask, zero256));
+                    auto const high = BlendWideChannels(_mm256_unpackhi_epi8(existing, zero256), _mm256_unpackhi_epi8(pixels, zero256), _mm256_unpackhi_epi8(mask, zero256));
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(target + i), _mm256_packus_epi16(low, high));
+                }
+                #elif defined(KENNYKERR_CPU_SSE2)
+                auto const zero = _mm_setzero_si128();
+
+                for (; i + 4 <= count; i += 4)
+                {
+                    auto const mask = _mm_loadu_si128(reinterpret_cast<__m128i const *>(coverage + i));
+
+                    if (0xffff == _mm_movemask_epi8(_mm_cmpeq_epi8(mask, zero)))
+                    {
+                        continue;
+                    }
+
+                    auto const pixels = _mm_loadu_si128(reinterpret_cast<__m128i const *>(source + i));
+                    auto const existing = _mm_loadu_si128(reinterpret_cast<__m128i const *>(target + i));
+                    auto const low = BlendWideChannels(_mm_unpacklo_epi8(existing, zero), _mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(mask, zero));
+                    auto const high = BlendWideChannels(_mm_unpackhi_epi8(existing, zero), _mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(mask, zero));
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(target + i), _mm_packus_epi16(low, high));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    if (coverage[i])
+                    {
+                        target[i] = SourceOverChannels(target[i], source[i], coverage[i]);
+                    }
+                }
+            }
+
+            // The 5-tap filter that spreads the coverage of each third of a pixel over its
+            // neighbours, from FreeType, in 256ths. It keeps the energy of the glyph while
+            // taming the color fringes of LCD text.
+            unsigned const LcdFilter[5] = { 8, 77, 86, 77, 8 };
+
+            // Filters a row of coverage sampled at three times the width of the pixels. The
+            // source is read two bytes either side of the count.
+            inline void FilterLcdCoverage(std::uint8_t const * source,
+                                          unsigned const count,
+                                          std::uint8_t * target)
+            {
+                unsigned i = 0;
+
+                #ifdef KENNYKERR_CPU_SSE2
+                auto const zero = _mm_setzero_si128();
+                auto const outer = _mm_set1_epi16(static_cast<short>(LcdFilter[0]));
+                auto const inner = _mm_set1_epi16(static_cast<short>(LcdFilter[1]));
+                auto const center = _mm_set1_epi16(static_cast<short>(LcdFilter[2]));
+                auto const half = _mm_set1_epi16(128);
+
+                auto const load = [&] (int const offset)
+                {
+                    return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<__m128i const *>(source + i + offset)), zero);
+                };
+
+                for (; i + 8 <= count; i += 8)
+                {
+                    // The sum reaches 255 * 256 + 128, which fits in unsigned 16-bit lanes.
+                    auto sum = _mm_add_epi16(half, _mm_mullo_epi16(center, load(0)));
+                    sum = _mm_add_epi16(sum, _mm_mullo_epi16(inner, _mm_add_epi16(load(-1), load(1))));
+                    sum = _mm_add_epi16(sum, _mm_mullo_epi16(outer, _mm_add_epi16(load(-2), load(2))));
+                    _mm_storel_epi64(reinterpret_cast<__m128i *>(target + i), _mm_packus_epi16(_mm_srli_epi16(sum, 8), zero));
+                }
+                #endif
+
+                for (; i != count; ++i)
+                {
+                    auto const samples = source + i;
+                    auto const sum = LcdFilter[0] * (samples[-2] + samples[2]) +
+                                     LcdFilter[1] * (samples[-1] + samples[1]) +
+                                     LcdFilter[2] * samples[0];
+
+                    target[i] = static_cast<std::uint8_t>((sum + 128) >> 8);
+                }
+            }
+
+            inline auto ApplyExtendMode(int value,
+                                        int const size,
+                                        ExtendMode const mode) -> int
+            {
+                switch (mode)
+                {
+                case ExtendMode::Wrap:
+                    value %= size;
+                    return value < 0 ? value + size : value;
+
+                case ExtendMode::Mirror:
+                    value %= size * 2;
+                    if (value < 0) value += size * 2;
+                    return value < size ? value : size * 2 - 1 - value;
+
+                default:
+                    return (std::min)((std::max)(value, 0), size - 1);
+                }
+            }
+
+            // Reads premultiplied pixels from a B8G8R8A8 bitmap through an affine mapping
+            // from device pixel centers to bitmap coordinates.
+            struct ImageSampler
+            {
+                std::uint8_t const * Bits;
+                unsigned Pitch;
+                int Width;
+                int Height;
+                ExtendMode ExtendX;
+                ExtendMode ExtendY;
+                bool Linear;
+
+                auto Fetch(int const x,
+                           int const y) const -> std::uint32_t
+                {
+                    std::uint32_t pixel;
+                    memcpy(&pixel,
+                           Bits + static_cast<size_t>(ApplyExtendMode(y, Height, ExtendY)) * Pitch + ApplyExtendMode(x, Width, ExtendX) * 4,
+                           sizeof(pixel));
+                    return pixel;
+                }
+
+                void Sample(Matrix3x2F const & mapping,
+                            int const x,
+                            int const y,
+                            unsigned const count,
+                            std::uint32_t * output) const
+                {
+                    // Each pixel is mapped from its own position rather than by stepping along
+                    // the span, so a pixel samples the same wherever its span starts.
+                    auto const rowU = (y + 0.5f) * mapping._21 + mapping._31;
+                    auto const rowV = (y + 0.5f) * mapping._22 + mapping._32;
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const column = static_cast<float>(x + static_cast<int>(i)) + 0.5f;
+                        auto const u = column * mapping._11 + rowU;
+                        auto const v = column * mapping._12 + rowV;
+
+                        if (!Linear)
+                        {
+                            output[i] = Fetch(static_cast<int>(std::floor(u)), static_cast<int>(std::floor(v)));
+                            continue;
+                        }
+
+                        auto const su = u - 0.5f;
+                        auto const sv = v - 0.5f;
+                        auto const left = static_cast<int>(std::floor(su));
+                        auto const top = static_cast<int>(std::floor(sv));
+                        auto const fx = static_cast<unsigned>((su - left) * 256.0f);
+                        auto const fy = static_cast<unsigned>((sv - top) * 256.0f);
+
+                        auto const upper = LerpPixel(Fetch(left, top), Fetch(left + 1, top), fx);
+                        auto const lower = LerpPixel(Fetch(left, top + 1), Fetch(left + 1, top + 1), fx);
+                        output[i] = LerpPixel(upper, lower, fy);
+                    }
+                }
+
+                // Blends two pixels by a weight from 0 to 256.
+                static auto LerpPixel(std::uint32_t const first,
+                                      std::uint32_t const second,
+                                      unsigned const weight) -> std::uint32_t
+                {
+                    auto const rb = (((first & 0xff00ff) * (256 - weight) + (second & 0xff00ff) * weight) >> 8) & 0xff00ff;
+                    auto const ag = (((first >> 8) & 0xff00ff) * (256 - weight) + ((second >> 8) & 0xff00ff) * weight) & 0xff00ff00;
+                    return rb | ag;
+                }
+            };
+
+            inline auto IsDrawableFormat(Dxgi::Format const format) -> bool
+            {
+                return Dxgi::Format::B8G8R8A8_UNORM == format || Dxgi::Format::B8G8R8A8_UNORM_SRGB == format;
+            }
+
+            inline auto GetImageSampler(BitmapImpl & bitmap,
+                                        ExtendMode const extendX,
+                                        ExtendMode const extendY,
+                                        bool const linear) -> ImageSampler
+            {
+                ASSERT(IsDrawableFormat(bitmap.Format.Format));
+
+                ImageSampler sampler;
+                sampler.Bits = bitmap.GetBits();
+                sampler.Pitch = bitmap.Pitch;
+                sampler.Width = static_cast<int>(bitmap.Size.Width);
+                sampler.Height = static_cast<int>(bitmap.Size.Height);
+                sampler.ExtendX = extendX;
+                sampler.ExtendY = extendY;
+                sampler.Linear = linear;
+                return sampler;
+            }
+
+            // Brushes produce spans of premultiplied pixels for device coordinates. The
+            // mapping passed in goes from device space to the brush's own space and is
+            // computed once per draw, so brushes stay immutable while drawing.
+            struct BrushImpl : Resource
+            {
+                float Opacity;
+                Matrix3x2F Transform;
+
+                explicit BrushImpl(BrushProperties const & properties) :
+                    Opacity(properties.Opacity),
+                    Transform(properties.Transform)
+                {}
+
+                // Returns true and the premultiplied color when every pixel is the same.
+                virtual auto IsSolid(std::uint32_t & color) const -> bool
+                {
+                    (void)color;
+                    return false;
+                }
+
+                virtual void Shade(Matrix3x2F const & mapping,
+                                   int x,
+                                   int y,
+                                   unsigned count,
+                                   std::uint32_t * output) const = 0;
+            };
+
+            struct SolidColorBrushImpl : BrushImpl
+            {
+                KennyKerr::Color Color;
+
+                SolidColorBrushImpl(KennyKerr::Color const & color,
+                                    BrushProperties const & properties) :
+                    BrushImpl(properties),
+                    Color(color)
+                {}
+
+                auto IsSolid(std::uint32_t & color) const -> bool override
+                {
+                    color = PackColor(Color, Opacity);
+                    return true;
+                }
+
+                void Shade(Matrix3x2F const &,
+                           int,
+                           int,
+                           unsigned const count,
+                           std::uint32_t * output) const override
+                {
+                    FillPixels(output, count, PackColor(Color, Opacity));
+                }
+            };
+
+            struct GradientStopCollectionImpl : Resource
+            {
+                std::vector<GradientStop> Stops;
+                Cpu::ExtendMode ExtendMode;
+                std::uint32_t Table[256];
+
+                GradientStopCollectionImpl(GradientStop const * stops,
+                                           unsigned const count,
+                                           Cpu::ExtendMode const extendMode) :
+                    Stops(stops, stops + count),
+                    ExtendMode(extendMode)
+                {
+                    std::stable_sort(Stops.begin(), Stops.end(), [] (GradientStop const & left, GradientStop const & right)
+                    {
+                        return left.Position < right.Position;
+                    });
+
+                    for (unsigned i = 0; i != 256; ++i)
+                    {
+                        Table[i] = PackColor(Interpolate(i / 255.0f));
+                    }
+                }
+
+                // Colors are interpolated unpremultiplied, as Direct2D does.
+                auto Interpolate(float const position) const -> Color
+                {
+                    if (Stops.empty())
+                    {
+                        return Color(0.0f, 0.0f, 0.0f, 0.0f);
+                    }
+
+                    if (position <= Stops.front().Position)
+                    {
+                        return Stops.front().Color;
+                    }
+
+                    for (size_t i = 1; i != Stops.size(); ++i)
+                    {
+                        auto const & previous = Stops[i - 1];
+                        auto const & next = Stops[i];
+
+                        if (position <= next.Position)
+                        {
+                            auto const span = next.Position - previous.Position;
+                            auto const t = 0.0f < span ? (position - previous.Position) / span : 1.0f;
+
+                            return Color(previous.Color.Red + (next.Color.Red - previous.Color.Red) * t,
+                                         previous.Color.Green + (next.Color.Green - previous.Color.Green) * t,
+                                         previous.Color.Blue + (next.Color.Blue - previous.Color.Blue) * t,
+                                         previous.Color.Alpha + (next.Color.Alpha - previous.Color.Alpha) * t);
+                        }
+                    }
+
+                    return Stops.back().Color;
+                }
+
+                auto Lookup(float const position) const -> std::uint32_t
+                {
+                    auto const index = static_cast<int>(std::floor(position * 255.0f + 0.5f));
+                    return Table[ApplyExtendMode(index, 256, ExtendMode)];
+                }
+            };
+
+            struct GradientBrushImpl : BrushImpl
+            {
+                Pointer<GradientStopCollectionImpl> Stops;
+
+                GradientBrushImpl(Pointer<GradientStopCollectionImpl> const & stops,
+                                  BrushProperties const & properties) :
+                    BrushImpl(properties),
+                    Stops(stops)
+                {}
+
+                void Finish(unsigned const count,
+                            std::uint32_t * output) const
+                {
+                    if (1.0f > Opacity)
+                    {
+                        auto const factor = static_cast<unsigned>((std::max)(Opacity, 0.0f) * 255.0f + 0.5f);
+
+                        for (unsigned i = 0; i != count; ++i)
+                        {
+                            output[i] = MultiplyPixel(output[i], factor);
+                        }
+                    }
+                }
+            };
+
+            struct LinearGradientBrushImpl : GradientBrushImpl
+            {
+                LinearGradientBrushProperties Properties;
+
+                LinearGradientBrushImpl(LinearGradientBrushProperties const & linear,
+                                        Pointer<GradientStopCollectionImpl> const & stops,
+                                        BrushProperties const & properties) :
+                    GradientBrushImpl(stops, properties),
+                    Properties(linear)
+                {}
+
+                void Shade(Matrix3x2F const & mapping,
+                           int const x,
+                           int const y,
+                           unsigned const count,
+                           std::uint32_t * output) const override
+                {
+                    auto const dx = Properties.EndPoint.X - Properties.StartPoint.X;
+                    auto const dy = Properties.EndPoint.Y - Properties.StartPoint.Y;
+                    auto const length = dx * dx + dy * dy;
+                    auto const scale = 0.0f < length ? 1.0f / length : 0.0f;
+
+                    auto const point = mapping.TransformPoint(Point2F(0.0f, y + 0.5f));
+                    auto const start = ((point.X - Properties.StartPoint.X) * dx + (point.Y - Properties.StartPoint.Y) * dy) * scale;
+                    auto const step = (mapping._11 * dx + mapping._12 * dy) * scale;
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        output[i] = Stops->Lookup(start + (static_cast<float>(x + static_cast<int>(i)) + 0.5f) * step);
+                    }
+
+                    Finish(count, output);
+                }
+            };
+
+            struct RadialGradientBrushImpl : GradientBrushImpl
+            {
+                RadialGradientBrushProperties Properties;
+
+                RadialGradientBrushImpl(RadialGradientBrushProperties const & radial,
+                                        Pointer<GradientStopCollectionImpl> const & stops,
+                                        BrushProperties const & properties) :
+                    GradientBrushImpl(stops, properties),
+                    Properties(radial)
+                {}
+
+                // Works in the space where the ellipse is the unit circle and finds how far
+                // along the ray from the gradient origin through the point the point lies.
+                void Shade(Matrix3x2F const & mapping,
+                           int const x,
+                           int const y,
+                           unsigned const count,
+                           std::uint32_t * output) const override
+                {
+                    if (0.0f == Properties.RadiusX || 0.0f == Properties.RadiusY)
+                    {
+                        FillPixels(output, count, Stops->Lookup(1.0f));
+                        Finish(count, output);
+                        return;
+                    }
+
+                    auto const sx = 1.0f / Properties.RadiusX;
+                    auto const sy = 1.0f / Properties.RadiusY;
+                    auto fx = Properties.Offset.X * sx;
+                    auto fy = Properties.Offset.Y * sy;
+                    auto const focus = fx * fx + fy * fy;
+
+                    if (focus > 0.998f)
+                    {
+                        auto const shrink = std::sqrt(0.998f / focus);
+                        fx *= shrink;
+                        fy *= shrink;
+                    }
+
+                    auto const c = fx * fx + fy * fy - 1.0f;
+                    auto const point = mapping.TransformPoint(Point2F(0.0f, y + 0.5f));
+                    auto const startX = (point.X - Properties.Center.X) * sx - fx;
+                    auto const startY = (point.Y - Properties.Center.Y) * sy - fy;
+                    auto const stepX = mapping._11 * sx;
+                    auto const stepY = mapping._12 * sy;
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const column = static_cast<float>(x + static_cast<int>(i)) + 0.5f;
+                        auto const px = startX + column * stepX;
+                        auto const py = startY + column * stepY;
+                        auto const a = px * px + py * py;
+                        auto const b = fx * px + fy * py;
+
+                        if (0.0f == a)
+                        {
+                            output[i] = Stops->Lookup(0.0f);
+                            continue;
+                        }
+
+                        auto const k = (-b + std::sqrt((std::max)(b * b - a * c, 0.0f))) / a;
+                        output[i] = Stops->Lookup(1.0f / k);
+                    }
+
+                    Finish(count, output);
+                }
+            };
+
+            struct BitmapBrushImpl : BrushImpl
+            {
+                Pointer<BitmapImpl> Bitmap;
+                BitmapBrushProperties Properties;
+
+                BitmapBrushImpl(Pointer<BitmapImpl> const & bitmap,
+                                BitmapBrushProperties const & bitmapProperties,
+                                BrushProperties const & properties) :
+                    BrushImpl(properties),
+                    Bitmap(bitmap),
+                    Properties(bitmapProperties)
+                {}
+
+                void Shade(Matrix3x2F const & mapping,
+                           int const x,
+                           int const y,
+                           unsigned const count,
+                           std::uint32_t * output) const override
+                {
+                    if (!Bitmap || 0 == Bitmap->Size.Width || 0 == Bitmap->Size.Height)
+                    {
+                        FillPixels(output, count, 0);
+                        return;
+                    }
+
+                    GetImageSampler(*Bitmap,
+                                    Properties.ExtendModeX,
+                                    Properties.ExtendModeY,
+                                    BitmapInterpolationMode::Linear == Properties.InterpolationMode).Sample(mapping, x, y, count, output);
+
+                    if (1.0f > Opacity)
+                    {
+                        auto const factor = static_cast<unsigned>((std::max)(Opacity, 0.0f) * 255.0f + 0.5f);
+
+                        for (unsigned i = 0; i != count; ++i)
+                        {
+                            output[i] = MultiplyPixel(output[i], factor);
+                        }
+                    }
+                }
+            };
+
+        } // Details
+
+        struct Brush : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Brush, Details::Object, Details::BrushImpl)
+
+            void SetOpacity(float opacity) const;
+            auto GetOpacity() const -> float;
+            void GetTransform(Matrix3x2F & transform) const;
+            void SetTransform(Matrix3x2F const & transform) const;
+        };
+
+        struct SolidColorBrush : Brush
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(SolidColorBrush, Brush, Details::SolidColorBrushImpl)
+
+            void SetColor(Color const & color) const;
+            auto GetColor() const -> Color;
+        };
+
+        struct GradientStopCollection : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(GradientStopCollection, Details::Object, Details::GradientStopCollectionImpl)
+
+            auto GetGradientStopCount() const -> unsigned;
+
+            void GetGradientStops(GradientStop * stops,
+                                  unsigned count) const;
+
+            auto GetExtendMode() const -> ExtendMode;
+        };
+
+        struct LinearGradientBrush : Brush
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(LinearGradientBrush, Brush, Details::LinearGradientBrushImpl)
+
+            void SetStartPoint(Point2F const & point) const;
+            void SetEndPoint(Point2F const & point) const;
+            auto GetStartPoint() const -> Point2F;
+            auto GetEndPoint() const -> Point2F;
+            auto GetGradientStopCollection() const -> GradientStopCollection;
+            auto BorrowGradientStopCollection() const -> Borrowed<GradientStopCollection>;
+        };
+
+        struct RadialGradientBrush : Brush
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(RadialGradientBrush, Brush, Details::RadialGradientBrushImpl)
+
+            void SetCenter(Point2F const & point) const;
+            void SetGradientOriginOffset(Point2F const & point) const;
+            void SetRadiusX(float radius) const;
+            void SetRadiusY(float radius) const;
+            auto GetCenter() const -> Point2F;
+            auto GetGradientOriginOffset() const -> Point2F;
+            auto GetRadiusX() const -> float;
+            auto GetRadiusY() const -> float;
+            auto GetGradientStopCollection() const -> GradientStopCollection;
+            auto BorrowGradientStopCollection() const -> Borrowed<GradientStopCollection>;
+        };
+
+        struct BitmapBrush : Brush
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(BitmapBrush, Brush, Details::BitmapBrushImpl)
+
+            void SetExtendModeX(ExtendMode mode) const;
+            void SetExtendModeY(ExtendMode mode) const;
+            void SetInterpolationMode(BitmapInterpolationMode mode) const;
+            void SetBitmap(Bitmap const & bitmap) const;
+            auto GetExtendModeX() const -> ExtendMode;
+            auto GetExtendModeY() const -> ExtendMode;
+            auto GetInterpolationMode() const -> BitmapInterpolationMode;
+            auto GetBitmap() const -> Bitmap;
+            auto BorrowBitmap() const -> Borrowed<Bitmap>;
+        };
+
+        inline void Brush::SetOpacity(float const opacity) const
+        {
+            (*this)->Opacity = opacity;
+        }
+
+        inline auto Brush::GetOpacity() const -> float
+        {
+            return (*this)->Opacity;
+        }
+
+        inline void Brush::GetTransform(Matrix3x2F & transform) const
+        {
+            transform = (*this)->Transform;
+        }
+
+        inline void Brush::SetTransform(Matrix3x2F const & transform) const
+        {
+            (*this)->Transform = transform;
+        }
+
+        inline void SolidColorBrush::SetColor(Color const & color) const
+        {
+            (*this)->Color = color;
+        }
+
+        inline auto SolidColorBrush::GetColor() const -> Color
+        {
+            return (*this)->Color;
+        }
+
+        inline auto GradientStopCollection::GetGradientStopCount() const -> unsigned
+        {
+            return static_cast<unsigned>((*this)->Stops.size());
+        }
+
+        inline void GradientStopCollection::GetGradientStops(GradientStop * stops,
+                                                             unsigned const count) const
+        {
+            std::copy_n((*this)->Stops.begin(), (std::min)(count, GetGradientStopCount()), stops);
+        }
+
+        inline auto GradientStopCollection::GetExtendMode() const -> ExtendMode
+        {
+            return (*this)->ExtendMode;
+        }
+
+        inline void LinearGradientBrush::SetStartPoint(Point2F const & point) const
+        {
+            (*this)->Properties.StartPoint = point;
+        }
+
+        inline void LinearGradientBrush::SetEndPoint(Point2F const & point) const
+        {
+            (*this)->Properties.EndPoint = point;
+        }
+
+        inline auto LinearGradientBrush::GetStartPoint() const -> Point2F
+        {
+            return (*this)->Properties.StartPoint;
+        }
+
+        inline auto LinearGradientBrush::GetEndPoint() const -> Point2F
+        {
+            return (*this)->Properties.EndPoint;
+        }
+
+        inline auto LinearGradientBrush::GetGradientStopCollection() const -> GradientStopCollection
+        {
+            return GradientStopCollection((*this)->Stops);
+        }
+
+        inline auto LinearGradientBrush::BorrowGradientStopCollection() const -> Borrowed<GradientStopCollection>
+        {
+            return Borrowed<GradientStopCollection>((*this)->Stops.Get());
+        }
+
+        inline void RadialGradientBrush::SetCenter(Point2F const & point) const
+        {
+            (*this)->Properties.Center = point;
+        }
+
+        inline void RadialGradientBrush::SetGradientOriginOffset(Point2F const & point) const
+        {
+            (*this)->Properties.Offset = point;
+        }
+
+        inline void RadialGradientBrush::SetRadiusX(float const radius) const
+        {
+            (*this)->Properties.RadiusX = radius;
+        }
+
+        inline void RadialGradientBrush::SetRadiusY(float const radius) const
+        {
+            (*this)->Properties.RadiusY = radius;
+        }
+
+        inline auto RadialGradientBrush::GetCenter() const -> Point2F
+        {
+            return (*this)->Properties.Center;
+        }
+
+        inline auto RadialGradientBrush::GetGradientOriginOffset() const -> Point2F
+        {
+            return (*this)->Properties.Offset;
+        }
+
+        inline auto RadialGradientBrush::GetRadiusX() const -> float
+        {
+            return (*this)->Properties.RadiusX;
+        }
+
+        inline auto RadialGradientBrush::GetRadiusY() const -> float
+        {
+            return (*this)->Properties.RadiusY;
+        }
+
+        inline auto RadialGradientBrush::GetGradientStopCollection() const -> GradientStopCollection
+        {
+            return GradientStopCollection((*this)->Stops);
+        }
+
+        inline auto RadialGradientBrush::BorrowGradientStopCollection() const -> Borrowed<GradientStopCollection>
+        {
+            return Borrowed<GradientStopCollection>((*this)->Stops.Get());
+        }
+
+        inline void BitmapBrush::SetExtendModeX(ExtendMode const mode) const
+        {
+            (*this)->Properties.ExtendModeX = mode;
+        }
+
+        inline void BitmapBrush::SetExtendModeY(ExtendMode const mode) const
+        {
+            (*this)->Properties.ExtendModeY = mode;
+        }
+
+        inline void BitmapBrush::SetInterpolationMode(BitmapInterpolationMode const mode) const
+        {
+            (*this)->Properties.InterpolationMode = mode;
+        }
+
+        inline void BitmapBrush::SetBitmap(Bitmap const & bitmap) const
+        {
+            if (bitmap && !Details::IsDrawableFormat(bitmap.GetPixelFormat().Format))
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            (*this)->Bitmap = bitmap.Share();
+        }
+
+        inline auto BitmapBrush::GetExtendModeX() const -> ExtendMode
+        {
+            return (*this)->Properties.ExtendModeX;
+        }
+
+        inline auto BitmapBrush::GetExtendModeY() const -> ExtendMode
+        {
+            return (*this)->Properties.ExtendModeY;
+        }
+
+        inline auto BitmapBrush::GetInterpolationMode() const -> BitmapInterpolationMode
+        {
+            return (*this)->Properties.InterpolationMode;
+        }
+
+        inline auto BitmapBrush::GetBitmap() const -> Bitmap
+        {
+            return Bitmap((*this)->Bitmap);
+        }
+
+        inline auto BitmapBrush::BorrowBitmap() const -> Borrowed<Bitmap>
+        {
+            return Borrowed<Bitmap>((*this)->Bitmap.Get());
+        }
+
+        enum class FillMode
+        {
+            Alternate = 0,
+            Winding   = 1,
+        };
+
+        enum class FigureBegin
+        {
+            Filled = 0,
+            Hollow = 1,
+        };
+
+        enum class FigureEnd
+        {
+            Open   = 0,
+            Closed = 1,
+        };
+
+        struct Ellipse
+        {
+            explicit Ellipse(Point2F const & center = Point2F(),
+                             float const radiusX    = 0.0f,
+                             float const radiusY    = 0.0f) :
+                Center(center),
+                RadiusX(radiusX),
+                RadiusY(radiusY)
+            {}
+
+            Point2F Center;
+            float RadiusX;
+            float RadiusY;
+        };
+
+        struct BezierSegment
+        {
+            explicit BezierSegment(Point2F const & point1 = Point2F(),
+                                   Point2F const & point2 = Point2F(),
+                                   Point2F const & point3 = Point2F()) :
+                Point1(point1),
+                Point2(point2),
+                Point3(point3)
+            {}
+
+            Point2F Point1;
+            Point2F Point2;
+            Point2F Point3;
+        };
+
+        struct QuadraticBezierSegment
+        {
+            explicit QuadraticBezierSegment(Point2F const & point1 = Point2F(),
+                                            Point2F const & point2 = Point2F()) :
+                Point1(point1),
+                Point2(point2)
+            {}
+
+            Point2F Point1;
+            Point2F Point2;
+        };
+
+        namespace Details
+        {
+            enum class PathVerb : std::uint8_t
+            {
+                Begin,
+                BeginHollow,
+                Line,
+                Quadratic,
+                Cubic,
+                End,
+            };
+
+            // Geometries keep their figures in user space and are flattened to lines in
+            // device space when drawn, so curves stay smooth under any transform.
+            struct GeometryImpl : Resource
+            {
+                std::vector<Point2F> Points;
+                std::vector<PathVerb> Verbs;
+                Cpu::FillMode FillMode;
+
+                GeometryImpl() :
+                    FillMode(Cpu::FillMode::Alternate)
+                {}
+
+                virtual auto IsRectangle(RectF & rect) const -> bool
+                {
+                    (void)rect;
+                    return false;
+                }
+
+                // The control points bound the curves, so the result may be generous.
+                virtual auto GetBounds(Matrix3x2F const & transform) const -> RectF
+                {
+                    if (Points.empty())
+                    {
+                        return RectF(FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX);
+                    }
+
+                    auto const first = transform.TransformPoint(Points.front());
+                    RectF result(first.X, first.Y, first.X, first.Y);
+
+                    for (auto const & point : Points)
+                    {
+                        auto const device = transform.TransformPoint(point);
+                        result.Left = (std::min)(result.Left, device.X);
+                        result.Top = (std::min)(result.Top, device.Y);
+                        result.Right = (std::max)(result.Right, device.X);
+                        result.Bottom = (std::max)(result.Bottom, device.Y);
+                    }
+
+                    return result;
+                }
+
+                // Calls line(from, to) for every edge of the filled figures in device space.
+                // Open figures are closed, as filling requires.
+                template <typename Line>
+                void Flatten(Matrix3x2F const & transform,
+                             Line const & line) const
+                {
+                    auto const tolerance = 0.1f;
+                    auto point = Points.data();
+                    Point2F start, current;
+                    auto filled = false;
+
+                    auto const to = [&] (Point2F const & next)
+                    {
+                        if (filled)
+                        {
+                            line(current, next);
+                        }
+
+                        current = next;
+                    };
+
+                    for (auto const verb : Verbs)
+                    {
+                        switch (verb)
+                        {
+                        case PathVerb::Begin:
+                        case PathVerb::BeginHollow:
+                            start = current = transform.TransformPoint(*point++);
+                            filled = PathVerb::Begin == verb;
+                            break;
+
+                        case PathVerb::Line:
+                            to(transform.TransformPoint(*point++));
+                            break;
+
+                        case PathVerb::Quadratic:
+                        {
+                            auto const p0 = current;
+                            auto const p1 = transform.TransformPoint(point[0]);
+                            auto const p2 = transform.TransformPoint(point[1]);
+                            point += 2;
+
+                            auto const dd = std::hypot(p0.X - 2.0f * p1.X + p2.X, p0.Y - 2.0f * p1.Y + p2.Y);
+                            auto const count = GetSegmentCount(dd * 0.25f / tolerance);
+
+                            for (unsigned i = 1; i < count; ++i)
+                            {
+                                auto const t = static_cast<float>(i) / count;
+                                auto const u = 1.0f - t;
+                                to(Point2F(u * u * p0.X + 2.0f * u * t * p1.X + t * t * p2.X,
+                                           u * u * p0.Y + 2.0f * u * t * p1.Y + t * t * p2.Y));
+                            }
+
+                            to(p2);
+                            break;
+                        }
+
+                        case PathVerb::Cubic:
+                        {
+                            auto const p0 = current;
+                            auto const p1 = transform.TransformPoint(point[0]);
+                            auto const p2 = transform.TransformPoint(point[1]);
+                            auto const p3 = transform.TransformPoint(point[2]);
+                            point += 3;
+
+                            auto const dd = (std::max)(std::hypot(p0.X - 2.0f * p1.X + p2.X, p0.Y - 2.0f * p1.Y + p2.Y),
+                                                       std::hypot(p1.X - 2.0f * p2.X + p3.X, p1.Y - 2.0f * p2.Y + p3.Y));
+                            auto const count = GetSegmentCount(dd * 0.75f / tolerance);
+
+                            for (unsigned i = 1; i < count; ++i)
+                            {
+                                auto const t = static_cast<float>(i) / count;
+                                auto const u = 1.0f - t;
+                                auto const a = u * u * u, b = 3.0f * u * u * t, c = 3.0f * u * t * t, d = t * t * t;
+                                to(Point2F(a * p0.X + b * p1.X + c * p2.X + d * p3.X,
+                                           a * p0.Y + b * p1.Y + c * p2.Y + d * p3.Y));
+                            }
+
+                            to(p3);
+                            break;
+                        }
+
+                        case PathVerb::End:
+                            to(start);
+                            filled = false;
+                            break;
+                        }
+                    }
+                }
+
+                static auto GetSegmentCount(float const squared) -> unsigned
+                {
+                    return static_cast<unsigned>((std::min)((std::max)(std::ceil(std::sqrt(squared)), 1.0f), 256.0f));
+                }
+            };
+
+            struct RectangleGeometryImpl : GeometryImpl
+            {
+                RectF Rect;
+
+                explicit RectangleGeometryImpl(RectF const & rect) :
+                    Rect(rect)
+                {
+                    Points.push_back(Point2F(rect.Left, rect.Top));
+                    Points.push_back(Point2F(rect.Right, rect.Top));
+                    Points.push_back(Point2F(rect.Right, rect.Bottom));
+                    Points.push_back(Point2F(rect.Left, rect.Bottom));
+                    PathVerb const verbs[] = { PathVerb::Begin, PathVerb::Line, PathVerb::Line, PathVerb::Line, PathVerb::End };
+                    Verbs.assign(std::begin(verbs), std::end(verbs));
+                }
+
+                auto IsRectangle(RectF & rect) const -> bool override
+                {
+                    rect = Rect;
+                    return true;
+                }
+            };
+
+            struct EllipseGeometryImpl : GeometryImpl
+            {
+                Cpu::Ellipse Ellipse;
+
+                explicit EllipseGeometryImpl(Cpu::Ellipse const & ellipse) :
+                    Ellipse(ellipse)
+                {
+                    // Four cubic arcs, each a quarter of the ellipse.
+                    auto const kappa = 0.5522847498f;
+                    auto const x = ellipse.Center.X, y = ellipse.Center.Y;
+                    auto const rx = ellipse.RadiusX, ry = ellipse.RadiusY;
+                    auto const kx = rx * kappa, ky = ry * kappa;
+
+                    Point2F const points[] =
+                    {
+                        Point2F(x + rx, y),
+                        Point2F(x + rx, y + ky), Point2F(x + kx, y + ry), Point2F(x, y + ry),
+                        Point2F(x - kx, y + ry), Point2F(x - rx, y + ky), Point2F(x - rx, y),
+                        Point2F(x - rx, y - ky), Point2F(x - kx, y - ry), Point2F(x, y - ry),
+                        Point2F(x + kx, y - ry), Point2F(x + rx, y - ky), Point2F(x + rx, y),
+                    };
+
+                    PathVerb const verbs[] = { PathVerb::Begin, PathVerb::Cubic, PathVerb::Cubic, PathVerb::Cubic, PathVerb::Cubic, PathVerb::End };
+                    Points.assign(std::begin(points), std::end(points));
+                    Verbs.assign(std::begin(verbs), std::end(verbs));
+                }
+
+                auto GetBounds(Matrix3x2F const & transform) const -> RectF override
+                {
+                    return GetBounds(Ellipse, transform);
+                }
+
+                static auto GetBounds(Cpu::Ellipse const & ellipse,
+                                      Matrix3x2F const & transform) -> RectF
+                {
+                    auto const center = transform.TransformPoint(ellipse.Center);
+                    auto const x = std::hypot(ellipse.RadiusX * transform._11, ellipse.RadiusY * transform._21);
+                    auto const y = std::hypot(ellipse.RadiusX * transform._12, ellipse.RadiusY * transform._22);
+                    return RectF(center.X - x, center.Y - y, center.X + x, center.Y + y);
+                }
+            };
+
+            struct PathGeometryImpl : GeometryImpl
+            {
+                bool Open;
+                bool Closed;
+
+                PathGeometryImpl() :
+                    Open(false),
+                    Closed(false)
+                {}
+            };
+
+        } // Details
+
+        struct Geometry : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Geometry, Details::Object, Details::GeometryImpl)
+
+            void GetBounds(RectF & bounds) const;
+
+            void GetBounds(Matrix3x2F const & transform,
+                           RectF & bounds) const;
+        };
+
+        struct RectangleGeometry : Geometry
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(RectangleGeometry, Geometry, Details::RectangleGeometryImpl)
+
+            void GetRect(RectF & rect) const;
+        };
+
+        struct EllipseGeometry : Geometry
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(EllipseGeometry, Geometry, Details::EllipseGeometryImpl)
+
+            void GetEllipse(Ellipse & ellipse) const;
+        };
+
+        struct GeometrySink : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(GeometrySink, Details::Object, Details::PathGeometryImpl)
+
+            void SetFillMode(FillMode mode) const;
+
+            void BeginFigure(Point2F const & startPoint,
+                             FigureBegin figureBegin) const;
+
+            void AddLine(Point2F const & point) const;
+
+            void AddLines(Point2F const * points,
+                          unsigned count) const;
+
+            template <unsigned Count>
+            void AddLines(Point2F const (&points)[Count]) const
+            {
+                AddLines(points,
+                         Count);
+            }
+
+            void AddBezier(BezierSegment const & bezier) const;
+
+            void AddBeziers(BezierSegment const * beziers,
+                            unsigned count) const;
+
+            template <unsigned Count>
+            void AddBeziers(BezierSegment const (&beziers)[Count]) const
+            {
+                AddBeziers(beziers,
+                           Count);
+            }
+
+            void AddQuadraticBezier(QuadraticBezierSegment const & bezier) const;
+
+            void EndFigure(FigureEnd figureEnd) const;
+            void Close() const;
+        };
+
+        struct PathGeometry : Geometry
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(PathGeometry, Geometry, Details::PathGeometryImpl)
+
+            auto Open() const -> GeometrySink;
+            auto GetFigureCount() const -> unsigned;
+        };
+
+        inline void Geometry::GetBounds(RectF & bounds) const
+        {
+            GetBounds(Matrix3x2F(), bounds);
+        }
+
+        inline void Geometry::GetBounds(Matrix3x2F const & transform,
+                                        RectF & bounds) const
+        {
+            bounds = (*this)->GetBounds(transform);
+        }
+
+        inline void RectangleGeometry::GetRect(RectF & rect) const
+        {
+            rect = (*this)->Rect;
+        }
+
+        inline void EllipseGeometry::GetEllipse(Ellipse & ellipse) const
+        {
+            ellipse = (*this)->Ellipse;
+        }
+
+        inline void GeometrySink::SetFillMode(FillMode const mode) const
+        {
+            (*this)->FillMode = mode;
+        }
+
+        inline void GeometrySink::BeginFigure(Point2F const & startPoint,
+                                              FigureBegin const figureBegin) const
+        {
+            (*this)->Points.push_back(startPoint);
+            (*this)->Verbs.push_back(FigureBegin::Filled == figureBegin ? Details::PathVerb::Begin : Details::PathVerb::BeginHollow);
+        }
+
+        inline void GeometrySink::AddLine(Point2F const & point) const
+        {
+            (*this)->Points.push_back(point);
+            (*this)->Verbs.push_back(Details::PathVerb::Line);
+        }
+
+        inline void GeometrySink::AddLines(Point2F const * points,
+                                           unsigned const count) const
+        {
+            for (unsigned i = 0; i != count; ++i)
+            {
+                AddLine(points[i]);
+            }
+        }
+
+        inline void GeometrySink::AddBezier(BezierSegment const & bezier) const
+        {
+            (*this)->Points.push_back(bezier.Point1);
+            (*this)->Points.push_back(bezier.Point2);
+            (*this)->Points.push_back(bezier.Point3);
+            (*this)->Verbs.push_back(Details::PathVerb::Cubic);
+        }
+
+        inline void GeometrySink::AddBeziers(BezierSegment const * beziers,
+                                             unsigned const count) const
+        {
+            for (unsigned i = 0; i != count; ++i)
+            {
+                AddBezier(beziers[i]);
+            }
+        }
+
+        inline void GeometrySink::AddQuadraticBezier(QuadraticBezierSegment const & bezier) const
+        {
+            (*this)->Points.push_back(bezier.Point1);
+            (*this)->Points.push_back(bezier.Point2);
+            (*this)->Verbs.push_back(Details::PathVerb::Quadratic);
+        }
+
+        // Filling treats open and closed figures alike.
+        inline void GeometrySink::EndFigure(FigureEnd) const
+        {
+            (*this)->Verbs.push_back(Details::PathVerb::End);
+        }
+
+        inline void GeometrySink::Close() const
+        {
+            (*this)->Open = false;
+            (*this)->Closed = true;
+        }
+
+        inline auto PathGeometry::Open() const -> GeometrySink
+        {
+            if ((*this)->Open || (*this)->Closed)
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            (*this)->Open = true;
+            return GeometrySink(Share());
+        }
+
+        inline auto PathGeometry::GetFigureCount() const -> unsigned
+        {
+            return static_cast<unsigned>(std::count_if((*this)->Verbs.begin(), (*this)->Verbs.end(), [] (Details::PathVerb const verb)
+            {
+                return Details::PathVerb::Begin == verb || Details::PathVerb::BeginHollow == verb;
+            }));
+        }
+
+        inline auto CreateRectangleGeometry(RectF const & rect) -> RectangleGeometry
+        {
+            return RectangleGeometry(Details::Make<Details::RectangleGeometryImpl>(rect));
+        }
+
+        inline auto CreateEllipseGeometry(Ellipse const & ellipse) -> EllipseGeometry
+        {
+            return EllipseGeometry(Details::Make<Details::EllipseGeometryImpl>(ellipse));
+        }
+
+        inline auto CreatePathGeometry() -> PathGeometry
+        {
+            return PathGeometry(Details::Make<Details::PathGeometryImpl>());
+        }
+
+        struct FontMetrics
+        {
+            FontMetrics() :
+                DesignUnitsPerEm(),
+                Ascent(),
+                Descent(),
+                LineGap(),
+                CapHeight(),
+                xHeight(),
+                UnderlinePosition(),
+                UnderlineThickness(),
+                StrikethroughPosition(),
+                StrikethroughThickness()
+            {}
+
+            unsigned short DesignUnitsPerEm;
+            unsigned short Ascent;
+            unsigned short Descent;
+            short LineGap;
+            unsigned short CapHeight;
+            unsigned short xHeight;
+            short UnderlinePosition;
+            unsigned short UnderlineThickness;
+            short StrikethroughPosition;
+            unsigned short StrikethroughThickness;
+        };
+
+        struct GlyphMetrics
+        {
+            GlyphMetrics() :
+                LeftSideBearing(),
+                AdvanceWidth(),
+                RightSideBearing(),
+                TopSideBearing(),
+                AdvanceHeight(),
+                BottomSideBearing(),
+                VerticalOriginY()
+            {}
+
+            int LeftSideBearing;
+            unsigned AdvanceWidth;
+            int RightSideBearing;
+            int TopSideBearing;
+            unsigned AdvanceHeight;
+            int BottomSideBearing;
+            int VerticalOriginY;
+        };
+
+        struct GlyphOffset
+        {
+            explicit GlyphOffset(float const advanceOffset = 0.0f,
+                                 float const ascenderOffset = 0.0f) :
+                AdvanceOffset(advanceOffset),
+                AscenderOffset(ascenderOffset)
+            {}
+
+            float AdvanceOffset;
+            float AscenderOffset;
+        };
+
+        namespace Details
+        {
+            // Font faces provide glyph outlines in design units, relative to the origin of
+            // the glyph on the baseline, with y increasing downward as on a render target.
+            // Glyph caches key on the identifier rather than the address, so that a face
+            // created where a released one used to be never finds its glyphs.
+            struct FontFaceImpl : Resource
+            {
+                // The glyphs of the Latin-1 characters and their advances in design units,
+                // for drawing simple text without shaping it.
+                struct LatinGlyphs
+                {
+                    unsigned short Glyphs[256];
+                    unsigned Advances[256];
+                    bool Kerning;
+                };
+
+                std::uint64_t const Id;
+                FontMetrics Metrics;
+
+                FontFaceImpl() :
+                    Id(GetNextId())
+                {}
+
+                static auto GetNextId() -> std::uint64_t
+                {
+                    static std::atomic<std::uint64_t> next(0);
+                    return ++next;
+                }
+
+                virtual auto GetGlyphCount() const -> unsigned = 0;
+
+                virtual auto GetGlyphMetrics(unsigned short glyph) const -> GlyphMetrics = 0;
+
+                // Appends the outline of the glyph, transformed, to the geometry.
+                virtual void AddGlyphOutline(unsigned short glyph,
+                                             Matrix3x2F const & transform,
+                                             GeometryImpl & outline) const = 0;
+
+                // Faces without a character map map everything to the missing glyph.
+                virtual void GetGlyphIndices(std::uint32_t const * codePoints,
+                                             unsigned const count,
+                                             unsigned short * glyphIndices) const
+                {
+                    (void)codePoints;
+                    std::fill(glyphIndices, glyphIndices + count, static_cast<unsigned short>(0));
+                }
+
+                virtual auto HasKerningPairs() const -> bool
+                {
+                    return false;
+                }
+
+                // Adjustments are in design units and apply to the advance of the first glyph
+                // of each pair, so the last is always zero.
+                virtual void GetKerningPairAdjustments(unsigned short const * glyphIndices,
+                                                       unsigned const count,
+                                                       int * adjustments) const
+                {
+                    (void)glyphIndices;
+                    std::fill(adjustments, adjustments + count, 0);
+                }
+
+                // Faces read from a font file give its bytes and the index of the face within
+                // it, so that saved command lists can carry the file.
+                virtual auto GetFontFile(std::uint8_t const *& bits,
+                                         size_t & size,
+                                         unsigned & faceIndex) const -> bool
+                {
+                    (void)bits;
+                    (void)size;
+                    (void)faceIndex;
+                    return false;
+                }
+
+                // Looked up from the character map the first time they are needed, since
+                // faces may be shared by threads.
+                auto GetLatinGlyphs() const -> LatinGlyphs const &
+                {
+                    std::call_once(m_latinFlag, [this]
+                    {
+                        std::uint32_t codePoints[256];
+
+                        for (std::uint32_t i = 0; i != 256; ++i)
+                        {
+                            codePoints[i] = i;
+                        }
+
+                        GetGlyphIndices(codePoints, 256, m_latin.Glyphs);
+
+                        for (unsigned i = 0; i != 256; ++i)
+                        {
+                            m_latin.Advances[i] = GetGlyphMetrics(m_latin.Glyphs[i]).AdvanceWidth;
+                        }
+
+                        m_latin.Kerning = HasKerningPairs();
+                    });
+
+                    return m_latin;
+                }
+
+            private:
+
+                mutable std::once_flag m_latinFlag;
+                mutable LatinGlyphs m_latin;
+            };
+
+            // A face whose glyphs are given as geometries, such as for icons.
+            struct GeometryFontFaceImpl : FontFaceImpl
+            {
+                struct Glyph
+                {
+                    unsigned FirstPoint;
+                    unsigned FirstVerb;
+                    unsigned VerbCount;
+                    GlyphMetrics Metrics;
+                };
+
+                std::vector<Point2F> Points;
+                std::vector<PathVerb> Verbs;
+                std::vector<Glyph> Glyphs;
+
+                auto GetGlyphCount() const -> unsigned override
+                {
+                    return static_cast<unsigned>(Glyphs.size());
+                }
+
+                auto GetGlyphMetrics(unsigned short const glyph) const -> GlyphMetrics override
+                {
+                    return glyph < Glyphs.size() ? Glyphs[glyph].Metrics : GlyphMetrics();
+                }
+
+                void AddGlyphOutline(unsigned short const glyph,
+                                     Matrix3x2F const & transform,
+                                     GeometryImpl & outline) const override
+                {
+                    if (glyph >= Glyphs.size())
+                    {
+                        return;
+                    }
+
+                    auto const & info = Glyphs[glyph];
+                    auto point = Points.data() + info.FirstPoint;
+                    auto const verbs = Verbs.data() + info.FirstVerb;
+
+                    for (unsigned i = 0; i != info.VerbCount; ++i)
+                    {
+                        auto const verb = verbs[i];
+                        outline.Verbs.push_back(verb);
+
+                        auto const count = PathVerb::Quadratic == verb ? 2 :
+                                           PathVerb::Cubic == verb ? 3 :
+                                           PathVerb::End == verb ? 0 : 1;
+
+                        for (auto j = 0; j != count; ++j)
+                        {
+                            outline.Points.push_back(transform.TransformPoint(*point++));
+                        }
+                    }
+                }
+            };
+
+        } // Details
+
+        struct FontFace : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(FontFace, Details::Object, Details::FontFaceImpl)
+
+            auto GetMetrics() const -> FontMetrics;
+            auto GetGlyphCount() const -> unsigned;
+
+            void GetDesignGlyphMetrics(unsigned short const * glyphIndices,
+                                       unsigned glyphCount,
+                                       GlyphMetrics * glyphMetrics) const;
+
+            void GetGlyphIndices(std::uint32_t const * codePoints,
+                                 unsigned codePointCount,
+                                 unsigned short * glyphIndices) const;
+
+            auto HasKerningPairs() const -> bool;
+
+            void GetKerningPairAdjustments(unsigned glyphCount,
+                                           unsigned short const * glyphIndices,
+                                           int * glyphAdvanceAdjustments) const;
+        };
+
+        inline auto FontFace::GetMetrics() const -> FontMetrics
+        {
+            return (*this)->Metrics;
+        }
+
+        inline auto FontFace::GetGlyphCount() const -> unsigned
+        {
+            return (*this)->GetGlyphCount();
+        }
+
+        inline void FontFace::GetDesignGlyphMetrics(unsigned short const * glyphIndices,
+                                                    unsigned const glyphCount,
+                                                    GlyphMetrics * glyphMetrics) const
+        {
+            for (unsigned i = 0; i != glyphCount; ++i)
+            {
+                glyphMetrics[i] = (*this)->GetGlyphMetrics(glyphIndices[i]);
+            }
+        }
+
+        inline void FontFace::GetGlyphIndices(std::uint32_t const * codePoints,
+                                              unsigned const codePointCount,
+                                              unsigned short * glyphIndices) const
+        {
+            (*this)->GetGlyphIndices(codePoints, codePointCount, glyphIndices);
+        }
+
+        inline auto FontFace::HasKerningPairs() const -> bool
+        {
+            return (*this)->HasKerningPairs();
+        }
+
+        inline void FontFace::GetKerningPairAdjustments(unsigned const glyphCount,
+                                                        unsigned short const * glyphIndices,
+                                                        int * glyphAdvanceAdjustments) const
+        {
+            (*this)->GetKerningPairAdjustments(glyphIndices, glyphCount, glyphAdvanceAdjustments);
+        }
+
+        // Creates a face from outlines in design units, drawn with the baseline at y = 0.
+        // Glyph indices are positions in the arrays. The side bearings come from the
+        // bounds of each outline.
+        inline auto CreateFontFace(FontMetrics const & metrics,
+                                   Geometry const * outlines,
+                                   unsigned const * advances,
+                                   unsigned const count) -> FontFace
+        {
+            if (0 == metrics.DesignUnitsPerEm || 0xffff < count)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            auto const face = Details::Make<Details::GeometryFontFaceImpl>();
+            face->Metrics = metrics;
+            face->Glyphs.resize(count);
+
+            for (unsigned i = 0; i != count; ++i)
+            {
+                auto & glyph = face->Glyphs[i];
+                glyph.FirstPoint = static_cast<unsigned>(face->Points.size());
+                glyph.FirstVerb = static_cast<unsigned>(face->Verbs.size());
+                glyph.VerbCount = 0;
+                glyph.Metrics.AdvanceWidth = advances[i];
+                glyph.Metrics.AdvanceHeight = metrics.Ascent + metrics.Descent;
+                glyph.Metrics.VerticalOriginY = metrics.Ascent;
+
+                if (!outlines[i])
+                {
+                    continue;
+                }
+
+                auto const & geometry = *outlines[i].Get();
+                face->Points.insert(face->Points.end(), geometry.Points.begin(), geometry.Points.end());
+                face->Verbs.insert(face->Verbs.end(), geometry.Verbs.begin(), geometry.Verbs.end());
+                glyph.VerbCount = static_cast<unsigned>(geometry.Verbs.size());
+
+                if (!geometry.Points.empty())
+                {
+                    auto const bounds = geometry.GetBounds(Matrix3x2F());
+                    glyph.Metrics.LeftSideBearing = static_cast<int>(std::floor(bounds.Left));
+                    glyph.Metrics.RightSideBearing = static_cast<int>(advances[i]) - static_cast<int>(std::ceil(bounds.Right));
+                    glyph.Metrics.TopSideBearing = metrics.Ascent + static_cast<int>(std::floor(bounds.Top));
+                    glyph.Metrics.BottomSideBearing = metrics.Descent - static_cast<int>(std::ceil(bounds.Bottom));
+                }
+            }
+
+            return FontFace(face);
+        }
+
+        struct GlyphRun
+        {
+            explicit GlyphRun(Cpu::FontFace const & fontFace            = Cpu::FontFace(),
+                              float const fontEmSize                    = 0.0f,
+                              unsigned const glyphCount                 = 0,
+                              unsigned short const * const glyphIndices = nullptr,
+                              float const * const glyphAdvances         = nullptr,
+                              GlyphOffset const * const glyphOffsets    = nullptr,
+                              bool const isSideways                     = false,
+                              unsigned const bidiLevel                  = 0) :
+                FontFace(fontFace.Get()),
+                FontEmSize(fontEmSize),
+                GlyphCount(glyphCount),
+                GlyphIndices(glyphIndices),
+                GlyphAdvances(glyphAdvances),
+                GlyphOffsets(glyphOffsets),
+                IsSideways(isSideways),
+                BidiLevel(bidiLevel)
+            {}
+
+            // Advances and offsets are optional. Without advances, glyphs advance by
+            // their design widths.
+            Details::FontFaceImpl * FontFace;
+            float FontEmSize;
+            unsigned GlyphCount;
+            unsigned short const * GlyphIndices;
+            float const * GlyphAdvances;
+            GlyphOffset const * GlyphOffsets;
+            bool IsSideways;
+            unsigned BidiLevel;
+        };
+
+        // Runs measured as GDI measures text have their glyphs drawn on whole pixels, and
+        // glyphs without advances of their own advance by whole pixels.
+        enum class MeasuringMode
+        {
+            Natural    = 0,
+            GdiClassic = 1,
+            GdiNatural = 2,
+        };
+
+        // One run of a batch drawn with DrawGlyphRuns. The run and the brush are only
+        // referred to, so they must outlive the call.
+        struct BatchedGlyphRun
+        {
+            explicit BatchedGlyphRun(Point2F const & baselineOrigin = Point2F(),
+                                     Cpu::GlyphRun const * glyphRun = nullptr,
+                                     Brush const & foregroundBrush = Brush()) :
+                BaselineOrigin(baselineOrigin),
+                GlyphRun(glyphRun),
+                ForegroundBrush(foregroundBrush.Get())
+            {}
+
+            Point2F BaselineOrigin;
+            Cpu::GlyphRun const * GlyphRun;
+            Details::BrushImpl const * ForegroundBrush;
+        };
+
+        // The order of the red, green, and blue stripes of the pixels of a display, left
+        // to right. Flat displays, and those of unknown geometry, get grayscale text.
+        enum class PixelGeometry
+        {
+            Flat = 0,
+            RGB  = 1,
+            BGR  = 2,
+        };
+
+        namespace Details
+        {
+            struct RenderingParamsImpl : Resource
+            {
+                float Gamma;
+                float EnhancedContrast;
+                float ClearTypeLevel;
+                Cpu::PixelGeometry PixelGeometry;
+
+                RenderingParamsImpl(float const gamma,
+                                    float const enhancedContrast,
+                                    float const clearTypeLevel,
+                                    Cpu::PixelGeometry const pixelGeometry) :
+                    Gamma(gamma),
+                    EnhancedContrast(enhancedContrast),
+                    ClearTypeLevel(clearTypeLevel),
+                    PixelGeometry(pixelGeometry)
+                {}
+            };
+        }
+
+        // How ClearType text is drawn. Gamma is that of the display, which blending corrects
+        // for, enhanced contrast raises the coverage of the edges of glyphs, and the
+        // ClearType level goes from grayscale at zero to full color fringes at one.
+        struct RenderingParams : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(RenderingParams, Details::Object, Details::RenderingParamsImpl)
+
+            auto GetGamma() const -> float;
+            auto GetEnhancedContrast() const -> float;
+            auto GetClearTypeLevel() const -> float;
+            auto GetPixelGeometry() const -> PixelGeometry;
+        };
+
+        inline auto RenderingParams::GetGamma() const -> float
+        {
+            return (*this)->Gamma;
+        }
+
+        inline auto RenderingParams::GetEnhancedContrast() const -> float
+        {
+            return (*this)->EnhancedContrast;
+        }
+
+        inline auto RenderingParams::GetClearTypeLevel() const -> float
+        {
+            return (*this)->ClearTypeLevel;
+        }
+
+        inline auto RenderingParams::GetPixelGeometry() const -> PixelGeometry
+        {
+            return (*this)->PixelGeometry;
+        }
+
+        // As with DirectWrite, gamma must be above zero and no more than 256, enhanced
+        // contrast not negative, and the ClearType level from zero to one.
+        inline auto CreateCustomRenderingParams(float const gamma,
+                                                float const enhancedContrast,
+                                                float const clearTypeLevel,
+                                                PixelGeometry const pixelGeometry) -> RenderingParams
+        {
+            if (!(0.0f < gamma && 256.0f >= gamma) ||
+                !(0.0f <= enhancedContrast && 1.0e6f > enhancedContrast) ||
+                !(0.0f <= clearTypeLevel && 1.0f >= clearTypeLevel) ||
+                PixelGeometry::BGR < pixelGeometry)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            return RenderingParams(Details::Make<Details::RenderingParamsImpl>(gamma,
+                                                                               enhancedContrast,
+                                                                               clearTypeLevel,
+                                                                               pixelGeometry));
+        }
+
+        // The settings Windows ships with for a typical display.
+        inline auto CreateRenderingParams() -> RenderingParams
+        {
+            return CreateCustomRenderingParams(1.8f, 0.5f, 1.0f, PixelGeometry::RGB);
+        }
+
+        namespace Details
+        {
+            // Calls glyph(index, origin) with the baseline origin of each glyph in a run.
+            // Right-to-left runs, those with an odd bidi level, advance to the left.
+            template <typename Glyph>
+            void ForEachGlyphOrigin(Point2F const & baselineOrigin,
+                                    GlyphRun const & run,
+                                    MeasuringMode const mode,
+                                    Glyph const & glyph)
+            {
+                auto const & face = *run.FontFace;
+                auto const scale = run.FontEmSize / (std::max)(1.0f, static_cast<float>(face.Metrics.DesignUnitsPerEm));
+                auto const direction = run.BidiLevel & 1 ? -1.0f : 1.0f;
+                auto const whole = MeasuringMode::Natural != mode;
+                auto pen = baselineOrigin.X;
+
+                for (unsigned i = 0; i != run.GlyphCount; ++i)
+                {
+                    auto const index = run.GlyphIndices[i];
+                    auto advance = run.GlyphAdvances ? run.GlyphAdvances[i] : face.GetGlyphMetrics(index).AdvanceWidth * scale;
+
+                    if (whole && !run.GlyphAdvances)
+                    {
+                        advance = std::floor(advance + 0.5f);
+                    }
+
+                    if (0.0f > direction)
+                    {
+                        pen -= advance;
+                    }
+
+                    auto origin = Point2F(pen, baselineOrigin.Y);
+
+                    if (run.GlyphOffsets)
+                    {
+                        origin.X += direction * run.GlyphOffsets[i].AdvanceOffset;
+                        origin.Y -= run.GlyphOffsets[i].AscenderOffset;
+                    }
+
+                    glyph(index, origin);
+
+                    if (0.0f < direction)
+                    {
+                        pen += advance;
+                    }
+                }
+            }
+
+            // Sideways glyphs are turned a quarter clockwise about their origins.
+            inline void AddGlyphRunOutline(Point2F const & baselineOrigin,
+                                           GlyphRun const & run,
+                                           MeasuringMode const mode,
+                                           GeometryImpl & outline)
+            {
+                if (!run.FontFace)
+                {
+                    return;
+                }
+
+                auto const & face = *run.FontFace;
+                auto const scale = run.FontEmSize / (std::max)(1.0f, static_cast<float>(face.Metrics.DesignUnitsPerEm));
+
+                ForEachGlyphOrigin(baselineOrigin, run, mode, [&] (unsigned short const index, Point2F const & origin)
+                {
+                    auto const transform = run.IsSideways ?
+                        Matrix3x2F(0.0f, scale, -scale, 0.0f, origin.X, origin.Y) :
+                        Matrix3x2F(scale, 0.0f, 0.0f, scale, origin.X, origin.Y);
+
+                    face.AddGlyphOutline(index, transform, outline);
+                });
+            }
+
+        } // Details
+
+        enum class TextAlignment
+        {
+            Leading   = 0,
+            Trailing  = 1,
+            Center    = 2,
+            Justified = 3,
+        };
+
+        enum class ParagraphAlignment
+        {
+            Near   = 0,
+            Far    = 1,
+            Center = 2,
+        };
+
+        enum class WordWrapping
+        {
+            Wrap   = 0,
+            NoWrap = 1,
+        };
+
+        enum class ReadingDirection
+        {
+            LeftToRight = 0,
+            RightToLeft = 1,
+        };
+
+        enum class LineSpacingMethod
+        {
+            Default = 0,
+            Uniform = 1,
+        };
+
+        enum class BreakCondition
+        {
+            Neutral     = 0,
+            CanBreak    = 1,
+            MayNotBreak = 2,
+            MustBreak   = 3,
+        };
+
+        struct TextRange
+        {
+            explicit TextRange(unsigned const startPosition = 0,
+                               unsigned const length = 0) :
+                StartPosition(startPosition),
+                Length(length)
+            {}
+
+            unsigned StartPosition;
+            unsigned Length;
+        };
+
+        struct LineBreakpoint
+        {
+            explicit LineBreakpoint(BreakCondition const breakConditionBefore = BreakCondition::Neutral,
+                                    BreakCondition const breakConditionAfter = BreakCondition::Neutral,
+                                    bool const isWhitespace = false,
+                                    bool const isSoftHyphen = false) :
+                BreakConditionBefore(static_cast<unsigned char>(breakConditionBefore)),
+                BreakConditionAfter(static_cast<unsigned char>(breakConditionAfter)),
+                IsWhitespace(isWhitespace),
+                IsSoftHyphen(isSoftHyphen),
+                Padding()
+            {}
+
+            unsigned char BreakConditionBefore : 2;
+            unsigned char BreakConditionAfter  : 2;
+            unsigned char IsWhitespace         : 1;
+            unsigned char IsSoftHyphen         : 1;
+            unsigned char Padding              : 2;
+        };
+
+        struct LineMetrics
+        {
+            explicit LineMetrics(unsigned const length = 0,
+                                 unsigned const trailingWhitespaceLength = 0,
+                                 unsigned const newlineLength = 0,
+                                 float const height = 0.0f,
+                                 float const baseline = 0.0f,
+                                 bool const isTrimmed = false) :
+                Length(length),
+                TrailingWhitespaceLength(trailingWhitespaceLength),
+                NewlineLength(newlineLength),
+                Height(height),
+                Baseline(baseline),
+                IsTrimmed(isTrimmed)
+            {}
+
+            unsigned Length;
+            unsigned TrailingWhitespaceLength;
+            unsigned NewlineLength;
+            float Height;
+            float Baseline;
+            bool IsTrimmed;
+        };
+
+        struct ClusterMetrics
+        {
+            explicit ClusterMetrics(float const width = 0.0f,
+                                    unsigned short const length = 0,
+                                    bool const canWrapLineAfter = false,
+                                    bool const isWhitespace = false,
+                                    bool const isNewline = false,
+                                    bool const isSoftHyphen = false,
+                                    bool const isRightToLeft = false) :
+                Width(width),
+                Length(length),
+                CanWrapLineAfter(canWrapLineAfter),
+                IsWhitespace(isWhitespace),
+                IsNewline(isNewline),
+                IsSoftHyphen(isSoftHyphen),
+                IsRightToLeft(isRightToLeft),
+                Padding()
+            {}
+
+            float Width;
+            unsigned short Length;
+            unsigned short CanWrapLineAfter : 1;
+            unsigned short IsWhitespace     : 1;
+            unsigned short IsNewline        : 1;
+            unsigned short IsSoftHyphen     : 1;
+            unsigned short IsRightToLeft    : 1;
+            unsigned short Padding          : 11;
+        };
+
+        struct TextMetrics
+        {
+            explicit TextMetrics(float const left = 0.0f,
+                                 float const top = 0.0f,
+                                 float const width = 0.0f,
+                                 float const widthIncludingTrailingWhitespace = 0.0f,
+                                 float const height = 0.0f,
+                                 float const layoutWidth = 0.0f,
+                                 float const layoutHeight = 0.0f,
+                                 unsigned const maxBidiReorderingDepth = 0,
+                                 unsigned const lineCount = 0) :
+                Left(left),
+                Top(top),
+                Width(width),
+                WidthIncludingTrailingWhitespace(widthIncludingTrailingWhitespace),
+                Height(height),
+                LayoutWidth(layoutWidth),
+                LayoutHeight(layoutHeight),
+                MaxBidiReorderingDepth(maxBidiReorderingDepth),
+                LineCount(lineCount)
+            {}
+
+            float Left;
+            float Top;
+            float Width;
+            float WidthIncludingTrailingWhitespace;
+            float Height;
+            float LayoutWidth;
+            float LayoutHeight;
+            unsigned MaxBidiReorderingDepth;
+            unsigned LineCount;
+        };
+
+        struct HitTestMetrics
+        {
+            explicit HitTestMetrics(unsigned const textPosition = 0,
+                                    unsigned const length = 0,
+                                    float const left = 0.0f,
+                                    float const top = 0.0f,
+                                    float const width = 0.0f,
+                                    float const height = 0.0f,
+                                    unsigned const bidiLevel = 0,
+                                    bool const isText = false,
+                                    bool const isTrimmed = false) :
+                TextPosition(textPosition),
+                Length(length),
+                Left(left),
+                Top(top),
+                Width(width),
+                Height(height),
+                BidiLevel(bidiLevel),
+                IsText(isText),
+                IsTrimmed(isTrimmed)
+            {}
+
+            unsigned TextPosition;
+            unsigned Length;
+            float Left;
+            float Top;
+            float Width;
+            float Height;
+            unsigned BidiLevel;
+            bool IsText;
+            bool IsTrimmed;
+        };
+
+        struct TrimmedTextMetrics
+        {
+            explicit TrimmedTextMetrics(unsigned const length = 0,
+                                        float const width = 0.0f,
+                                        bool const isTrimmed = false) :
+                Length(length),
+                Width(width),
+                IsTrimmed(isTrimmed)
+            {}
+
+            unsigned Length;
+            float Width;
+            bool IsTrimmed;
+        };
+
+        enum class FontFeatureTag : unsigned
+        {
+            Default                   = 0x746c6664, // 'dflt'
+            Kerning                   = 0x6e72656b, // 'kern'
+            StandardLigatures         = 0x6167696c, // 'liga'
+            ContextualAlternates      = 0x746c6163, // 'calt'
+            TabularFigures            = 0x6d756e74, // 'tnum'
+            ProportionalFigures       = 0x6d756e70, // 'pnum'
+            SmallCapitals             = 0x70636d73, // 'smcp'
+            SlashedZero               = 0x6f72657a, // 'zero'
+        };
+
+        struct FontFeature
+        {
+            explicit FontFeature(FontFeatureTag const nameTag = FontFeatureTag::Default,
+                                 unsigned const parameter = 0) :
+                NameTag(nameTag),
+                Parameter(parameter)
+            {}
+
+            FontFeatureTag NameTag;
+            unsigned Parameter;
+        };
+
+        inline auto operator==(FontFeature const & left,
+                               FontFeature const & right) -> bool
+        {
+            return left.NameTag == right.NameTag && left.Parameter == right.Parameter;
+        }
+
+        struct ShapingCacheStatistics
+        {
+            ShapingCacheStatistics() :
+                Lookups(),
+                Hits(),
+                Entries(),
+                Bytes()
+            {}
+
+            std::uint64_t Lookups;
+            std::uint64_t Hits;
+            std::uint64_t Entries;
+            std::uint64_t Bytes;
+        };
+
+        enum class DrawTextOptions
+        {
+            None   = 0,
+            NoSnap = 1,
+            Clip   = 2,
+        };
+
+        inline auto operator|(DrawTextOptions const left,
+                              DrawTextOptions const right) -> DrawTextOptions
+        {
+            return static_cast<DrawTextOptions>(static_cast<int>(left) | static_cast<int>(right));
+        }
+
+        inline auto operator&(DrawTextOptions const left,
+                              DrawTextOptions const right) -> DrawTextOptions
+        {
+            return static_cast<DrawTextOptions>(static_cast<int>(left) & static_cast<int>(right));
+        }
+
+        namespace Details
+        {
+            // Reads the code point at a position and returns the number of characters it
+            // takes. A wchar_t holds UTF-16 where it is two bytes wide and UTF-32 elsewhere,
+            // so text positions count the same units as the caller's string.
+            inline auto ReadCodePoint(wchar_t const * text,
+                                      unsigned const length,
+                                      unsigned const position,
+                                      std::uint32_t & codePoint) -> unsigned
+            {
+                auto const first = static_cast<std::uint32_t>(text[position]);
+
+                if (2 == sizeof(wchar_t) && 0xd800 <= first && 0xdc00 > first && position + 1 < length)
+                {
+                    auto const second = static_cast<std::uint32_t>(text[position + 1]);
+
+                    if (0xdc00 <= second && 0xe000 > second)
+                    {
+                        codePoint = 0x10000 + ((first - 0xd800) << 10) + (second - 0xdc00);
+                        return 2;
+                    }
+                }
+
+                codePoint = first;
+                return 1;
+            }
+
+            // The line breaking classes of UAX #14 that matter to scripts without complex
+            // shaping. Everything else breaks like a letter.
+            enum class BreakClass : unsigned char
+            {
+                Letter,
+                Digit,
+                Space,
+                Tab,
+                ZeroWidthSpace,
+                Glue,
+                Hyphen,
+                SoftHyphen,
+                LineFeed,
+                CarriageReturn,
+                Newline,
+                Ideographic,
+                Open,
+                Close,
+                Combining,
+                Invisible,
+            };
+
+            inline auto GetBreakClass(std::uint32_t const c) -> BreakClass
+            {
+                if (0x80 > c)
+                {
+                    if ('0' <= c && '9' >= c) return BreakClass::Digit;
+                    if (' ' == c) return BreakClass::Space;
+                    if ('\t' == c) return BreakClass::Tab;
+                    if ('\n' == c) return BreakClass::LineFeed;
+                    if ('\r' == c) return BreakClass::CarriageReturn;
+                    if ('\v' == c || '\f' == c) return BreakClass::Newline;
+                    if ('-' == c) return BreakClass::Hyphen;
+                    if ('(' == c || '[' == c || '{' == c) return BreakClass::Open;
+                    if (')' == c || ']' == c || '}' == c || ',' == c || '.' == c || ':' == c || ';' == c || '!' == c || '?' == c) return BreakClass::Close;
+                    if (0x20 > c || 0x7f == c) return BreakClass::Invisible;
+                    return BreakClass::Letter;
+                }
+
+                if (0x85 == c || 0x2028 == c || 0x2029 == c) return BreakClass::Newline;
+                if (0xa0 == c || 0x2007 == c || 0x2011 == c || 0x202f == c || 0x2060 == c || 0xfeff == c) return BreakClass::Glue;
+                if (0xad == c) return BreakClass::SoftHyphen;
+                if (0x200b == c) return BreakClass::ZeroWidthSpace;
+                if (0x1680 == c || (0x2000 <= c && 0x200a >= c) || 0x205f == c || 0x3000 == c) return BreakClass::Space;
+                if (0x2010 == c || 0x2012 == c || 0x2013 == c) return BreakClass::Hyphen;
+
+                if ((0x300 <= c && 0x36f >= c) || (0x1ab0 <= c && 0x1aff >= c) || (0x1dc0 <= c && 0x1dff >= c) ||
+                    (0x20d0 <= c && 0x20ff >= c) || (0xfe00 <= c && 0xfe0f >= c) || (0xfe20 <= c && 0xfe2f >= c) ||
+                    0x200c == c || 0x200d == c || (0xe0100 <= c && 0xe01ef >= c))
+                {
+                    return BreakClass::Combining;
+                }
+
+                if (0xa0 > c || (0x200e <= c && 0x200f >= c) || (0x202a <= c && 0x202e >= c) || (0x2061 <= c && 0x206f >= c))
+                {
+                    return BreakClass::Invisible;
+                }
+
+                if (0x3001 == c || 0x3002 == c || 0xff0c == c || 0xff0e == c || 0xff09 == c || 0x300d == c || 0x300f == c) return BreakClass::Close;
+                if (0xff08 == c || 0x300c == c || 0x300e == c) return BreakClass::Open;
+
+                if ((0x2e80 <= c && 0x2fff >= c) || (0x3040 <= c && 0x30ff >= c) || (0x3400 <= c && 0x4dbf >= c) ||
+                    (0x4e00 <= c && 0x9fff >= c) || (0xac00 <= c && 0xd7af >= c) || (0xf900 <= c && 0xfaff >= c) ||
+                    (0xff00 <= c && 0xffef >= c) || (0x20000 <= c && 0x3fffd >= c))
+                {
+                    return BreakClass::Ideographic;
+                }
+
+                return BreakClass::Letter;
+            }
+
+            inline auto IsNewlineClass(BreakClass const value) -> bool
+            {
+                return BreakClass::LineFeed == value || BreakClass::CarriageReturn == value || BreakClass::Newline == value;
+            }
+
+            // Decides whether a line may end between two characters, given the class of
+            // the one before (a combining mark takes the class of its base) and the one after.
+            inline auto GetBreakCondition(BreakClass const before,
+                                          BreakClass const after) -> BreakCondition
+            {
+                if (BreakClass::CarriageReturn == before && BreakClass::LineFeed == after)
+                {
+                    return BreakCondition::MayNotBreak;
+                }
+
+                if (IsNewlineClass(before))
+                {
+                    return BreakCondition::MustBreak;
+                }
+
+                if (IsNewlineClass(after) ||
+                    BreakClass::Combining == after ||
+                    BreakClass::Space == after ||
+                    BreakClass::Tab == after ||
+                    BreakClass::ZeroWidthSpace == after ||
+                    BreakClass::Glue == before ||
+                    BreakClass::Glue == after)
+                {
+                    return BreakCondition::MayNotBreak;
+                }
+
+                if (BreakClass::Space == before ||
+                    BreakClass::Tab == before ||
+                    BreakClass::ZeroWidthSpace == before ||
+                    BreakClass::SoftHyphen == before ||
+                    (BreakClass::Hyphen == before && BreakClass::Letter == after))
+                {
+                    return BreakCondition::CanBreak;
+                }
+
+                if (BreakClass::Close == after || BreakClass::Open == before)
+                {
+                    return BreakCondition::MayNotBreak;
+                }
+
+                if (BreakClass::Ideographic == before || BreakClass::Ideographic == after)
+                {
+                    return BreakCondition::CanBreak;
+                }
+
+                return BreakCondition::MayNotBreak;
+            }
+
+            struct TypographyImpl : Resource
+            {
+                std::vector<FontFeature> Features;
+            };
+
+            // Glyphs and their advances in pixels for a run of text. Offsets are left empty
+            // when every glyph sits at its origin. The shaping cache hands the same result
+            // to threads that know nothing of each other, so it is always counted with
+            // interlocked instructions.
+            struct ShapedText : Resource
+            {
+                std::vector<unsigned short> Glyphs;
+                std::vector<float> Advances;
+                std::vector<GlyphOffset> Offsets;
+
+                void AddRef() const
+                {
+                    AtomicReferenceCount::Increment(References);
+                }
+
+                void Release() const
+                {
+                    if (AtomicReferenceCount::Decrement(References))
+                    {
+                        delete this;
+                    }
+                }
+            };
+
+            // Gives one glyph for each code point, with the advances of the face and kerning
+            // unless a feature turns it off. Characters that take no space map to the space
+            // glyph with no advance, and combining marks keep their glyphs but don't advance.
+            inline void ShapeText(FontFaceImpl const & face,
+                                  float const fontSize,
+                                  std::vector<FontFeature> const & features,
+                                  wchar_t const * text,
+                                  unsigned const length,
+                                  ShapedText & result)
+            {
+                auto const scale = fontSize / (std::max)(1.0f, static_cast<float>(face.Metrics.DesignUnitsPerEm));
+                std::vector<std::uint32_t> codePoints;
+
+                for (unsigned position = 0; position != length;)
+                {
+                    std::uint32_t codePoint = 0;
+                    position += ReadCodePoint(text, length, position, codePoint);
+                    codePoints.push_back(codePoint);
+                }
+
+                auto const count = static_cast<unsigned>(codePoints.size());
+                result.Glyphs.resize(count);
+                result.Advances.resize(count);
+                result.Offsets.clear();
+                face.GetGlyphIndices(codePoints.data(), count, result.Glyphs.data());
+
+                std::uint32_t const space = ' ';
+                unsigned short spaceGlyph = 0;
+                face.GetGlyphIndices(&space, 1, &spaceGlyph);
+
+                for (unsigned i = 0; i != count; ++i)
+                {
+                    auto const type = GetBreakClass(codePoints[i]);
+
+                    if (BreakClass::Letter == type || BreakClass::Digit == type || BreakClass::Ideographic == type ||
+                        BreakClass::Open == type || BreakClass::Close == type || BreakClass::Hyphen == type ||
+                        BreakClass::Space == type || BreakClass::Glue == type)
+                    {
+                        result.Advances[i] = face.GetGlyphMetrics(result.Glyphs[i]).AdvanceWidth * scale;
+                    }
+                    else
+                    {
+                        result.Glyphs[i] = BreakClass::Combining == type ? result.Glyphs[i] : spaceGlyph;
+                        result.Advances[i] = 0.0f;
+                    }
+                }
+
+                auto kerning = face.HasKerningPairs();
+
+                for (auto const & feature : features)
+                {
+                    if (FontFeatureTag::Kerning == feature.NameTag)
+                    {
+                        kerning = kerning && 0 != feature.Parameter;
+                    }
+                }
+
+                if (kerning && 1 < count)
+                {
+                    std::vector<int> adjustments(count);
+                    face.GetKerningPairAdjustments(result.Glyphs.data(), count, adjustments.data());
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        result.Advances[i] += adjustments[i] * scale;
+                    }
+                }
+            }
+
+            // Remembers how recent runs of text were shaped, for the whole process, since the
+            // same labels are laid out again and again. A run is known by everything that
+            // can change its shaping, and its hash spreads runs over shards that each have
+            // their own lock and order of use, so threads laying out text rarely wait on one
+            // another. The budget is shared evenly between the shards, and each forgets its
+            // least recently used runs to stay within its share. Long runs, such as whole
+            // documents, are shaped without being cached.
+            class ShapingCache
+            {
+                struct Entry
+                {
+                    std::uint64_t Hash;
+                    std::uint64_t Face;
+                    float Size;
+                    Cpu::ReadingDirection ReadingDirection;
+                    std::wstring Text;
+                    std::wstring LocaleName;
+                    std::vector<FontFeature> Features;
+                    Pointer<ShapedText const> Result;
+                    std::uint64_t Bytes;
+                };
+
+                struct Shard
+                {
+                    std::mutex Lock;
+                    std::list<Entry> Entries;
+                    std::unordered_multimap<std::uint64_t, std::list<Entry>::iterator> Index;
+                    std::uint64_t Bytes;
+
+                    Shard() :
+                        Bytes(0)
+                    {}
+                };
+
+                static unsigned const ShardCount = 16;
+
+                Shard m_shards[ShardCount];
+                std::atomic<std::uint64_t> m_limit;
+                std::atomic<std::uint64_t> m_lookups;
+                std::atomic<std::uint64_t> m_hits;
+
+                static void Mix(std::uint64_t & hash,
+                                std::uint64_t const value)
+                {
+                    hash = (hash ^ value) * 0x100000001b3;
+                }
+
+                void Evict(Shard & shard,
+                           std::uint64_t const limit)
+                {
+                    while (shard.Bytes > limit && !shard.Entries.empty())
+                    {
+                        auto const last = std::prev(shard.Entries.end());
+                        auto const range = shard.Index.equal_range(last->Hash);
+
+                        for (auto i = range.first; i != range.second; ++i)
+                        {
+                            if (i->second == last)
+                            {
+                                shard.Index.erase(i);
+                                break;
+                            }
+                        }
+
+                        shard.Bytes -= last->Bytes;
+                        shard.Entries.erase(last);
+                    }
+                }
+
+            public:
+
+                static unsigned const MaximumLength = 1024;
+
+                struct Key
+                {
+                    FontFaceImpl const * Face;
+                    float Size;
+                    Cpu::ReadingDirection ReadingDirection;
+                    wchar_t const * Text;
+                    unsigned Length;
+                    std::wstring const * LocaleName;
+                    std::vector<FontFeature> const * Features;
+                    std::uint64_t Hash;
+                };
+
+                ShapingCache() :
+                    m_limit(4 * 1024 * 1024),
+                    m_lookups(0),
+                    m_hits(0)
+                {}
+
+                static auto GetInstance() -> ShapingCache &
+                {
+                    static ShapingCache cache;
+                    return cache;
+                }
+
+                static void SetHash(Key & key)
+                {
+                    std::uint64_t hash = 0xcbf29ce484222325;
+                    Mix(hash, key.Face->Id);
+                    Mix(hash, static_cast<std::uint64_t>(key.Size * 64.0f));
+                    Mix(hash, static_cast<std::uint64_t>(key.ReadingDirection));
+
+                    for (unsigned i = 0; i != key.Length; ++i)
+                    {
+                        Mix(hash, static_cast<std::uint64_t>(key.Text[i]));
+                    }
+
+                    for (auto const c : *key.LocaleName)
+                    {
+                        Mix(hash, static_cast<std::uint64_t>(c));
+                    }
+
+                    for (auto const & feature : *key.Features)
+                    {
+                        Mix(hash, static_cast<std::uint64_t>(feature.NameTag) << 32 | feature.Parameter);
+                    }
+
+                    key.Hash = hash;
+                }
+
+                auto Find(Key const & key) -> Pointer<ShapedText const>
+                {
+                    ++m_lookups;
+                    auto & shard = m_shards[key.Hash % ShardCount];
+                    std::lock_guard<std::mutex> lock(shard.Lock);
+                    auto const range = shard.Index.equal_range(key.Hash);
+
+                    for (auto i = range.first; i != range.second; ++i)
+                    {
+                        auto const & entry = *i->second;
+
+                        if (entry.Face == key.Face->Id &&
+                            entry.Size == key.Size &&
+                            entry.ReadingDirection == key.ReadingDirection &&
+                            entry.Text.size() == key.Length &&
+                            std::equal(entry.Text.begin(), entry.Text.end(), key.Text) &&
+                            entry.LocaleName == *key.LocaleName &&
+                            entry.Features == *key.Features)
+                        {
+                            shard.Entries.splice(shard.Entries.begin(), shard.Entries, i->second);
+                            ++m_hits;
+                            return entry.Result;
+                        }
+                    }
+
+                    return nullptr;
+                }
+
+                void Add(Key const & key,
+                         Pointer<ShapedText const> const & result)
+                {
+                    Entry entry;
+                    entry.Hash = key.Hash;
+                    entry.Face = key.Face->Id;
+                    entry.Size = key.Size;
+                    entry.ReadingDirection = key.ReadingDirection;
+                    entry.Text.assign(key.Text, key.Length);
+                    entry.LocaleName = *key.LocaleName;
+                    entry.Features = *key.Features;
+                    entry.Result = result;
+                    entry.Bytes = sizeof(Entry) + sizeof(ShapedText) + 64 +
+                                  (entry.Text.size() + entry.LocaleName.size()) * sizeof(wchar_t) +
+                                  entry.Features.size() * sizeof(FontFeature) +
+                                  result->Glyphs.size() * (sizeof(unsigned short) + sizeof(float)) +
+                                  result->Offsets.size() * sizeof(GlyphOffset);
+
+                    auto const limit = m_limit.load() / ShardCount;
+
+                    if (entry.Bytes > limit)
+                    {
+                        return;
+                    }
+
+                    auto & shard = m_shards[key.Hash % ShardCount];
+                    std::lock_guard<std::mutex> lock(shard.Lock);
+                    shard.Bytes += entry.Bytes;
+                    shard.Entries.push_front(std::move(entry));
+                    shard.Index.insert(std::make_pair(key.Hash, shard.Entries.begin()));
+                    Evict(shard, limit);
+                }
+
+                void SetLimit(std::uint64_t const limit)
+                {
+                    m_limit = limit;
+
+                    for (auto & shard : m_shards)
+                    {
+                        std::lock_guard<std::mutex> lock(shard.Lock);
+                        Evict(shard, limit / ShardCount);
+                    }
+                }
+
+                auto GetLimit() const -> std::uint64_t
+                {
+                    return m_limit;
+                }
+
+                auto GetStatistics() -> ShapingCacheStatistics
+                {
+                    ShapingCacheStatistics statistics;
+                    statistics.Lookups = m_lookups;
+                    statistics.Hits = m_hits;
+
+                    for (auto & shard : m_shards)
+                    {
+                        std::lock_guard<std::mutex> lock(shard.Lock);
+                        statistics.Entries += shard.Entries.size();
+                        statistics.Bytes += shard.Bytes;
+                    }
+
+                    return statistics;
+                }
+
+                void Clear()
+                {
+                    for (auto & shard : m_shards)
+                    {
+                        std::lock_guard<std::mutex> lock(shard.Lock);
+                        shard.Index.clear();
+                        shard.Entries.clear();
+                        shard.Bytes = 0;
+                    }
+
+                    m_lookups = 0;
+                    m_hits = 0;
+                }
+            };
+
+            inline auto GetShapedText(FontFaceImpl const & face,
+                                      float const fontSize,
+                                      TypographyImpl const * typography,
+                                      std::wstring const & localeName,
+                                      Cpu::ReadingDirection const readingDirection,
+                                      wchar_t const * text,
+                                      unsigned const length) -> Pointer<ShapedText const>
+            {
+                static std::vector<FontFeature> const none;
+                auto const & features = typography ? typography->Features : none;
+
+                ShapingCache::Key key;
+                key.Face = &face;
+                key.Size = fontSize;
+                key.ReadingDirection = readingDirection;
+                key.Text = text;
+                key.Length = length;
+                key.LocaleName = &localeName;
+                key.Features = &features;
+
+                auto & cache = ShapingCache::GetInstance();
+
+                if (ShapingCache::MaximumLength >= length)
+                {
+                    ShapingCache::SetHash(key);
+
+                    if (auto result = cache.Find(key))
+                    {
+                        return result;
+                    }
+                }
+
+                auto const result = Make<ShapedText>();
+                ShapeText(face, fontSize, features, text, length, *result);
+
+                if (ShapingCache::MaximumLength >= length)
+                {
+                    cache.Add(key, result);
+                }
+
+                return result;
+            }
+
+            struct TextFormatImpl : Resource
+            {
+                Pointer<FontFaceImpl> FontFace;
+                float FontSize;
+                std::wstring LocaleName;
+                Cpu::TextAlignment TextAlignment;
+                Cpu::ParagraphAlignment ParagraphAlignment;
+                Cpu::WordWrapping WordWrapping;
+                Cpu::ReadingDirection ReadingDirection;
+                float IncrementalTabStop;
+                LineSpacingMethod LineSpacing;
+                float LineHeight;
+                float LineBaseline;
+
+                TextFormatImpl(Pointer<FontFaceImpl> fontFace,
+                               float const fontSize,
+                               wchar_t const * localeName) :
+                    FontFace(std::move(fontFace)),
+                    FontSize(fontSize),
+                    LocaleName(localeName),
+                    TextAlignment(Cpu::TextAlignment::Leading),
+                    ParagraphAlignment(Cpu::ParagraphAlignment::Near),
+                    WordWrapping(Cpu::WordWrapping::Wrap),
+                    ReadingDirection(Cpu::ReadingDirection::LeftToRight),
+                    IncrementalTabStop(4.0f * fontSize),
+                    LineSpacing(LineSpacingMethod::Default),
+                    LineHeight(0.0f),
+                    LineBaseline(0.0f)
+                {}
+
+                // Layouts note which of their cached stages a change of format makes stale.
+                virtual void FormatChanged(bool const reshape)
+                {
+                    (void)reshape;
+                }
+
+                // The height and baseline of a line whose largest font size is given.
+                void GetLineHeight(float const largest,
+                                   float & height,
+                                   float & baseline) const
+                {
+                    if (LineSpacingMethod::Uniform == LineSpacing)
+                    {
+                        height = LineHeight;
+                        baseline = LineBaseline;
+                        return;
+                    }
+
+                    auto const & metrics = FontFace->Metrics;
+                    auto const scale = largest / (std::max)(1.0f, static_cast<float>(metrics.DesignUnitsPerEm));
+                    baseline = metrics.Ascent * scale;
+                    height = (metrics.Ascent + metrics.Descent + metrics.LineGap) * scale;
+                }
+
+                // The alignment of a line, which is only justified if it may be. A right-to-left
+                // reading direction swaps leading and trailing.
+                auto GetLineAlignment(bool const justify) const -> Cpu::TextAlignment
+                {
+                    auto alignment = TextAlignment;
+
+                    if (Cpu::TextAlignment::Justified == alignment && !justify)
+                    {
+                        alignment = Cpu::TextAlignment::Leading;
+                    }
+
+                    if (Cpu::ReadingDirection::RightToLeft == ReadingDirection)
+                    {
+                        alignment = Cpu::TextAlignment::Leading == alignment ? Cpu::TextAlignment::Trailing :
+                                    Cpu::TextAlignment::Trailing == alignment ? Cpu::TextAlignment::Leading : alignment;
+                    }
+
+                    return alignment;
+                }
+
+                // The offset of lines as a whole from the top of the layout box.
+                auto GetParagraphTop(float const space) const -> float
+                {
+                    return Cpu::ParagraphAlignment::Far == ParagraphAlignment ? space :
+                           Cpu::ParagraphAlignment::Center == ParagraphAlignment ? space / 2.0f : 0.0f;
+                }
+            };
+
+            // Lays text out in three stages, each cached until something it depends on
+            // changes. Line breakpoints and clusters depend only on the text, so they are
+            // found once. Glyphs and advances depend on the font sizes, typography and tab
+            // stops, and each run of the text is shaped through the shaping cache. Lines
+            // depend on the width and the paragraph format, and fitting them needs nothing
+            // more than binary searches through the running advances of the clusters, so
+            // resizing a layout never shapes its text again. The height only moves the
+            // lines as a whole. Text is set left to right in the one font face, with
+            // kerning but no other shaping, and a right-to-left reading direction only
+            // aligns the lines from the right.
+            struct TextLayoutImpl : TextFormatImpl
+            {
+                enum ClusterFlags : unsigned char
+                {
+                    CanWrapAfter = 1,
+                    Whitespace   = 2,
+                    Newline      = 4,
+                    SoftHyphen   = 8,
+                    Tab          = 16,
+                };
+
+                // A range of text with the same font size and typography, from its position
+                // to that of the next.
+                struct FormatRun
+                {
+                    unsigned Position;
+                    float Size;
+                    Pointer<TypographyImpl> Typography;
+                };
+
+                struct Line
+                {
+                    unsigned FirstCluster;
+                    unsigned LastCluster;
+                    unsigned ContentEnd;
+                    unsigned Length;
+                    unsigned TrailingWhitespaceLength;
+                    unsigned NewlineLength;
+                    float Left;
+                    float Top;
+                    float Width;
+                    float WidthIncludingTrailingWhitespace;
+                    float Height;
+                    float Baseline;
+                    float Justify;
+                };
+
+                std::vector<wchar_t> Text;
+                float MaxWidth;
+                float MaxHeight;
+                std::vector<FormatRun> Runs;
+                bool Shaped;
+                bool Fitted;
+
+                std::vector<LineBreakpoint> Breakpoints;
+
+                // Cluster c starts at ClusterPositions[c] in the text and at ClusterGlyphs[c]
+                // among the glyphs. Each array has one more element than there are clusters.
+                std::vector<unsigned> ClusterPositions;
+                std::vector<unsigned> ClusterGlyphs;
+                std::vector<unsigned char> Flags;
+
+                // The last cluster at or before each one that a line may end after, or -1.
+                std::vector<int> PreviousBreaks;
+
+                // The number of whitespace clusters before each, for justification.
+                std::vector<unsigned> WhitespaceCounts;
+
+                // The clusters that end paragraphs, in order.
+                std::vector<unsigned> Newlines;
+
+                std::vector<unsigned short> Glyphs;
+                std::vector<float> Advances;
+                std::vector<GlyphOffset> GlyphOffsets;
+
+                // The sum of the advances of the clusters before each. These are doubles so
+                // that lines far into a long text measure as precisely as the first.
+                std::vector<double> Offsets;
+
+                std::vector<Line> Lines;
+                std::vector<float> Justified;
+
+                TextLayoutImpl(wchar_t const * text,
+                               unsigned const length,
+                               TextFormatImpl const & format,
+                               float const maxWidth,
+                               float const maxHeight) :
+                    TextFormatImpl(format),
+                    Text(text, text + length),
+                    MaxWidth(maxWidth),
+                    MaxHeight(maxHeight),
+                    Shaped(false),
+                    Fitted(false)
+                {
+                    FormatRun run;
+                    run.Position = 0;
+                    run.Size = FontSize;
+                    Runs.push_back(run);
+                    FindBreakpoints();
+                }
+
+                void FormatChanged(bool const reshape) override
+                {
+                    Shaped = Shaped && !reshape;
+                    Fitted = false;
+                }
+
+                void SetMaxWidth(float const maxWidth)
+                {
+                    if (MaxWidth != maxWidth)
+                    {
+                        MaxWidth = maxWidth;
+                        Fitted = false;
+                    }
+                }
+
+                auto GetLength() const -> unsigned
+                {
+                    return static_cast<unsigned>(Text.size());
+                }
+
+                auto GetClusterCount() const -> unsigned
+                {
+                    return static_cast<unsigned>(ClusterPositions.size() - 1);
+                }
+
+                auto FindRun(unsigned const position) const -> unsigned
+                {
+                    return static_cast<unsigned>(std::upper_bound(Runs.begin(), Runs.end(), position, [] (unsigned const value, FormatRun const & run)
+                    {
+                        return value < run.Position;
+                    }) - Runs.begin()) - 1;
+                }
+
+                auto GetFontSize(unsigned const position) const -> float
+                {
+                    return Runs[FindRun(position)].Size;
+                }
+
+                // The end of a range, which must start within the text, clipped to the text.
+                auto GetRangeEnd(TextRange const & range) const -> unsigned
+                {
+                    auto const length = GetLength();
+
+                    if (range.StartPosition > length)
+                    {
+                        HR(E_INVALIDARG);
+                    }
+
+                    return range.StartPosition + (std::min)(range.Length, length - range.StartPosition);
+                }
+
+                // Returns the index of the run starting at the position, splitting the run
+                // that covers it if need be.
+                auto SplitRun(unsigned const position) -> unsigned
+                {
+                    if (position >= GetLength())
+                    {
+                        return static_cast<unsigned>(Runs.size());
+                    }
+
+                    auto const index = FindRun(position);
+
+                    if (Runs[index].Position == position)
+                    {
+                        return index;
+                    }
+
+                    auto run = Runs[index];
+                    run.Position = position;
+                    Runs.insert(Runs.begin() + index + 1, run);
+                    return index + 1;
+                }
+
+                template <typename Change>
+                void ChangeRuns(unsigned const start,
+                                unsigned const end,
+                                Change const & change)
+                {
+                    SplitRun(end);
+                    auto const first = SplitRun(start);
+                    auto const last = SplitRun(end);
+
+                    for (auto i = first; i != last; ++i)
+                    {
+                        change(Runs[i]);
+                    }
+
+                    Runs.erase(std::unique(Runs.begin(), Runs.end(), [] (FormatRun const & first, FormatRun const & second)
+                    {
+                        return first.Size == second.Size && first.Typography.Get() == second.Typography.Get();
+                    }), Runs.end());
+
+                    Shaped = false;
+                    Fitted = false;
+                }
+
+                // Splits the text into clusters, each a character with any combining marks that
+                // follow it or a CR LF pair, and notes where lines may or must end.
+                void FindBreakpoints()
+                {
+                    auto const length = GetLength();
+                    Breakpoints.assign(length, LineBreakpoint(BreakCondition::MayNotBreak, BreakCondition::MayNotBreak));
+
+                    auto previous = BreakClass::Invisible;
+                    unsigned position = 0;
+                    unsigned glyph = 0;
+
+                    while (position != length)
+                    {
+                        std::uint32_t codePoint = 0;
+                        auto const size = ReadCodePoint(Text.data(), length, position, codePoint);
+                        auto const current = GetBreakClass(codePoint);
+
+                        if (0 != position)
+                        {
+                            auto const condition = static_cast<unsigned char>(GetBreakCondition(previous, current));
+                            Breakpoints[position - 1].BreakConditionAfter = condition;
+                            Breakpoints[position].BreakConditionBefore = condition;
+                        }
+
+                        if (0 == position || !(BreakClass::Combining == current || (BreakClass::CarriageReturn == previous && BreakClass::LineFeed == current)))
+                        {
+                            ClusterPositions.push_back(position);
+                            ClusterGlyphs.push_back(glyph);
+                        }
+
+                        for (unsigned i = 0; i != size; ++i)
+                        {
+                            auto & breakpoint = Breakpoints[position + i];
+                            breakpoint.IsWhitespace = BreakClass::Space == current || BreakClass::Tab == current || IsNewlineClass(current);
+                            breakpoint.IsSoftHyphen = BreakClass::SoftHyphen == current;
+                        }
+
+                        if (BreakClass::Combining != current || 0 == position)
+                        {
+                            previous = current;
+                        }
+
+                        position += size;
+                        ++glyph;
+                    }
+
+                    if (0 != length)
+                    {
+                        Breakpoints[length - 1].BreakConditionAfter = static_cast<unsigned char>(BreakCondition::CanBreak);
+                    }
+
+                    ClusterPositions.push_back(length);
+                    ClusterGlyphs.push_back(glyph);
+                    auto const count = GetClusterCount();
+                    Flags.assign(count, 0);
+                    PreviousBreaks.resize(count);
+                    WhitespaceCounts.assign(count + 1, 0);
+                    auto lastBreak = -1;
+
+                    for (unsigned c = 0; c != count; ++c)
+                    {
+                        auto const first = Breakpoints[ClusterPositions[c]];
+                        auto const last = Breakpoints[ClusterPositions[c + 1] - 1];
+                        auto const after = static_cast<BreakCondition>(last.BreakConditionAfter);
+                        unsigned char flags = 0;
+
+                        if (BreakCondition::CanBreak == after || BreakCondition::MustBreak == after)
+                        {
+                            flags |= CanWrapAfter;
+                            lastBreak = static_cast<int>(c);
+                        }
+
+                        if (first.IsWhitespace)
+                        {
+                            flags |= Whitespace;
+                        }
+
+                        if (first.IsSoftHyphen)
+                        {
+                            flags |= SoftHyphen;
+                        }
+
+                        std::uint32_t character = 0;
+                        ReadCodePoint(Text.data(), length, ClusterPositions[c], character);
+
+                        if ('\t' == character)
+                        {
+                            flags |= Tab;
+                        }
+
+                        if (IsNewlineClass(GetBreakClass(character)))
+                        {
+                            flags |= Newline;
+                            Newlines.push_back(c);
+                        }
+
+                        Flags[c] = flags;
+                        PreviousBreaks[c] = lastBreak;
+                        WhitespaceCounts[c + 1] = WhitespaceCounts[c] + ((flags & Whitespace) && !(flags & Newline) ? 1 : 0);
+                    }
+                }
+
+                // Shapes each run of the text, starting and ending with whole clusters, and
+                // gathers the results.
+                void Shape()
+                {
+                    auto const count = GetClusterCount();
+                    auto const glyphCount = ClusterGlyphs[count];
+                    Glyphs.resize(glyphCount);
+                    Advances.resize(glyphCount);
+                    GlyphOffsets.clear();
+                    Offsets.resize(count + 1);
+
+                    for (unsigned first = 0; first != count;)
+                    {
+                        auto const & run = Runs[FindRun(ClusterPositions[first])];
+                        auto last = first + 1;
+
+                        while (last != count && &Runs[FindRun(ClusterPositions[last])] == &run)
+                        {
+                            ++last;
+                        }
+
+                        auto const position = ClusterPositions[first];
+
+                        auto const shaped = GetShapedText(*FontFace,
+                                                          run.Size,
+                                                          run.Typography.Get(),
+                                                          LocaleName,
+                                                          ReadingDirection,
+                                                          Text.data() + position,
+                                                          ClusterPositions[last] - position);
+
+                        auto const glyph = ClusterGlyphs[first];
+                        std::copy(shaped->Glyphs.begin(), shaped->Glyphs.end(), Glyphs.begin() + glyph);
+                        std::copy(shaped->Advances.begin(), shaped->Advances.end(), Advances.begin() + glyph);
+
+                        if (!shaped->Offsets.empty())
+                        {
+                            GlyphOffsets.resize(glyphCount);
+                            std::copy(shaped->Offsets.begin(), shaped->Offsets.end(), GlyphOffsets.begin() + glyph);
+                        }
+
+                        first = last;
+                    }
+
+                    // Tabs advance to the next stop from the start of their paragraph.
+                    auto const tabStop = static_cast<double>(IncrementalTabStop);
+                    auto paragraph = 0.0;
+                    Offsets[0] = 0.0;
+
+                    for (unsigned c = 0; c != count; ++c)
+                    {
+                        auto width = 0.0f;
+
+                        if (Flags[c] & Tab)
+                        {
+                            auto const x = Offsets[c] - paragraph;
+                            width = static_cast<float>((std::floor(x / tabStop + 1e-6) + 1.0) * tabStop - x);
+                            Advances[ClusterGlyphs[c]] = width;
+                        }
+                        else
+                        {
+                            for (auto g = ClusterGlyphs[c]; g != ClusterGlyphs[c + 1]; ++g)
+                            {
+                                width += Advances[g];
+                            }
+                        }
+
+                        Offsets[c + 1] = Offsets[c] + width;
+
+                        if (Flags[c] & Newline)
+                        {
+                            paragraph = Offsets[c + 1];
+                        }
+                    }
+
+                    Shaped = true;
+                }
+
+                auto GetWidth(unsigned const first,
+                              unsigned const last) const -> float
+                {
+                    return static_cast<float>(Offsets[last] - Offsets[first]);
+                }
+
+                // Finds the clusters of each line. The clusters that fit are found with a binary
+                // search, and the line ends after the last break opportunity among them, or
+                // where it overflows if a word is wider than the layout. Whitespace hangs past
+                // the end of a line rather than moving to the next.
+                void Fit()
+                {
+                    if (!Shaped)
+                    {
+                        Shape();
+                    }
+
+                    Lines.clear();
+                    auto const count = GetClusterCount();
+                    auto const wrap = Cpu::WordWrapping::Wrap == WordWrapping;
+                    auto const tolerance = 1.0 / 1024.0;
+                    auto newline = Newlines.begin();
+                    unsigned first = 0;
+                    auto top = 0.0f;
+
+                    while (first != count)
+                    {
+                        auto const paragraphEnd = Newlines.end() != newline ? *newline + 1 : count;
+                        auto last = paragraphEnd;
+
+                        if (wrap)
+                        {
+                            auto const limit = Offsets[first] + MaxWidth + tolerance;
+                            auto const fit = static_cast<unsigned>(std::upper_bound(Offsets.begin() + first + 1, Offsets.begin() + paragraphEnd + 1, limit) - Offsets.begin()) - 1;
+
+                            if (fit < paragraphEnd)
+                            {
+                                last = fit;
+
+                                while (last != paragraphEnd && (Flags[last] & Whitespace))
+                                {
+                                    ++last;
+                                }
+
+                                if (last == fit || !(Flags[last - 1] & CanWrapAfter))
+                                {
+                                    auto const previous = fit > first ? PreviousBreaks[fit - 1] : -1;
+                                    last = previous >= static_cast<int>(first) ? static_cast<unsigned>(previous) + 1 : (std::max)(first + 1, fit);
+
+                                    while (last != paragraphEnd && (Flags[last] & Whitespace))
+                                    {
+                                        ++last;
+                                    }
+                                }
+                            }
+                        }
+
+                        AddLine(first, last, paragraphEnd == last, top);
+                        first = last;
+
+                        if (paragraphEnd == last && Newlines.end() != newline)
+                        {
+                            ++newline;
+                        }
+                    }
+
+                    if (0 == count || (Flags[count - 1] & Newline))
+                    {
+                        AddLine(count, count, true, top);
+                    }
+
+                    Fitted = true;
+                }
+
+                void AddLine(unsigned const first,
+                             unsigned const last,
+                             bool const paragraphEnd,
+                             float & top)
+                {
+                    Line line = {};
+                    line.FirstCluster = first;
+                    line.LastCluster = last;
+                    line.ContentEnd = last;
+                    line.Length = ClusterPositions[last] - ClusterPositions[first];
+
+                    while (line.ContentEnd != first && (Flags[line.ContentEnd - 1] & Whitespace))
+                    {
+                        --line.ContentEnd;
+
+                        if (Flags[line.ContentEnd] & Newline)
+                        {
+                            line.NewlineLength = ClusterPositions[line.ContentEnd + 1] - ClusterPositions[line.ContentEnd];
+                        }
+                    }
+
+                    line.TrailingWhitespaceLength = ClusterPositions[last] - ClusterPositions[line.ContentEnd];
+                    line.Width = GetWidth(first, line.ContentEnd);
+                    line.WidthIncludingTrailingWhitespace = GetWidth(first, last - (line.NewlineLength ? 1 : 0));
+                    line.Top = top;
+
+                    auto const start = ClusterPositions[first];
+                    auto const end = (std::max)(start + 1, ClusterPositions[last]);
+                    auto largest = 0.0f;
+
+                    for (auto i = FindRun(start); i != Runs.size() && Runs[i].Position < end; ++i)
+                    {
+                        largest = (std::max)(largest, Runs[i].Size);
+                    }
+
+                    GetLineHeight(largest, line.Height, line.Baseline);
+                    auto const space = MaxWidth - line.Width;
+                    auto const alignment = GetLineAlignment(!paragraphEnd && 0.0f < space);
+
+                    if (Cpu::TextAlignment::Trailing == alignment)
+                    {
+                        line.Left = space;
+                    }
+                    else if (Cpu::TextAlignment::Center == alignment)
+                    {
+                        line.Left = space / 2.0f;
+                    }
+                    else if (Cpu::TextAlignment::Justified == alignment)
+                    {
+                        auto const spaces = WhitespaceCounts[line.ContentEnd] - WhitespaceCounts[first];
+
+                        if (0 != spaces)
+                        {
+                            line.Justify = space / spaces;
+                            line.Width = MaxWidth;
+                        }
+                    }
+
+                    top += line.Height;
+                    Lines.push_back(line);
+                }
+
+                void Update()
+                {
+                    if (!Fitted)
+                    {
+                        Fit();
+                    }
+                }
+
+                auto GetHeight() const -> float
+                {
+                    return Lines.back().Top + Lines.back().Height;
+                }
+
+                // The offset of the lines as a whole, for paragraph alignment.
+                auto GetTop() const -> float
+                {
+                    return GetParagraphTop(MaxHeight - GetHeight());
+                }
+
+                // The distance from the left of the layout to the leading edge of a cluster.
+                auto GetClusterLeft(Line const & line,
+                                    unsigned const cluster) const -> float
+                {
+                    auto left = line.Left + GetWidth(line.FirstCluster, cluster);
+
+                    if (0.0f != line.Justify)
+                    {
+                        left += line.Justify * (WhitespaceCounts[(std::min)(cluster, line.ContentEnd)] - WhitespaceCounts[line.FirstCluster]);
+                    }
+
+                    return left;
+                }
+
+                auto FindCluster(unsigned const position) const -> unsigned
+                {
+                    return static_cast<unsigned>(std::upper_bound(ClusterPositions.begin(), ClusterPositions.end() - 1, position) - ClusterPositions.begin()) - 1;
+                }
+
+                auto FindLineOfCluster(unsigned const cluster) const -> Line const &
+                {
+                    return *(std::upper_bound(Lines.begin() + 1, Lines.end(), cluster, [] (unsigned const value, Line const & line)
+                    {
+                        return value < line.FirstCluster;
+                    }) - 1);
+                }
+
+                // Lines above the first or below the last are taken to be the first or last.
+                auto FindLineAt(float const y) const -> Line const &
+                {
+                    return *(std::upper_bound(Lines.begin() + 1, Lines.end(), y, [] (float const value, Line const & line)
+                    {
+                        return value < line.Top;
+                    }) - 1);
+                }
+
+                // The cluster of a line under a distance from the left of the layout, if there
+                // is one. The leading edges of the clusters only ever move right.
+                auto FindClusterAt(Line const & line,
+                                   float const x) const -> unsigned
+                {
+                    auto first = line.FirstCluster;
+                    auto count = line.LastCluster - first;
+
+                    while (0 != count)
+                    {
+                        auto const half = count / 2;
+
+                        if (GetClusterLeft(line, first + half + 1) <= x)
+                        {
+                            first += half + 1;
+                            count -= half + 1;
+                        }
+                        else
+                        {
+                            count = half;
+                        }
+                    }
+
+                    return first;
+                }
+
+                auto GetHitTestMetrics(Line const & line,
+                                       unsigned const first,
+                                       unsigned const last) const -> HitTestMetrics
+                {
+                    auto const left = GetClusterLeft(line, first);
+
+                    return HitTestMetrics(ClusterPositions[first],
+                                          ClusterPositions[last] - ClusterPositions[first],
+                                          left,
+                                          GetTop() + line.Top,
+                                          GetClusterLeft(line, last) - left,
+                                          line.Height,
+                                          0,
+                                          first != last);
+                }
+
+                auto GetMetrics() -> TextMetrics
+                {
+                    Update();
+                    TextMetrics metrics;
+                    metrics.Left = FLT_MAX;
+                    metrics.Top = GetTop();
+                    metrics.Height = GetHeight();
+                    metrics.LayoutWidth = MaxWidth;
+                    metrics.LayoutHeight = MaxHeight;
+                    metrics.MaxBidiReorderingDepth = 1;
+                    metrics.LineCount = static_cast<unsigned>(Lines.size());
+
+                    for (auto const & line : Lines)
+                    {
+                        metrics.Left = (std::min)(metrics.Left, line.Left);
+                        metrics.Width = (std::max)(metrics.Width, line.Width);
+                        metrics.WidthIncludingTrailingWhitespace = (std::max)(metrics.WidthIncludingTrailingWhitespace, line.WidthIncludingTrailingWhitespace);
+                    }
+
+                    return metrics;
+                }
+
+                // Draws each line as glyph runs of one font size, leaving out the whitespace
+                // that ends it. Justified lines widen their spaces through a copy of the advances.
+                template <typename Draw>
+                void ForEachGlyphRun(Point2F const & origin,
+                                     Draw const & draw)
+                {
+                    Update();
+                    auto const top = origin.Y + GetTop();
+
+                    for (auto const & line : Lines)
+                    {
+                        auto cluster = line.FirstCluster;
+
+                        while (cluster != line.ContentEnd)
+                        {
+                            auto const size = GetFontSize(ClusterPositions[cluster]);
+                            auto end = cluster + 1;
+
+                            while (end != line.ContentEnd && GetFontSize(ClusterPositions[end]) == size)
+                            {
+                                ++end;
+                            }
+
+                            auto const firstGlyph = ClusterGlyphs[cluster];
+                            auto const glyphCount = ClusterGlyphs[end] - firstGlyph;
+                            auto advances = Advances.data() + firstGlyph;
+
+                            if (0.0f != line.Justify)
+                            {
+                                Justified.assign(advances, advances + glyphCount);
+
+                                for (auto c = cluster; c != end; ++c)
+                                {
+                                    if (Flags[c] & Whitespace)
+                                    {
+                                        Justified[ClusterGlyphs[c] - firstGlyph] += line.Justify;
+                                    }
+                                }
+
+                                advances = Justified.data();
+                            }
+
+                            GlyphRun run;
+                            run.FontFace = FontFace.Get();
+                            run.FontEmSize = size;
+                            run.GlyphCount = glyphCount;
+                            run.GlyphIndices = Glyphs.data() + firstGlyph;
+                            run.GlyphAdvances = advances;
+                            run.GlyphOffsets = GlyphOffsets.empty() ? nullptr : GlyphOffsets.data() + firstGlyph;
+
+                            draw(Point2F(origin.X + GetClusterLeft(line, cluster), top + line.Top + line.Baseline), run);
+                            cluster = end;
+                        }
+                    }
+                }
+            };
+
+            // Short text of printable Latin-1 characters, set left to right on one line,
+            // needs none of the stages of a layout. Each character is its own cluster with
+            // one glyph, taken from the table of its face along with its advance, so the
+            // text is measured and placed as a layout would place it without allocating.
+            // Anything else, including text that would wrap, is left to a layout.
+            struct SimpleText
+            {
+                static unsigned const MaximumLength = 256;
+
+                unsigned short Glyphs[MaximumLength];
+                float Advances[MaximumLength];
+                int Adjustments[MaximumLength];
+                unsigned Count;
+                float Width;
+
+                auto Set(TextFormatImpl const & format,
+                         wchar_t const * text,
+                         unsigned const length,
+                         float const maxWidth) -> bool
+                {
+                    if (MaximumLength < length || Cpu::ReadingDirection::LeftToRight != format.ReadingDirection)
+                    {
+                        return false;
+                    }
+
+                    for (unsigned i = 0; i != length; ++i)
+                    {
+                        auto const c = static_cast<std::uint32_t>(text[i]);
+
+                        if (0x20 > c || (0x7f <= c && 0xa0 > c) || 0xad == c || 0xff < c)
+                        {
+                            return false;
+                        }
+                    }
+
+                    auto const & face = *format.FontFace;
+                    auto const & latin = face.GetLatinGlyphs();
+                    auto const scale = format.FontSize / (std::max)(1.0f, static_cast<float>(face.Metrics.DesignUnitsPerEm));
+
+                    for (unsigned i = 0; i != length; ++i)
+                    {
+                        Glyphs[i] = latin.Glyphs[text[i]];
+                        Advances[i] = latin.Advances[text[i]] * scale;
+                    }
+
+                    if (latin.Kerning && 1 < length)
+                    {
+                        face.GetKerningPairAdjustments(Glyphs, length, Adjustments);
+
+                        for (unsigned i = 0; i != length; ++i)
+                        {
+                            Advances[i] += Adjustments[i] * scale;
+                        }
+                    }
+
+                    // Trailing spaces hang, so they neither count toward the width nor wrap.
+                    auto total = 0.0;
+                    auto content = 0.0;
+                    Count = 0;
+
+                    for (unsigned i = 0; i != length; ++i)
+                    {
+                        total += Advances[i];
+
+                        if (' ' != text[i])
+                        {
+                            content = total;
+                            Count = i + 1;
+                        }
+                    }
+
+                    if (Cpu::WordWrapping::Wrap == format.WordWrapping && total > maxWidth + 1.0 / 1024.0)
+                    {
+                        return false;
+                    }
+
+                    Width = static_cast<float>(content);
+                    return true;
+                }
+            };
+
+            // Reads the first line of text one character at a time, shaping each as a layout
+            // would, until the content no longer fits. The width of a cluster depends on how
+            // its last glyph kerns with the next, so each glyph waits for the one after it
+            // before it is added. The cut is the end of the last cluster, other than
+            // whitespace, that fits along with the trimming sign. The text that is kept no
+            // longer kerns with what followed it, so its width leaves that pair out.
+            inline auto MeasureTrimmedText(TextFormatImpl const & format,
+                                           wchar_t const * text,
+                                           unsigned const length,
+                                           float const maxWidth,
+                                           float const trimmingSignWidth) -> TrimmedTextMetrics
+            {
+                auto const & face = *format.FontFace;
+                auto const & latin = face.GetLatinGlyphs();
+                auto const scale = format.FontSize / (std::max)(1.0f, static_cast<float>(face.Metrics.DesignUnitsPerEm));
+                auto const tabStop = static_cast<double>(format.IncrementalTabStop);
+                auto const tolerance = 1.0 / 1024.0;
+                auto const limit = maxWidth + tolerance;
+                auto const budget = maxWidth - trimmingSignWidth + tolerance;
+
+                auto x = 0.0;
+                auto content = 0.0;
+                auto fitWidth = 0.0;
+                unsigned fitLength = 0;
+                unsigned clusterEnd = 0;
+                auto clusterWidth = 0.0f;
+                auto clusterTab = false;
+                auto clusterWhitespace = false;
+                unsigned short previousGlyph = 0;
+                auto previousAdvance = 0.0f;
+                auto trimmed = false;
+
+                // Adds the cluster read so far, given its width without the kerning of its
+                // last glyph with the next, returning false once the content overflows.
+                auto const addCluster = [&] (float const keptWidth) -> bool
+                {
+                    auto const width = clusterTab ? static_cast<float>((std::floor(x / tabStop + 1e-6) + 1.0) * tabStop - x) : clusterWidth;
+                    auto const kept = x + keptWidth;
+                    x += width;
+
+                    if (!clusterWhitespace)
+                    {
+                        if (kept <= budget)
+                        {
+                            fitWidth = kept;
+                            fitLength = clusterEnd;
+                        }
+
+                        if (x > limit)
+                        {
+                            return false;
+                        }
+
+                        content = x;
+                    }
+
+                    return true;
+                };
+
+                for (unsigned position = 0; position != length;)
+                {
+                    std::uint32_t codePoint = 0;
+                    auto const size = ReadCodePoint(text, length, position, codePoint);
+                    auto const type = GetBreakClass(codePoint);
+                    unsigned short glyph = 0;
+
+                    if (0x100 > codePoint)
+                    {
+                        glyph = latin.Glyphs[codePoint];
+                    }
+                    else
+                    {
+                        face.GetGlyphIndices(&codePoint, 1, &glyph);
+                    }
+
+                    auto advance = 0.0f;
+
+                    if (BreakClass::Letter == type || BreakClass::Digit == type || BreakClass::Ideographic == type ||
+                        BreakClass::Open == type || BreakClass::Close == type || BreakClass::Hyphen == type ||
+                        BreakClass::Space == type || BreakClass::Glue == type)
+                    {
+                        advance = (0x100 > codePoint ? latin.Advances[codePoint] : face.GetGlyphMetrics(glyph).AdvanceWidth) * scale;
+                    }
+                    else if (BreakClass::Combining != type)
+                    {
+                        glyph = latin.Glyphs[' '];
+                    }
+
+                    if (0 != position)
+                    {
+                        auto kerning = 0.0f;
+
+                        if (latin.Kerning)
+                        {
+                            unsigned short const pair[] = { previousGlyph, glyph };
+                            int adjustments[2];
+                            face.GetKerningPairAdjustments(pair, 2, adjustments);
+                            kerning = adjustments[0] * scale;
+                        }
+
+                        auto const keptWidth = clusterWidth + previousAdvance;
+                        clusterWidth += previousAdvance + kerning;
+
+                        if (BreakClass::Combining != type)
+                        {
+                            if (!addCluster(keptWidth))
+                            {
+                                trimmed = true;
+                                break;
+                            }
+
+                            clusterWidth = 0.0f;
+                        }
+                    }
+
+                    // The first line break ends the line, and whatever follows its cluster is trimmed.
+                    if (IsNewlineClass(type))
+                    {
+                        auto previous = type;
+                        auto end = position + size;
+
+                        while (end != length)
+                        {
+                            std::uint32_t next = 0;
+                            auto const nextSize = ReadCodePoint(text, length, end, next);
+                            auto const nextType = GetBreakClass(next);
+
+                            if (!(BreakClass::Combining == nextType || (BreakClass::CarriageReturn == previous && BreakClass::LineFeed == nextType)))
+                            {
+                                break;
+                            }
+
+                            previous = BreakClass::Combining == nextType ? previous : nextType;
+                            end += nextSize;
+                        }
+
+                        trimmed = end != length;
+                        break;
+                    }
+
+                    if (0 == position || BreakClass::Combining != type)
+                    {
+                        clusterTab = BreakClass::Tab == type;
+                        clusterWhitespace = BreakClass::Space == type || clusterTab;
+                    }
+
+                    previousGlyph = glyph;
+                    previousAdvance = advance;
+                    position += size;
+                    clusterEnd = position;
+
+                    if (position == length)
+                    {
+                        clusterWidth += previousAdvance;
+
+                        if (!addCluster(clusterWidth))
+                        {
+                            trimmed = true;
+                        }
+                    }
+                }
+
+                if (trimmed)
+                {
+                    return TrimmedTextMetrics(fitLength, static_cast<float>(fitWidth), true);
+                }
+
+                return TrimmedTextMetrics(length, static_cast<float>(content), false);
+            }
+
+        } // Details
+
+        // Layouts read the features of a typography when they next shape their text.
+        struct Typography : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Typography, Details::Object, Details::TypographyImpl)
+
+            void AddFontFeature(FontFeature const & fontFeature) const;
+            auto GetFontFeatureCount() const -> unsigned;
+            auto GetFontFeature(unsigned fontFeatureIndex) const -> FontFeature;
+        };
+
+        inline void Typography::AddFontFeature(FontFeature const & fontFeature) const
+        {
+            (*this)->Features.push_back(fontFeature);
+        }
+
+        inline auto Typography::GetFontFeatureCount() const -> unsigned
+        {
+            return static_cast<unsigned>((*this)->Features.size());
+        }
+
+        inline auto Typography::GetFontFeature(unsigned const fontFeatureIndex) const -> FontFeature
+        {
+            if (fontFeatureIndex >= (*this)->Features.size())
+            {
+                HR(E_INVALIDARG);
+            }
+
+            return (*this)->Features[fontFeatureIndex];
+        }
+
+        inline auto CreateTypography() -> Typography
+        {
+            return Typography(Details::Make<Details::TypographyImpl>());
+        }
+
+        struct TextFormat : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(TextFormat, Details::Object, Details::TextFormatImpl)
+
+            auto GetFontFace() const -> FontFace;
+            auto GetFontSize() const -> float;
+            auto GetLocaleName() const -> wchar_t const *;
+
+            void SetTextAlignment(TextAlignment textAlignment) const;
+            auto GetTextAlignment() const -> TextAlignment;
+
+            void SetParagraphAlignment(ParagraphAlignment paragraphAlignment) const;
+            auto GetParagraphAlignment() const -> ParagraphAlignment;
+
+            void SetWordWrapping(WordWrapping wordWrapping) const;
+            auto GetWordWrapping() const -> WordWrapping;
+
+            void SetReadingDirection(ReadingDirection readingDirection) const;
+            auto GetReadingDirection() const -> ReadingDirection;
+
+            void SetIncrementalTabStop(float incrementalTabStop) const;
+            auto GetIncrementalTabStop() const -> float;
+
+            // Uniform spacing gives every line the same height and baseline, while the
+            // default spacing uses the ascent, descent and line gap of the font.
+            void SetLineSpacing(LineSpacingMethod lineSpacingMethod,
+                                float lineSpacing,
+                                float baseline) const;
+
+            void GetLineSpacing(LineSpacingMethod & lineSpacingMethod,
+                                float & lineSpacing,
+                                float & baseline) const;
+        };
+
+        inline auto TextFormat::GetFontFace() const -> FontFace
+        {
+            return FontFace((*this)->FontFace);
+        }
+
+        inline auto TextFormat::GetFontSize() const -> float
+        {
+            return (*this)->FontSize;
+        }
+
+        inline auto TextFormat::GetLocaleName() const -> wchar_t const *
+        {
+            return (*this)->LocaleName.c_str();
+        }
+
+        inline void TextFormat::SetTextAlignment(TextAlignment const textAlignment) const
+        {
+            (*this)->TextAlignment = textAlignment;
+            (*this)->FormatChanged(false);
+        }
+
+        inline auto TextFormat::GetTextAlignment() const -> TextAlignment
+        {
+            return (*this)->TextAlignment;
+        }
+
+        inline void TextFormat::SetParagraphAlignment(ParagraphAlignment const paragraphAlignment) const
+        {
+            (*this)->ParagraphAlignment = paragraphAlignment;
+        }
+
+        inline auto TextFormat::GetParagraphAlignment() const -> ParagraphAlignment
+        {
+            return (*this)->ParagraphAlignment;
+        }
+
+        inline void TextFormat::SetWordWrapping(WordWrapping const wordWrapping) const
+        {
+            (*this)->WordWrapping = wordWrapping;
+            (*this)->FormatChanged(false);
+        }
+
+        inline auto TextFormat::GetWordWrapping() const -> WordWrapping
+        {
+            return (*this)->WordWrapping;
+        }
+
+        inline void TextFormat::SetReadingDirection(ReadingDirection const readingDirection) const
+        {
+            (*this)->ReadingDirection = readingDirection;
+            (*this)->FormatChanged(false);
+        }
+
+        inline auto TextFormat::GetReadingDirection() const -> ReadingDirection
+        {
+            return (*this)->ReadingDirection;
+        }
+
+        inline void TextFormat::SetIncrementalTabStop(float const incrementalTabStop) const
+        {
+            if (0.0f >= incrementalTabStop)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            (*this)->IncrementalTabStop = incrementalTabStop;
+            (*this)->FormatChanged(true);
+        }
+
+        inline auto TextFormat::GetIncrementalTabStop() const -> float
+        {
+            return (*this)->IncrementalTabStop;
+        }
+
+        inline void TextFormat::SetLineSpacing(LineSpacingMethod const lineSpacingMethod,
+                                               float const lineSpacing,
+                                               float const baseline) const
+        {
+            if (LineSpacingMethod::Uniform == lineSpacingMethod && !(0.0f < lineSpacing && 0.0f <= baseline))
+            {
+                HR(E_INVALIDARG);
+            }
+
+            (*this)->LineSpacing = lineSpacingMethod;
+            (*this)->LineHeight = lineSpacing;
+            (*this)->LineBaseline = baseline;
+            (*this)->FormatChanged(false);
+        }
+
+        inline void TextFormat::GetLineSpacing(LineSpacingMethod & lineSpacingMethod,
+                                               float & lineSpacing,
+                                               float & baseline) const
+        {
+            lineSpacingMethod = (*this)->LineSpacing;
+            lineSpacing = (*this)->LineHeight;
+            baseline = (*this)->LineBaseline;
+        }
+
+        // Layouts keep the text and the format as they were when created, and cache the
+        // results of each stage of layout until something it depends on changes.
+        struct TextLayout : TextFormat
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(TextLayout, TextFormat, Details::TextLayoutImpl)
+
+            using TextFormat::GetFontSize;
+
+            void SetMaxWidth(float maxWidth) const;
+            auto GetMaxWidth() const -> float;
+
+            void SetMaxHeight(float maxHeight) const;
+            auto GetMaxHeight() const -> float;
+
+            void SetFontSize(float fontSize,
+                             TextRange const & textRange) const;
+
+            auto GetFontSize(unsigned currentPosition) const -> float;
+
+            void SetTypography(Typography const & typography,
+                               TextRange const & textRange) const;
+
+            auto GetTypography(unsigned currentPosition) const -> Typography;
+
+            auto GetMetrics() const -> TextMetrics;
+
+            // These return the number of lines or clusters, filling in as many as there is
+            // room for, so a null buffer finds the count.
+            auto GetLineMetrics(LineMetrics * lineMetrics,
+                                unsigned maxLineCount) const -> unsigned;
+
+            auto GetClusterMetrics(ClusterMetrics * clusterMetrics,
+                                   unsigned maxClusterCount) const -> unsigned;
+
+            // The width of the widest run of text that can't be wrapped.
+            auto DetermineMinWidth() const -> float;
+
+            // Hit testing uses the lines and clusters as they were last laid out, finding
+            // them with binary searches, so it may be done on every move of the mouse.
+            auto HitTestPoint(float pointX,
+                              float pointY,
+                              bool & isTrailingHit,
+                              bool & isInside) const -> HitTestMetrics;
+
+            auto HitTestTextPosition(unsigned textPosition,
+                                     bool isTrailingHit,
+                                     float & pointX,
+                                     float & pointY) const -> HitTestMetrics;
+
+            // Returns the number of rectangles covering the range, one for each line, and
+            // fills in as many as there is room for.
+            auto HitTestTextRange(unsigned textPosition,
+                                  unsigned textLength,
+                                  float originX,
+                                  float originY,
+                                  HitTestMetrics * hitTestMetrics,
+                                  unsigned maxHitTestMetricsCount) const -> unsigned;
+
+            template <unsigned Count>
+            auto HitTestTextRange(unsigned textPosition,
+                                  unsigned textLength,
+                                  float originX,
+                                  float originY,
+                                  HitTestMetrics (&hitTestMetrics)[Count]) const -> unsigned
+            {
+                return HitTestTextRange(textPosition,
+                                        textLength,
+                                        originX,
+                                        originY,
+                                        hitTestMetrics,
+                                        Count);
+            }
+        };
+
+        inline void TextLayout::SetMaxWidth(float const maxWidth) const
+        {
+            if (0.0f > maxWidth)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            (*this)->SetMaxWidth(maxWidth);
+        }
+
+        inline auto TextLayout::GetMaxWidth() const -> float
+        {
+            return (*this)->MaxWidth;
+        }
+
+        inline void TextLayout::SetMaxHeight(float const maxHeight) const
+        {
+            if (0.0f > maxHeight)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            (*this)->MaxHeight = maxHeight;
+        }
+
+        inline auto TextLayout::GetMaxHeight() const -> float
+        {
+            return (*this)->MaxHeight;
+        }
+
+        inline void TextLayout::SetFontSize(float const fontSize,
+                                            TextRange const & textRange) const
+        {
+            if (!(0.0f < fontSize))
+            {
+                HR(E_INVALIDARG);
+            }
+
+            (*this)->ChangeRuns(textRange.StartPosition, (*this)->GetRangeEnd(textRange), [&] (Details::TextLayoutImpl::FormatRun & run)
+            {
+                run.Size = fontSize;
+            });
+        }
+
+        inline auto TextLayout::GetFontSize(unsigned const currentPosition) const -> float
+        {
+            return (*this)->GetFontSize(currentPosition);
+        }
+
+        inline void TextLayout::SetTypography(Typography const & typography,
+                                              TextRange const & textRange) const
+        {
+            (*this)->ChangeRuns(textRange.StartPosition, (*this)->GetRangeEnd(textRange), [&] (Details::TextLayoutImpl::FormatRun & run)
+            {
+                run.Typography = typography.Share();
+            });
+        }
+
+        inline auto TextLayout::GetTypography(unsigned const currentPosition) const -> Typography
+        {
+            return Typography((*this)->Runs[(*this)->FindRun(currentPosition)].Typography);
+        }
+
+        inline auto TextLayout::GetMetrics() const -> TextMetrics
+        {
+            return (*this)->GetMetrics();
+        }
+
+        inline auto TextLayout::GetLineMetrics(LineMetrics * lineMetrics,
+                                               unsigned const maxLineCount) const -> unsigned
+        {
+            auto & layout = *Get();
+            layout.Update();
+            auto const count = static_cast<unsigned>(layout.Lines.size());
+
+            for (unsigned i = 0; i != (std::min)(count, maxLineCount); ++i)
+            {
+                auto const & line = layout.Lines[i];
+
+                lineMetrics[i] = LineMetrics(line.Length,
+                                             line.TrailingWhitespaceLength,
+                                             line.NewlineLength,
+                                             line.Height,
+                                             line.Baseline);
+            }
+
+            return count;
+        }
+
+        inline auto TextLayout::GetClusterMetrics(ClusterMetrics * clusterMetrics,
+                                                  unsigned const maxClusterCount) const -> unsigned
+        {
+            auto & layout = *Get();
+            layout.Update();
+            auto const count = layout.GetClusterCount();
+
+            for (unsigned i = 0; i != (std::min)(count, maxClusterCount); ++i)
+            {
+                auto const flags = layout.Flags[i];
+                auto const length = layout.ClusterPositions[i + 1] - layout.ClusterPositions[i];
+
+                clusterMetrics[i] = ClusterMetrics(layout.GetWidth(i, i + 1),
+                                                   static_cast<unsigned short>(length),
+                                                   0 != (flags & Details::TextLayoutImpl::CanWrapAfter),
+                                                   0 != (flags & Details::TextLayoutImpl::Whitespace),
+                                                   0 != (flags & Details::TextLayoutImpl::Newline),
+                                                   0 != (flags & Details::TextLayoutImpl::SoftHyphen));
+            }
+
+            return count;
+        }
+
+        inline auto TextLayout::DetermineMinWidth() const -> float
+        {
+            auto & layout = *Get();
+            layout.Update();
+            auto const count = layout.GetClusterCount();
+            auto width = 0.0f;
+            unsigned first = 0;
+
+            for (unsigned c = 0; c != count; ++c)
+            {
+                if (layout.Flags[c] & Details::TextLayoutImpl::CanWrapAfter)
+                {
+                    auto end = c + 1;
+
+                    while (end != first && (layout.Flags[end - 1] & Details::TextLayoutImpl::Whitespace))
+                    {
+                        --end;
+                    }
+
+                    width = (std::max)(width, layout.GetWidth(first, end));
+                    first = c + 1;
+                }
+            }
+
+            return width;
+        }
+
+        // Points past the end of a line that ends a paragraph hit before its newline, and
+        // those past the end of a wrapped line hit the trailing side of its last cluster.
+        inline auto TextLayout::HitTestPoint(float const pointX,
+                                             float const pointY,
+                                             bool & isTrailingHit,
+                                             bool & isInside) const -> HitTestMetrics
+        {
+            auto & layout = *Get();
+            layout.Update();
+
+            auto const top = layout.GetTop();
+            auto const & line = layout.FindLineAt(pointY - top);
+            isInside = pointY >= top + layout.Lines.front().Top && pointY < top + line.Top + line.Height;
+            isTrailingHit = false;
+
+            if (line.FirstCluster == line.LastCluster)
+            {
+                isInside = false;
+                return layout.GetHitTestMetrics(line, line.FirstCluster, line.LastCluster);
+            }
+
+            auto cluster = layout.FindClusterAt(line, pointX);
+
+            if (pointX < layout.GetClusterLeft(line, line.FirstCluster))
+            {
+                isInside = false;
+            }
+            else if (cluster == line.LastCluster)
+            {
+                isInside = false;
+                --cluster;
+                isTrailingHit = 0 == line.NewlineLength;
+            }
+            else
+            {
+                auto const left = layout.GetClusterLeft(line, cluster);
+                auto const right = layout.GetClusterLeft(line, cluster + 1);
+                isTrailingHit = pointX >= (left + right) / 2.0f;
+            }
+
+            return layout.GetHitTestMetrics(line, cluster, cluster + 1);
+        }
+
+        // The end of the text is a position of its own, with no width.
+        inline auto TextLayout::HitTestTextPosition(unsigned const textPosition,
+                                                    bool const isTrailingHit,
+                                                    float & pointX,
+                                                    float & pointY) const -> HitTestMetrics
+        {
+            auto & layout = *Get();
+            layout.Update();
+
+            auto const cluster = textPosition < layout.GetLength() ? layout.FindCluster(textPosition) : layout.GetClusterCount();
+            auto const & line = layout.FindLineOfCluster(cluster);
+            auto const last = (std::min)(cluster + 1, line.LastCluster);
+            auto const metrics = layout.GetHitTestMetrics(line, (std::min)(cluster, last), last);
+
+            pointX = metrics.Left + (isTrailingHit ? metrics.Width : 0.0f);
+            pointY = metrics.Top;
+            return metrics;
+        }
+
+        inline auto TextLayout::HitTestTextRange(unsigned const textPosition,
+                                                 unsigned const textLength,
+                                                 float const originX,
+                                                 float const originY,
+                                                 HitTestMetrics * hitTestMetrics,
+                                                 unsigned const maxHitTestMetricsCount) const -> unsigned
+        {
+            auto & layout = *Get();
+            layout.Update();
+
+            auto const length = layout.GetLength();
+            auto const first = textPosition < length ? layout.FindCluster(textPosition) : layout.GetClusterCount();
+            auto const end = textPosition < length && textLength < length - textPosition ? textPosition + textLength : length;
+            auto const last = 0 == textLength ? first : end > layout.ClusterPositions[first] ? layout.FindCluster(end - 1) + 1 : first;
+
+            auto line = &layout.FindLineOfCluster(first);
+            unsigned count = 0;
+
+            for (;;)
+            {
+                if (count < maxHitTestMetricsCount)
+                {
+                    auto & metrics = hitTestMetrics[count];
+                    metrics = layout.GetHitTestMetrics(*line, (std::max)(first, line->FirstCluster), (std::min)(last, line->LastCluster));
+                    metrics.Left += originX;
+                    metrics.Top += originY;
+                }
+
+                ++count;
+
+                if (line->LastCluster >= last || &layout.Lines.back() == line)
+                {
+                    break;
+                }
+
+                ++line;
+            }
+
+            return count;
+        }
+
+        inline auto CreateTextFormat(FontFace const & fontFace,
+                                     float const fontSize,
+                                     wchar_t const * localeName = L"en-us") -> TextFormat
+        {
+            if (!fontFace || !(0.0f < fontSize) || !localeName)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            return TextFormat(Details::Make<Details::TextFormatImpl>(fontFace.Share(), fontSize, localeName));
+        }
+
+        inline auto CreateTextLayout(wchar_t const * string,
+                                     unsigned const length,
+                                     TextFormat const & textFormat,
+                                     float const maxWidth,
+                                     float const maxHeight) -> TextLayout
+        {
+            if (!textFormat || (!string && 0 != length) || 0.0f > maxWidth || 0.0f > maxHeight)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            return TextLayout(Details::Make<Details::TextLayoutImpl>(string, length, *textFormat.Get(), maxWidth, maxHeight));
+        }
+
+        // Finds where text set on one line is cut to fit a width, such as in the cells of a
+        // table, without laying it out or shaping past the cut. Text that fits is measured
+        // whole, with trailing whitespace hanging. Otherwise the length and width are of the
+        // clusters that fit along with the trimming sign, such as an ellipsis measured with
+        // this same function, and exclude whitespace before the cut. Text after the first
+        // line break is always trimmed.
+        inline auto MeasureTrimmedText(wchar_t const * string,
+                                       unsigned const length,
+                                       TextFormat const & textFormat,
+                                       float const maxWidth,
+                                       float const trimmingSignWidth = 0.0f) -> TrimmedTextMetrics
+        {
+            if (!textFormat || (!string && 0 != length) || !(0.0f <= maxWidth) || !(0.0f <= trimmingSignWidth))
+            {
+                HR(E_INVALIDARG);
+            }
+
+            return Details::MeasureTrimmedText(*textFormat.Get(), string, length, maxWidth, trimmingSignWidth);
+        }
+
+        // Limits the memory the process-wide cache of shaped text holds on to.
+        inline void SetMaximumShapingCacheMemory(std::uint64_t const maximumInBytes)
+        {
+            Details::ShapingCache::GetInstance().SetLimit(maximumInBytes);
+        }
+
+        inline auto GetMaximumShapingCacheMemory() -> std::uint64_t
+        {
+            return Details::ShapingCache::GetInstance().GetLimit();
+        }
+
+        // The hit rate is the ratio of hits to lookups since the cache was last cleared.
+        inline auto GetShapingCacheStatistics() -> ShapingCacheStatistics
+        {
+            return Details::ShapingCache::GetInstance().GetStatistics();
+        }
+
+        inline void ClearShapingCache()
+        {
+            Details::ShapingCache::GetInstance().Clear();
+        }
+
+        enum class LayerOptions
+        {
+            None                     = 0,
+            InitializeFromBackground = 1,
+            IgnoreAlpha              = 2,
+        };
+
+        inline auto operator|(LayerOptions const left,
+                              LayerOptions const right) -> LayerOptions
+        {
+            return static_cast<LayerOptions>(static_cast<int>(left) | static_cast<int>(right));
+        }
+
+        inline auto operator&(LayerOptions const left,
+                              LayerOptions const right) -> LayerOptions
+        {
+            return static_cast<LayerOptions>(static_cast<int>(left) & static_cast<int>(right));
+        }
+
+        struct LayerParameters
+        {
+            explicit LayerParameters(RectF const & contentBounds           = RectF::Infinite(),
+                                     Geometry const & geometricMask        = Geometry(),
+                                     AntialiasMode const maskAntialiasMode = AntialiasMode::PerPrimitive,
+                                     Matrix3x2F const & maskTransform      = Matrix3x2F(),
+                                     float const opacity                   = 1.0f,
+                                     Brush const & opacityBrush            = Brush(),
+                                     LayerOptions const layerOptions       = LayerOptions::None) :
+                ContentBounds(contentBounds),
+                GeometricMask(geometricMask),
+                MaskAntialiasMode(maskAntialiasMode),
+                MaskTransform(maskTransform),
+                Opacity(opacity),
+                OpacityBrush(opacityBrush),
+                LayerOptions(layerOptions)
+            {}
+
+            RectF ContentBounds;
+            Geometry GeometricMask;
+            AntialiasMode MaskAntialiasMode;
+            Matrix3x2F MaskTransform;
+            float Opacity;
+            Brush OpacityBrush;
+            Cpu::LayerOptions LayerOptions;
+        };
+
+        namespace Details
+        {
+            struct LayerImpl : Resource
+            {
+                SizeF Size;
+
+                explicit LayerImpl(SizeF const & size) :
+                    Size(size)
+                {}
+            };
+
+        } // Details
+
+        // Layers keep no pixels of their own. The render target draws layer content
+        // into buffers from its pool, so a layer only records the requested size.
+        struct Layer : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Layer, Details::Object, Details::LayerImpl)
+
+            auto GetSize() const -> SizeF;
+        };
+
+        inline auto Layer::GetSize() const -> SizeF
+        {
+            return (*this)->Size;
+        }
+
+        // Text rendering parameters are part of the state, as they are of a Direct2D
+        // drawing state block. Empty parameters mean the settings of CreateRenderingParams.
+        struct DrawingStateDescription
+        {
+            explicit DrawingStateDescription(Cpu::AntialiasMode const antialiasMode         = Cpu::AntialiasMode::PerPrimitive,
+                                             Cpu::TextAntialiasMode const textAntialiasMode = Cpu::TextAntialiasMode::Default,
+                                             std::uint64_t const tag1                       = 0,
+                                             std::uint64_t const tag2                       = 0,
+                                             Matrix3x2F const & transform                   = Matrix3x2F(),
+                                             RenderingParams const & textRenderingParams    = RenderingParams()) :
+                AntialiasMode(antialiasMode),
+                TextAntialiasMode(textAntialiasMode),
+                Tag1(tag1),
+                Tag2(tag2),
+                Transform(transform),
+                TextRenderingParams(textRenderingParams)
+            {}
+
+            Cpu::AntialiasMode AntialiasMode;
+            Cpu::TextAntialiasMode TextAntialiasMode;
+            std::uint64_t Tag1;
+            std::uint64_t Tag2;
+            Matrix3x2F Transform;
+            RenderingParams TextRenderingParams;
+        };
+
+        namespace Details
+        {
+            inline auto IsSameState(DrawingStateDescription const & first,
+                                    DrawingStateDescription const & second) -> bool
+            {
+                return first.AntialiasMode == second.AntialiasMode &&
+                       first.TextAntialiasMode == second.TextAntialiasMode &&
+                       first.Tag1 == second.Tag1 &&
+                       first.Tag2 == second.Tag2 &&
+                       0 == memcmp(&first.Transform, &second.Transform, sizeof(first.Transform)) &&
+                       first.TextRenderingParams.Get() == second.TextRenderingParams.Get();
+            }
+
+            // Snapshots are never changed once made, so blocks and render targets share
+            // them freely and saving or restoring state only copies a pointer.
+            struct DrawingStateSnapshot : Resource
+            {
+                DrawingStateDescription const Description;
+
+                explicit DrawingStateSnapshot(DrawingStateDescription const & description) :
+                    Description(description)
+                {}
+            };
+
+            struct DrawingStateBlockImpl : Resource
+            {
+                Pointer<DrawingStateSnapshot> State;
+
+                explicit DrawingStateBlockImpl(DrawingStateDescription const & description) :
+                    State(Make<DrawingStateSnapshot>(description))
+                {}
+            };
+
+        } // Details
+
+        struct DrawingStateBlock : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(DrawingStateBlock, Details::Object, Details::DrawingStateBlockImpl)
+
+            void GetDescription(DrawingStateDescription & description) const;
+            void SetDescription(DrawingStateDescription const & description) const;
+        };
+
+        inline void DrawingStateBlock::GetDescription(DrawingStateDescription & description) const
+        {
+            description = (*this)->State->Description;
+        }
+
+        inline void DrawingStateBlock::SetDescription(DrawingStateDescription const & description) const
+        {
+            (*this)->State = Details::Make<Details::DrawingStateSnapshot>(description);
+        }
+
+        inline auto CreateDrawingStateBlock(DrawingStateDescription const & description = DrawingStateDescription()) -> DrawingStateBlock
+        {
+            return DrawingStateBlock(Details::Make<Details::DrawingStateBlockImpl>(description));
+        }
+
+        namespace Details
+        {
+            // Device pixels, with the right and bottom edges excluded.
+            struct PixelRect
+            {
+                int Left;
+                int Top;
+                int Right;
+                int Bottom;
+
+                auto IsEmpty() const -> bool
+                {
+                    return Left >= Right || Top >= Bottom;
+                }
+            };
+
+            inline auto Intersect(PixelRect const & first,
+                                  PixelRect const & second) -> PixelRect
+            {
+                PixelRect const result =
+                {
+                    (std::max)(first.Left, second.Left),
+                    (std::max)(first.Top, second.Top),
+                    (std::min)(first.Right, second.Right),
+                    (std::min)(first.Bottom, second.Bottom),
+                };
+
+                return result;
+            }
+
+            inline auto ToPixel(float const value) -> int
+            {
+                return static_cast<int>((std::min)((std::max)(value, -1073741824.0f), 1073741824.0f));
+            }
+
+            inline auto TransformBounds(RectF const & rect,
+                                        Matrix3x2F const & transform) -> RectF
+            {
+                Point2F const corners[] =
+                {
+                    transform.TransformPoint(Point2F(rect.Left, rect.Top)),
+                    transform.TransformPoint(Point2F(rect.Right, rect.Top)),
+                    transform.TransformPoint(Point2F(rect.Left, rect.Bottom)),
+                    transform.TransformPoint(Point2F(rect.Right, rect.Bottom)),
+                };
+
+                RectF result(corners[0].X, corners[0].Y, corners[0].X, corners[0].Y);
+
+                for (auto const & corner : corners)
+                {
+                    result.Left = (std::min)(result.Left, corner.X);
+                    result.Top = (std::min)(result.Top, corner.Y);
+                    result.Right = (std::max)(result.Right, corner.X);
+                    result.Bottom = (std::max)(result.Bottom, corner.Y);
+                }
+
+                return result;
+            }
+
+            // Returns the pixels whose centers may fall inside the transformed rectangle.
+            inline auto GetPixelBounds(RectF const & rect,
+                                       Matrix3x2F const & transform) -> PixelRect
+            {
+                auto const bounds = TransformBounds(rect, transform);
+
+                PixelRect const result =
+                {
+                    ToPixel(std::floor(bounds.Left + 0.5f)),
+                    ToPixel(std::floor(bounds.Top + 0.5f)),
+                    ToPixel(std::floor(bounds.Right + 0.5f)),
+                    ToPixel(std::floor(bounds.Bottom + 0.5f)),
+                };
+
+                return result;
+            }
+
+            // Returns every pixel that a device rectangle touches.
+            inline auto GetOuterBounds(RectF const & rect) -> PixelRect
+            {
+                PixelRect const result =
+                {
+                    ToPixel(std::floor(rect.Left)),
+                    ToPixel(std::floor(rect.Top)),
+                    ToPixel(std::ceil(rect.Right)),
+                    ToPixel(std::ceil(rect.Bottom)),
+                };
+
+                return result;
+            }
+
+            inline auto GetOuterBounds(RectF const & rect,
+                                       Matrix3x2F const & transform) -> PixelRect
+            {
+                return GetOuterBounds(TransformBounds(rect, transform));
+            }
+
+            // Narrows the bounds to a rectangle that covers whole pixels, as it does when
+            // it lands on pixel edges or is not antialiased.
+            inline auto GetRectangleClip(RectF const & rect,
+                                         Matrix3x2F const & transform,
+                                         bool const aliased,
+                                         PixelRect & bounds) -> bool
+            {
+                if (!transform.IsAxisAligned())
+                {
+                    return false;
+                }
+
+                auto const device = TransformBounds(rect, transform);
+
+                if (!aliased &&
+                    (std::floor(device.Left) != device.Left || std::floor(device.Top) != device.Top ||
+                     std::floor(device.Right) != device.Right || std::floor(device.Bottom) != device.Bottom))
+                {
+                    return false;
+                }
+
+                bounds = Intersect(bounds, GetPixelBounds(device, Matrix3x2F()));
+                return true;
+            }
+
+            // The clip is a rectangle in device space. Outer holds every pixel it touches
+            // and Inner the pixels it covers entirely, so only the pixels between the two
+            // need fractional coverage.
+            struct ClipState
+            {
+                RectF Bounds;
+                PixelRect Outer;
+                PixelRect Inner;
+
+                auto HasEdges() const -> bool
+                {
+                    return Outer.Left != Inner.Left || Outer.Top != Inner.Top ||
+                           Outer.Right != Inner.Right || Outer.Bottom != Inner.Bottom;
+                }
+            };
+
+            inline auto GetClipState(RectF const & bounds) -> ClipState
+            {
+                ClipState result;
+                result.Bounds = bounds;
+                result.Outer = GetOuterBounds(bounds);
+                result.Inner.Left = ToPixel(std::ceil(bounds.Left));
+                result.Inner.Top = ToPixel(std::ceil(bounds.Top));
+                result.Inner.Right = ToPixel(std::floor(bounds.Right));
+                result.Inner.Bottom = ToPixel(std::floor(bounds.Bottom));
+                return result;
+            }
+
+            inline auto GetClipState(PixelRect const & pixels) -> ClipState
+            {
+                ClipState result;
+                result.Bounds = RectF(static_cast<float>(pixels.Left),
+                                      static_cast<float>(pixels.Top),
+                                      static_cast<float>(pixels.Right),
+                                      static_cast<float>(pixels.Bottom));
+                result.Outer = pixels;
+                result.Inner = pixels;
+                return result;
+            }
+
+            inline auto Intersect(ClipState const & clip,
+                                  RectF const & rect) -> ClipState
+            {
+                return GetClipState(RectF((std::max)(clip.Bounds.Left, rect.Left),
+                                          (std::max)(clip.Bounds.Top, rect.Top),
+                                          (std::min)(clip.Bounds.Right, rect.Right),
+                                          (std::min)(clip.Bounds.Bottom, rect.Bottom)));
+            }
+
+            // Returns how much of a pixel lies between two edges.
+            inline auto GetOverlap(float const low,
+                                   float const high,
+                                   int const pixel) -> float
+            {
+                return (std::max)(0.0f, (std::min)(high, pixel + 1.0f) - (std::max)(low, static_cast<float>(pixel)));
+            }
+
+            // Maps device coordinates into a source rectangle drawn into a destination
+            // rectangle under the world transform.
+            inline auto GetSourceMapping(Matrix3x2F const & transform,
+                                         RectF const & destination,
+                                         RectF const & source,
+                                         Matrix3x2F & mapping) -> bool
+            {
+                if (0.0f == destination.Width() || 0.0f == destination.Height())
+                {
+                    return false;
+                }
+
+                mapping = transform;
+
+                if (!mapping.Invert())
+                {
+                    return false;
+                }
+
+                auto const scaleX = source.Width() / destination.Width();
+                auto const scaleY = source.Height() / destination.Height();
+
+                mapping = mapping * Matrix3x2F(scaleX,
+                                               0.0f,
+                                               0.0f,
+                                               scaleY,
+                                               source.Left - destination.Left * scaleX,
+                                               source.Top - destination.Top * scaleY);
+
+                return true;
+            }
+
+            // Finds the integral device offset when a source rectangle lands on whole
+            // device pixels without scaling or rotation.
+            inline auto IsPixelAligned(Matrix3x2F const & transform,
+                                       RectF const & destination,
+                                       RectF const & source,
+                                       int & offsetX,
+                                       int & offsetY) -> bool
+            {
+                if (1.0f != transform._11 || 1.0f != transform._22 || !transform.IsAxisAligned() ||
+                    destination.Width() != source.Width() || destination.Height() != source.Height())
+                {
+                    return false;
+                }
+
+                auto const left = destination.Left + transform._31;
+                auto const top = destination.Top + transform._32;
+                auto const x = left - source.Left;
+                auto const y = top - source.Top;
+
+                if (std::floor(left) != left || std::floor(top) != top ||
+                    std::floor(x) != x || std::floor(y) != y ||
+                    std::floor(source.Left) != source.Left || std::floor(source.Top) != source.Top)
+                {
+                    return false;
+                }
+
+                offsetX = ToPixel(x);
+                offsetY = ToPixel(y);
+                return true;
+            }
+
+            // Opacity masks use the alpha channel, or the only channel of an A8 bitmap.
+            inline auto GetCoverageLayout(Dxgi::Format const format,
+                                          unsigned & stride,
+                                          unsigned & offset) -> bool
+            {
+                switch (format)
+                {
+                case Dxgi::Format::A8_UNORM:
+                    stride = 1;
+                    offset = 0;
+                    return true;
+
+                case Dxgi::Format::B8G8R8A8_UNORM:
+                case Dxgi::Format::B8G8R8A8_UNORM_SRGB:
+                case Dxgi::Format::R8G8B8A8_UNORM:
+                case Dxgi::Format::R8G8B8A8_UNORM_SRGB:
+                    stride = 4;
+                    offset = 3;
+                    return true;
+
+                default:
+                    return false;
+                }
+            }
+
+            // Produces coverage for device pixels whose centers map inside the source
+            // rectangle, either from a mask or as a constant for drawing bitmaps.
+            struct CoverageSampler
+            {
+                std::uint8_t const * Bits;
+                unsigned Pitch;
+                unsigned Stride;
+                Matrix3x2F Mapping;
+                RectF Source;
+                int Left;
+                int Top;
+                int Right;
+                int Bottom;
+                unsigned Scale;
+
+                auto Fetch(int const x,
+                           int const y) const -> unsigned
+                {
+                    return Bits[static_cast<size_t>((std::min)((std::max)(y, Top), Bottom - 1)) * Pitch +
+                                static_cast<size_t>((std::min)((std::max)(x, Left), Right - 1)) * Stride];
+                }
+
+                void Sample(int const x,
+                            int const y,
+                            unsigned const count,
+                            std::uint8_t * output) const
+                {
+                    auto const rowU = (y + 0.5f) * Mapping._21 + Mapping._31;
+                    auto const rowV = (y + 0.5f) * Mapping._22 + Mapping._32;
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const column = static_cast<float>(x + static_cast<int>(i)) + 0.5f;
+                        auto const u = column * Mapping._11 + rowU;
+                        auto const v = column * Mapping._12 + rowV;
+
+                        if (u < Source.Left || u >= Source.Right || v < Source.Top || v >= Source.Bottom)
+                        {
+                            output[i] = 0;
+                            continue;
+                        }
+
+                        if (!Bits)
+                        {
+                            output[i] = static_cast<std::uint8_t>(Scale);
+                            continue;
+                        }
+
+                        auto const su = u - 0.5f;
+                        auto const sv = v - 0.5f;
+                        auto const left = static_cast<int>(std::floor(su));
+                        auto const top = static_cast<int>(std::floor(sv));
+                        auto const fx = static_cast<unsigned>((su - left) * 256.0f);
+                        auto const fy = static_cast<unsigned>((sv - top) * 256.0f);
+
+                        auto const upper = Fetch(left, top) * (256 - fx) + Fetch(left + 1, top) * fx;
+                        auto const lower = Fetch(left, top + 1) * (256 - fx) + Fetch(left + 1, top + 1) * fx;
+                        auto const value = (upper * (256 - fy) + lower * fy + 32768) >> 16;
+                        output[i] = static_cast<std::uint8_t>(255 == Scale ? value : Divide255(value * Scale));
+                    }
+                }
+
+                static auto Divide255(unsigned const value) -> unsigned
+                {
+                    return (value + 128 + ((value + 128) >> 8)) >> 8;
+                }
+            };
+
+            inline auto GetOpacityScale(float const opacity) -> unsigned
+            {
+                return static_cast<unsigned>((std::min)((std::max)(opacity, 0.0f), 1.0f) * 255.0f + 0.5f);
+            }
+
+            // Accumulates the signed area that edges cover in each cell, so a running sum
+            // along a row yields exact antialiased coverage without sorting edges.
+            class Rasterizer
+            {
+                PixelRect m_bounds;
+                unsigned m_stride;
+                std::vector<float> m_cells;
+
+                void AddClippedLine(float x0,
+                                    float y0,
+                                    float x1,
+                                    float y1)
+                {
+                    auto const width = static_cast<float>(m_bounds.Right - m_bounds.Left);
+                    x0 = (std::min)((std::max)(x0, 0.0f), width);
+                    x1 = (std::min)((std::max)(x1, 0.0f), width);
+
+                    if (y0 == y1)
+                    {
+                        return;
+                    }
+
+                    auto direction = 1.0f;
+
+                    if (y0 > y1)
+                    {
+                        std::swap(x0, x1);
+                        std::swap(y0, y1);
+                        direction = -1.0f;
+                    }
+
+                    auto const height = m_bounds.Bottom - m_bounds.Top;
+                    auto const slope = (x1 - x0) / (y1 - y0);
+                    auto x = x0;
+
+                    if (y0 < 0.0f)
+                    {
+                        x -= y0 * slope;
+                    }
+
+                    auto const last = (std::min)(height, static_cast<int>(std::ceil(y1)));
+
+                    for (auto y = (std::max)(0, static_cast<int>(y0)); y < last; ++y)
+                    {
+                        auto const cells = m_cells.data() + static_cast<size_t>(y) * m_stride;
+                        auto const dy = (std::min)(static_cast<float>(y + 1), y1) - (std::max)(static_cast<float>(y), y0);
+                        auto const next = (std::min)((std::max)(x + slope * dy, 0.0f), width);
+                        auto const d = dy * direction;
+                        auto const left = (std::min)(x, next);
+                        auto const right = (std::max)(x, next);
+                        auto const leftFloor = std::floor(left);
+                        auto const leftIndex = static_cast<int>(leftFloor);
+                        auto const rightCeil = std::ceil(right);
+                        auto const rightIndex = static_cast<int>(rightCeil);
+
+                        if (rightIndex <= leftIndex + 1)
+                        {
+                            auto const middle = 0.5f * (x + next) - leftFloor;
+                            cells[leftIndex] += d - d * middle;
+                            cells[leftIndex + 1] += d * middle;
+                        }
+                        else
+                        {
+                            auto const scale = 1.0f / (right - left);
+                            auto const leftFraction = left - leftFloor;
+                            auto const first = 0.5f * scale * (1.0f - leftFraction) * (1.0f - leftFraction);
+                            auto const rightFraction = right - rightCeil + 1.0f;
+                            auto const end = 0.5f * scale * rightFraction * rightFraction;
+
+                            cells[leftIndex] += d * first;
+
+                            if (rightIndex == leftIndex + 2)
+                            {
+                                cells[leftIndex + 1] += d * (1.0f - first - end);
+                            }
+                            else
+                            {
+                                auto const second = scale * (1.5f - leftFraction);
+                                cells[leftIndex + 1] += d * (second - first);
+
+                                for (auto i = leftIndex + 2; i < rightIndex - 1; ++i)
+                                {
+                                    cells[i] += d * scale;
+                                }
+
+                                auto const before = second + (rightIndex - leftIndex - 3) * scale;
+                                cells[rightIndex - 1] += d * (1.0f - before - end);
+                            }
+
+                            cells[rightIndex] += d * end;
+                        }
+
+                        x = next;
+                    }
+                }
+
+            public:
+
+                Rasterizer() :
+                    m_stride(0)
+                {
+                    m_bounds.Left = m_bounds.Top = m_bounds.Right = m_bounds.Bottom = 0;
+                }
+
+                // The cells are kept between uses, and reading coverage clears them again.
+                void Reset(PixelRect const & bounds)
+                {
+                    m_bounds = bounds;
+                    m_stride = static_cast<unsigned>(bounds.Right - bounds.Left) + 2;
+                    auto const size = static_cast<size_t>(m_stride) * static_cast<unsigned>(bounds.Bottom - bounds.Top);
+
+                    if (m_cells.size() < size)
+                    {
+                        m_cells.resize(size);
+                    }
+                }
+
+                // Lines crossing the left or right edge are split there so the area outside
+                // still contributes to the running sum.
+                void AddLine(Point2F const & from,
+                             Point2F const & to)
+                {
+                    auto x0 = from.X - m_bounds.Left;
+                    auto y0 = from.Y - m_bounds.Top;
+                    auto const x1 = to.X - m_bounds.Left;
+                    auto const y1 = to.Y - m_bounds.Top;
+                    auto const height = static_cast<float>(m_bounds.Bottom - m_bounds.Top);
+
+                    if (y0 == y1 || (y0 <= 0.0f && y1 <= 0.0f) || (y0 >= height && y1 >= height))
+                    {
+                        return;
+                    }
+
+                    float const edges[] = { 0.0f, static_cast<float>(m_bounds.Right - m_bounds.Left) };
+
+                    for (unsigned i = 0; i != 2; ++i)
+                    {
+                        auto const edge = edges[x0 < x1 ? i : 1 - i];
+
+                        if ((x0 < edge) != (x1 < edge))
+                        {
+                            auto const y = y0 + (edge - x0) / (x1 - x0) * (y1 - y0);
+                            AddClippedLine(x0, y0, edge, y);
+                            x0 = edge;
+                            y0 = y;
+                        }
+                    }
+
+                    AddClippedLine(x0, y0, x1, y1);
+                }
+
+                void AddGeometry(GeometryImpl const & geometry,
+                                 Matrix3x2F const & transform)
+                {
+                    geometry.Flatten(transform, [&] (Point2F const & from, Point2F const & to)
+                    {
+                        AddLine(from, to);
+                    });
+                }
+
+                // Rows may be read concurrently, but each only once.
+                void GetCoverage(int const x,
+                                 int const y,
+                                 unsigned const count,
+                                 FillMode const mode,
+                                 bool const aliased,
+                                 std::uint8_t * output)
+                {
+                    auto const cells = m_cells.data() + static_cast<size_t>(y - m_bounds.Top) * m_stride;
+                    auto const begin = static_cast<unsigned>(x - m_bounds.Left);
+                    auto sum = 0.0f;
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        sum += cells[begin + i];
+                        cells[begin + i] = 0.0f;
+                        auto value = std::fabs(sum);
+
+                        if (FillMode::Alternate == mode)
+                        {
+                            value = std::fmod(value, 2.0f);
+                            if (value > 1.0f) value = 2.0f - value;
+                        }
+                        else
+                        {
+                            value = (std::min)(value, 1.0f);
+                        }
+
+                        output[i] = static_cast<std::uint8_t>(aliased ? (value >= 0.5f ? 255 : 0) : static_cast<int>(value * 255.0f + 0.5f));
+                    }
+
+                    if (begin + count + 2 == m_stride)
+                    {
+                        cells[begin + count] = 0.0f;
+                        cells[begin + count + 1] = 0.0f;
+                    }
+                    else
+                    {
+                        // The next span of the row picks up the running sum from here.
+                        cells[begin + count] += sum;
+                    }
+                }
+            };
+
+            // Sizes are rounded up to buckets growing by half at a time, so that buffers
+            // released by one frame are found again by the next.
+            inline auto GetBucketSize(unsigned const size) -> unsigned
+            {
+                unsigned bucket = 64;
+
+                while (bucket < size)
+                {
+                    bucket = bucket & (bucket - 1) ? bucket / 3 * 4 : bucket / 2 * 3;
+                }
+
+                return bucket;
+            }
+
+            // Hands out premultiplied pixel buffers for layers. Buffers left unused for a
+            // while are freed.
+            class SurfacePool
+            {
+                struct Entry
+                {
+                    unsigned Width;
+                    unsigned Height;
+                    unsigned LastUsed;
+                    bool Busy;
+                    std::unique_ptr<std::uint32_t[]> Pixels;
+                };
+
+                std::vector<Entry> m_entries;
+                unsigned m_frame;
+
+            public:
+
+                static unsigned const MaximumAge = 120;
+
+                SurfacePool() :
+                    m_frame(0)
+                {}
+
+                // Returns the index of a buffer at least as large as the size requested.
+                auto Acquire(unsigned const width,
+                             unsigned const height) -> unsigned
+                {
+                    auto const bucketWidth = GetBucketSize(width);
+                    auto const bucketHeight = GetBucketSize(height);
+
+                    for (unsigned i = 0; i != m_entries.size(); ++i)
+                    {
+                        auto & entry = m_entries[i];
+
+                        if (!entry.Busy && entry.Width == bucketWidth && entry.Height == bucketHeight)
+                        {
+                            entry.Busy = true;
+                            entry.LastUsed = m_frame;
+                            return i;
+                        }
+                    }
+
+                    Entry entry;
+                    entry.Width = bucketWidth;
+                    entry.Height = bucketHeight;
+                    entry.LastUsed = m_frame;
+                    entry.Busy = true;
+                    entry.Pixels.reset(new std::uint32_t[static_cast<size_t>(bucketWidth) * bucketHeight]);
+                    m_entries.push_back(std::move(entry));
+                    return static_cast<unsigned>(m_entries.size() - 1);
+                }
+
+                void Release(unsigned const index)
+                {
+                    m_entries[index].Busy = false;
+                }
+
+                auto GetPixels(unsigned const index) const -> std::uint32_t *
+                {
+                    return m_entries[index].Pixels.get();
+                }
+
+                auto GetPitch(unsigned const index) const -> unsigned
+                {
+                    return m_entries[index].Width * 4;
+                }
+
+                // Called once a frame, when no buffers are busy.
+                void Trim()
+                {
+                    ++m_frame;
+
+                    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&] (Entry const & entry)
+                    {
+                        return !entry.Busy && m_frame - entry.LastUsed > MaximumAge;
+                    }), m_entries.end());
+                }
+            };
+
+            // Keeps the pixels of compatible render targets after they are released, in
+            // the same buckets as layers and apart by format. A surface is free again once
+            // nothing but the pool holds it. Free surfaces are dropped when they haven't
+            // been used for a while, and oldest first when the pool is over its limit.
+            class CompatibleTargetPool : public Resource
+            {
+                struct Entry
+                {
+                    unsigned Width;
+                    unsigned Height;
+                    PixelFormat Format;
+                    unsigned LastUsed;
+                    Pointer<PooledPixels> Pixels;
+                };
+
+                std::vector<Entry> m_entries;
+                unsigned m_frame;
+                std::uint64_t m_limit;
+
+                static auto GetBytes(Entry const & entry) -> std::uint64_t
+                {
+                    return static_cast<std::uint64_t>(entry.Width) * 4 * entry.Height;
+                }
+
+                static auto IsFree(Entry const & entry) -> bool
+                {
+                    return entry.Pixels->IsFree();
+                }
+
+                void Shrink()
+                {
+                    auto size = GetSize();
+
+                    while (size > m_limit)
+                    {
+                        auto oldest = m_entries.end();
+
+                        for (auto entry = m_entries.begin(); entry != m_entries.end(); ++entry)
+                        {
+                            if (IsFree(*entry) && (m_entries.end() == oldest || entry->LastUsed < oldest->LastUsed))
+                            {
+                                oldest = entry;
+                            }
+                        }
+
+                        if (m_entries.end() == oldest)
+                        {
+                            break;
+                        }
+
+                        size -= GetBytes(*oldest);
+                        m_entries.erase(oldest);
+                    }
+                }
+
+            public:
+
+                static unsigned const MaximumAge = 120;
+
+                CompatibleTargetPool() :
+                    m_frame(0),
+                    m_limit(64 * 1024 * 1024)
+                {}
+
+                void SetLimit(std::uint64_t const limit)
+                {
+                    m_limit = limit;
+                    Shrink();
+                }
+
+                auto GetLimit() const -> std::uint64_t
+                {
+                    return m_limit;
+                }
+
+                // The memory held by the pool, whether free or in use.
+                auto GetSize() const -> std::uint64_t
+                {
+                    std::uint64_t result = 0;
+
+                    for (auto const & entry : m_entries)
+                    {
+                        result += GetBytes(entry);
+                    }
+
+                    return result;
+                }
+
+                // Pixels are left as the last target drew them, or uninitialized.
+                auto Acquire(unsigned const width,
+                             unsigned const height,
+                             PixelFormat const & format,
+                             unsigned & pitch) -> Pointer<PooledPixels>
+                {
+                    auto const bucketWidth = GetBucketSize(width);
+                    auto const bucketHeight = GetBucketSize(height);
+                    pitch = bucketWidth * 4;
+
+                    for (auto & entry : m_entries)
+                    {
+                        if (entry.Width == bucketWidth && entry.Height == bucketHeight &&
+                            entry.Format.Format == format.Format && entry.Format.AlphaMode == format.AlphaMode &&
+                            IsFree(entry))
+                        {
+                            entry.LastUsed = m_frame;
+                            return entry.Pixels;
+                        }
+                    }
+
+                    Entry entry;
+                    entry.Width = bucketWidth;
+                    entry.Height = bucketHeight;
+                    entry.Format = format;
+                    entry.LastUsed = m_frame;
+                    entry.Pixels = Make<PooledPixels>(static_cast<size_t>(pitch) * bucketHeight);
+                    auto const result = entry.Pixels;
+                    m_entries.push_back(std::move(entry));
+                    Shrink();
+                    return result;
+                }
+
+                void Trim()
+                {
+                    ++m_frame;
+
+                    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [&] (Entry const & entry)
+                    {
+                        return IsFree(entry) && m_frame - entry.LastUsed > MaximumAge;
+                    }), m_entries.end());
+
+                    Shrink();
+                }
+            };
+
+            // Keeps rasterized glyph coverage in pages of 8-bit pixels, so that text is
+            // drawn by copying coverage rather than rasterizing outlines again. Glyphs are
+            // packed into shelves of similar heights. Pages are evicted whole, least
+            // recently used first, once the cache is over its limit.
+            class GlyphCache
+            {
+            public:
+
+                static unsigned const PageSize = 512;
+                static unsigned const MaximumGlyphSize = 128;
+                static unsigned const SubpixelPositions = 4;
+                static unsigned const LuminanceLevels = 5;
+                static unsigned const MaximumLcdTunings = 64;
+
+                // Left and Top place the coverage relative to the pixel holding the origin
+                // of the glyph, and X is in bytes. Blank glyphs have no width and no page.
+                // LCD glyphs have four bytes of coverage for each pixel, laid out as the
+                // channels of a pixel are.
+                struct Glyph
+                {
+                    unsigned Page;
+                    unsigned X;
+                    unsigned Y;
+                    unsigned Width;
+                    unsigned Height;
+                    int Left;
+                    int Top;
+                };
+
+            private:
+
+                struct Key
+                {
+                    std::uint64_t Face;
+                    float Size;
+                    unsigned short Index;
+                    std::uint8_t Subpixel;
+                    bool Aliased;
+                    std::uint16_t Lcd;
+
+                    auto operator==(Key const & other) const -> bool
+                    {
+                        return Face == other.Face && Size == other.Size && Index == other.Index &&
+                               Subpixel == other.Subpixel && Aliased == other.Aliased && Lcd == other.Lcd;
+                    }
+                };
+
+                struct KeyHash
+                {
+                    auto operator()(Key const & key) const -> size_t
+                    {
+                        std::uint32_t size;
+                        memcpy(&size, &key.Size, sizeof(size));
+                        auto hash = key.Face * 0x9e3779b97f4a7c15ull;
+                        hash ^= (static_cast<std::uint64_t>(size) << 32 | static_cast<std::uint64_t>(key.Index) << 16 |
+                                 static_cast<std::uint64_t>(key.Lcd) << 4 | static_cast<std::uint64_t>(key.Subpixel) << 1 |
+                                 (key.Aliased ? 1u : 0u)) * 0xc2b2ae3d27d4eb4full;
+                        return static_cast<size_t>(hash ^ hash >> 29);
+                    }
+                };
+
+                struct Shelf
+                {
+                    unsigned Y;
+                    unsigned Height;
+                    unsigned Used;
+                };
+
+                struct Page
+                {
+                    std::unique_ptr<std::uint8_t[]> Pixels;
+                    std::vector<Shelf> Shelves;
+                    unsigned Bottom;
+                    std::uint64_t LastUsed;
+                    std::vector<Key> Keys;
+                };
+
+                // The settings of LCD glyphs and the tables that correct their coverage for
+                // text of each level of luminance, for gamma and enhanced contrast.
+                struct LcdTuning
+                {
+                    float Gamma;
+                    float EnhancedContrast;
+                    float ClearTypeLevel;
+                    PixelGeometry Geometry;
+                    std::uint8_t Tables[LuminanceLevels][256];
+                };
+
+                std::unordered_map<Key, Glyph, KeyHash> m_glyphs;
+                std::vector<Page> m_pages;
+                std::vector<LcdTuning> m_tunings;
+                std::vector<std::uint8_t> m_samples;
+                unsigned m_current;
+                std::uint64_t m_clock;
+                std::uint64_t m_limit;
+                Rasterizer m_rasterizer;
+                GeometryImpl m_outline;
+
+                static auto GetPageBytes() -> std::uint64_t
+                {
+                    return static_cast<std::uint64_t>(PageSize) * PageSize;
+                }
+
+                void Clear(Page & page)
+                {
+                    for (auto const & key : page.Keys)
+                    {
+                        m_glyphs.erase(key);
+                    }
+
+                    page.Keys.clear();
+                    page.Shelves.clear();
+                    page.Bottom = 0;
+                }
+
+                // Pages used since the last call to BeginLookup are left alone, since their
+                // pixels may still be read.
+                auto FindOldestPage() const -> unsigned
+                {
+                    auto result = static_cast<unsigned>(m_pages.size());
+
+                    for (unsigned i = 0; i != m_pages.size(); ++i)
+                    {
+                        auto const & page = m_pages[i];
+
+                        if (page.Pixels && page.LastUsed < m_clock &&
+                            (m_pages.size() == result || page.LastUsed < m_pages[result].LastUsed))
+                        {
+                            result = i;
+                        }
+                    }
+
+                    return result;
+                }
+
+                // Glyphs go on the shortest shelf they fit, unless that would waste more than
+                // half of it, in which case a new shelf is started if there is room.
+                static auto Allocate(Page & page,
+                                     unsigned const width,
+                                     unsigned const height,
+                                     unsigned & x,
+                                     unsigned & y) -> bool
+                {
+                    Shelf * best = nullptr;
+
+                    for (auto & shelf : page.Shelves)
+                    {
+                        if (shelf.Height >= height && PageSize - shelf.Used >= width &&
+                            (!best || shelf.Height < best->Height))
+                        {
+                            best = &shelf;
+                        }
+                    }
+
+                    auto const shelfHeight = (height + 3) & ~3u;
+
+                    if ((!best || best->Height > height * 2) && PageSize - page.Bottom >= shelfHeight)
+                    {
+                        Shelf const shelf = { page.Bottom, shelfHeight, 0 };
+                        page.Shelves.push_back(shelf);
+                        page.Bottom += shelfHeight;
+                        best = &page.Shelves.back();
+                    }
+
+                    if (!best)
+                    {
+                        return false;
+                    }
+
+                    x = best->Used;
+                    y = best->Y;
+                    best->Used += width;
+                    return true;
+                }
+
+                // Glyphs are added to the current page until it is full. The next page is a
+                // new one while the cache is within its limit, and otherwise the oldest page,
+                // emptied. When every page is in use, the cache grows beyond its limit.
+                auto NextPage() -> unsigned
+                {
+                    auto result = static_cast<unsigned>(m_pages.size());
+
+                    if (GetSize() + GetPageBytes() > m_limit)
+                    {
+                        result = FindOldestPage();
+                    }
+
+                    if (m_pages.size() != result)
+                    {
+                        Clear(m_pages[result]);
+                        return result;
+                    }
+
+                    for (unsigned i = 0; i != m_pages.size(); ++i)
+                    {
+                        if (!m_pages[i].Pixels)
+                        {
+                            result = i;
+                            break;
+                        }
+                    }
+
+                    if (m_pages.size() == result)
+                    {
+                        m_pages.push_back(Page());
+                    }
+
+                    auto & page = m_pages[result];
+                    page.Pixels.reset(new std::uint8_t[static_cast<size_t>(GetPageBytes())]);
+                    page.Bottom = 0;
+                    return result;
+                }
+
+                // For each level of luminance, the coverage is first raised by enhanced
+                // contrast and then moved toward what blending in linear light would give for
+                // text of that luminance over a background of the opposite one. As DirectWrite
+                // does, it only goes a quarter of the way, since the whole of it leaves dark
+                // text looking faint and light text looking bold.
+                static void MakeLcdTables(LcdTuning & tuning)
+                {
+                    auto const contrast = tuning.EnhancedContrast;
+
+                    for (unsigned level = 0; level != LuminanceLevels; ++level)
+                    {
+                        auto const foreground = static_cast<float>(level) / (LuminanceLevels - 1);
+                        auto const background = 1.0f - foreground;
+                        auto const linearForeground = std::pow(foreground, tuning.Gamma);
+                        auto const linearBackground = std::pow(background, tuning.Gamma);
+
+                        for (unsigned i = 0; i != 256; ++i)
+                        {
+                            auto coverage = i / 255.0f;
+                            coverage = coverage * (contrast + 1.0f) / (coverage * contrast + 1.0f);
+
+                            if (1.0f / 64.0f < std::fabs(foreground - background))
+                            {
+                                auto const linear = linearBackground + (linearForeground - linearBackground) * coverage;
+                                auto const corrected = (std::pow(linear, 1.0f / tuning.Gamma) - background) / (foreground - background);
+                                coverage += (corrected - coverage) * 0.25f;
+                            }
+
+                            tuning.Tables[level][i] = static_cast<std::uint8_t>((std::min)((std::max)(coverage, 0.0f), 1.0f) * 255.0f + 0.5f);
+                        }
+                    }
+                }
+
+                // LCD glyphs are sampled at three times the width of a pixel, and filtered,
+                // before each third becomes the coverage of one channel.
+                void RasterizeLcdGlyph(Key const & key,
+                                       PixelRect const & bounds,
+                                       Glyph const & glyph,
+                                       std::uint8_t * pixels)
+                {
+                    auto const & tuning = m_tunings[(key.Lcd - 1) / LuminanceLevels];
+                    auto const & table = tuning.Tables[(key.Lcd - 1) % LuminanceLevels];
+                    auto const level = static_cast<int>(tuning.ClearTypeLevel * 256.0f + 0.5f);
+                    auto const count = glyph.Width * 3;
+
+                    m_samples.assign(count * 2 + 4, 0);
+                    auto const samples = m_samples.data() + 2;
+                    auto const filtered = samples + count + 2;
+
+                    for (unsigned row = 0; row != glyph.Height; ++row)
+                    {
+                        m_rasterizer.GetCoverage(bounds.Left, bounds.Top + static_cast<int>(row), count, FillMode::Winding, false, samples);
+                        FilterLcdCoverage(samples, count, filtered);
+                        auto const target = pixels + static_cast<size_t>(glyph.Y + row) * PageSize + glyph.X;
+
+                        for (unsigned x = 0; x != glyph.Width; ++x)
+                        {
+                            int channels[3] = { filtered[x * 3], filtered[x * 3 + 1], filtered[x * 3 + 2] };
+                            auto const gray = (channels[0] + channels[1] + channels[2] + 1) / 3;
+
+                            for (auto & channel : channels)
+                            {
+                                channel = table[gray + (channel - gray) * level / 256];
+                            }
+
+                            if (PixelGeometry::BGR == tuning.Geometry)
+                            {
+                                std::swap(channels[0], channels[2]);
+                            }
+
+                            auto const alpha = (std::max)((std::max)(channels[0], channels[1]), channels[2]);
+                            auto const value = static_cast<std::uint32_t>(channels[2] | channels[1] << 8 | channels[0] << 16 | alpha << 24);
+                            memcpy(target + x * 4, &value, sizeof(value));
+                        }
+                    }
+                }
+
+                // Rasterizes a glyph onto a page, or returns false if it is too large.
+                auto Add(Key const & key,
+                         FontFaceImpl const & face,
+                         Glyph & glyph) -> bool
+                {
+                    auto const samples = key.Lcd ? 3.0f : 1.0f;
+                    auto const scale = key.Size / (std::max)(1.0f, static_cast<float>(face.Metrics.DesignUnitsPerEm));
+                    auto const offset = static_cast<float>(key.Subpixel) / SubpixelPositions;
+
+                    m_outline.Points.clear();
+                    m_outline.Verbs.clear();
+                    face.AddGlyphOutline(key.Index, Matrix3x2F(scale * samples, 0.0f, 0.0f, scale, offset * samples, 0.0f), m_outline);
+
+                    auto bounds = GetOuterBounds(m_outline.GetBounds(Matrix3x2F()));
+                    glyph.Page = 0;
+                    glyph.X = 0;
+                    glyph.Y = 0;
+                    glyph.Width = 0;
+                    glyph.Height = 0;
+                    glyph.Left = 0;
+                    glyph.Top = 0;
+
+                    if (bounds.IsEmpty())
+                    {
+                        // Blank glyphs are forgotten along with the current page.
+                        if (!m_pages.empty() && m_pages[m_current].Pixels)
+                        {
+                            m_pages[m_current].Keys.push_back(key);
+                        }
+
+                        return true;
+                    }
+
+                    glyph.Left = bounds.Left;
+                    glyph.Top = bounds.Top;
+
+                    if (key.Lcd)
+                    {
+                        // The filter reaches two samples either side of the outline.
+                        auto const pixel = [] (int const sample)
+                        {
+                            return sample >= 0 ? sample / 3 : -((2 - sample) / 3);
+                        };
+
+                        glyph.Left = pixel(bounds.Left - 2);
+                        bounds.Left = glyph.Left * 3;
+                        bounds.Right = (pixel(bounds.Right + 1) + 1) * 3;
+                    }
+
+                    auto const width = static_cast<unsigned>(bounds.Right - bounds.Left) / static_cast<unsigned>(samples);
+                    auto const bytes = key.Lcd ? width * 4 : width;
+
+                    if (MaximumGlyphSize < width || static_cast<int>(MaximumGlyphSize) < bounds.Bottom - bounds.Top || PageSize < bytes)
+                    {
+                        return false;
+                    }
+
+                    glyph.Width = width;
+                    glyph.Height = static_cast<unsigned>(bounds.Bottom - bounds.Top);
+
+                    if (m_pages.empty() || !m_pages[m_current].Pixels ||
+                        !Allocate(m_pages[m_current], bytes, glyph.Height, glyph.X, glyph.Y))
+                    {
+                        m_current = NextPage();
+                        Allocate(m_pages[m_current], bytes, glyph.Height, glyph.X, glyph.Y);
+                    }
+
+                    glyph.Page = m_current;
+                    auto & page = m_pages[m_current];
+                    page.LastUsed = m_clock;
+                    page.Keys.push_back(key);
+
+                    m_rasterizer.Reset(bounds);
+                    m_rasterizer.AddGeometry(m_outline, Matrix3x2F());
+
+                    if (key.Lcd)
+                    {
+                        RasterizeLcdGlyph(key, bounds, glyph, page.Pixels.get());
+                        return true;
+                    }
+
+                    for (unsigned row = 0; row != glyph.Height; ++row)
+                    {
+                        m_rasterizer.GetCoverage(bounds.Left,
+                                                 bounds.Top + static_cast<int>(row),
+                                                 glyph.Width,
+                                                 FillMode::Winding,
+                                                 key.Aliased,
+                                                 page.Pixels.get() + static_cast<size_t>(glyph.Y + row) * PageSize + glyph.X);
+                    }
+
+                    return true;
+                }
+
+            public:
+
+                GlyphCache() :
+                    m_current(0),
+                    m_clock(0),
+                    m_limit(4 * 1024 * 1024)
+                {
+                    m_outline.FillMode = FillMode::Winding;
+                }
+
+                void SetLimit(std::uint64_t const limit)
+                {
+                    m_limit = limit;
+                    Trim();
+                }
+
+                auto GetLimit() const -> std::uint64_t
+                {
+                    return m_limit;
+                }
+
+                auto GetSize() const -> std::uint64_t
+                {
+                    std::uint64_t result = 0;
+
+                    for (auto const & page : m_pages)
+                    {
+                        if (page.Pixels)
+                        {
+                            result += GetPageBytes();
+                        }
+                    }
+
+                    return result;
+                }
+
+                // Glyphs found after this call stay in the cache until the next call.
+                void BeginLookup()
+                {
+                    ++m_clock;
+                }
+
+                // Returns what Find takes to render LCD glyphs with these settings for text
+                // of the given luminance, from zero to one. Past a handful of settings, the
+                // glyphs of any others are left grayscale, which zero asks for.
+                auto GetLcdRendering(RenderingParamsImpl const & params,
+                                     float const luminance) -> unsigned
+                {
+                    unsigned index = 0;
+
+                    while (m_tunings.size() != index &&
+                           !(m_tunings[index].Gamma == params.Gamma &&
+                             m_tunings[index].EnhancedContrast == params.EnhancedContrast &&
+                             m_tunings[index].ClearTypeLevel == params.ClearTypeLevel &&
+                             m_tunings[index].Geometry == params.PixelGeometry))
+                    {
+                        ++index;
+                    }
+
+                    if (m_tunings.size() == index)
+                    {
+                        if (MaximumLcdTunings == index)
+                        {
+                            return 0;
+                        }
+
+                        m_tunings.push_back(LcdTuning());
+                        auto & tuning = m_tunings.back();
+                        tuning.Gamma = params.Gamma;
+                        tuning.EnhancedContrast = params.EnhancedContrast;
+                        tuning.ClearTypeLevel = params.ClearTypeLevel;
+                        tuning.Geometry = params.PixelGeometry;
+                        MakeLcdTables(tuning);
+                    }
+
+                    auto const level = static_cast<unsigned>((std::min)((std::max)(luminance, 0.0f), 1.0f) * (LuminanceLevels - 1) + 0.5f);
+                    return 1 + index * LuminanceLevels + level;
+                }
+
+                // Size is the em size in pixels, and subpixel the position of the origin
+                // within its pixel in steps of a quarter. Returns false for glyphs too large
+                // to cache, which are better filled as outlines.
+                auto Find(FontFaceImpl const & face,
+                          float const size,
+                          unsigned short const index,
+                          unsigned const subpixel,
+                          bool const aliased,
+                          unsigned const lcd,
+                          Glyph const *& result) -> bool
+                {
+                    Key const key = { face.Id, size, index, static_cast<std::uint8_t>(subpixel), aliased, static_cast<std::uint16_t>(lcd) };
+                    auto found = m_glyphs.find(key);
+
+                    if (m_glyphs.end() == found)
+                    {
+                        Glyph glyph;
+
+                        if (!Add(key, face, glyph))
+                        {
+                            return false;
+                        }
+
+                        found = m_glyphs.insert(std::make_pair(key, glyph)).first;
+                    }
+                    else if (0 != found->second.Width)
+                    {
+                        m_pages[found->second.Page].LastUsed = m_clock;
+                    }
+
+                    result = &found->second;
+                    return true;
+                }
+
+                auto GetPixels(Glyph const & glyph) const -> std::uint8_t const *
+                {
+                    return m_pages[glyph.Page].Pixels.get() + static_cast<size_t>(glyph.Y) * PageSize + glyph.X;
+                }
+
+                // Frees the oldest pages while the cache is over its limit.
+                void Trim()
+                {
+                    ++m_clock;
+
+                    while (GetSize() > m_limit)
+                    {
+                        auto const oldest = FindOldestPage();
+
+                        if (m_pages.size() == oldest)
+                        {
+                            break;
+                        }
+
+                        Clear(m_pages[oldest]);
+                        m_pages[oldest].Pixels.reset();
+                    }
+
+                    if (0 == GetSize())
+                    {
+                        m_glyphs.clear();
+                        m_pages.clear();
+                        m_current = 0;
+                    }
+                }
+            };
+
+            unsigned const SpanSize = 256;
+
+            // A handful of non-overlapping rectangles. Overlapping rectangles are merged
+            // into their union and, past the limit, so are the two whose union adds the
+            // least area, so the region only ever grows to cover what was added.
+            class DirtyRegion
+            {
+            public:
+
+                static unsigned const MaximumCount = 8;
+
+            private:
+
+                PixelRect m_rects[MaximumCount + 1];
+                unsigned m_count;
+
+                static auto GetArea(PixelRect const & rect) -> double
+                {
+                    return static_cast<double>(rect.Right - rect.Left) * (rect.Bottom - rect.Top);
+                }
+
+                static auto GetUnion(PixelRect const & first,
+                                     PixelRect const & second) -> PixelRect
+                {
+                    PixelRect const result =
+                    {
+                        (std::min)(first.Left, second.Left),
+                        (std::min)(first.Top, second.Top),
+                        (std::max)(first.Right, second.Right),
+                        (std::max)(first.Bottom, second.Bottom),
+                    };
+
+                    return result;
+                }
+
+                void Remove(unsigned const index)
+                {
+                    m_rects[index] = m_rects[--m_count];
+                }
+
+            public:
+
+                DirtyRegion() :
+                    m_count(0)
+                {}
+
+                void Clear()
+                {
+                    m_count = 0;
+                }
+
+                auto IsEmpty() const -> bool
+                {
+                    return 0 == m_count;
+                }
+
+                auto GetCount() const -> unsigned
+                {
+                    return m_count;
+                }
+
+                auto operator[](unsigned const index) const -> PixelRect const &
+                {
+                    return m_rects[index];
+                }
+
+                auto GetBounds() const -> PixelRect
+                {
+                    if (0 == m_count)
+                    {
+                        PixelRect const empty = { 0, 0, 0, 0 };
+                        return empty;
+                    }
+
+                    auto result = m_rects[0];
+
+                    for (unsigned i = 1; i < m_count; ++i)
+                    {
+                        result = GetUnion(result, m_rects[i]);
+                    }
+
+                    return result;
+                }
+
+                void Add(PixelRect rect)
+                {
+                    if (rect.IsEmpty())
+                    {
+                        return;
+                    }
+
+                    for (unsigned i = 0; i != m_count; )
+                    {
+                        if (Intersect(m_rects[i], rect).IsEmpty())
+                        {
+                            ++i;
+                        }
+                        else
+                        {
+                            rect = GetUnion(rect, m_rects[i]);
+                            Remove(i);
+                            i = 0;
+                        }
+                    }
+
+                    m_rects[m_count++] = rect;
+
+                    if (MaximumCount < m_count)
+                    {
+                        unsigned first = 0;
+                        unsigned second = 1;
+                        auto waste = DBL_MAX;
+
+                        for (unsigned i = 0; i != m_count; ++i)
+                        {
+                            for (auto j = i + 1; j != m_count; ++j)
+                            {
+                                auto const added = GetArea(GetUnion(m_rects[i], m_rects[j])) - GetArea(m_rects[i]) - GetArea(m_rects[j]);
+
+                                if (added < waste)
+                                {
+                                    waste = added;
+                                    first = i;
+                                    second = j;
+                                }
+                            }
+                        }
+
+                        rect = GetUnion(m_rects[first], m_rects[second]);
+                        Remove(second);
+                        Remove(first);
+                        Add(rect);
+                    }
+                }
+            };
+
+            struct CommandListImpl;
+
+            // Render targets hold the drawing state shared by every kind of target. Draw
+            // calls report failures when EndDraw is called, as Direct2D does.
+            struct RenderTargetImpl : Resource
+            {
+                Matrix3x2F Transform;
+                Cpu::AntialiasMode AntialiasMode;
+                Cpu::TextAntialiasMode TextAntialiasMode;
+                std::uint64_t Tag1;
+                std::uint64_t Tag2;
+                bool Drawing;
+                HRESULT Error;
+                std::uint64_t ErrorTag1;
+                std::uint64_t ErrorTag2;
+
+                // The snapshot last saved or restored, shared again by saves for as long as
+                // the state still matches it. States holds the states pushed by PushState,
+                // kept by value so that pushing allocates nothing once the stack has grown.
+                Pointer<DrawingStateSnapshot> Snapshot;
+                std::vector<DrawingStateDescription> States;
+
+                // Created by the first compatible render target and trimmed by EndDraw.
+                Pointer<CompatibleTargetPool> Compatible;
+
+                // Holds transient resources, and is reset by EndDraw.
+                FrameArena Arena;
+
+                auto GetArena(ResourceLifetime const lifetime) -> FrameArena *
+                {
+                    return ResourceLifetime::Transient == lifetime ? &Arena : nullptr;
+                }
+
+                auto GetCompatibleTargetPool() -> CompatibleTargetPool &
+                {
+                    if (!Compatible)
+                    {
+                        Compatible = Make<CompatibleTargetPool>();
+                    }
+
+                    return *Compatible;
+                }
+
+                // Created by the first glyph run drawn from the cache and trimmed by EndDraw.
+                std::unique_ptr<GlyphCache> Glyphs;
+
+                // How ClearType text is drawn, or null for the settings of CreateRenderingParams.
+                Pointer<RenderingParamsImpl> TextRenderingParams;
+
+                auto GetGlyphCache() -> GlyphCache &
+                {
+                    if (!Glyphs)
+                    {
+                        Glyphs.reset(new GlyphCache);
+                    }
+
+                    return *Glyphs;
+                }
+
+                // Invalidated collects what changed since the last frame. BeginDraw moves it
+                // into Dirty, the region that frame draws into, or the whole target if
+                // Invalidate wasn't called. Rectangles off the target add nothing, so a frame
+                // that only invalidated those draws nothing.
+                DirtyRegion Invalidated;
+                DirtyRegion Dirty;
+                bool Invalidating;
+
+                RenderTargetImpl() :
+                    AntialiasMode(Cpu::AntialiasMode::PerPrimitive),
+                    TextAntialiasMode(Cpu::TextAntialiasMode::Default),
+                    Tag1(0),
+                    Tag2(0),
+                    Drawing(false),
+                    Error(S_OK),
+                    ErrorTag1(0),
+                    ErrorTag2(0),
+                    Invalidating(false)
+                {}
+
+                // The tags at the first failure tell the caller which drawing failed.
+                void Fail(HRESULT const result)
+                {
+                    if (S_OK == Error)
+                    {
+                        Error = result;
+                        ErrorTag1 = Tag1;
+                        ErrorTag2 = Tag2;
+                    }
+                }
+
+                auto GetState() const -> DrawingStateDescription
+                {
+                    return DrawingStateDescription(AntialiasMode, TextAntialiasMode, Tag1, Tag2, Transform, RenderingParams(TextRenderingParams));
+                }
+
+                void SetState(DrawingStateDescription const & state)
+                {
+                    Transform = state.Transform;
+                    AntialiasMode = state.AntialiasMode;
+                    TextAntialiasMode = state.TextAntialiasMode;
+                    Tag1 = state.Tag1;
+                    Tag2 = state.Tag2;
+                    TextRenderingParams = state.TextRenderingParams.Share();
+                }
+
+                auto SaveState() -> Pointer<DrawingStateSnapshot>
+                {
+                    auto const state = GetState();
+
+                    if (!Snapshot || !IsSameState(Snapshot->Description, state))
+                    {
+                        Snapshot = Make<DrawingStateSnapshot>(state);
+                    }
+
+                    return Snapshot;
+                }
+
+                void RestoreState(Pointer<DrawingStateSnapshot> const & state)
+                {
+                    Snapshot = state;
+                    SetState(state->Description);
+                }
+
+                void PushState()
+                {
+                    States.push_back(GetState());
+                }
+
+                void PopState()
+                {
+                    if (States.empty())
+                    {
+                        Fail(D2DERR_POP_CALL_DID_NOT_MATCH_PUSH);
+                        return;
+                    }
+
+                    SetState(States.back());
+                    States.pop_back();
+                }
+
+                auto CanDraw() -> bool
+                {
+                    if (!Drawing || !IsReady())
+                    {
+                        Fail(D2DERR_WRONG_STATE);
+                        return false;
+                    }
+
+                    return true;
+                }
+
+                auto GetTargetRect() const -> PixelRect
+                {
+                    auto const size = GetPixelSize();
+                    PixelRect const result = { 0, 0, static_cast<int>(size.Width), static_cast<int>(size.Height) };
+                    return result;
+                }
+
+                void Invalidate()
+                {
+                    if (IsReady())
+                    {
+                        Invalidated.Add(GetTargetRect());
+                        Invalidating = true;
+                    }
+                }
+
+                void Invalidate(PixelRect const & rect)
+                {
+                    if (IsReady())
+                    {
+                        Invalidated.Add(Intersect(rect, GetTargetRect()));
+                        Invalidating = true;
+                    }
+                }
+
+                void UpdateDirtyRegion()
+                {
+                    Dirty = Invalidated;
+                    Invalidated.Clear();
+                    auto const invalidating = Invalidating;
+                    Invalidating = false;
+
+                    if (!invalidating)
+                    {
+                        Dirty.Add(GetTargetRect());
+                    }
+                }
+
+                virtual auto IsReady() const -> bool = 0;
+                virtual auto GetPixelSize() const -> SizeU = 0;
+
+                virtual void Clear(Color const & color) = 0;
+
+                virtual void FillOpacityMask(BitmapImpl & mask,
+                                             BrushImpl const & brush,
+                                             RectF const & destination,
+                                             RectF const & source) = 0;
+
+                virtual void DrawBitmap(BitmapImpl & bitmap,
+                                        RectF const & destination,
+                                        float opacity,
+                                        BitmapInterpolationMode mode,
+                                        RectF const & source) = 0;
+
+                virtual void FillRectangle(RectF const & rect,
+                                           BrushImpl const & brush) = 0;
+
+                virtual void FillRectangles(RectF const * rects,
+                                            unsigned const count,
+                                            BrushImpl const & brush)
+                {
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        FillRectangle(rects[i], brush);
+                    }
+                }
+
+                virtual void FillEllipse(Ellipse const & ellipse,
+                                         BrushImpl const & brush) = 0;
+
+                virtual void FillGeometry(GeometryImpl const & geometry,
+                                          BrushImpl const & brush,
+                                          BrushImpl const * opacityBrush) = 0;
+
+                // Targets without a glyph cache fill the outlines of the run.
+                virtual void DrawGlyphRun(Point2F const & baselineOrigin,
+                                          GlyphRun const & run,
+                                          BrushImpl const & brush,
+                                          MeasuringMode const mode)
+                {
+                    auto const outline = Make<PathGeometryImpl>();
+                    outline->FillMode = FillMode::Winding;
+                    outline->Closed = true;
+                    AddGlyphRunOutline(baselineOrigin, run, mode, *outline);
+                    FillGeometry(*outline, brush, nullptr);
+                }
+
+                virtual void DrawGlyphRuns(BatchedGlyphRun const * runs,
+                                           unsigned const count,
+                                           MeasuringMode const mode)
+                {
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        DrawGlyphRun(runs[i].BaselineOrigin, *runs[i].GlyphRun, *runs[i].ForegroundBrush, mode);
+                    }
+                }
+
+                virtual void DrawImage(CommandListImpl & list,
+                                       Point2F const & offset) = 0;
+
+                virtual void PushAxisAlignedClip(RectF const & rect,
+                                                 Cpu::AntialiasMode mode) = 0;
+                virtual void PopAxisAlignedClip() = 0;
+
+                virtual void PushLayer(LayerParameters const & parameters) = 0;
+                virtual void PopLayer() = 0;
+
+                virtual void BeginFrame() {}
+                virtual void EndFrame() {}
+            };
+
+            // Commands are recorded into blocks of memory that are only ever appended to,
+            // so recording a draw call is a bump of a pointer and a copy of its arguments.
+            // Blocks may also be borrowed, such as from a mapped file.
+            class CommandArena
+            {
+                struct Block
+                {
+                    std::unique_ptr<std::uint8_t[]> Storage;
+                    std::uint8_t const * Bits;
+                    unsigned Size;
+                    unsigned Used;
+                };
+
+                std::vector<Block> m_blocks;
+
+            public:
+
+                static unsigned const BlockSize = 4096;
+
+                auto Allocate(unsigned const size) -> void *
+                {
+                    if (m_blocks.empty() || m_blocks.back().Size - m_blocks.back().Used < size)
+                    {
+                        Block block;
+                        block.Size = size > BlockSize ? size : BlockSize;
+                        block.Used = 0;
+                        block.Storage.reset(new std::uint8_t[block.Size]);
+                        block.Bits = block.Storage.get();
+                        m_blocks.push_back(std::move(block));
+                    }
+
+                    auto & block = m_blocks.back();
+                    auto const result = block.Storage.get() + block.Used;
+                    block.Used += size;
+                    return result;
+                }
+
+                // The memory must outlive the arena and hold whole commands.
+                void Borrow(void const * bits,
+                            unsigned const size)
+                {
+                    Block block;
+                    block.Bits = static_cast<std::uint8_t const *>(bits);
+                    block.Size = size;
+                    block.Used = size;
+                    m_blocks.push_back(std::move(block));
+                }
+
+                auto GetSize() const -> size_t
+                {
+                    size_t result = 0;
+
+                    for (auto const & block : m_blocks)
+                    {
+                        result += block.Used;
+                    }
+
+                    return result;
+                }
+
+                template <typename F>
+                void ForEach(F const & f) const
+                {
+                    for (auto const & block : m_blocks)
+                    {
+                        for (unsigned offset = 0; offset != block.Used; )
+                        {
+                            offset += f(block.Bits + offset);
+                        }
+                    }
+                }
+            };
+
+            enum class CommandType : std::uint32_t
+            {
+                SetTransform,
+                SetAntialiasMode,
+                Clear,
+                FillRectangle,
+                FillEllipse,
+                FillGeometry,
+                FillOpacityMask,
+                DrawBitmap,
+                DrawImage,
+                PushAxisAlignedClip,
+                PopAxisAlignedClip,
+                PushLayer,
+                PopLayer,
+                FillRectangles,
+                SetTextAntialiasMode,
+                SetTextRenderingParams,
+                DrawGlyphRun,
+            };
+
+            // Every record starts with its type and size. Resources are stored as indices
+            // into the resources of the command list.
+            struct Command
+            {
+                CommandType Type;
+                unsigned Size;
+            };
+
+            unsigned const NoResource = ~0u;
+
+            struct SetTransformCommand : Command
+            {
+                Matrix3x2F Transform;
+            };
+
+            struct SetAntialiasModeCommand : Command
+            {
+                Cpu::AntialiasMode Mode;
+            };
+
+            struct ClearCommand : Command
+            {
+                Color Value;
+            };
+
+            struct FillRectangleCommand : Command
+            {
+                RectF Rect;
+                unsigned Brush;
+            };
+
+            // The rectangles follow the command.
+            struct FillRectanglesCommand : Command
+            {
+                unsigned Brush;
+                unsigned Count;
+
+                auto GetRects() const -> RectF const *
+                {
+                    return reinterpret_cast<RectF const *>(this + 1);
+                }
+            };
+
+            struct FillEllipseCommand : Command
+            {
+                Cpu::Ellipse Ellipse;
+                unsigned Brush;
+            };
+
+            struct FillGeometryCommand : Command
+            {
+                unsigned Geometry;
+                unsigned Brush;
+                unsigned OpacityBrush;
+            };
+
+            struct FillOpacityMaskCommand : Command
+            {
+                unsigned Mask;
+                unsigned Brush;
+                RectF Destination;
+                RectF Source;
+            };
+
+            struct DrawBitmapCommand : Command
+            {
+                unsigned Bitmap;
+                RectF Destination;
+                float Opacity;
+                BitmapInterpolationMode Mode;
+                RectF Source;
+            };
+
+            struct DrawImageCommand : Command
+            {
+                unsigned List;
+                Point2F Offset;
+            };
+
+            struct PushAxisAlignedClipCommand : Command
+            {
+                RectF Rect;
+                Cpu::AntialiasMode Mode;
+            };
+
+            struct PushLayerCommand : Command
+            {
+                RectF ContentBounds;
+                unsigned GeometricMask;
+                Cpu::AntialiasMode MaskAntialiasMode;
+                Matrix3x2F MaskTransform;
+                float Opacity;
+                unsigned OpacityBrush;
+                Cpu::LayerOptions Options;
+            };
+
+            struct SetTextAntialiasModeCommand : Command
+            {
+                Cpu::TextAntialiasMode Mode;
+            };
+
+            // No parameters means the target's defaults.
+            struct SetTextRenderingParamsCommand : Command
+            {
+                unsigned Params;
+            };
+
+            // The glyph indices follow the command, padded to a whole number of unsigned
+            // values, and then the advances and offsets if the run has them.
+            struct DrawGlyphRunCommand : Command
+            {
+                Point2F BaselineOrigin;
+                unsigned FontFace;
+                float FontEmSize;
+                unsigned GlyphCount;
+                unsigned Brush;
+                MeasuringMode Mode;
+                std::uint32_t HasAdvances;
+                std::uint32_t HasOffsets;
+                std::uint32_t IsSideways;
+                unsigned BidiLevel;
+
+                static auto GetExtra(unsigned const count,
+                                     bool const advances,
+                                     bool const offsets) -> std::uint64_t
+                {
+                    return ((std::uint64_t(count) * sizeof(unsigned short) + 3) & ~std::uint64_t(3)) +
+                           (advances ? std::uint64_t(count) * sizeof(float) : 0) +
+                           (offsets ? std::uint64_t(count) * sizeof(GlyphOffset) : 0);
+                }
+
+                auto GetIndices() const -> unsigned short const *
+                {
+                    return reinterpret_cast<unsigned short const *>(this + 1);
+                }
+
+                auto GetAdvances() const -> float const *
+                {
+                    return HasAdvances ? reinterpret_cast<float const *>(reinterpret_cast<std::uint8_t const *>(this + 1) + static_cast<size_t>(GetExtra(GlyphCount, false, false))) : nullptr;
+                }
+
+                auto GetOffsets() const -> GlyphOffset const *
+                {
+                    return HasOffsets ? reinterpret_cast<GlyphOffset const *>(reinterpret_cast<std::uint8_t const *>(this + 1) + static_cast<size_t>(GetExtra(GlyphCount, 0 != HasAdvances, false))) : nullptr;
+                }
+            };
+
+            // Brushes that outlive the frame keep their own copy of transient stops.
+            inline auto KeepStops(Pointer<GradientStopCollectionImpl> const & stops,
+                                  FrameArena const * arena) -> Pointer<GradientStopCollectionImpl>
+            {
+                if (!arena && stops && stops->Transient)
+                {
+                    return Make<GradientStopCollectionImpl>(*stops);
+                }
+
+                return stops;
+            }
+
+            template <typename T>
+            auto PersistGradient(T const & brush) -> Pointer<Resource>
+            {
+                auto const copy = Make<T>(brush);
+                copy->Stops = KeepStops(copy->Stops, nullptr);
+                return copy;
+            }
+
+            // Copies a transient resource to the heap, for recordings that outlive its
+            // frame.
+            inline auto Persist(Resource const & resource) -> Pointer<Resource>
+            {
+                if (auto const solid = dynamic_cast<SolidColorBrushImpl const *>(&resource))
+                {
+                    return Make<SolidColorBrushImpl>(*solid);
+                }
+
+                if (auto const bitmap = dynamic_cast<BitmapBrushImpl const *>(&resource))
+                {
+                    return Make<BitmapBrushImpl>(*bitmap);
+                }
+
+                if (auto const linear = dynamic_cast<LinearGradientBrushImpl const *>(&resource))
+                {
+                    return PersistGradient(*linear);
+                }
+
+                if (auto const radial = dynamic_cast<RadialGradientBrushImpl const *>(&resource))
+                {
+                    return PersistGradient(*radial);
+                }
+
+                if (auto const stops = dynamic_cast<GradientStopCollectionImpl const *>(&resource))
+                {
+                    return Make<GradientStopCollectionImpl>(*stops);
+                }
+
+                auto const path = dynamic_cast<PathGeometryImpl const *>(&resource);
+                ASSERT(path);
+                return Make<PathGeometryImpl>(*path);
+            }
+
+            class MappedFile;
+
+            struct CommandListImpl : ImageImpl
+            {
+                CommandArena Commands;
+                std::shared_ptr<MappedFile> File;
+                std::vector<Pointer<Resource>> Resources;
+                std::unordered_map<Resource const *, unsigned> Indices;
+                unsigned Count;
+                bool Open;
+                bool Closed;
+
+                CommandListImpl() :
+                    Count(0),
+                    Open(false),
+                    Closed(false)
+                {}
+
+                template <typename T>
+                auto Append(CommandType const type,
+                            unsigned const extra = 0) -> T &
+                {
+                    static_assert(sizeof(T) % sizeof(unsigned) == 0, "commands are packed on unsigned boundaries");
+                    ASSERT(0 == extra % sizeof(unsigned));
+                    auto const command = new (Commands.Allocate(sizeof(T) + extra)) T();
+                    command->Type = type;
+                    command->Size = sizeof(T) + extra;
+                    ++Count;
+                    return *command;
+                }
+
+                auto AddResource(Resource const * resource) -> unsigned
+                {
+                    if (!resource)
+                    {
+                        return NoResource;
+                    }
+
+                    // A transient resource's memory is reused once its frame ends, so its
+                    // address can't identify it and each use is recorded as a copy.
+                    if (resource->Transient)
+                    {
+                        Resources.push_back(Persist(*resource));
+                        return static_cast<unsigned>(Resources.size() - 1);
+                    }
+
+                    auto const result = Indices.insert(std::make_pair(resource, static_cast<unsigned>(Resources.size())));
+
+                    if (result.second)
+                    {
+                        Resources.push_back(Pointer<Resource>(const_cast<Resource *>(resource)));
+                    }
+
+                    return result.first->second;
+                }
+
+                template <typename T>
+                auto GetResource(unsigned const index) const -> T *
+                {
+                    return NoResource == index ? nullptr : static_cast<T *>(Resources[index].Get());
+                }
+            };
+
+            // Receives the commands of a command list. Sinks override what they need.
+            struct CommandSinkImpl : Resource
+            {
+                virtual void BeginDraw() {}
+                virtual auto EndDraw() -> HRESULT { return S_OK; }
+
+                virtual void SetTransform(Matrix3x2F const &) {}
+                virtual void SetAntialiasMode(Cpu::AntialiasMode) {}
+
+                virtual void Clear(Color const &) {}
+
+                virtual void FillRectangle(RectF const &,
+                                           BrushImpl const &) {}
+
+                // Sinks that don't handle batches see each rectangle in turn.
+                virtual void FillRectangles(RectF const * rects,
+                                            unsigned const count,
+                                            BrushImpl const & brush)
+                {
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        FillRectangle(rects[i], brush);
+                    }
+                }
+
+                virtual void FillEllipse(Ellipse const &,
+                                         BrushImpl const &) {}
+
+                virtual void FillGeometry(GeometryImpl const &,
+                                          BrushImpl const &,
+                                          BrushImpl const *) {}
+
+                virtual void FillOpacityMask(BitmapImpl &,
+                                             BrushImpl const &,
+                                             RectF const &,
+                                             RectF const &) {}
+
+                virtual void DrawBitmap(BitmapImpl &,
+                                        RectF const &,
+                                        float,
+                                        BitmapInterpolationMode,
+                                        RectF const &) {}
+
+                virtual void PushAxisAlignedClip(RectF const &,
+                                                 Cpu::AntialiasMode) {}
+
+                virtual void PopAxisAlignedClip() {}
+
+                virtual void PushLayer(LayerParameters const &) {}
+                virtual void PopLayer() {}
+
+                virtual void SetTextAntialiasMode(Cpu::TextAntialiasMode) {}
+                virtual void SetTextRenderingParams(RenderingParamsImpl const *) {}
+
+                virtual void DrawGlyphRun(Point2F const &,
+                                          GlyphRun const &,
+                                          BrushImpl const &,
+                                          MeasuringMode) {}
+            };
+
+            // A recording starts from the identity transform, per-primitive antialiasing and
+            // the default text antialiasing and rendering parameters. Transforms it sets are
+            // relative to the base it is replayed under.
+            struct ReplayState
+            {
+                Matrix3x2F Base;
+                Matrix3x2F Transform;
+                Cpu::AntialiasMode Mode;
+                Cpu::TextAntialiasMode TextMode;
+                RenderingParamsImpl const * TextParams;
+            };
+
+            inline auto BeginReplay(CommandSinkImpl & sink,
+                                    Matrix3x2F const & base) -> ReplayState
+            {
+                ReplayState const state = { base, base, Cpu::AntialiasMode::PerPrimitive, Cpu::TextAntialiasMode::Default, nullptr };
+                sink.SetTransform(state.Transform);
+                sink.SetAntialiasMode(state.Mode);
+                sink.SetTextAntialiasMode(state.TextMode);
+                sink.SetTextRenderingParams(state.TextParams);
+                return state;
+            }
+
+            inline void Replay(CommandListImpl const & list,
+                               CommandSinkImpl & sink,
+                               Matrix3x2F const & base);
+
+            // Sends one command to a sink. Command lists drawn into the list are sent in
+            // line, under the transform they were drawn with.
+            inline void ReplayCommand(CommandListImpl const & list,
+                                      Command const & command,
+                                      CommandSinkImpl & sink,
+                                      ReplayState & state)
+            {
+                switch (command.Type)
+                {
+                case CommandType::SetTransform:
+                {
+                    state.Transform = static_cast<SetTransformCommand const &>(command).Transform * state.Base;
+                    sink.SetTransform(state.Transform);
+                    break;
+                }
+                case CommandType::SetAntialiasMode:
+                {
+                    state.Mode = static_cast<SetAntialiasModeCommand const &>(command).Mode;
+                    sink.SetAntialiasMode(state.Mode);
+                    break;
+                }
+                case CommandType::Clear:
+                {
+                    sink.Clear(static_cast<ClearCommand const &>(command).Value);
+                    break;
+                }
+                case CommandType::FillRectangle:
+                {
+                    auto const & args = static_cast<FillRectangleCommand const &>(command);
+                    sink.FillRectangle(args.Rect, *list.GetResource<BrushImpl>(args.Brush));
+                    break;
+                }
+                case CommandType::FillRectangles:
+                {
+                    auto const & args = static_cast<FillRectanglesCommand const &>(command);
+                    sink.FillRectangles(args.GetRects(), args.Count, *list.GetResource<BrushImpl>(args.Brush));
+                    break;
+                }
+                case CommandType::FillEllipse:
+                {
+                    auto const & args = static_cast<FillEllipseCommand const &>(command);
+                    sink.FillEllipse(args.Ellipse, *list.GetResource<BrushImpl>(args.Brush));
+                    break;
+                }
+                case CommandType::FillGeometry:
+                {
+                    auto const & args = static_cast<FillGeometryCommand const &>(command);
+                    sink.FillGeometry(*list.GetResource<GeometryImpl>(args.Geometry),
+                                      *list.GetResource<BrushImpl>(args.Brush),
+                                      list.GetResource<BrushImpl>(args.OpacityBrush));
+                    break;
+                }
+                case CommandType::FillOpacityMask:
+                {
+                    auto const & args = static_cast<FillOpacityMaskCommand const &>(command);
+                    sink.FillOpacityMask(*list.GetResource<BitmapImpl>(args.Mask),
+                                         *list.GetResource<BrushImpl>(args.Brush),
+                                         args.Destination,
+                                         args.Source);
+                    break;
+                }
+                case CommandType::DrawBitmap:
+                {
+                    auto const & args = static_cast<DrawBitmapCommand const &>(command);
+                    sink.DrawBitmap(*list.GetResource<BitmapImpl>(args.Bitmap),
+                                    args.Destination,
+                                    args.Opacity,
+                                    args.Mode,
+                                    args.Source);
+                    break;
+                }
+                case CommandType::DrawImage:
+                {
+                    auto const & args = static_cast<DrawImageCommand const &>(command);
+                    Replay(*list.GetResource<CommandListImpl>(args.List),
+                           sink,
+                           Matrix3x2F::Translation(args.Offset.X, args.Offset.Y) * state.Transform);
+                    sink.SetTransform(state.Transform);
+                    sink.SetAntialiasMode(state.Mode);
+                    sink.SetTextAntialiasMode(state.TextMode);
+                    sink.SetTextRenderingParams(state.TextParams);
+                    break;
+                }
+                case CommandType::PushAxisAlignedClip:
+                {
+                    auto const & args = static_cast<PushAxisAlignedClipCommand const &>(command);
+                    sink.PushAxisAlignedClip(args.Rect, args.Mode);
+                    break;
+                }
+                case CommandType::PopAxisAlignedClip:
+                {
+                    sink.PopAxisAlignedClip();
+                    break;
+                }
+                case CommandType::PushLayer:
+                {
+                    auto const & args = static_cast<PushLayerCommand const &>(command);
+                    auto const mask = list.GetResource<GeometryImpl>(args.GeometricMask);
+                    auto const brush = list.GetResource<BrushImpl>(args.OpacityBrush);
+
+                    sink.PushLayer(LayerParameters(args.ContentBounds,
+                                                   mask ? Geometry(Pointer<GeometryImpl>(const_cast<GeometryImpl *>(mask))) : Geometry(),
+                                                   args.MaskAntialiasMode,
+                                                   args.MaskTransform,
+                                                   args.Opacity,
+                                                   brush ? Brush(Pointer<BrushImpl>(const_cast<BrushImpl *>(brush))) : Brush(),
+                                                   args.Options));
+                    break;
+                }
+                case CommandType::PopLayer:
+                {
+                    sink.PopLayer();
+                    break;
+                }
+                case CommandType::SetTextAntialiasMode:
+                {
+                    state.TextMode = static_cast<SetTextAntialiasModeCommand const &>(command).Mode;
+                    sink.SetTextAntialiasMode(state.TextMode);
+                    break;
+                }
+                case CommandType::SetTextRenderingParams:
+                {
+                    state.TextParams = list.GetResource<RenderingParamsImpl>(static_cast<SetTextRenderingParamsCommand const &>(command).Params);
+                    sink.SetTextRenderingParams(state.TextParams);
+                    break;
+                }
+                case CommandType::DrawGlyphRun:
+                {
+                    auto const & args = static_cast<DrawGlyphRunCommand const &>(command);
+                    GlyphRun run;
+                    run.FontFace = list.GetResource<FontFaceImpl>(args.FontFace);
+                    run.FontEmSize = args.FontEmSize;
+                    run.GlyphCount = args.GlyphCount;
+                    run.GlyphIndices = args.GetIndices();
+                    run.GlyphAdvances = args.GetAdvances();
+                    run.GlyphOffsets = args.GetOffsets();
+                    run.IsSideways = 0 != args.IsSideways;
+                    run.BidiLevel = args.BidiLevel;
+                    sink.DrawGlyphRun(args.BaselineOrigin, run, *list.GetResource<BrushImpl>(args.Brush), args.Mode);
+                    break;
+                }
+                }
+            }
+
+            inline void Replay(CommandListImpl const & list,
+                               CommandSinkImpl & sink,
+                               Matrix3x2F const & base)
+            {
+                auto state = BeginReplay(sink, base);
+
+                list.Commands.ForEach([&] (std::uint8_t const * bits) -> unsigned
+                {
+                    auto const & command = *reinterpret_cast<Command const *>(bits);
+                    ReplayCommand(list, command, sink, state);
+                    return command.Size;
+                });
+            }
+
+            // Draws the commands onto a render target, under the transform the target has
+            // when they are sent. The state of the target is restored afterwards, and draw
+            // calls fail as usual when the target is not drawing.
+            struct TargetSinkImpl : CommandSinkImpl
+            {
+                RenderTargetImpl & Target;
+                Pointer<RenderTargetImpl> Owner;
+                Matrix3x2F SavedTransform;
+                Cpu::AntialiasMode SavedMode;
+                Cpu::TextAntialiasMode SavedTextMode;
+                Pointer<RenderingParamsImpl> SavedTextParams;
+                bool Active;
+
+                explicit TargetSinkImpl(RenderTargetImpl & target) :
+                    Target(target),
+                    SavedMode(Cpu::AntialiasMode::PerPrimitive),
+                    SavedTextMode(Cpu::TextAntialiasMode::Default),
+                    Active(false)
+                {}
+
+                void BeginDraw() override
+                {
+                    Active = Target.CanDraw();
+                    SavedTransform = Target.Transform;
+                    SavedMode = Target.AntialiasMode;
+                    SavedTextMode = Target.TextAntialiasMode;
+                    SavedTextParams = Target.TextRenderingParams;
+                }
+
+                auto EndDraw() -> HRESULT override
+                {
+                    Target.Transform = SavedTransform;
+                    Target.AntialiasMode = SavedMode;
+                    Target.TextAntialiasMode = SavedTextMode;
+                    Target.TextRenderingParams = SavedTextParams;
+                    SavedTextParams = nullptr;
+                    Active = false;
+                    return S_OK;
+                }
+
+                void SetTransform(Matrix3x2F const & transform) override
+                {
+                    Target.Transform = transform * SavedTransform;
+                }
+
+                void SetAntialiasMode(Cpu::AntialiasMode const mode) override
+                {
+                    Target.AntialiasMode = mode;
+                }
+
+                void Clear(Color const & color) override
+                {
+                    if (Active)
+                    {
+                        Target.Clear(color);
+                    }
+                }
+
+                void FillRectangle(RectF const & rect,
+                                   BrushImpl const & brush) override
+                {
+                    if (Active)
+                    {
+                        Target.FillRectangle(rect, brush);
+                    }
+                }
+
+                void FillRectangles(RectF const * rects,
+                                    unsigned const count,
+                                    BrushImpl const & brush) override
+                {
+                    if (Active)
+                    {
+                        Target.FillRectangles(rects, count, brush);
+                    }
+                }
+
+                void FillEllipse(Ellipse const & ellipse,
+                                 BrushImpl const & brush) override
+                {
+                    if (Active)
+                    {
+                        Target.FillEllipse(ellipse, brush);
+                    }
+                }
+
+                void FillGeometry(GeometryImpl const & geometry,
+                                  BrushImpl const & brush,
+                                  BrushImpl const * opacityBrush) override
+                {
+                    if (Active)
+                    {
+                        Target.FillGeometry(geometry, brush, opacityBrush);
+                    }
+                }
+
+                void FillOpacityMask(BitmapImpl & mask,
+                                     BrushImpl const & brush,
+                                     RectF const & destination,
+                                     RectF const & source) override
+                {
+                    if (Active)
+                    {
+                        Target.FillOpacityMask(mask, brush, destination, source);
+                    }
+                }
+
+                void DrawBitmap(BitmapImpl & bitmap,
+                                RectF const & destination,
+                                float const opacity,
+                                BitmapInterpolationMode const mode,
+                                RectF const & source) override
+                {
+                    if (Active)
+                    {
+                        Target.DrawBitmap(bitmap, destination, opacity, mode, source);
+                    }
+                }
+
+                void PushAxisAlignedClip(RectF const & rect,
+                                         Cpu::AntialiasMode const mode) override
+                {
+                    if (Active)
+                    {
+                        Target.PushAxisAlignedClip(rect, mode);
+                    }
+                }
+
+                void PopAxisAlignedClip() override
+                {
+                    if (Active)
+                    {
+                        Target.PopAxisAlignedClip();
+                    }
+                }
+
+                void PushLayer(LayerParameters const & parameters) override
+                {
+                    if (Active)
+                    {
+                        Target.PushLayer(parameters);
+                    }
+                }
+
+                void PopLayer() override
+                {
+                    if (Active)
+                    {
+                        Target.PopLayer();
+                    }
+                }
+
+                void SetTextAntialiasMode(Cpu::TextAntialiasMode const mode) override
+                {
+                    Target.TextAntialiasMode = mode;
+                }
+
+                void SetTextRenderingParams(RenderingParamsImpl const * params) override
+                {
+                    Target.TextRenderingParams = Pointer<RenderingParamsImpl>(const_cast<RenderingParamsImpl *>(params));
+                }
+
+                void DrawGlyphRun(Point2F const & baselineOrigin,
+                                  GlyphRun const & run,
+                                  BrushImpl const & brush,
+                                  MeasuringMode const mode) override
+                {
+                    if (Active)
+                    {
+                        Target.DrawGlyphRun(baselineOrigin, run, brush, mode);
+                    }
+                }
+            };
+
+            inline void DrawCommandList(RenderTargetImpl & target,
+                                        CommandListImpl const & list,
+                                        Point2F const & offset)
+            {
+                TargetSinkImpl sink(target);
+                sink.BeginDraw();
+                Replay(list, sink, Matrix3x2F::Translation(offset.X, offset.Y));
+                sink.EndDraw();
+            }
+
+            // Records draw calls into a command list. State is recorded only when a draw
+            // call finds it changed.
+            struct CommandRecorderImpl : RenderTargetImpl
+            {
+                Pointer<CommandListImpl> List;
+                Matrix3x2F RecordedTransform;
+                Cpu::AntialiasMode RecordedMode;
+                Cpu::TextAntialiasMode RecordedTextMode;
+                RenderingParamsImpl const * RecordedTextParams;
+
+                explicit CommandRecorderImpl(Pointer<CommandListImpl> const & list) :
+                    List(list),
+                    RecordedMode(Cpu::AntialiasMode::PerPrimitive),
+                    RecordedTextMode(Cpu::TextAntialiasMode::Default),
+                    RecordedTextParams(nullptr)
+                {}
+
+                auto IsReady() const -> bool override
+                {
+                    return List->Open;
+                }
+
+                auto GetPixelSize() const -> SizeU override
+                {
+                    return SizeU();
+                }
+
+                template <typename T>
+                auto Record(CommandType const type,
+                            unsigned const extra = 0) -> T &
+                {
+                    if (0 != memcmp(&RecordedTransform, &Transform, sizeof(Transform)))
+                    {
+                        RecordedTransform = Transform;
+                        List->Append<SetTransformCommand>(CommandType::SetTransform).Transform = Transform;
+                    }
+
+                    if (RecordedMode != AntialiasMode)
+                    {
+                        RecordedMode = AntialiasMode;
+                        List->Append<SetAntialiasModeCommand>(CommandType::SetAntialiasMode).Mode = AntialiasMode;
+                    }
+
+                    return List->Append<T>(type, extra);
+                }
+
+                void Clear(Color const & color) override
+                {
+                    Record<ClearCommand>(CommandType::Clear).Value = color;
+                }
+
+                void FillRectangle(RectF const & rect,
+                                   BrushImpl const & brush) override
+                {
+                    auto & command = Record<FillRectangleCommand>(CommandType::FillRectangle);
+                    command.Rect = rect;
+                    command.Brush = List->AddResource(&brush);
+                }
+
+                void FillEllipse(Ellipse const & ellipse,
+                                 BrushImpl const & brush) override
+                {
+                    auto & command = Record<FillEllipseCommand>(CommandType::FillEllipse);
+                    command.Ellipse = ellipse;
+                    command.Brush = List->AddResource(&brush);
+                }
+
+                void FillGeometry(GeometryImpl const & geometry,
+                                  BrushImpl const & brush,
+                                  BrushImpl const * opacityBrush) override
+                {
+                    auto & command = Record<FillGeometryCommand>(CommandType::FillGeometry);
+                    command.Geometry = List->AddResource(&geometry);
+                    command.Brush = List->AddResource(&brush);
+                    command.OpacityBrush = List->AddResource(opacityBrush);
+                }
+
+                void FillOpacityMask(BitmapImpl & mask,
+                                     BrushImpl const & brush,
+                                     RectF const & destination,
+                                     RectF const & source) override
+                {
+                    auto & command = Record<FillOpacityMaskCommand>(CommandType::FillOpacityMask);
+                    command.Mask = List->AddResource(&mask);
+                    command.Brush = List->AddResource(&brush);
+                    command.Destination = destination;
+                    command.Source = source;
+                }
+
+                void DrawBitmap(BitmapImpl & bitmap,
+                                RectF const & destination,
+                                float const opacity,
+                                BitmapInterpolationMode const mode,
+                                RectF const & source) override
+                {
+                    auto & command = Record<DrawBitmapCommand>(CommandType::DrawBitmap);
+                    command.Bitmap = List->AddResource(&bitmap);
+                    command.Destination = destination;
+                    command.Opacity = opacity;
+                    command.Mode = mode;
+                    command.Source = source;
+                }
+
+                void DrawImage(CommandListImpl & list,
+                               Point2F const & offset) override
+                {
+                    auto & command = Record<DrawImageCommand>(CommandType::DrawImage);
+                    command.List = List->AddResource(&list);
+                    command.Offset = offset;
+                }
+
+                // Runs are recorded as glyphs rather than outlines, so they replay through the
+                // glyph cache of the target, and batches are recorded run by run. Parameters
+                // are compared by address, which the list keeps alive once recorded.
+                void DrawGlyphRun(Point2F const & baselineOrigin,
+                                  GlyphRun const & run,
+                                  BrushImpl const & brush,
+                                  MeasuringMode const mode) override
+                {
+                    if (!run.FontFace || 0 == run.GlyphCount)
+                    {
+                        return;
+                    }
+
+                    if (RecordedTextMode != TextAntialiasMode)
+                    {
+                        RecordedTextMode = TextAntialiasMode;
+                        List->Append<SetTextAntialiasModeCommand>(CommandType::SetTextAntialiasMode).Mode = TextAntialiasMode;
+                    }
+
+                    if (RecordedTextParams != TextRenderingParams.Get())
+                    {
+                        RecordedTextParams = TextRenderingParams.Get();
+                        List->Append<SetTextRenderingParamsCommand>(CommandType::SetTextRenderingParams).Params = List->AddResource(RecordedTextParams);
+                    }
+
+                    auto const extra = static_cast<unsigned>(DrawGlyphRunCommand::GetExtra(run.GlyphCount, nullptr != run.GlyphAdvances, nullptr != run.GlyphOffsets));
+                    auto & command = Record<DrawGlyphRunCommand>(CommandType::DrawGlyphRun, extra);
+                    command.BaselineOrigin = baselineOrigin;
+                    command.FontFace = List->AddResource(run.FontFace);
+                    command.FontEmSize = run.FontEmSize;
+                    command.GlyphCount = run.GlyphCount;
+                    command.Brush = List->AddResource(&brush);
+                    command.Mode = mode;
+                    command.HasAdvances = nullptr != run.GlyphAdvances;
+                    command.HasOffsets = nullptr != run.GlyphOffsets;
+                    command.IsSideways = run.IsSideways;
+                    command.BidiLevel = run.BidiLevel;
+
+                    auto const indices = const_cast<unsigned short *>(command.GetIndices());
+                    memcpy(indices, run.GlyphIndices, run.GlyphCount * sizeof(unsigned short));
+
+                    // The padding is saved with the command, so it is cleared.
+                    if (run.GlyphCount & 1)
+                    {
+                        indices[run.GlyphCount] = 0;
+                    }
+
+                    if (run.GlyphAdvances)
+                    {
+                        memcpy(const_cast<float *>(command.GetAdvances()), run.GlyphAdvances, run.GlyphCount * sizeof(float));
+                    }
+
+                    if (run.GlyphOffsets)
+                    {
+                        memcpy(const_cast<GlyphOffset *>(command.GetOffsets()), run.GlyphOffsets, run.GlyphCount * sizeof(GlyphOffset));
+                    }
+                }
+
+                void PushAxisAlignedClip(RectF const & rect,
+                                         Cpu::AntialiasMode const mode) override
+                {
+                    auto & command = Record<PushAxisAlignedClipCommand>(CommandType::PushAxisAlignedClip);
+                    command.Rect = rect;
+                    command.Mode = mode;
+                }
+
+                void PopAxisAlignedClip() override
+                {
+                    List->Append<Command>(CommandType::PopAxisAlignedClip);
+                }
+
+                void PushLayer(LayerParameters const & parameters) override
+                {
+                    auto & command = Record<PushLayerCommand>(CommandType::PushLayer);
+                    command.ContentBounds = parameters.ContentBounds;
+                    command.GeometricMask = List->AddResource(parameters.GeometricMask.Get());
+                    command.MaskAntialiasMode = parameters.MaskAntialiasMode;
+                    command.MaskTransform = parameters.MaskTransform;
+                    command.Opacity = parameters.Opacity;
+                    command.OpacityBrush = List->AddResource(parameters.OpacityBrush.Get());
+                    command.Options = parameters.LayerOptions;
+                }
+
+                void PopLayer() override
+                {
+                    List->Append<Command>(CommandType::PopLayer);
+                }
+            };
+
+            // Pixels being drawn, either the target or a layer positioned on it.
+            struct Surface
+            {
+                std::uint8_t * Bits;
+                unsigned Pitch;
+                int Left;
+                int Top;
+            };
+
+            struct LayerState
+            {
+                PixelRect Bounds;
+                ClipState PreviousClip;
+                size_t ClipDepth;
+                Surface PreviousSurface;
+                bool Pooled;
+                unsigned Buffer;
+                Pointer<GeometryImpl> Mask;
+                Matrix3x2F MaskTransform;
+                bool Aliased;
+                float Opacity;
+                Pointer<BrushImpl> OpacityBrush;
+                Matrix3x2F BrushMapping;
+                Cpu::LayerOptions Options;
+            };
+
+            // Draws into the pixels of a premultiplied B8G8R8A8 bitmap.
+            struct RasterTargetImpl : RenderTargetImpl
+            {
+                Pointer<BitmapImpl> Target;
+
+                // The pooled pixels of a scratch target, which go back to the pool with the
+                // target even if its bitmap is still held.
+                Pointer<PooledPixels> Scratch;
+                Surface Current;
+                ClipState Clip;
+                std::vector<ClipState> Clips;
+                std::vector<LayerState> Layers;
+                SurfacePool Pool;
+                Rasterizer Coverage;
+
+                // The glyphs of the runs being drawn and the brushes they're drawn with, kept
+                // to reuse their storage. The glyphs of one brush are also indexed by the
+                // bands of rows they cross, so a span only looks at those on its row.
+                struct PlacedGlyph
+                {
+                    int Left;
+                    int Top;
+                    int Right;
+                    int Bottom;
+                    std::uint8_t const * Pixels;
+                    unsigned Brush;
+                };
+
+                static unsigned const PlacedBandShift = 4;
+
+                // LCD is what the glyph cache takes to render glyphs for the brush, or zero
+                // for grayscale coverage.
+                struct PlacedBrush
+                {
+                    BrushImpl const * Brush;
+                    unsigned Lcd;
+                };
+
+                std::vector<PlacedGlyph> Placed;
+                std::vector<PlacedBrush> PlacedBrushes;
+                std::vector<unsigned> PlacedBands;
+                std::vector<unsigned> PlacedByBand;
+                std::vector<int> PlacedWidest;
+
+                auto IsReady() const -> bool override
+                {
+                    return nullptr != Target;
+                }
+
+                auto GetPixelSize() const -> SizeU override
+                {
+                    return Target ? Target->Size : SizeU();
+                }
+
+                // Draw calls intersect their bounds with this first, so that work outside the
+                // clip is rejected before anything is rasterized or shaded.
+                auto GetClip() const -> PixelRect
+                {
+                    return Clip.Outer;
+                }
+
+                auto GetPixels(int const x,
+                               int const y) const -> std::uint32_t *
+                {
+                    return reinterpret_cast<std::uint32_t *>(Current.Bits + static_cast<size_t>(y - Current.Top) * Current.Pitch) + (x - Current.Left);
+                }
+
+                void BeginFrame() override
+                {
+                    Current.Bits = Target->Bits;
+                    Current.Pitch = Target->Pitch;
+                    Current.Left = 0;
+                    Current.Top = 0;
+                    UpdateDirtyRegion();
+                    Clip = GetClipState(Dirty.GetBounds());
+                    Clips.clear();
+                    Layers.clear();
+                }
+
+                void EndFrame() override
+                {
+                    if (!Layers.empty() || !Clips.empty())
+                    {
+                        Fail(D2DERR_PUSH_POP_UNBALANCED);
+
+                        while (!Layers.empty())
+                        {
+                            Clips.resize(Layers.back().ClipDepth);
+                            PopLayer();
+                        }
+
+                        Clips.clear();
+                    }
+
+                    Pool.Trim();
+
+                    if (Glyphs)
+                    {
+                        Glyphs->Trim();
+                    }
+                }
+
+                // Scales coverage on the pixels that the clip only partly covers. Spans away
+                // from the clip edges are returned untouched.
+                auto ApplyClipEdges(int const x,
+                                    int const y,
+                                    unsigned const count,
+                                    std::uint8_t const * mask,
+                                    std::uint8_t * coverage) const -> std::uint8_t const *
+                {
+                    auto const & inner = Clip.Inner;
+                    auto const end = x + static_cast<int>(count);
+                    auto const insideRow = y >= inner.Top && y < inner.Bottom;
+
+                    if (insideRow && x >= inner.Left && end <= inner.Right)
+                    {
+                        return mask;
+                    }
+
+                    if (mask != coverage)
+                    {
+                        if (mask)
+                        {
+                            memcpy(coverage, mask, count);
+                        }
+                        else
+                        {
+                            memset(coverage, 255, count);
+                        }
+                    }
+
+                    auto const scale = [&] (int const pixel, float const factor)
+                    {
+                        auto & value = coverage[pixel - x];
+                        value = static_cast<std::uint8_t>(value * factor + 0.5f);
+                    };
+
+                    if (insideRow && inner.Left < inner.Right)
+                    {
+                        if (inner.Left - 1 >= x && inner.Left - 1 < end)
+                        {
+                            scale(inner.Left - 1, GetOverlap(Clip.Bounds.Left, Clip.Bounds.Right, inner.Left - 1));
+                        }
+
+                        if (inner.Right >= x && inner.Right < end)
+                        {
+                            scale(inner.Right, GetOverlap(Clip.Bounds.Left, Clip.Bounds.Right, inner.Right));
+                        }
+
+                        return coverage;
+                    }
+
+                    auto const row = GetOverlap(Clip.Bounds.Top, Clip.Bounds.Bottom, y);
+
+                    for (auto pixel = x; pixel != end; ++pixel)
+                    {
+                        scale(pixel, row * GetOverlap(Clip.Bounds.Left, Clip.Bounds.Right, pixel));
+                    }
+
+                    return coverage;
+                }
+
+                // Blends spans of the bounds in parallel rows. Cover returns the coverage of a
+                // span, or nullptr when fully covered. Shade returns the premultiplied source
+                // pixels and is not called for solid colors or spans without coverage.
+                template <typename Cover, typename Shade>
+                void Compose(PixelRect const & bounds,
+                             bool const solid,
+                             std::uint32_t const color,
+                             Cover const & cover,
+                             Shade const & shade)
+                {
+                    auto const width = static_cast<unsigned>(bounds.Right - bounds.Left);
+                    auto const grain = (std::max)(1u, 32768u / width);
+                    auto const edges = Clip.HasEdges();
+
+                    ParallelFor(static_cast<unsigned>(bounds.Bottom - bounds.Top), grain, [&] (unsigned const begin, unsigned const end)
+                    {
+                        std::uint8_t coverage[SpanSize];
+                        std::uint32_t pixels[SpanSize];
+
+                        for (auto row = begin; row != end; ++row)
+                        {
+                            auto const y = bounds.Top + static_cast<int>(row);
+
+                            for (auto x = bounds.Left; x < bounds.Right; x += SpanSize)
+                            {
+                                auto const count = (std::min)(SpanSize, static_cast<unsigned>(bounds.Right - x));
+                                auto mask = cover(x, y, count, coverage);
+
+                                if (edges)
+                                {
+                                    mask = ApplyClipEdges(x, y, count, mask, coverage);
+                                }
+
+                                auto first = 0u;
+                                auto last = count;
+
+                                if (mask)
+                                {
+                                    TrimZeroCoverage(mask, first, last);
+
+                                    if (first == last)
+                                    {
+                                        continue;
+                                    }
+
+                                    mask += first;
+                                }
+
+                                if (solid)
+                                {
+                                    BlendSolid(GetPixels(x + static_cast<int>(first), y), last - first, color, mask);
+                                }
+                                else
+                                {
+                                    BlendSpan(GetPixels(x + static_cast<int>(first), y), last - first, shade(x + static_cast<int>(first), y, last - first, pixels), mask);
+                                }
+                            }
+                        }
+                    });
+                }
+
+                // Runs a draw once for each rectangle of the dirty region, clipped to it. The
+                // clip in between already covers the bounds of the region, so a region of a
+                // single rectangle needs nothing more.
+                template <typename Draw>
+                void ForEachDirtyRect(Draw const & draw)
+                {
+                    if (1 == Dirty.GetCount())
+                    {
+                        draw();
+                        return;
+                    }
+
+                    auto const clip = Clip;
+
+                    for (unsigned i = 0; i != Dirty.GetCount(); ++i)
+                    {
+                        Clip = Intersect(clip, GetClipState(Dirty[i]).Bounds);
+
+                        if (!Clip.Outer.IsEmpty())
+                        {
+                            draw();
+                        }
+                    }
+
+                    Clip = clip;
+                }
+
+                void Clear(Color const & color) override
+                {
+                    ForEachDirtyRect([&] { RenderClear(color); });
+                }
+
+                void FillOpacityMask(BitmapImpl & mask,
+                                     BrushImpl const & brush,
+                                     RectF const & destination,
+                                     RectF const & source) override
+                {
+                    ForEachDirtyRect([&] { RenderOpacityMask(mask, brush, destination, source); });
+                }
+
+                void DrawBitmap(BitmapImpl & bitmap,
+                                RectF const & destination,
+                                float const opacity,
+                                BitmapInterpolationMode const mode,
+                                RectF const & source) override
+                {
+                    ForEachDirtyRect([&] { RenderBitmap(bitmap, destination, opacity, mode, source); });
+                }
+
+                void FillRectangle(RectF const & rect,
+                                   BrushImpl const & brush) override
+                {
+                    ForEachDirtyRect([&] { RenderRectangle(rect, brush); });
+                }
+
+                void FillRectangles(RectF const * rects,
+                                    unsigned const count,
+                                    BrushImpl const & brush) override
+                {
+                    ForEachDirtyRect([&]
+                    {
+                        for (unsigned i = 0; i != count; ++i)
+                        {
+                            RenderRectangle(rects[i], brush);
+                        }
+                    });
+                }
+
+                void FillEllipse(Ellipse const & ellipse,
+                                 BrushImpl const & brush) override
+                {
+                    EllipseGeometryImpl const geometry(ellipse);
+                    ForEachDirtyRect([&] { RenderGeometry(geometry, brush, nullptr); });
+                }
+
+                void FillGeometry(GeometryImpl const & geometry,
+                                  BrushImpl const & brush,
+                                  BrushImpl const * opacityBrush) override
+                {
+                    ForEachDirtyRect([&] { RenderGeometry(geometry, brush, opacityBrush); });
+                }
+
+                void DrawGlyphRun(Point2F const & baselineOrigin,
+                                  GlyphRun const & run,
+                                  BrushImpl const & brush,
+                                  MeasuringMode const mode) override
+                {
+                    BatchedGlyphRun batch(baselineOrigin, &run);
+                    batch.ForegroundBrush = &brush;
+                    DrawGlyphRuns(&batch, 1, mode);
+                }
+
+                // Runs drawn upright at a modest size under scaling and translation come from
+                // the glyph cache, and anything else is filled as outlines straight away. The
+                // cached glyphs of the whole batch are then blended with one pass per brush.
+                void DrawGlyphRuns(BatchedGlyphRun const * runs,
+                                   unsigned const count,
+                                   MeasuringMode const mode) override
+                {
+                    GetGlyphCache().BeginLookup();
+                    Placed.clear();
+                    PlacedBrushes.clear();
+
+                    auto const scaled = 0.0f == Transform._12 && 0.0f == Transform._21 && Transform._11 == Transform._22;
+                    auto const lcd = Cpu::TextAntialiasMode::ClearType == TextAntialiasMode &&
+                                     (!TextRenderingParams || PixelGeometry::Flat != TextRenderingParams->PixelGeometry);
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const & batch = runs[i];
+
+                        if (!batch.GlyphRun || !batch.ForegroundBrush || !batch.GlyphRun->FontFace || 0 == batch.GlyphRun->GlyphCount)
+                        {
+                            continue;
+                        }
+
+                        auto const & run = *batch.GlyphRun;
+                        auto const size = run.FontEmSize * Transform._11;
+                        auto const placed = Placed.size();
+
+                        if (run.IsSideways || !scaled ||
+                            !(0.0f < size && GlyphCache::MaximumGlyphSize >= size) ||
+                            !PlaceGlyphs(batch.BaselineOrigin, run, size, FindPlacedBrush(*batch.ForegroundBrush, lcd), mode))
+                        {
+                            Placed.resize(placed);
+                            RenderTargetImpl::DrawGlyphRun(batch.BaselineOrigin, run, *batch.ForegroundBrush, mode);
+                        }
+                    }
+
+                    std::sort(Placed.begin(), Placed.end(), [] (PlacedGlyph const & first, PlacedGlyph const & second)
+                    {
+                        return first.Brush < second.Brush || (first.Brush == second.Brush && first.Left < second.Left);
+                    });
+
+                    for (auto first = Placed.begin(); Placed.end() != first; )
+                    {
+                        auto const last = std::find_if(first, Placed.end(), [&] (PlacedGlyph const & glyph)
+                        {
+                            return glyph.Brush != first->Brush;
+                        });
+
+                        auto const bounds = IndexGlyphBands(first, last);
+                        ForEachDirtyRect([&] { RenderGlyphs(PlacedBrushes[first->Brush], bounds); });
+                        first = last;
+                    }
+                }
+
+                // ClearType glyphs are corrected for the luminance of solid brushes, and left
+                // as they are for others.
+                auto FindPlacedBrush(BrushImpl const & brush,
+                                     bool const lcd) -> unsigned
+                {
+                    auto const found = std::find_if(PlacedBrushes.rbegin(), PlacedBrushes.rend(), [&] (PlacedBrush const & placed)
+                    {
+                        return &brush == placed.Brush;
+                    });
+
+                    if (PlacedBrushes.rend() != found)
+                    {
+                        return static_cast<unsigned>(PlacedBrushes.rend() - found - 1);
+                    }
+
+                    PlacedBrush placed = { &brush, 0 };
+
+                    if (lcd)
+                    {
+                        static RenderingParamsImpl const defaults(1.8f, 0.5f, 1.0f, PixelGeometry::RGB);
+                        std::uint32_t color = 0;
+                        auto luminance = 0.5f;
+
+                        if (brush.IsSolid(color) && 0 != color >> 24)
+                        {
+                            luminance = (0.2126f * (color >> 16 & 0xff) + 0.7152f * (color >> 8 & 0xff) + 0.0722f * (color & 0xff)) / (color >> 24);
+                        }
+
+                        placed.Lcd = GetGlyphCache().GetLcdRendering(TextRenderingParams ? *TextRenderingParams : defaults, luminance);
+                    }
+
+                    PlacedBrushes.push_back(placed);
+                    return static_cast<unsigned>(PlacedBrushes.size() - 1);
+                }
+
+                // Finds the cached coverage of each glyph and where it goes on the target.
+                // Returns false if a glyph can't be cached. Text measured as GDI measures it
+                // is drawn on whole pixels, as aliased text is.
+                auto PlaceGlyphs(Point2F const & baselineOrigin,
+                                 GlyphRun const & run,
+                                 float const size,
+                                 unsigned const brush,
+                                 MeasuringMode const mode) -> bool
+                {
+                    auto & cache = GetGlyphCache();
+                    auto const aliased = Cpu::TextAntialiasMode::Aliased == TextAntialiasMode;
+                    auto const whole = aliased || MeasuringMode::Natural != mode;
+                    auto const lcd = PlacedBrushes[brush].Lcd;
+                    auto const limit = 1 << 24;
+                    auto result = true;
+
+                    ForEachGlyphOrigin(baselineOrigin, run, mode, [&] (unsigned short const index, Point2F const & origin)
+                    {
+                        auto const device = Transform.TransformPoint(origin);
+
+                        if (!result || !(limit > std::fabs(device.X) && limit > std::fabs(device.Y)))
+                        {
+                            result = false;
+                            return;
+                        }
+
+                        auto x = std::floor(whole ? device.X + 0.5f : device.X);
+                        auto subpixel = whole ? 0u : static_cast<unsigned>((device.X - x) * GlyphCache::SubpixelPositions + 0.5f);
+
+                        if (GlyphCache::SubpixelPositions == subpixel)
+                        {
+                            x += 1.0f;
+                            subpixel = 0;
+                        }
+
+                        GlyphCache::Glyph const * glyph = nullptr;
+
+                        if (!cache.Find(*run.FontFace, size, index, subpixel, aliased, lcd, glyph))
+                        {
+                            result = false;
+                            return;
+                        }
+
+                        if (0 == glyph->Width)
+                        {
+                            return;
+                        }
+
+                        PlacedGlyph placed;
+                        placed.Left = static_cast<int>(x) + glyph->Left;
+                        placed.Top = static_cast<int>(std::floor(device.Y + 0.5f)) + glyph->Top;
+                        placed.Right = placed.Left + static_cast<int>(glyph->Width);
+                        placed.Bottom = placed.Top + static_cast<int>(glyph->Height);
+                        placed.Pixels = cache.GetPixels(*glyph);
+                        placed.Brush = brush;
+                        Placed.push_back(placed);
+                    });
+
+                    return result;
+                }
+
+                // Lists the glyphs of one brush, sorted from left to right, under each band of
+                // rows they cross along with the widest glyph of each band.
+                auto IndexGlyphBands(std::vector<PlacedGlyph>::const_iterator const first,
+                                     std::vector<PlacedGlyph>::const_iterator const last) -> PixelRect
+                {
+                    PixelRect bounds = { first->Left, first->Top, first->Right, first->Bottom };
+
+                    for (auto glyph = first; last != glyph; ++glyph)
+                    {
+                        bounds.Left = (std::min)(bounds.Left, glyph->Left);
+                        bounds.Top = (std::min)(bounds.Top, glyph->Top);
+                        bounds.Right = (std::max)(bounds.Right, glyph->Right);
+                        bounds.Bottom = (std::max)(bounds.Bottom, glyph->Bottom);
+                    }
+
+                    auto const band = [&] (int const y)
+                    {
+                        return static_cast<unsigned>(y - bounds.Top) >> PlacedBandShift;
+                    };
+
+                    PlacedBands.assign(band(bounds.Bottom - 1) + 2, 0);
+                    PlacedWidest.assign(PlacedBands.size(), 0);
+
+                    for (auto glyph = first; last != glyph; ++glyph)
+                    {
+                        for (auto i = band(glyph->Top); i <= band(glyph->Bottom - 1); ++i)
+                        {
+                            ++PlacedBands[i + 1];
+                            PlacedWidest[i] = (std::max)(PlacedWidest[i], glyph->Right - glyph->Left);
+                        }
+                    }
+
+                    for (size_t i = 1; i != PlacedBands.size(); ++i)
+                    {
+                        PlacedBands[i] += PlacedBands[i - 1];
+                    }
+
+                    PlacedByBand.resize(PlacedBands.back());
+                    auto next = PlacedBands;
+
+                    for (auto glyph = first; last != glyph; ++glyph)
+                    {
+                        for (auto i = band(glyph->Top); i <= band(glyph->Bottom - 1); ++i)
+                        {
+                            PlacedByBand[next[i]++] = static_cast<unsigned>(glyph - Placed.cbegin());
+                        }
+                    }
+
+                    return bounds;
+                }
+
+                // The glyphs of one brush are blended in one pass over their bounds. Each span
+                // gathers the rows of the glyphs it crosses, taking the larger coverage where
+                // glyphs overlap, whether or not they belong to the same run.
+                void RenderGlyphs(PlacedBrush const & placed,
+                                  PixelRect const & glyphBounds)
+                {
+                    auto const bounds = Intersect(glyphBounds, GetClip());
+
+                    if (bounds.IsEmpty())
+                    {
+                        return;
+                    }
+
+                    auto const top = glyphBounds.Top;
+                    auto const channels = placed.Lcd ? 4 : 1;
+
+                    auto const gather = [&] (int const x, int const y, unsigned const count, std::uint8_t * coverage)
+                    {
+                        auto const end = x + static_cast<int>(count);
+                        auto const band = static_cast<unsigned>(y - top) >> PlacedBandShift;
+                        auto const bandEnd = PlacedByBand.cbegin() + PlacedBands[band + 1];
+                        memset(coverage, 0, count * channels);
+
+                        auto index = std::lower_bound(PlacedByBand.cbegin() + PlacedBands[band], bandEnd, x - PlacedWidest[band], [&] (unsigned const glyph, int const left)
+                        {
+                            return Placed[glyph].Left <= left;
+                        });
+
+                        for (; bandEnd != index && Placed[*index].Left < end; ++index)
+                        {
+                            auto const & glyph = Placed[*index];
+
+                            if (y < glyph.Top || y >= glyph.Bottom || x >= glyph.Right)
+                            {
+                                continue;
+                            }
+
+                            auto const from = (std::max)(x, glyph.Left);
+                            auto const to = (std::min)(end, glyph.Right);
+                            auto const row = glyph.Pixels + static_cast<size_t>(y - glyph.Top) * GlyphCache::PageSize + (from - glyph.Left) * channels;
+                            MaxCoverage(coverage + (from - x) * channels, row, static_cast<unsigned>((to - from) * channels));
+                        }
+                    };
+
+                    if (placed.Lcd)
+                    {
+                        ComposeBrushChannels(bounds, *placed.Brush, [&] (int const x, int const y, unsigned const count, std::uint32_t * coverage)
+                        {
+                            gather(x, y, count, reinterpret_cast<std::uint8_t *>(coverage));
+                        });
+                    }
+                    else
+                    {
+                        ComposeBrush(bounds, *placed.Brush, [&] (int const x, int const y, unsigned const count, std::uint8_t * coverage) -> std::uint8_t const *
+                        {
+                            gather(x, y, count, coverage);
+                            return coverage;
+                        });
+                    }
+                }
+
+                void DrawImage(CommandListImpl & list,
+                               Point2F const & offset) override
+                {
+                    DrawCommandList(*this, list, offset);
+                }
+
+                // Pixels on the edges of an antialiased clip are replaced in proportion to
+                // how much of them the clip covers.
+                void RenderClear(Color const & color)
+                {
+                    auto const bounds = GetClip();
+                    auto const value = PackColor(color);
+
+                    for (auto y = bounds.Top; y < bounds.Bottom; ++y)
+                    {
+                        auto const pixels = GetPixels(bounds.Left, y);
+                        auto const width = static_cast<unsigned>(bounds.Right - bounds.Left);
+
+                        if (!Clip.HasEdges())
+                        {
+                            FillPixels(pixels, width, value);
+                            continue;
+                        }
+
+                        std::uint8_t coverage[SpanSize];
+
+                        for (unsigned x = 0; x < width; x += SpanSize)
+                        {
+                            auto const count = (std::min)(SpanSize, width - x);
+                            auto const mask = ApplyClipEdges(bounds.Left + static_cast<int>(x), y, count, nullptr, coverage);
+
+                            if (!mask)
+                            {
+                                FillPixels(pixels + x, count, value);
+                                continue;
+                            }
+
+                            for (unsigned i = 0; i != count; ++i)
+                            {
+                                auto & target = pixels[x + i];
+                                target = MultiplyPixel(value, mask[i]) + MultiplyPixel(target, 255 - mask[i]);
+                            }
+                        }
+                    }
+                }
+
+                // Blends the brush through the mask. A solid brush never produces source
+                // pixels, and a mask drawn at its own size on whole pixels is read in place
+                // rather than resampled.
+                void RenderOpacityMask(BitmapImpl & mask,
+                                       BrushImpl const & brush,
+                                       RectF const & destination,
+                                       RectF const & source)
+                {
+                    unsigned stride, offset;
+
+                    if (!GetCoverageLayout(mask.Format.Format, stride, offset))
+                    {
+                        Fail(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+                        return;
+                    }
+
+                    auto const bounds = Intersect(GetPixelBounds(destination, Transform), GetClip());
+                    Matrix3x2F mapping;
+
+                    if (bounds.IsEmpty() || !GetSourceMapping(Transform, destination, source, mapping))
+                    {
+                        return;
+                    }
+
+                    std::uint32_t color = 0;
+                    auto const solid = brush.IsSolid(color);
+
+                    if (solid && 0 == color)
+                    {
+                        return;
+                    }
+
+                    auto brushMapping = brush.Transform * Transform;
+
+                    if (!brushMapping.Invert())
+                    {
+                        return;
+                    }
+
+                    auto const shade = [&] (int const x, int const y, unsigned const count, std::uint32_t * pixels) -> std::uint32_t const *
+                    {
+                        brush.Shade(brushMapping, x, y, count, pixels);
+                        return pixels;
+                    };
+
+                    auto const bits = mask.GetBits() + offset;
+                    auto const pitch = mask.Pitch;
+                    int offsetX, offsetY;
+
+                    if (IsPixelAligned(Transform, destination, source, offsetX, offsetY))
+                    {
+                        Compose(bounds, solid, color, [&] (int const x, int const y, unsigned const count, std::uint8_t * coverage) -> std::uint8_t const *
+                        {
+                            auto const row = bits + static_cast<size_t>(y - offsetY) * pitch + static_cast<size_t>(x - offsetX) * stride;
+
+                            if (1 == stride)
+                            {
+                                return row;
+                            }
+
+                            for (unsigned i = 0; i != count; ++i)
+                            {
+                                coverage[i] = row[i * stride];
+                            }
+
+                            return coverage;
+                        }, shade);
+
+                        return;
+                    }
+
+                    CoverageSampler sampler;
+                    sampler.Bits = bits;
+                    sampler.Pitch = pitch;
+                    sampler.Stride = stride;
+                    sampler.Mapping = mapping;
+                    sampler.Source = source;
+                    sampler.Left = ToPixel(std::floor(source.Left));
+                    sampler.Top = ToPixel(std::floor(source.Top));
+                    sampler.Right = ToPixel(std::ceil(source.Right));
+                    sampler.Bottom = ToPixel(std::ceil(source.Bottom));
+                    sampler.Scale = 255;
+
+                    Compose(bounds, solid, color, [&] (int const x, int const y, unsigned const count, std::uint8_t * coverage) -> std::uint8_t const *
+                    {
+                        sampler.Sample(x, y, count, coverage);
+                        return coverage;
+                    }, shade);
+                }
+
+                void RenderBitmap(BitmapImpl & bitmap,
+                                  RectF const & destination,
+                                  float const opacity,
+                                  BitmapInterpolationMode const mode,
+                                  RectF const & source)
+                {
+                    if (!IsDrawableFormat(bitmap.Format.Format))
+                    {
+                        Fail(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+                        return;
+                    }
+
+                    auto const bounds = Intersect(GetPixelBounds(destination, Transform), GetClip());
+                    auto const scale = GetOpacityScale(opacity);
+                    Matrix3x2F mapping;
+
+                    if (bounds.IsEmpty() || 0 == scale || !GetSourceMapping(Transform, destination, source, mapping))
+                    {
+                        return;
+                    }
+
+                    auto const sampler = GetImageSampler(bitmap, ExtendMode::Clamp, ExtendMode::Clamp, BitmapInterpolationMode::Linear == mode);
+                    std::uint8_t constant[SpanSize];
+                    memset(constant, static_cast<int>(scale), sizeof(constant));
+                    int offsetX, offsetY;
+
+                    if (IsPixelAligned(Transform, destination, source, offsetX, offsetY))
+                    {
+                        Compose(bounds, false, 0, [&] (int, int, unsigned, std::uint8_t *) -> std::uint8_t const *
+                        {
+                            return 255 == scale ? nullptr : constant;
+                        },
+                        [&] (int const x, int const y, unsigned, std::uint32_t *) -> std::uint32_t const *
+                        {
+                            return reinterpret_cast<std::uint32_t const *>(sampler.Bits + static_cast<size_t>(y - offsetY) * sampler.Pitch) + (x - offsetX);
+                        });
+
+                        return;
+                    }
+
+                    CoverageSampler coverage;
+                    coverage.Bits = nullptr;
+                    coverage.Mapping = mapping;
+                    coverage.Source = source;
+                    coverage.Scale = scale;
+
+                    Compose(bounds, false, 0, [&] (int const x, int const y, unsigned const count, std::uint8_t * output) -> std::uint8_t const *
+                    {
+                        coverage.Sample(x, y, count, output);
+                        return output;
+                    },
+                    [&] (int const x, int const y, unsigned const count, std::uint32_t * pixels) -> std::uint32_t const *
+                    {
+                        sampler.Sample(mapping, x, y, count, pixels);
+                        return pixels;
+                    });
+                }
+
+                // Scales coverage by the alpha of a brush, for opacity brushes.
+                static void ApplyOpacityBrush(BrushImpl const & brush,
+                                              Matrix3x2F const & mapping,
+                                              int const x,
+                                              int const y,
+                                              unsigned const count,
+                                              std::uint8_t * coverage)
+                {
+                    std::uint32_t pixels[SpanSize];
+                    brush.Shade(mapping, x, y, count, pixels);
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        coverage[i] = static_cast<std::uint8_t>(CoverageSampler::Divide255(coverage[i] * (pixels[i] >> 24)));
+                    }
+                }
+
+                auto IsVisible(BrushImpl const & brush) const -> bool
+                {
+                    std::uint32_t color = 0;
+                    return !(brush.IsSolid(color) && 0 == color) && (brush.Transform * Transform).IsInvertible();
+                }
+
+                template <typename Cover>
+                void ComposeBrush(PixelRect const & bounds,
+                                  BrushImpl const & brush,
+                                  Cover const & cover)
+                {
+                    std::uint32_t color = 0;
+                    auto const solid = brush.IsSolid(color);
+                    auto mapping = brush.Transform * Transform;
+
+                    if ((solid && 0 == color) || !mapping.Invert())
+                    {
+                        return;
+                    }
+
+                    Compose(bounds, solid, color, cover, [&] (int const x, int const y, unsigned const count, std::uint32_t * pixels) -> std::uint32_t const *
+                    {
+                        brush.Shade(mapping, x, y, count, pixels);
+                        return pixels;
+                    });
+                }
+
+                // As ComposeBrush, with a byte of coverage for each channel of a pixel, as
+                // LCD text has. Cover fills in four bytes for each pixel of the span.
+                template <typename Cover>
+                void ComposeBrushChannels(PixelRect const & bounds,
+                                          BrushImpl const & brush,
+                                          Cover const & cover)
+                {
+                    std::uint32_t color = 0;
+                    auto const solid = brush.IsSolid(color);
+                    auto mapping = brush.Transform * Transform;
+
+                    if ((solid && 0 == color) || !mapping.Invert())
+                    {
+                        return;
+                    }
+
+                    auto const width = static_cast<unsigned>(bounds.Right - bounds.Left);
+                    auto const grain = (std::max)(1u, 32768u / width);
+                    auto const edges = Clip.HasEdges();
+
+                    ParallelFor(static_cast<unsigned>(bounds.Bottom - bounds.Top), grain, [&] (unsigned const begin, unsigned const end)
+                    {
+                        std::uint32_t coverage[SpanSize];
+                        std::uint8_t edge[SpanSize];
+                        std::uint32_t pixels[SpanSize];
+
+                        if (solid)
+                        {
+                            FillPixels(pixels, SpanSize, color);
+                        }
+
+                        for (auto row = begin; row != end; ++row)
+                        {
+                            auto const y = bounds.Top + static_cast<int>(row);
+
+                            for (auto x = bounds.Left; x < bounds.Right; x += SpanSize)
+                            {
+                                auto const count = (std::min)(SpanSize, static_cast<unsigned>(bounds.Right - x));
+                                cover(x, y, count, coverage);
+
+                                if (edges)
+                                {
+                                    if (auto const mask = ApplyClipEdges(x, y, count, nullptr, edge))
+                                    {
+                                        for (unsigned i = 0; i != count; ++i)
+                                        {
+                                            coverage[i] = MultiplyPixel(coverage[i], mask[i]);
+                                        }
+                                    }
+                                }
+
+                                auto first = 0u;
+                                auto last = count;
+
+                                while (first != last && 0 == coverage[first])
+                                {
+                                    ++first;
+                                }
+
+                                while (first != last && 0 == coverage[last - 1])
+                                {
+                                    --last;
+                                }
+
+                                if (first == last)
+                                {
+                                    continue;
+                                }
+
+                                auto const left = x + static_cast<int>(first);
+
+                                if (!solid)
+                                {
+                                    brush.Shade(mapping, left, y, last - first, pixels);
+                                }
+
+                                BlendSpanChannels(GetPixels(left, y), last - first, pixels, coverage + first);
+                            }
+                        }
+                    });
+                }
+
+                // Rectangles under scaling and translation get exact coverage on their edge
+                // pixels, and spans inside the rectangle need no coverage at all.
+                void RenderRectangle(RectF const & rect,
+                                     BrushImpl const & brush)
+                {
+                    if (!Transform.IsAxisAligned())
+                    {
+                        FillPolygon(rect, brush);
+                        return;
+                    }
+
+                    auto const first = Transform.TransformPoint(Point2F(rect.Left, rect.Top));
+                    auto const second = Transform.TransformPoint(Point2F(rect.Right, rect.Bottom));
+                    RectF const device((std::min)(first.X, second.X),
+                                       (std::min)(first.Y, second.Y),
+                                       (std::max)(first.X, second.X),
+                                       (std::max)(first.Y, second.Y));
+
+                    if (AntialiasMode::Aliased == AntialiasMode)
+                    {
+                        auto const bounds = Intersect(GetPixelBounds(device, Matrix3x2F()), GetClip());
+
+                        if (!bounds.IsEmpty())
+                        {
+                            ComposeBrush(bounds, brush, [] (int, int, unsigned, std::uint8_t *) -> std::uint8_t const *
+                            {
+                                return nullptr;
+                            });
+                        }
+
+                        return;
+                    }
+
+                    auto const bounds = Intersect(GetOuterBounds(device), GetClip());
+
+                    if (bounds.IsEmpty())
+                    {
+                        return;
+                    }
+
+                    auto const insideLeft = static_cast<int>(std::ceil(device.Left));
+                    auto const insideRight = static_cast<int>(std::floor(device.Right));
+
+                    auto const overlap = [] (float const low, float const high, int const pixel)
+                    {
+                        return (std::max)(0.0f, (std::min)(high, pixel + 1.0f) - (std::max)(low, static_cast<float>(pixel)));
+                    };
+
+                    ComposeBrush(bounds, brush, [&] (int const x, int const y, unsigned const count, std::uint8_t * coverage) -> std::uint8_t const *
+                    {
+                        auto const row = overlap(device.Top, device.Bottom, y);
+
+                        if (1.0f <= row && x >= insideLeft && x + static_cast<int>(count) <= insideRight)
+                        {
+                            return nullptr;
+                        }
+
+                        for (unsigned i = 0; i != count; ++i)
+                        {
+                            auto const pixel = x + static_cast<int>(i);
+                            auto const column = pixel >= insideLeft && pixel < insideRight ? 1.0f : overlap(device.Left, device.Right, pixel);
+                            coverage[i] = static_cast<std::uint8_t>(column * row * 255.0f + 0.5f);
+                        }
+
+                        return coverage;
+                    });
+                }
+
+                void FillPolygon(RectF const & rect,
+                                 BrushImpl const & brush)
+                {
+                    RectangleGeometryImpl const geometry(rect);
+                    RenderGeometry(geometry, brush, nullptr);
+                }
+
+                void RenderGeometry(GeometryImpl const & geometry,
+                                    BrushImpl const & brush,
+                                    BrushImpl const * opacityBrush)
+                {
+                    RectF rect;
+
+                    if (!opacityBrush && Transform.IsAxisAligned() && geometry.IsRectangle(rect))
+                    {
+                        RenderRectangle(rect, brush);
+                        return;
+                    }
+
+                    auto const bounds = Intersect(GetOuterBounds(geometry.GetBounds(Transform)), GetClip());
+
+                    if (bounds.IsEmpty() || !IsVisible(brush))
+                    {
+                        return;
+                    }
+
+                    Matrix3x2F opacityMapping;
+
+                    if (opacityBrush)
+                    {
+                        opacityMapping = opacityBrush->Transform * Transform;
+
+                        if (!opacityMapping.Invert())
+                        {
+                            return;
+                        }
+                    }
+
+                    Coverage.Reset(bounds);
+                    Coverage.AddGeometry(geometry, Transform);
+                    auto const aliased = AntialiasMode::Aliased == AntialiasMode;
+
+                    ComposeBrush(bounds, brush, [&] (int const x, int const y, unsigned const count, std::uint8_t * coverage) -> std::uint8_t const *
+                    {
+                        Coverage.GetCoverage(x, y, count, geometry.FillMode, aliased, coverage);
+
+                        if (opacityBrush && !IsZeroCoverage(coverage, count))
+                        {
+                            ApplyOpacityBrush(*opacityBrush, opacityMapping, x, y, count, coverage);
+                        }
+
+                        return coverage;
+                    });
+                }
+
+                // Clips are kept as rectangles rather than masks. Pushing one saves the current
+                // clip on a stack that keeps its storage from frame to frame, and draw calls
+                // scale coverage only on the pixels the clip covers partly. As with Direct2D,
+                // a rotated or skewed transform clips to the bounds of the transformed rect.
+                void PushAxisAlignedClip(RectF const & rect,
+                                         Cpu::AntialiasMode const mode) override
+                {
+                    auto device = TransformBounds(rect, Transform);
+
+                    if (Cpu::AntialiasMode::Aliased == mode)
+                    {
+                        device = RectF(std::floor(device.Left + 0.5f),
+                                       std::floor(device.Top + 0.5f),
+                                       std::floor(device.Right + 0.5f),
+                                       std::floor(device.Bottom + 0.5f));
+                    }
+
+                    Clips.push_back(Clip);
+                    Clip = Intersect(Clip, device);
+                }
+
+                void PopAxisAlignedClip() override
+                {
+                    if (Clips.size() <= (Layers.empty() ? 0 : Layers.back().ClipDepth))
+                    {
+                        Fail(D2DERR_POP_CALL_DID_NOT_MATCH_PUSH);
+                        return;
+                    }
+
+                    Clip = Clips.back();
+                    Clips.pop_back();
+                }
+
+                // Layers are drawn into a pooled buffer covering only what can be seen: the
+                // content bounds, the mask bounds and the clip. Without opacity and with at
+                // most a rectangular mask, the layer is just a narrower clip on the target.
+                void PushLayer(LayerParameters const & parameters) override
+                {
+                    LayerState layer;
+                    layer.Bounds = Clip.Outer;
+                    layer.PreviousClip = Clip;
+                    layer.ClipDepth = Clips.size();
+                    layer.PreviousSurface = Current;
+                    layer.Pooled = false;
+                    layer.Buffer = 0;
+                    layer.Mask = parameters.GeometricMask.Share();
+                    layer.MaskTransform = parameters.MaskTransform * Transform;
+                    layer.Aliased = AntialiasMode::Aliased == parameters.MaskAntialiasMode;
+                    layer.Opacity = parameters.Opacity;
+                    layer.OpacityBrush = parameters.OpacityBrush.Share();
+                    layer.Options = parameters.LayerOptions;
+
+                    if (-FLT_MAX < parameters.ContentBounds.Left || -FLT_MAX < parameters.ContentBounds.Top ||
+                        FLT_MAX > parameters.ContentBounds.Right || FLT_MAX > parameters.ContentBounds.Bottom)
+                    {
+                        layer.Bounds = Intersect(layer.Bounds, GetOuterBounds(parameters.ContentBounds, Transform));
+                    }
+
+                    if (layer.Mask)
+                    {
+                        layer.Bounds = Intersect(layer.Bounds, GetOuterBounds(layer.Mask->GetBounds(layer.MaskTransform)));
+                    }
+
+                    if (layer.OpacityBrush)
+                    {
+                        layer.BrushMapping = layer.OpacityBrush->Transform * Transform;
+
+                        if (!layer.BrushMapping.Invert())
+                        {
+                            layer.Opacity = 0.0f;
+                        }
+                    }
+
+                    if (layer.Bounds.IsEmpty() || 0 == GetOpacityScale(layer.Opacity))
+                    {
+                        layer.Bounds.Right = layer.Bounds.Left;
+                        Clip = GetClipState(layer.Bounds);
+                        Layers.push_back(std::move(layer));
+                        return;
+                    }
+
+                    RectF rect;
+
+                    if (255 == GetOpacityScale(layer.Opacity) &&
+                        !layer.OpacityBrush &&
+                        LayerOptions::None == (layer.Options & LayerOptions::IgnoreAlpha) &&
+                        (!layer.Mask || (layer.Mask->IsRectangle(rect) && GetRectangleClip(rect, layer.MaskTransform, layer.Aliased, layer.Bounds))))
+                    {
+                        Clip = Intersect(Clip, GetClipState(layer.Bounds).Bounds);
+                        Layers.push_back(std::move(layer));
+                        return;
+                    }
+
+                    auto const width = static_cast<unsigned>(layer.Bounds.Right - layer.Bounds.Left);
+                    auto const height = static_cast<unsigned>(layer.Bounds.Bottom - layer.Bounds.Top);
+                    layer.Pooled = true;
+                    layer.Buffer = Pool.Acquire(width, height);
+
+                    Current.Bits = reinterpret_cast<std::uint8_t *>(Pool.GetPixels(layer.Buffer));
+                    Current.Pitch = Pool.GetPitch(layer.Buffer);
+                    Current.Left = layer.Bounds.Left;
+                    Current.Top = layer.Bounds.Top;
+
+                    // The fractional edges of the clip are applied once, when the layer is
+                    // composited, rather than to everything drawn into it.
+                    Clip = GetClipState(layer.Bounds);
+
+                    auto const background = LayerOptions::None != (layer.Options & LayerOptions::InitializeFromBackground);
+                    auto const & parent = layer.PreviousSurface;
+
+                    for (auto y = layer.Bounds.Top; y < layer.Bounds.Bottom; ++y)
+                    {
+                        auto const row = GetPixels(layer.Bounds.Left, y);
+
+                        if (background)
+                        {
+                            memcpy(row,
+                                   parent.Bits + static_cast<size_t>(y - parent.Top) * parent.Pitch + static_cast<size_t>(layer.Bounds.Left - parent.Left) * 4,
+                                   width * 4);
+                        }
+                        else
+                        {
+                            memset(row, 0, width * 4);
+                        }
+                    }
+
+                    Layers.push_back(std::move(layer));
+                }
+
+                void PopLayer() override
+                {
+                    if (Layers.empty() || Layers.back().ClipDepth != Clips.size())
+                    {
+                        Fail(D2DERR_POP_CALL_DID_NOT_MATCH_PUSH);
+                        return;
+                    }
+
+                    auto const layer = std::move(Layers.back());
+                    Layers.pop_back();
+                    auto const pixels = Current;
+                    Current = layer.PreviousSurface;
+                    Clip = layer.PreviousClip;
+
+                    if (!layer.Pooled)
+                    {
+                        return;
+                    }
+
+                    auto const & bounds = layer.Bounds;
+                    auto const width = static_cast<unsigned>(bounds.Right - bounds.Left);
+
+                    auto const row = [&] (int const x, int const y)
+                    {
+                        return reinterpret_cast<std::uint32_t *>(pixels.Bits + static_cast<size_t>(y - pixels.Top) * pixels.Pitch) + (x - pixels.Left);
+                    };
+
+                    if (LayerOptions::None != (layer.Options & LayerOptions::IgnoreAlpha))
+                    {
+                        for (auto y = bounds.Top; y < bounds.Bottom; ++y)
+                        {
+                            auto const line = row(bounds.Left, y);
+
+                            for (unsigned x = 0; x != width; ++x)
+                            {
+                                line[x] |= 0xff000000;
+                            }
+                        }
+                    }
+
+                    auto const scale = GetOpacityScale(layer.Opacity);
+                    std::uint8_t constant[SpanSize];
+                    memset(constant, static_cast<int>(scale), sizeof(constant));
+
+                    ForEachDirtyRect([&]
+                    {
+                        auto const area = Intersect(bounds, GetClip());
+
+                        if (area.IsEmpty())
+                        {
+                            return;
+                        }
+
+                        if (layer.Mask)
+                        {
+                            Coverage.Reset(area);
+                            Coverage.AddGeometry(*layer.Mask, layer.MaskTransform);
+                        }
+
+                        Compose(area, false, 0, [&] (int const x, int const y, unsigned const count, std::uint8_t * coverage) -> std::uint8_t const *
+                        {
+                            if (!layer.Mask)
+                            {
+                                if (!layer.OpacityBrush)
+                                {
+                                    return 255 == scale ? nullptr : constant;
+                                }
+
+                                memset(coverage, static_cast<int>(scale), count);
+                            }
+                            else
+                            {
+                                Coverage.GetCoverage(x, y, count, layer.Mask->FillMode, layer.Aliased, coverage);
+
+                                if (255 != scale)
+                                {
+                                    for (unsigned i = 0; i != count; ++i)
+                                    {
+                                        coverage[i] = static_cast<std::uint8_t>(CoverageSampler::Divide255(coverage[i] * scale));
+                                    }
+                                }
+                            }
+
+                            if (layer.OpacityBrush && !IsZeroCoverage(coverage, count))
+                            {
+                                ApplyOpacityBrush(*layer.OpacityBrush, layer.BrushMapping, x, y, count, coverage);
+                            }
+
+                            return coverage;
+                        },
+                        [&] (int const x, int const y, unsigned, std::uint32_t *) -> std::uint32_t const *
+                        {
+                            return row(x, y);
+                        });
+                    });
+
+                    Pool.Release(layer.Buffer);
+                }
+            };
+
+            inline auto GetBitmapRect(BitmapImpl const & bitmap) -> RectF
+            {
+                return RectF(0.0f,
+                             0.0f,
+                             static_cast<float>(bitmap.Size.Width),
+                             static_cast<float>(bitmap.Size.Height));
+            }
+
+            // Source rectangles are limited to the bitmap, as Direct2D does.
+            inline auto ClampSourceRect(BitmapImpl const & bitmap,
+                                        RectF const & source) -> RectF
+            {
+                auto const bounds = GetBitmapRect(bitmap);
+
+                return RectF((std::max)(source.Left, bounds.Left),
+                             (std::max)(source.Top, bounds.Top),
+                             (std::min)(source.Right, bounds.Right),
+                             (std::min)(source.Bottom, bounds.Bottom));
+            }
+
+        } // Details
+
+        struct BitmapRenderTarget;
+
+        // A software render target with the shape of the Direct2D render target. It
+        // draws into a premultiplied B8G8R8A8 bitmap.
+        struct RenderTarget : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(RenderTarget, Details::Object, Details::RenderTargetImpl)
+
+            auto CreateBitmap(SizeU const & size,
+                              PixelFormat const & format = PixelFormat(Dxgi::Format::B8G8R8A8_UNORM, AlphaMode::Premultiplied)) const -> Bitmap;
+
+            auto CreateBitmapBrush(Bitmap const & bitmap,
+                                   ResourceLifetime lifetime = ResourceLifetime::Default) const -> BitmapBrush;
+
+            auto CreateBitmapBrush(Bitmap const & bitmap,
+                                   BitmapBrushProperties const & bitmapBrushProperties,
+                                   ResourceLifetime lifetime = ResourceLifetime::Default) const -> BitmapBrush;
+
+            auto CreateBitmapBrush(Bitmap const & bitmap,
+                                   BitmapBrushProperties const & bitmapBrushProperties,
+                                   BrushProperties const & brushProperties,
+                                   ResourceLifetime lifetime = ResourceLifetime::Default) const -> BitmapBrush;
+
+            auto CreateSolidColorBrush(Color const & color,
+                                       ResourceLifetime lifetime = ResourceLifetime::Default) const -> SolidColorBrush;
+
+            auto CreateSolidColorBrush(Color const & color,
+                                       BrushProperties const & properties,
+                                       ResourceLifetime lifetime = ResourceLifetime::Default) const -> SolidColorBrush;
+
+            auto CreateGradientStopCollection(GradientStop const * stops,
+                                              unsigned count,
+                                              ExtendMode mode = ExtendMode::Clamp,
+                                              ResourceLifetime lifetime = ResourceLifetime::Default) const -> GradientStopCollection;
+
+            template <unsigned Count>
+            auto CreateGradientStopCollection(GradientStop const (&stops)[Count],
+                                              ExtendMode mode = ExtendMode::Clamp,
+                                              ResourceLifetime lifetime = ResourceLifetime::Default) const -> GradientStopCollection
+            {
+                return CreateGradientStopCollection(stops,
+                                                    Count,
+                                                    mode,
+                                                    lifetime);
+            }
+
+            auto CreateLinearGradientBrush(LinearGradientBrushProperties const & linearGradientBrushProperties,
+                                           GradientStopCollection const & stops,
+                                           ResourceLifetime lifetime = ResourceLifetime::Default) const -> LinearGradientBrush;
+
+            auto CreateLinearGradientBrush(LinearGradientBrushProperties const & linearGradientBrushProperties,
+                                           BrushProperties const & brushProperties,
+                                           GradientStopCollection const & stops,
+                                           ResourceLifetime lifetime = ResourceLifetime::Default) const -> LinearGradientBrush;
+
+            auto CreateRadialGradientBrush(RadialGradientBrushProperties const & radialGradientBrushProperties,
+                                           GradientStopCollection const & stops,
+                                           ResourceLifetime lifetime = ResourceLifetime::Default) const -> RadialGradientBrush;
+
+            auto CreateRadialGradientBrush(RadialGradientBrushProperties const & radialGradientBrushProperties,
+                                           BrushProperties const & brushProperties,
+                                           GradientStopCollection const & stops,
+                                           ResourceLifetime lifetime = ResourceLifetime::Default) const -> RadialGradientBrush;
+
+            // Path geometries don't depend on a render target, but may use its frame
+            // memory when they are transient.
+            auto CreatePathGeometry(ResourceLifetime lifetime = ResourceLifetime::Default) const -> PathGeometry;
+
+            // Compatible render targets draw into surfaces recycled from a pool kept by
+            // this render target, so their contents start out undefined, as they do in
+            // Direct2D. A surface returns to the pool once the target and its bitmap are
+            // released, or with the target alone in scratch mode.
+            auto CreateCompatibleRenderTarget() const -> BitmapRenderTarget;
+            auto CreateCompatibleRenderTarget(SizeU const & desiredPixelSize) const -> BitmapRenderTarget;
+
+            auto CreateCompatibleRenderTarget(SizeU const & desiredPixelSize,
+                                              PixelFormat const & desiredFormat,
+                                              CompatibleRenderTargetOptions options = CompatibleRenderTargetOptions::None) const -> BitmapRenderTarget;
+
+            // Limits the memory the pool of compatible render targets holds on to.
+            void SetMaximumTextureMemory(std::uint64_t maximumInBytes) const;
+            auto GetMaximumTextureMemory() const -> std::uint64_t;
+
+            // Limits the memory the cache of rasterized glyphs holds on to.
+            void SetMaximumGlyphCacheMemory(std::uint64_t maximumInBytes) const;
+            auto GetMaximumGlyphCacheMemory() const -> std::uint64_t;
+
+            auto CreateLayer() const -> Layer;
+            auto CreateLayer(SizeF const & size) const -> Layer;
+
+            void FillRectangle(RectF const & rect,
+                               Brush const & brush) const;
+
+            void FillEllipse(Ellipse const & ellipse,
+                             Brush const & brush) const;
+
+            void FillGeometry(Geometry const & geometry,
+                              Brush const & brush) const;
+
+            void FillGeometry(Geometry const & geometry,
+                              Brush const & brush,
+                              Brush const & opacityBrush) const;
+
+            void DrawGlyphRun(Point2F const & baselineOrigin,
+                              GlyphRun const & glyphRun,
+                              Brush const & foregroundBrush,
+                              MeasuringMode measuringMode = MeasuringMode::Natural) const;
+
+            // Draws many runs at once, such as the labels of a chart or the cells of a grid,
+            // blending the glyphs of each brush in one pass. Overlapping glyphs take the
+            // larger of their coverages, across runs as within one, so wherever runs overlap
+            // the result differs from drawing them one at a time, even with the same brush.
+            // The brushes are also blended in the order they first appear, and runs filled
+            // as outlines are drawn first. Runs that don't overlap are drawn just as
+            // DrawGlyphRun draws them.
+            void DrawGlyphRuns(BatchedGlyphRun const * runs,
+                               unsigned count,
+                               MeasuringMode measuringMode = MeasuringMode::Natural) const;
+
+            template <unsigned Count>
+            void DrawGlyphRuns(BatchedGlyphRun const (&runs)[Count],
+                               MeasuringMode measuringMode = MeasuringMode::Natural) const
+            {
+                DrawGlyphRuns(runs,
+                              Count,
+                              measuringMode);
+            }
+
+            // Lays the text out for the rectangle and draws it. Short Latin text that fits on
+            // one line is drawn straight from the glyphs of its face, and anything else through
+            // a layout, which is cheaper to keep between frames and draw with DrawTextLayout.
+            void DrawText(wchar_t const * string,
+                          unsigned length,
+                          TextFormat const & textFormat,
+                          RectF const & layoutRect,
+                          Brush const & brush,
+                          DrawTextOptions options = DrawTextOptions::None) const;
+
+            void DrawTextLayout(Point2F const & origin,
+                                TextLayout const & textLayout,
+                                Brush const & brush,
+                                DrawTextOptions options = DrawTextOptions::None) const;
+
+            void FillOpacityMask(Bitmap const & mask,
+                                 Brush const & brush,
+                                 OpacityMaskContent content) const;
+
+            void FillOpacityMask(Bitmap const & mask,
+                                 Brush const & brush,
+                                 OpacityMaskContent content,
+                                 RectF const & destination,
+                                 RectF const & source) const;
+
+            void DrawBitmap(Bitmap const & bitmap) const;
+
+            void DrawBitmap(Bitmap const & bitmap,
+                            float opacity) const;
+
+            void DrawBitmap(Bitmap const & bitmap,
+                            RectF const & destination) const;
+
+            void DrawBitmap(Bitmap const & bitmap,
+                            RectF const & destination,
+                            float opacity) const;
+
+            void DrawBitmap(Bitmap const & bitmap,
+                            RectF const & destination,
+                            float opacity,
+                            BitmapInterpolationMode mode) const;
+
+            void DrawBitmap(Bitmap const & bitmap,
+                            RectF const & destination,
+                            float opacity,
+                            BitmapInterpolationMode mode,
+                            RectF const & source) const;
+
+            // Draws a bitmap at its own size, or replays a closed command list under the
+            // current transform.
+            void DrawImage(Image const & image,
+                           BitmapInterpolationMode mode = BitmapInterpolationMode::Linear) const;
+
+            void DrawImage(Image const & image,
+                           Point2F const & targetOffset,
+                           BitmapInterpolationMode mode = BitmapInterpolationMode::Linear) const;
+
+            void SetTransform(Matrix3x2F const & transform) const;
+            void GetTransform(Matrix3x2F & transform) const;
+
+            void SetAntialiasMode(AntialiasMode mode) const;
+            auto GetAntialiasMode() const -> AntialiasMode;
+
+            void SetTextAntialiasMode(TextAntialiasMode mode) const;
+            auto GetTextAntialiasMode() const -> TextAntialiasMode;
+
+            // ClearType text is drawn with these settings, or those of CreateRenderingParams
+            // if none are set. A pixel geometry of Flat draws it in grayscale.
+            void SetTextRenderingParams(RenderingParams const & textRenderingParams = RenderingParams()) const;
+            auto GetTextRenderingParams() const -> RenderingParams;
+
+            void SetTags(std::uint64_t tag1,
+                         std::uint64_t tag2) const;
+
+            void GetTags(std::uint64_t & tag1,
+                         std::uint64_t & tag2) const;
+
+            void SaveDrawingState(DrawingStateBlock const & block) const;
+            void RestoreDrawingState(DrawingStateBlock const & block) const;
+
+            // Saves the drawing state on a stack kept by the render target, for callers
+            // that would otherwise need a block for each level of nesting. Pushes must be
+            // balanced by the end of the frame.
+            void PushState() const;
+            void PopState() const;
+
+            void PushLayer(LayerParameters const & parameters) const;
+
+            void PushLayer(LayerParameters const & parameters,
+                           Layer const & layer) const;
+
+            void PopLayer() const;
+
+            void PushAxisAlignedClip(RectF const & rect,
+                                     AntialiasMode mode) const;
+
+            void PopAxisAlignedClip() const;
+
+            // Marks pixels to be redrawn by the next frame, which then draws only into
+            // them. A frame for which nothing was invalidated draws into the whole target,
+            // while one that only invalidated rectangles off the target draws nothing.
+            void Invalidate() const;
+            void Invalidate(RectF const & rect) const;
+
+            // The region the current or last frame draws into, as a few rectangles.
+            auto GetDirtyRectCount() const -> unsigned;
+
+            void GetDirtyRects(RectU * rects,
+                               unsigned count) const;
+
+            void Clear() const;
+            void Clear(Color const & color) const;
+
+            void BeginDraw() const;
+            auto EndDraw() const -> HRESULT;
+
+            // Also returns the tags that were set when the first failure occurred.
+            auto EndDraw(std::uint64_t & tag1,
+                         std::uint64_t & tag2) const -> HRESULT;
+
+            auto GetPixelFormat() const -> PixelFormat;
+            auto GetSize() const -> SizeF;
+            auto GetPixelSize() const -> SizeU;
+        };
+
+        struct BitmapRenderTarget : RenderTarget
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(BitmapRenderTarget, RenderTarget, Details::RasterTargetImpl)
+
+            auto GetBitmap() const -> Bitmap;
+            auto BorrowBitmap() const -> Borrowed<Bitmap>;
+        };
+
+        struct CommandList;
+
+        struct DeviceContext : RenderTarget
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(DeviceContext, RenderTarget, Details::RasterTargetImpl)
+
+            auto CreateCommandList() const -> CommandList;
+
+            void SetTarget(Bitmap const & bitmap) const;
+            void SetTarget() const;
+            auto GetTarget() const -> Bitmap;
+            auto BorrowTarget() const -> Borrowed<Bitmap>;
+
+            using RenderTarget::FillOpacityMask;
+
+            void FillOpacityMask(Bitmap const & opacityMask,
+                                 Brush const & brush) const;
+
+            void FillOpacityMask(Bitmap const & opacityMask,
+                                 Brush const & brush,
+                                 RectF const & destinationRectangle) const;
+
+            void FillOpacityMask(Bitmap const & opacityMask,
+                                 Brush const & brush,
+                                 RectF const & destinationRectangle,
+                                 RectF const & sourceRectangle) const;
+        };
+
+        struct CommandSink : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(CommandSink, Details::Object, Details::CommandSinkImpl)
+        };
+
+        struct CommandList : Image
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(CommandList, Image, Details::CommandListImpl)
+
+            // Returns a render target that records into the command list until it is closed.
+            auto Open() const -> RenderTarget;
+
+            void Close() const;
+
+            void Stream(CommandSink const & sink) const;
+        };
+
+        inline auto CreateCommandList() -> CommandList
+        {
+            return CommandList(Details::Make<Details::CommandListImpl>());
+        }
+
+        // Returns a sink that draws the commands streamed to it onto the target.
+        inline auto CreateCommandSink(RenderTarget const & target) -> CommandSink
+        {
+            auto const sink = Details::Make<Details::TargetSinkImpl>(*target.Get());
+            sink->Owner = target.Share();
+            return CommandSink(sink);
+        }
+
+        inline auto CommandList::Open() const -> RenderTarget
+        {
+            if ((*this)->Open || (*this)->Closed)
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            (*this)->Open = true;
+            return RenderTarget(Details::Make<Details::CommandRecorderImpl>(Share()));
+        }
+
+        inline void CommandList::Close() const
+        {
+            if ((*this)->Closed)
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            (*this)->Open = false;
+            (*this)->Closed = true;
+            std::unordered_map<Details::Resource const *, unsigned>().swap((*this)->Indices);
+        }
+
+        inline void CommandList::Stream(CommandSink const & sink) const
+        {
+            if (!(*this)->Closed)
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            sink->BeginDraw();
+            Details::Replay(*Get(), *sink.Get(), Matrix3x2F());
+            HR(sink->EndDraw());
+        }
+
+        inline auto DeviceContext::CreateCommandList() const -> CommandList
+        {
+            return Cpu::CreateCommandList();
+        }
+
+        inline void RenderTarget::DrawImage(Image const & image,
+                                            BitmapInterpolationMode const mode) const
+        {
+            DrawImage(image, Point2F(), mode);
+        }
+
+        inline void RenderTarget::DrawImage(Image const & image,
+                                            Point2F const & targetOffset,
+                                            BitmapInterpolationMode const mode) const
+        {
+            if (!(*this)->CanDraw())
+            {
+                return;
+            }
+
+            auto const list = dynamic_cast<Details::CommandListImpl *>(image.Get());
+
+            if (!list)
+            {
+                auto & bitmap = static_cast<Details::BitmapImpl &>(*image.Get());
+                auto const rect = Details::GetBitmapRect(bitmap);
+
+                (*this)->DrawBitmap(bitmap,
+                                    RectF(targetOffset.X,
+                                          targetOffset.Y,
+                                          targetOffset.X + rect.Right,
+                                          targetOffset.Y + rect.Bottom),
+                                    1.0f,
+                                    mode,
+                                    rect);
+            }
+            else if (!list->Closed)
+            {
+                (*this)->Fail(D2DERR_WRONG_STATE);
+            }
+            else
+            {
+                (*this)->DrawImage(*list, targetOffset);
+            }
+        }
+
+        inline auto CreateDeviceContext() -> DeviceContext
+        {
+            return DeviceContext(Details::Make<Details::RasterTargetImpl>());
+        }
+
+        inline auto CreateRenderTarget(Bitmap const & target) -> BitmapRenderTarget
+        {
+            auto const context = CreateDeviceContext();
+            context.SetTarget(target);
+            return BitmapRenderTarget(context.Share());
+        }
+
+        inline auto CreateBitmapRenderTarget(SizeU const & size) -> BitmapRenderTarget
+        {
+            return CreateRenderTarget(CreateBitmap(size));
+        }
+
+        inline auto RenderTarget::CreateBitmap(SizeU const & size,
+                                               PixelFormat const & format) const -> Bitmap
+        {
+            return Cpu::CreateBitmap(size, format);
+        }
+
+        inline auto RenderTarget::CreateBitmapBrush(Bitmap const & bitmap,
+                                                    ResourceLifetime const lifetime) const -> BitmapBrush
+        {
+            return CreateBitmapBrush(bitmap, BitmapBrushProperties(), BrushProperties(), lifetime);
+        }
+
+        inline auto RenderTarget::CreateBitmapBrush(Bitmap const & bitmap,
+                                                    BitmapBrushProperties const & bitmapBrushProperties,
+                                                    ResourceLifetime const lifetime) const -> BitmapBrush
+        {
+            return CreateBitmapBrush(bitmap, bitmapBrushProperties, BrushProperties(), lifetime);
+        }
+
+        inline auto RenderTarget::CreateBitmapBrush(Bitmap const & bitmap,
+                                                    BitmapBrushProperties const & bitmapBrushProperties,
+                                                    BrushProperties const & brushProperties,
+                                                    ResourceLifetime const lifetime) const -> BitmapBrush
+        {
+            BitmapBrush brush(Details::MakeIn<Details::BitmapBrushImpl>((*this)->GetArena(lifetime),
+                                                                             nullptr,
+                                                                             bitmapBrushProperties,
+                                                                             brushProperties));
+            brush.SetBitmap(bitmap);
+            return brush;
+        }
+
+        inline auto RenderTarget::CreateSolidColorBrush(Color const & color,
+                                                        ResourceLifetime const lifetime) const -> SolidColorBrush
+        {
+            return CreateSolidColorBrush(color, BrushProperties(), lifetime);
+        }
+
+        inline auto RenderTarget::CreateSolidColorBrush(Color const & color,
+                                                        BrushProperties const & properties,
+                                                        ResourceLifetime const lifetime) const -> SolidColorBrush
+        {
+            return SolidColorBrush(Details::MakeIn<Details::SolidColorBrushImpl>((*this)->GetArena(lifetime),
+                                                                                      color,
+                                                                                      properties));
+        }
+
+        inline auto RenderTarget::CreateGradientStopCollection(GradientStop const * stops,
+                                                               unsigned const count,
+                                                               ExtendMode const mode,
+                                                               ResourceLifetime const lifetime) const -> GradientStopCollection
+        {
+            return GradientStopCollection(Details::MakeIn<Details::GradientStopCollectionImpl>((*this)->GetArena(lifetime),
+                                                                                                    stops,
+                                                                                                    count,
+                                                                                                    mode));
+        }
+
+        inline auto RenderTarget::CreateLinearGradientBrush(LinearGradientBrushProperties const & linearGradientBrushProperties,
+                                                            GradientStopCollection const & stops,
+                                                            ResourceLifetime const lifetime) const -> LinearGradientBrush
+        {
+            return CreateLinearGradientBrush(linearGradientBrushProperties, BrushProperties(), stops, lifetime);
+        }
+
+        inline auto RenderTarget::CreateLinearGradientBrush(LinearGradientBrushProperties const & linearGradientBrushProperties,
+                                                            BrushProperties const & brushProperties,
+                                                            GradientStopCollection const & stops,
+                                                            ResourceLifetime const lifetime) const -> LinearGradientBrush
+        {
+            auto const arena = (*this)->GetArena(lifetime);
+
+            return LinearGradientBrush(Details::MakeIn<Details::LinearGradientBrushImpl>(arena,
+                                                                                              linearGradientBrushProperties,
+                                                                                              Details::KeepStops(stops.Share(), arena),
+                                                                                              brushProperties));
+        }
+
+        inline auto RenderTarget::CreateRadialGradientBrush(RadialGradientBrushProperties const & radialGradientBrushProperties,
+                                                            GradientStopCollection const & stops,
+                                                            ResourceLifetime const lifetime) const -> RadialGradientBrush
+        {
+            return CreateRadialGradientBrush(radialGradientBrushProperties, BrushProperties(), stops, lifetime);
+        }
+
+        inline auto RenderTarget::CreateRadialGradientBrush(RadialGradientBrushProperties const & radialGradientBrushProperties,
+                                                            BrushProperties const & brushProperties,
+                                                            GradientStopCollection const & stops,
+                                                            ResourceLifetime const lifetime) const -> RadialGradientBrush
+        {
+            auto const arena = (*this)->GetArena(lifetime);
+
+            return RadialGradientBrush(Details::MakeIn<Details::RadialGradientBrushImpl>(arena,
+                                                                                              radialGradientBrushProperties,
+                                                                                              Details::KeepStops(stops.Share(), arena),
+                                                                                              brushProperties));
+        }
+
+        inline auto RenderTarget::CreatePathGeometry(ResourceLifetime const lifetime) const -> PathGeometry
+        {
+            return PathGeometry(Details::MakeIn<Details::PathGeometryImpl>((*this)->GetArena(lifetime)));
+        }
+
+        inline auto RenderTarget::CreateCompatibleRenderTarget() const -> BitmapRenderTarget
+        {
+            return CreateCompatibleRenderTarget(GetPixelSize());
+        }
+
+        inline auto RenderTarget::CreateCompatibleRenderTarget(SizeU const & desiredPixelSize) const -> BitmapRenderTarget
+        {
+            return CreateCompatibleRenderTarget(desiredPixelSize, PixelFormat());
+        }
+
+        inline auto RenderTarget::CreateCompatibleRenderTarget(SizeU const & desiredPixelSize,
+                                                               PixelFormat const & desiredFormat,
+                                                               CompatibleRenderTargetOptions const options) const -> BitmapRenderTarget
+        {
+            PixelFormat const format(Dxgi::Format::Unknown == desiredFormat.Format ? Dxgi::Format::B8G8R8A8_UNORM : desiredFormat.Format,
+                                     AlphaMode::Unknown == desiredFormat.AlphaMode ? AlphaMode::Premultiplied : desiredFormat.AlphaMode);
+
+            if (!Details::IsDrawableFormat(format.Format) || AlphaMode::Straight == format.AlphaMode)
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            unsigned pitch = 0;
+            auto const pixels = (*this)->GetCompatibleTargetPool().Acquire(desiredPixelSize.Width, desiredPixelSize.Height, format, pitch);
+            auto const bitmap = Details::Make<Details::BitmapImpl>(desiredPixelSize, format, pitch, pixels->Bits.get());
+            auto const context = CreateDeviceContext();
+
+            if (CompatibleRenderTargetOptions::Scratch == options)
+            {
+                context->Scratch = pixels;
+            }
+            else
+            {
+                bitmap->Pooled = pixels;
+            }
+
+            context.SetTarget(Bitmap(bitmap));
+            return BitmapRenderTarget(context.Share());
+        }
+
+        inline void RenderTarget::SetMaximumTextureMemory(std::uint64_t const maximumInBytes) const
+        {
+            (*this)->GetCompatibleTargetPool().SetLimit(maximumInBytes);
+        }
+
+        inline auto RenderTarget::GetMaximumTextureMemory() const -> std::uint64_t
+        {
+            return (*this)->GetCompatibleTargetPool().GetLimit();
+        }
+
+        inline void RenderTarget::SetMaximumGlyphCacheMemory(std::uint64_t const maximumInBytes) const
+        {
+            (*this)->GetGlyphCache().SetLimit(maximumInBytes);
+        }
+
+        inline auto RenderTarget::GetMaximumGlyphCacheMemory() const -> std::uint64_t
+        {
+            return (*this)->GetGlyphCache().GetLimit();
+        }
+
+        inline auto RenderTarget::CreateLayer() const -> Layer
+        {
+            return CreateLayer(SizeF());
+        }
+
+        inline auto RenderTarget::CreateLayer(SizeF const & size) const -> Layer
+        {
+            return Layer(Details::Make<Details::LayerImpl>(size));
+        }
+
+        inline void RenderTarget::FillRectangle(RectF const & rect,
+                                                Brush const & brush) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->FillRectangle(rect, *brush.Get());
+            }
+        }
+
+        inline void RenderTarget::FillEllipse(Ellipse const & ellipse,
+                                              Brush const & brush) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->FillEllipse(ellipse, *brush.Get());
+            }
+        }
+
+        inline void RenderTarget::FillGeometry(Geometry const & geometry,
+                                               Brush const & brush) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->FillGeometry(*geometry.Get(), *brush.Get(), nullptr);
+            }
+        }
+
+        inline void RenderTarget::FillGeometry(Geometry const & geometry,
+                                               Brush const & brush,
+                                               Brush const & opacityBrush) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->FillGeometry(*geometry.Get(), *brush.Get(), opacityBrush.Get());
+            }
+        }
+
+        inline void RenderTarget::DrawGlyphRun(Point2F const & baselineOrigin,
+                                               GlyphRun const & glyphRun,
+                                               Brush const & foregroundBrush,
+                                               MeasuringMode const measuringMode) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->DrawGlyphRun(baselineOrigin, glyphRun, *foregroundBrush.Get(), measuringMode);
+            }
+        }
+
+        inline void RenderTarget::DrawGlyphRuns(BatchedGlyphRun const * runs,
+                                                unsigned const count,
+                                                MeasuringMode const measuringMode) const
+        {
+            if (0 != count && (*this)->CanDraw())
+            {
+                ASSERT(runs);
+                (*this)->DrawGlyphRuns(runs, count, measuringMode);
+            }
+        }
+
+        inline void RenderTarget::DrawText(wchar_t const * string,
+                                           unsigned const length,
+                                           TextFormat const & textFormat,
+                                           RectF const & layoutRect,
+                                           Brush const & brush,
+                                           DrawTextOptions const options) const
+        {
+            if (!(*this)->CanDraw())
+            {
+                return;
+            }
+
+            auto const width = (std::max)(0.0f, layoutRect.Right - layoutRect.Left);
+            auto const height = (std::max)(0.0f, layoutRect.Bottom - layoutRect.Top);
+            auto const & format = *textFormat.Get();
+            Details::SimpleText simple;
+
+            if (!simple.Set(format, string, length, width))
+            {
+                auto const layout = CreateTextLayout(string, length, textFormat, width, height);
+                DrawTextLayout(Point2F(layoutRect.Left, layoutRect.Top), layout, brush, options);
+                return;
+            }
+
+            if (0 == simple.Count)
+            {
+                return;
+            }
+
+            float lineHeight, baseline;
+            format.GetLineHeight(format.FontSize, lineHeight, baseline);
+            auto const space = width - simple.Width;
+            auto const alignment = format.GetLineAlignment(false);
+
+            auto const left = Cpu::TextAlignment::Trailing == alignment ? space :
+                              Cpu::TextAlignment::Center == alignment ? space / 2.0f : 0.0f;
+
+            auto const top = format.GetParagraphTop(height - lineHeight);
+            auto const clip = DrawTextOptions::None != (options & DrawTextOptions::Clip);
+
+            if (clip)
+            {
+                (*this)->PushAxisAlignedClip(RectF(layoutRect.Left, layoutRect.Top, layoutRect.Left + width, layoutRect.Top + height), AntialiasMode::Aliased);
+            }
+
+            GlyphRun run;
+            run.FontFace = format.FontFace.Get();
+            run.FontEmSize = format.FontSize;
+            run.GlyphCount = simple.Count;
+            run.GlyphIndices = simple.Glyphs;
+            run.GlyphAdvances = simple.Advances;
+            (*this)->DrawGlyphRun(Point2F(layoutRect.Left + left, layoutRect.Top + top + baseline), run, *brush.Get(), MeasuringMode::Natural);
+
+            if (clip)
+            {
+                (*this)->PopAxisAlignedClip();
+            }
+        }
+
+        // Clipping is to the layout box.
+        inline void RenderTarget::DrawTextLayout(Point2F const & origin,
+                                                 TextLayout const & textLayout,
+                                                 Brush const & brush,
+                                                 DrawTextOptions const options) const
+        {
+            if (!(*this)->CanDraw())
+            {
+                return;
+            }
+
+            auto & layout = *textLayout.Get();
+            auto const clip = DrawTextOptions::None != (options & DrawTextOptions::Clip);
+
+            if (clip)
+            {
+                (*this)->PushAxisAlignedClip(RectF(origin.X, origin.Y, origin.X + layout.MaxWidth, origin.Y + layout.MaxHeight), AntialiasMode::Aliased);
+            }
+
+            layout.ForEachGlyphRun(origin, [&] (Point2F const & baselineOrigin, GlyphRun const & run)
+            {
+                (*this)->DrawGlyphRun(baselineOrigin, run, *brush.Get(), MeasuringMode::Natural);
+            });
+
+            if (clip)
+            {
+                (*this)->PopAxisAlignedClip();
+            }
+        }
+
+        inline void RenderTarget::FillOpacityMask(Bitmap const & mask,
+                                                  Brush const & brush,
+                                                  OpacityMaskContent content) const
+        {
+            auto const rect = Details::GetBitmapRect(*mask.Get());
+
+            FillOpacityMask(mask,
+                            brush,
+                            content,
+                            rect,
+                            rect);
+        }
+
+        // The content hint only selects gamma in Direct2D, so it does not change blending here.
+        inline void RenderTarget::FillOpacityMask(Bitmap const & mask,
+                                                  Brush const & brush,
+                                                  OpacityMaskContent,
+                                                  RectF const & destination,
+                                                  RectF const & source) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->FillOpacityMask(*mask.Get(),
+                                         *brush.Get(),
+                                         destination,
+                                         Details::ClampSourceRect(*mask.Get(), source));
+            }
+        }
+
+        inline void RenderTarget::DrawBitmap(Bitmap const & bitmap) const
+        {
+            DrawBitmap(bitmap, Details::GetBitmapRect(*bitmap.Get()), 1.0f);
+        }
+
+        inline void RenderTarget::DrawBitmap(Bitmap const & bitmap,
+                                             float const opacity) const
+        {
+            DrawBitmap(bitmap, Details::GetBitmapRect(*bitmap.Get()), opacity);
+        }
+
+        inline void RenderTarget::DrawBitmap(Bitmap const & bitmap,
+                                             RectF const & destination) const
+        {
+            DrawBitmap(bitmap, destination, 1.0f);
+        }
+
+        inline void RenderTarget::DrawBitmap(Bitmap const & bitmap,
+                                             RectF const & destination,
+                                             float const opacity) const
+        {
+            DrawBitmap(bitmap, destination, opacity, BitmapInterpolationMode::Linear);
+        }
+
+        inline void RenderTarget::DrawBitmap(Bitmap const & bitmap,
+                                             RectF const & destination,
+                                             float const opacity,
+                                             BitmapInterpolationMode const mode) const
+        {
+            DrawBitmap(bitmap, destination, opacity, mode, Details::GetBitmapRect(*bitmap.Get()));
+        }
+
+        inline void RenderTarget::DrawBitmap(Bitmap const & bitmap,
+                                             RectF const & destination,
+                                             float const opacity,
+                                             BitmapInterpolationMode const mode,
+                                             RectF const & source) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->DrawBitmap(*bitmap.Get(),
+                                    destination,
+                                    opacity,
+                                    mode,
+                                    Details::ClampSourceRect(*bitmap.Get(), source));
+            }
+        }
+
+        inline void RenderTarget::SetTransform(Matrix3x2F const & transform) const
+        {
+            (*this)->Transform = transform;
+        }
+
+        inline void RenderTarget::GetTransform(Matrix3x2F & transform) const
+        {
+            transform = (*this)->Transform;
+        }
+
+        inline void RenderTarget::SetAntialiasMode(AntialiasMode const mode) const
+        {
+            (*this)->AntialiasMode = mode;
+        }
+
+        inline auto RenderTarget::GetAntialiasMode() const -> AntialiasMode
+        {
+            return (*this)->AntialiasMode;
+        }
+
+        inline void RenderTarget::SetTextAntialiasMode(TextAntialiasMode const mode) const
+        {
+            (*this)->TextAntialiasMode = mode;
+        }
+
+        inline auto RenderTarget::GetTextAntialiasMode() const -> TextAntialiasMode
+        {
+            return (*this)->TextAntialiasMode;
+        }
+
+        inline void RenderTarget::SetTextRenderingParams(RenderingParams const & textRenderingParams) const
+        {
+            (*this)->TextRenderingParams = textRenderingParams.Share();
+        }
+
+        inline auto RenderTarget::GetTextRenderingParams() const -> RenderingParams
+        {
+            return RenderingParams((*this)->TextRenderingParams);
+        }
+
+        inline void RenderTarget::SetTags(std::uint64_t const tag1,
+                                          std::uint64_t const tag2) const
+        {
+            (*this)->Tag1 = tag1;
+            (*this)->Tag2 = tag2;
+        }
+
+        inline void RenderTarget::GetTags(std::uint64_t & tag1,
+                                          std::uint64_t & tag2) const
+        {
+            tag1 = (*this)->Tag1;
+            tag2 = (*this)->Tag2;
+        }
+
+        inline void RenderTarget::SaveDrawingState(DrawingStateBlock const & block) const
+        {
+            block->State = (*this)->SaveState();
+        }
+
+        inline void RenderTarget::RestoreDrawingState(DrawingStateBlock const & block) const
+        {
+            (*this)->RestoreState(block->State);
+        }
+
+        inline void RenderTarget::PushState() const
+        {
+            (*this)->PushState();
+        }
+
+        inline void RenderTarget::PopState() const
+        {
+            (*this)->PopState();
+        }
+
+        inline void RenderTarget::PushLayer(LayerParameters const & parameters) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->PushLayer(parameters);
+            }
+        }
+
+        inline void RenderTarget::PushLayer(LayerParameters const & parameters,
+                                            Layer const &) const
+        {
+            PushLayer(parameters);
+        }
+
+        inline void RenderTarget::PopLayer() const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->PopLayer();
+            }
+        }
+
+        inline void RenderTarget::PushAxisAlignedClip(RectF const & rect,
+                                                      AntialiasMode const mode) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->PushAxisAlignedClip(rect, mode);
+            }
+        }
+
+        inline void RenderTarget::PopAxisAlignedClip() const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->PopAxisAlignedClip();
+            }
+        }
+
+        inline void RenderTarget::Invalidate() const
+        {
+            (*this)->Invalidate();
+        }
+
+        inline void RenderTarget::Invalidate(RectF const & rect) const
+        {
+            (*this)->Invalidate(Details::GetOuterBounds(rect));
+        }
+
+        inline auto RenderTarget::GetDirtyRectCount() const -> unsigned
+        {
+            return (*this)->Dirty.GetCount();
+        }
+
+        inline void RenderTarget::GetDirtyRects(RectU * rects,
+                                                unsigned const count) const
+        {
+            auto const & dirty = (*this)->Dirty;
+
+            for (unsigned i = 0; i != (std::min)(count, dirty.GetCount()); ++i)
+            {
+                rects[i] = RectU(static_cast<unsigned>(dirty[i].Left),
+                                 static_cast<unsigned>(dirty[i].Top),
+                                 static_cast<unsigned>(dirty[i].Right),
+                                 static_cast<unsigned>(dirty[i].Bottom));
+            }
+        }
+
+        inline void RenderTarget::Clear() const
+        {
+            Clear(Color(0.0f, 0.0f, 0.0f, 0.0f));
+        }
+
+        inline void RenderTarget::Clear(Color const & color) const
+        {
+            if ((*this)->CanDraw())
+            {
+                (*this)->Clear(color);
+            }
+        }
+
+        inline void RenderTarget::BeginDraw() const
+        {
+            if ((*this)->Drawing)
+            {
+                (*this)->Fail(D2DERR_WRONG_STATE);
+                return;
+            }
+
+            (*this)->Drawing = true;
+
+            if ((*this)->IsReady())
+            {
+                (*this)->BeginFrame();
+            }
+        }
+
+        inline auto RenderTarget::EndDraw() const -> HRESULT
+        {
+            std::uint64_t tag1, tag2;
+            return EndDraw(tag1, tag2);
+        }
+
+        inline auto RenderTarget::EndDraw(std::uint64_t & tag1,
+                                          std::uint64_t & tag2) const -> HRESULT
+        {
+            if (!(*this)->Drawing)
+            {
+                (*this)->Fail(D2DERR_WRONG_STATE);
+            }
+            else
+            {
+                auto & states = (*this)->States;
+
+                if (!states.empty())
+                {
+                    (*this)->Fail(D2DERR_PUSH_POP_UNBALANCED);
+                    (*this)->SetState(states.front());
+                    states.clear();
+                }
+
+                if ((*this)->IsReady())
+                {
+                    (*this)->EndFrame();
+                }
+
+                if ((*this)->Compatible)
+                {
+                    (*this)->Compatible->Trim();
+                }
+
+                (*this)->Arena.Reset();
+            }
+
+            auto const result = (*this)->Error;
+            tag1 = S_OK == result ? 0 : (*this)->ErrorTag1;
+            tag2 = S_OK == result ? 0 : (*this)->ErrorTag2;
+            (*this)->Drawing = false;
+            (*this)->Error = S_OK;
+            return result;
+        }
+
+        inline auto RenderTarget::GetPixelFormat() const -> PixelFormat
+        {
+            return PixelFormat(Dxgi::Format::B8G8R8A8_UNORM, AlphaMode::Premultiplied);
+        }
+
+        inline auto RenderTarget::GetSize() const -> SizeF
+        {
+            auto const size = GetPixelSize();
+
+            return SizeF(static_cast<float>(size.Width),
+                         static_cast<float>(size.Height));
+        }
+
+        inline auto RenderTarget::GetPixelSize() const -> SizeU
+        {
+            return (*this)->GetPixelSize();
+        }
+
+        inline auto BitmapRenderTarget::GetBitmap() const -> Bitmap
+        {
+            return Bitmap((*this)->Target);
+        }
+
+        inline auto BitmapRenderTarget::BorrowBitmap() const -> Borrowed<Bitmap>
+        {
+            return Borrowed<Bitmap>((*this)->Target.Get());
+        }
+
+        inline void DeviceContext::SetTarget(Bitmap const & bitmap) const
+        {
+            if (bitmap && !Details::IsDrawableFormat(bitmap.GetPixelFormat().Format))
+            {
+                HR(WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT);
+            }
+
+            if (bitmap && bitmap.IsImmutable())
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            if (bitmap)
+            {
+                bitmap.Map();
+            }
+
+            (*this)->Target = bitmap.Share();
+            (*this)->Invalidated.Clear();
+            (*this)->Invalidating = false;
+
+            if ((*this)->Drawing && bitmap)
+            {
+                (*this)->BeginFrame();
+            }
+        }
+
+        inline void DeviceContext::SetTarget() const
+        {
+            (*this)->Target.Reset();
+        }
+
+        inline auto DeviceContext::GetTarget() const -> Bitmap
+        {
+            return Bitmap((*this)->Target);
+        }
+
+        inline auto DeviceContext::BorrowTarget() const -> Borrowed<Bitmap>
+        {
+            return Borrowed<Bitmap>((*this)->Target.Get());
+        }
+
+        inline void DeviceContext::FillOpacityMask(Bitmap const & opacityMask,
+                                                   Brush const & brush) const
+        {
+            RenderTarget::FillOpacityMask(opacityMask, brush, OpacityMaskContent::Graphics);
+        }
+
+        inline void DeviceContext::FillOpacityMask(Bitmap const & opacityMask,
+                                                   Brush const & brush,
+                                                   RectF const & destinationRectangle) const
+        {
+            FillOpacityMask(opacityMask,
+                            brush,
+                            destinationRectangle,
+                            Details::GetBitmapRect(*opacityMask.Get()));
+        }
+
+        inline void DeviceContext::FillOpacityMask(Bitmap const & opacityMask,
+                                                   Brush const & brush,
+                                                   RectF const & destinationRectangle,
+                                                   RectF const & sourceRectangle) const
+        {
+            RenderTarget::FillOpacityMask(opacityMask,
+                                          brush,
+                                          OpacityMaskContent::Graphics,
+                                          destinationRectangle,
+                                          sourceRectangle);
+        }
+
+        namespace Details
+        {
+            // Rewrites a closed command list so that it replays with less work. State is
+            // set only where a draw needs it and draws that can't be seen are dropped.
+            // Each draw moves back past draws it doesn't overlap to join earlier draws with
+            // the same state and brush, and rectangles that end up next to each other are
+            // filled as a batch. Bounds are widened by a unit so that antialiased edges
+            // sharing a pixel keep their order at the scale the list was recorded.
+            class CommandListOptimizer
+            {
+            public:
+
+                typedef std::unordered_map<CommandListImpl const *, Pointer<CommandListImpl>> ListMap;
+
+            private:
+
+                struct Item
+                {
+                    Command const * Source;
+                    unsigned Transform;
+                    Cpu::AntialiasMode Mode;
+                    unsigned Resource;
+                    unsigned Batch;
+                    RectF Bounds;
+                };
+
+                struct Batch
+                {
+                    unsigned First;
+                    RectF Bounds;
+                };
+
+                // How many batches a draw looks back through for one it can join.
+                static unsigned const Lookback = 64;
+
+                CommandListImpl const & m_source;
+                ListMap const & m_lists;
+                Pointer<CommandListImpl> m_result;
+                std::vector<unsigned> m_resources;
+                std::unordered_map<std::uint32_t, unsigned> m_solids;
+                std::vector<Matrix3x2F> m_transforms;
+                std::vector<Item> m_items;
+                std::vector<Batch> m_batches;
+                std::vector<unsigned> m_order;
+                std::vector<RectF> m_rects;
+                Matrix3x2F m_emittedTransform;
+                Cpu::AntialiasMode m_emittedMode;
+
+                CommandListOptimizer(CommandListImpl const & source,
+                                     ListMap const & lists) :
+                    m_source(source),
+                    m_lists(lists),
+                    m_result(Make<CommandListImpl>()),
+                    m_resources(source.Resources.size(), NoResource),
+                    m_transforms(1),
+                    m_emittedMode(Cpu::AntialiasMode::PerPrimitive)
+                {}
+
+                static auto IsInvisible(BrushImpl const & brush) -> bool
+                {
+                    std::uint32_t color = 0;
+                    return brush.IsSolid(color) && 0 == color;
+                }
+
+                static auto IsSameColor(SolidColorBrushImpl const & first,
+                                        SolidColorBrushImpl const & second) -> bool
+                {
+                    return 0 == memcmp(&first.Color, &second.Color, sizeof(first.Color)) && first.Opacity == second.Opacity;
+                }
+
+                // Solid color brushes with the same color become one, so that the draws that
+                // use them may be batched.
+                auto AddResource(Resource const & resource) -> unsigned
+                {
+                    if (auto const list = dynamic_cast<CommandListImpl const *>(&resource))
+                    {
+                        return m_result->AddResource(m_lists.at(list).Get());
+                    }
+
+                    auto const solid = dynamic_cast<SolidColorBrushImpl const *>(&resource);
+
+                    if (!solid)
+                    {
+                        return m_result->AddResource(&resource);
+                    }
+
+                    std::uint32_t color = 0;
+                    solid->IsSolid(color);
+                    auto const found = m_solids.find(color);
+
+                    if (m_solids.end() != found && IsSameColor(*solid, *static_cast<SolidColorBrushImpl const *>(m_result->Resources[found->second].Get())))
+                    {
+                        return found->second;
+                    }
+
+                    auto const index = m_result->AddResource(&resource);
+                    m_solids.insert(std::make_pair(color, index));
+                    return index;
+                }
+
+                auto Map(unsigned const index) -> unsigned
+                {
+                    if (NoResource == index)
+                    {
+                        return NoResource;
+                    }
+
+                    auto & mapped = m_resources[index];
+
+                    if (NoResource == mapped)
+                    {
+                        mapped = AddResource(*m_source.Resources[index]);
+                    }
+
+                    return mapped;
+                }
+
+                static auto GetRectBounds(RectF const & rect,
+                                          Matrix3x2F const & transform) -> RectF
+                {
+                    Point2F const corners[] =
+                    {
+                        transform.TransformPoint(Point2F(rect.Left, rect.Top)),
+                        transform.TransformPoint(Point2F(rect.Right, rect.Top)),
+                        transform.TransformPoint(Point2F(rect.Right, rect.Bottom)),
+                        transform.TransformPoint(Point2F(rect.Left, rect.Bottom)),
+                    };
+
+                    RectF result(corners[0].X, corners[0].Y, corners[0].X, corners[0].Y);
+
+                    for (auto const & corner : corners)
+                    {
+                        result.Left = (std::min)(result.Left, corner.X);
+                        result.Top = (std::min)(result.Top, corner.Y);
+                        result.Right = (std::max)(result.Right, corner.X);
+                        result.Bottom = (std::max)(result.Bottom, corner.Y);
+                    }
+
+                    return result;
+                }
+
+                static auto Union(RectF const & first,
+                                  RectF const & second) -> RectF
+                {
+                    return RectF((std::min)(first.Left, second.Left),
+                                 (std::min)(first.Top, second.Top),
+                                 (std::max)(first.Right, second.Right),
+                                 (std::max)(first.Bottom, second.Bottom));
+                }
+
+                static auto Overlaps(RectF const & first,
+                                     RectF const & second) -> bool
+                {
+                    return first.Left < second.Right && second.Left < first.Right &&
+                           first.Top < second.Bottom && second.Top < first.Bottom;
+                }
+
+                static auto IsRectangle(Command const & command) -> bool
+                {
+                    return CommandType::FillRectangle == command.Type || CommandType::FillRectangles == command.Type;
+                }
+
+                // Draws are compatible when they may be replayed one after the other without
+                // any state or brush changing in between.
+                auto IsCompatible(Item const & first,
+                                  Item const & second) const -> bool
+                {
+                    auto const sameType = first.Source->Type == second.Source->Type ||
+                                          (IsRectangle(*first.Source) && IsRectangle(*second.Source));
+
+                    return sameType &&
+                           first.Resource == second.Resource &&
+                           first.Mode == second.Mode &&
+                           0 == memcmp(&m_transforms[first.Transform], &m_transforms[second.Transform], sizeof(Matrix3x2F));
+                }
+
+                void AddDraw(Command const & command,
+                             Cpu::AntialiasMode const mode,
+                             unsigned const resource,
+                             RectF bounds)
+                {
+                    // Bounds that aren't numbers can't be trusted to keep anything apart.
+                    if (!(bounds.Left == bounds.Left && bounds.Top == bounds.Top && bounds.Right == bounds.Right && bounds.Bottom == bounds.Bottom))
+                    {
+                        bounds = RectF(-FLT_MAX, -FLT_MAX, FLT_MAX, FLT_MAX);
+                    }
+
+                    bounds.Left -= 1.0f;
+                    bounds.Top -= 1.0f;
+                    bounds.Right += 1.0f;
+                    bounds.Bottom += 1.0f;
+
+                    Item item = { &command, static_cast<unsigned>(m_transforms.size() - 1), mode, resource, 0, bounds };
+                    auto const first = m_batches.size() > Lookback ? m_batches.size() - Lookback : 0;
+
+                    for (auto i = m_batches.size(); i-- > first; )
+                    {
+                        auto & batch = m_batches[i];
+
+                        if (IsCompatible(m_items[batch.First], item))
+                        {
+                            item.Batch = static_cast<unsigned>(i);
+                            batch.Bounds = Union(batch.Bounds, bounds);
+                            m_items.push_back(item);
+                            return;
+                        }
+
+                        if (Overlaps(batch.Bounds, bounds))
+                        {
+                            break;
+                        }
+                    }
+
+                    item.Batch = static_cast<unsigned>(m_batches.size());
+                    Batch const batch = { static_cast<unsigned>(m_items.size()), bounds };
+                    m_batches.push_back(batch);
+                    m_items.push_back(item);
+                }
+
+                void EmitTransform(Matrix3x2F const & transform)
+                {
+                    if (0 != memcmp(&m_emittedTransform, &transform, sizeof(transform)))
+                    {
+                        m_emittedTransform = transform;
+                        m_result->Append<SetTransformCommand>(CommandType::SetTransform).Transform = transform;
+                    }
+                }
+
+                void EmitMode(Cpu::AntialiasMode const mode)
+                {
+                    if (m_emittedMode != mode)
+                    {
+                        m_emittedMode = mode;
+                        m_result->Append<SetAntialiasModeCommand>(CommandType::SetAntialiasMode).Mode = mode;
+                    }
+                }
+
+                template <typename T>
+                auto Copy(Command const & command) -> T &
+                {
+                    auto & copy = m_result->Append<T>(command.Type);
+                    copy = static_cast<T const &>(command);
+                    return copy;
+                }
+
+                void EmitRectangles(unsigned const resource)
+                {
+                    if (1 == m_rects.size())
+                    {
+                        auto & command = m_result->Append<FillRectangleCommand>(CommandType::FillRectangle);
+                        command.Rect = m_rects[0];
+                        command.Brush = resource;
+                    }
+                    else
+                    {
+                        auto const extra = static_cast<unsigned>(m_rects.size() * sizeof(RectF));
+                        auto & command = m_result->Append<FillRectanglesCommand>(CommandType::FillRectangles, extra);
+                        command.Brush = resource;
+                        command.Count = static_cast<unsigned>(m_rects.size());
+                        memcpy(const_cast<RectF *>(command.GetRects()), m_rects.data(), extra);
+                    }
+
+                    m_rects.clear();
+                }
+
+                void EmitDraw(Item const & item)
+                {
+                    auto const & command = *item.Source;
+
+                    switch (command.Type)
+                    {
+                    case CommandType::FillRectangle:
+                    {
+                        m_rects.push_back(static_cast<FillRectangleCommand const &>(command).Rect);
+                        break;
+                    }
+                    case CommandType::FillRectangles:
+                    {
+                        auto const & args = static_cast<FillRectanglesCommand const &>(command);
+                        m_rects.insert(m_rects.end(), args.GetRects(), args.GetRects() + args.Count);
+                        break;
+                    }
+                    case CommandType::FillEllipse:
+                    {
+                        Copy<FillEllipseCommand>(command).Brush = item.Resource;
+                        break;
+                    }
+                    case CommandType::FillGeometry:
+                    {
+                        auto & copy = Copy<FillGeometryCommand>(command);
+                        copy.Geometry = Map(copy.Geometry);
+                        copy.Brush = item.Resource;
+                        copy.OpacityBrush = Map(copy.OpacityBrush);
+                        break;
+                    }
+                    case CommandType::FillOpacityMask:
+                    {
+                        auto & copy = Copy<FillOpacityMaskCommand>(command);
+                        copy.Mask = Map(copy.Mask);
+                        copy.Brush = item.Resource;
+                        break;
+                    }
+                    case CommandType::DrawBitmap:
+                    {
+                        Copy<DrawBitmapCommand>(command).Bitmap = item.Resource;
+                        break;
+                    }
+                    default:
+                    {
+                        ASSERT(false);
+                        break;
+                    }
+                    }
+                }
+
+                // Writes the draws since the last barrier, batch by batch.
+                void Flush()
+                {
+                    m_order.resize(m_items.size());
+
+                    for (unsigned i = 0; i != m_order.size(); ++i)
+                    {
+                        m_order[i] = i;
+                    }
+
+                    std::stable_sort(m_order.begin(), m_order.end(), [&] (unsigned const first, unsigned const second)
+                    {
+                        return m_items[first].Batch < m_items[second].Batch;
+                    });
+
+                    for (unsigned i = 0; i != m_order.size(); ++i)
+                    {
+                        auto const & item = m_items[m_order[i]];
+                        EmitTransform(m_transforms[item.Transform]);
+                        EmitMode(item.Mode);
+                        EmitDraw(item);
+
+                        if (!m_rects.empty() && (i + 1 == m_order.size() || !IsCompatible(item, m_items[m_order[i + 1]])))
+                        {
+                            EmitRectangles(item.Resource);
+                        }
+                    }
+
+                    m_items.clear();
+                    m_batches.clear();
+                    auto const current = m_transforms.back();
+                    m_transforms.assign(1, current);
+                }
+
+                // Anything other than a draw keeps its place, and draws don't move past it.
+                void EmitBarrier(Command const & command)
+                {
+                    Flush();
+
+                    switch (command.Type)
+                    {
+                    case CommandType::Clear:
+                    {
+                        Copy<ClearCommand>(command);
+                        break;
+                    }
+                    case CommandType::DrawImage:
+                    {
+                        EmitTransform(m_transforms.back());
+                        auto & copy = Copy<DrawImageCommand>(command);
+                        copy.List = Map(copy.List);
+                        break;
+                    }
+                    case CommandType::PushAxisAlignedClip:
+                    {
+                        EmitTransform(m_transforms.back());
+                        Copy<PushAxisAlignedClipCommand>(command);
+                        break;
+                    }
+                    case CommandType::PushLayer:
+                    {
+                        EmitTransform(m_transforms.back());
+                        auto & copy = Copy<PushLayerCommand>(command);
+                        copy.GeometricMask = Map(copy.GeometricMask);
+                        copy.OpacityBrush = Map(copy.OpacityBrush);
+                        break;
+                    }
+                    default:
+                    {
+                        Copy<Command>(command);
+                        break;
+                    }
+                    }
+                }
+
+                void Add(Command const & command,
+                         Cpu::AntialiasMode & mode)
+                {
+                    auto const & transform = m_transforms.back();
+
+                    switch (command.Type)
+                    {
+                    case CommandType::SetTransform:
+                    {
+                        auto const & value = static_cast<SetTransformCommand const &>(command).Transform;
+
+                        if (0 != memcmp(&transform, &value, sizeof(value)))
+                        {
+                            m_transforms.push_back(value);
+                        }
+
+                        break;
+                    }
+                    case CommandType::SetAntialiasMode:
+                    {
+                        mode = static_cast<SetAntialiasModeCommand const &>(command).Mode;
+                        break;
+                    }
+                    // Text state only matters to glyph runs, which draws don't move past, so
+                    // it is copied straight away.
+                    case CommandType::SetTextAntialiasMode:
+                    {
+                        Copy<SetTextAntialiasModeCommand>(command);
+                        break;
+                    }
+                    case CommandType::SetTextRenderingParams:
+                    {
+                        auto & copy = Copy<SetTextRenderingParamsCommand>(command);
+                        copy.Params = Map(copy.Params);
+                        break;
+                    }
+                    // Glyph runs are not batched with other draws, but keep their place like
+                    // anything else that is not a draw.
+                    case CommandType::DrawGlyphRun:
+                    {
+                        auto const & args = static_cast<DrawGlyphRunCommand const &>(command);
+
+                        if (!IsInvisible(*m_source.GetResource<BrushImpl>(args.Brush)))
+                        {
+                            Flush();
+                            EmitTransform(m_transforms.back());
+                            EmitMode(mode);
+
+                            auto const extra = command.Size - static_cast<unsigned>(sizeof(DrawGlyphRunCommand));
+                            auto & copy = m_result->Append<DrawGlyphRunCommand>(command.Type, extra);
+                            copy = args;
+                            memcpy(&copy + 1, &args + 1, extra);
+                            copy.FontFace = Map(copy.FontFace);
+                            copy.Brush = Map(copy.Brush);
+                        }
+
+                        break;
+                    }
+                    case CommandType::FillRectangle:
+                    {
+                        auto const & args = static_cast<FillRectangleCommand const &>(command);
+
+                        if (!IsInvisible(*m_source.GetResource<BrushImpl>(args.Brush)) && args.Rect.Left != args.Rect.Right && args.Rect.Top != args.Rect.Bottom)
+                        {
+                            AddDraw(command, mode, Map(args.Brush), GetRectBounds(args.Rect, transform));
+                        }
+
+                        break;
+                    }
+                    case CommandType::FillRectangles:
+                    {
+                        auto const & args = static_cast<FillRectanglesCommand const &>(command);
+
+                        if (0 != args.Count && !IsInvisible(*m_source.GetResource<BrushImpl>(args.Brush)))
+                        {
+                            auto bounds = GetRectBounds(args.GetRects()[0], transform);
+
+                            for (unsigned i = 1; i != args.Count; ++i)
+                            {
+                                bounds = Union(bounds, GetRectBounds(args.GetRects()[i], transform));
+                            }
+
+                            AddDraw(command, mode, Map(args.Brush), bounds);
+                        }
+
+                        break;
+                    }
+                    case CommandType::FillEllipse:
+                    {
+                        auto const & args = static_cast<FillEllipseCommand const &>(command);
+
+                        if (!IsInvisible(*m_source.GetResource<BrushImpl>(args.Brush)))
+                        {
+                            AddDraw(command, mode, Map(args.Brush), EllipseGeometryImpl::GetBounds(args.Ellipse, transform));
+                        }
+
+                        break;
+                    }
+                    case CommandType::FillGeometry:
+                    {
+                        auto const & args = static_cast<FillGeometryCommand const &>(command);
+
+                        if (!IsInvisible(*m_source.GetResource<BrushImpl>(args.Brush)))
+                        {
+                            AddDraw(command, mode, Map(args.Brush), m_source.GetResource<GeometryImpl>(args.Geometry)->GetBounds(transform));
+                        }
+
+                        break;
+                    }
+                    case CommandType::FillOpacityMask:
+                    {
+                        auto const & args = static_cast<FillOpacityMaskCommand const &>(command);
+
+                        if (!IsInvisible(*m_source.GetResource<BrushImpl>(args.Brush)))
+                        {
+                            AddDraw(command, mode, Map(args.Brush), GetRectBounds(args.Destination, transform));
+                        }
+
+                        break;
+                    }
+                    case CommandType::DrawBitmap:
+                    {
+                        auto const & args = static_cast<DrawBitmapCommand const &>(command);
+
+                        if (0.0f < args.Opacity)
+                        {
+                            AddDraw(command, mode, Map(args.Bitmap), GetRectBounds(args.Destination, transform));
+                        }
+
+                        break;
+                    }
+                    default:
+                    {
+                        EmitBarrier(command);
+                        break;
+                    }
+                    }
+                }
+
+            public:
+
+                // Lists drawn by the list are optimized first, and only once however often
+                // they are drawn.
+                static auto Optimize(CommandListImpl const & source,
+                                     ListMap & lists) -> Pointer<CommandListImpl>
+                {
+                    auto const found = lists.find(&source);
+
+                    if (lists.end() != found)
+                    {
+                        return found->second;
+                    }
+
+                    for (auto const & resource : source.Resources)
+                    {
+                        if (auto const nested = dynamic_cast<CommandListImpl const *>(resource.Get()))
+                        {
+                            Optimize(*nested, lists);
+                        }
+                    }
+
+                    CommandListOptimizer optimizer(source, lists);
+                    auto mode = Cpu::AntialiasMode::PerPrimitive;
+
+                    source.Commands.ForEach([&] (std::uint8_t const * bits) -> unsigned
+                    {
+                        auto const & command = *reinterpret_cast<Command const *>(bits);
+                        optimizer.Add(command, mode);
+                        return command.Size;
+                    });
+
+                    optimizer.Flush();
+                    optimizer.m_result->Closed = true;
+                    lists[&source] = optimizer.m_result;
+                    return optimizer.m_result;
+                }
+            };
+
+        } // Details
+
+        // Returns a command list that draws the same as a closed command list but with
+        // fewer commands. The list itself is left as it is.
+        inline auto OptimizeCommandList(CommandList const & list) -> CommandList
+        {
+            if (!list->Closed)
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            Details::CommandListOptimizer::ListMap lists;
+            return CommandList(Details::CommandListOptimizer::Optimize(*list.Get(), lists));
+        }
+
+        namespace Details
+        {
+            // A saved command list file holds a header, the bitmaps the lists use keyed by
+            // a hash of their pixels, the font files of the faces they draw text with keyed
+            // by a hash of their bytes, and then each command list after any lists it draws,
+            // ending with the one that was saved. Commands are saved as recorded, so the
+            // version changes whenever a command record does.
+            std::uint32_t const CommandFileMagic = 0x4c434b4b; // KKCL
+            std::uint32_t const CommandFileVersion = 3;
+            std::uint32_t const CommandFileByteOrder = 0x01020304;
+
+            struct CommandFileHeader
+            {
+                std::uint32_t Magic;
+                std::uint32_t Version;
+                std::uint32_t ByteOrder;
+                std::uint32_t BitmapCount;
+                std::uint32_t FontCount;
+                std::uint32_t ListCount;
+            };
+
+            // The pixels follow on the next 16 byte boundary of the file.
+            struct CommandFileBitmap
+            {
+                std::uint64_t Hash;
+                std::uint32_t Width;
+                std::uint32_t Height;
+                std::uint32_t Format;
+                std::uint32_t AlphaMode;
+                std::uint32_t Pitch;
+                std::uint32_t Reserved;
+            };
+
+            // The bytes of the font file follow on the next 16 byte boundary of the file.
+            struct CommandFileFont
+            {
+                std::uint64_t Hash;
+                std::uint64_t Size;
+            };
+
+            struct CommandFileList
+            {
+                std::uint32_t ResourceCount;
+                std::uint32_t CommandCount;
+                std::uint32_t CommandBytes;
+            };
+
+            enum class CommandFileResource : std::uint32_t
+            {
+                SolidColorBrush,
+                LinearGradientBrush,
+                RadialGradientBrush,
+                BitmapBrush,
+                RectangleGeometry,
+                EllipseGeometry,
+                PathGeometry,
+                Bitmap,
+                CommandList,
+                RenderingParams,
+                GeometryFontFace,
+                OpenTypeFontFace,
+            };
+
+            // Each resource is a type and size followed by the fields below, and gradient
+            // stops, glyphs, points or verbs as the counts describe.
+            struct CommandFileResourceHeader
+            {
+                CommandFileResource Type;
+                std::uint32_t Size;
+            };
+
+            struct SavedBrush
+            {
+                float Opacity;
+                Matrix3x2F Transform;
+            };
+
+            struct SavedSolidColorBrush
+            {
+                SavedBrush Brush;
+                Color Value;
+            };
+
+            struct SavedLinearGradientBrush
+            {
+                SavedBrush Brush;
+                LinearGradientBrushProperties Properties;
+                Cpu::ExtendMode ExtendMode;
+                std::uint32_t StopCount;
+            };
+
+            struct SavedRadialGradientBrush
+            {
+                SavedBrush Brush;
+                RadialGradientBrushProperties Properties;
+                Cpu::ExtendMode ExtendMode;
+                std::uint32_t StopCount;
+            };
+
+            struct SavedBitmapBrush
+            {
+                SavedBrush Brush;
+                BitmapBrushProperties Properties;
+                std::uint32_t HasBitmap;
+                std::uint64_t Bitmap;
+            };
+
+            struct SavedPathGeometry
+            {
+                Cpu::FillMode FillMode;
+                std::uint32_t PointCount;
+                std::uint32_t VerbCount;
+            };
+
+            struct SavedRenderingParams
+            {
+                float Gamma;
+                float EnhancedContrast;
+                float ClearTypeLevel;
+                Cpu::PixelGeometry PixelGeometry;
+            };
+
+            struct SavedGeometryFontFace
+            {
+                FontMetrics Metrics;
+                std::uint32_t GlyphCount;
+                std::uint32_t PointCount;
+                std::uint32_t VerbCount;
+            };
+
+            struct SavedOpenTypeFontFace
+            {
+                std::uint64_t Font;
+                std::uint32_t FaceIndex;
+                std::uint32_t Reserved;
+            };
+
+            inline auto GetCommandName(CommandType const type) -> char const *
+            {
+                switch (type)
+                {
+                case CommandType::SetTransform:           return "SetTransform";
+                case CommandType::SetAntialiasMode:       return "SetAntialiasMode";
+                case CommandType::Clear:                  return "Clear";
+                case CommandType::FillRectangle:          return "FillRectangle";
+                case CommandType::FillEllipse:            return "FillEllipse";
+                case CommandType::FillGeometry:           return "FillGeometry";
+                case CommandType::FillOpacityMask:        return "FillOpacityMask";
+                case CommandType::DrawBitmap:             return "DrawBitmap";
+                case CommandType::DrawImage:              return "DrawImage";
+                case CommandType::PushAxisAlignedClip:    return "PushAxisAlignedClip";
+                case CommandType::PopAxisAlignedClip:     return "PopAxisAlignedClip";
+                case CommandType::PushLayer:              return "PushLayer";
+                case CommandType::PopLayer:               return "PopLayer";
+                case CommandType::FillRectangles:         return "FillRectangles";
+                case CommandType::SetTextAntialiasMode:   return "SetTextAntialiasMode";
+                case CommandType::SetTextRenderingParams: return "SetTextRenderingParams";
+                case CommandType::DrawGlyphRun:           return "DrawGlyphRun";
+                }
+
+                return "Unknown";
+            }
+
+            inline auto HashBytes(std::uint64_t hash,
+                                  std::uint8_t const * bytes,
+                                  size_t const size) -> std::uint64_t
+            {
+                size_t i = 0;
+
+                for (; i + 8 <= size; i += 8)
+                {
+                    std::uint64_t word;
+                    memcpy(&word, bytes + i, 8);
+                    hash = (hash ^ word) * 0x100000001b3ull;
+                    hash ^= hash >> 29;
+                }
+
+                for (; i != size; ++i)
+                {
+                    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+                }
+
+                return hash;
+            }
+
+            // Identical pixels give identical hashes wherever the bitmaps came from.
+            inline auto HashBitmap(BitmapImpl & bitmap) -> std::uint64_t
+            {
+                std::uint32_t const description[] =
+                {
+                    bitmap.Size.Width,
+                    bitmap.Size.Height,
+                    static_cast<std::uint32_t>(bitmap.Format.Format),
+                    static_cast<std::uint32_t>(bitmap.Format.AlphaMode),
+                };
+
+                auto hash = HashBytes(0xcbf29ce484222325ull, reinterpret_cast<std::uint8_t const *>(description), sizeof(description));
+                auto const bits = bitmap.GetBits();
+                auto const width = bitmap.Size.Width * GetBytesPerPixel(bitmap.Format.Format);
+
+                for (unsigned y = 0; y != bitmap.Size.Height; ++y)
+                {
+                    hash = HashBytes(hash, bits + static_cast<size_t>(y) * bitmap.Pitch, width);
+                }
+
+                return hash;
+            }
+
+            inline auto OpenFile(char const * filename,
+                                 char const * mode) -> std::FILE *
+            {
+#ifdef _MSC_VER
+                std::FILE * file = nullptr;
+                return 0 == fopen_s(&file, filename, mode) ? file : nullptr;
+#else
+                return std::fopen(filename, mode);
+#endif
+            }
+
+            // Writes the file front to back, without building it in memory first.
+            class CommandFileWriter
+            {
+                std::FILE * m_file;
+                size_t m_offset;
+                std::vector<CommandListImpl const *> m_lists;
+                std::unordered_map<CommandListImpl const *, unsigned> m_listIndices;
+                std::vector<BitmapImpl *> m_bitmaps;
+                std::unordered_map<BitmapImpl const *, std::uint64_t> m_hashes;
+                std::unordered_map<std::uint64_t, unsigned> m_bitmapIndices;
+                std::vector<CommandFileFont> m_fonts;
+                std::vector<std::uint8_t const *> m_fontBits;
+                std::unordered_map<std::uint8_t const *, std::uint64_t> m_fontHashes;
+                std::unordered_map<std::uint64_t, unsigned> m_fontIndices;
+
+                void Write(void const * data,
+                           size_t const size)
+                {
+                    if (0 != size && size != std::fwrite(data, 1, size, m_file))
+                    {
+                        HR(E_FAIL);
+                    }
+
+                    m_offset += size;
+                }
+
+                template <typename T>
+                void Write(T const & value)
+                {
+                    Write(&value, sizeof(T));
+                }
+
+                void Align(size_t const alignment)
+                {
+                    std::uint8_t const zeros[16] = {};
+                    Write(zeros, (alignment - m_offset % alignment) % alignment);
+                }
+
+                void AddBitmap(BitmapImpl * bitmap)
+                {
+                    if (!bitmap || m_hashes.count(bitmap))
+                    {
+                        return;
+                    }
+
+                    auto const hash = HashBitmap(*bitmap);
+                    m_hashes[bitmap] = hash;
+
+                    if (m_bitmapIndices.insert(std::make_pair(hash, static_cast<unsigned>(m_bitmaps.size()))).second)
+                    {
+                        m_bitmaps.push_back(bitmap);
+                    }
+                }
+
+                // Faces that share a font file save it once.
+                void AddFont(FontFaceImpl const & face)
+                {
+                    std::uint8_t const * bits = nullptr;
+                    size_t size = 0;
+                    unsigned faceIndex = 0;
+
+                    if (!face.GetFontFile(bits, size, faceIndex) || m_fontHashes.count(bits))
+                    {
+                        return;
+                    }
+
+                    auto const hash = HashBytes(0xcbf29ce484222325ull ^ size, bits, size);
+                    m_fontHashes[bits] = hash;
+
+                    if (m_fontIndices.insert(std::make_pair(hash, static_cast<unsigned>(m_fonts.size()))).second)
+                    {
+                        CommandFileFont const font = { hash, size };
+                        m_fonts.push_back(font);
+                        m_fontBits.push_back(bits);
+                    }
+                }
+
+                void AddList(CommandListImpl const & list)
+                {
+                    if (m_listIndices.count(&list))
+                    {
+                        return;
+                    }
+
+                    for (auto const & resource : list.Resources)
+                    {
+                        if (auto const nested = dynamic_cast<CommandListImpl const *>(resource.Get()))
+                        {
+                            AddList(*nested);
+                        }
+                        else if (auto const brush = dynamic_cast<BitmapBrushImpl const *>(resource.Get()))
+                        {
+                            AddBitmap(brush->Bitmap.Get());
+                        }
+                        else if (auto const face = dynamic_cast<FontFaceImpl const *>(resource.Get()))
+                        {
+                            AddFont(*face);
+                        }
+                        else
+                        {
+                            AddBitmap(dynamic_cast<BitmapImpl *>(resource.Get()));
+                        }
+                    }
+
+                    m_listIndices[&list] = static_cast<unsigned>(m_lists.size());
+                    m_lists.push_back(&list);
+                }
+
+                void WriteBitmap(BitmapImpl & bitmap)
+                {
+                    auto const width = bitmap.Size.Width * GetBytesPerPixel(bitmap.Format.Format);
+
+                    CommandFileBitmap header = {};
+                    header.Hash = m_hashes[&bitmap];
+                    header.Width = bitmap.Size.Width;
+                    header.Height = bitmap.Size.Height;
+                    header.Format = static_cast<std::uint32_t>(bitmap.Format.Format);
+                    header.AlphaMode = static_cast<std::uint32_t>(bitmap.Format.AlphaMode);
+                    header.Pitch = (width + 15) & ~15u;
+                    Write(header);
+                    Align(16);
+
+                    auto const bits = bitmap.GetBits();
+
+                    for (unsigned y = 0; y != bitmap.Size.Height; ++y)
+                    {
+                        Write(bits + static_cast<size_t>(y) * bitmap.Pitch, width);
+                        Align(16);
+                    }
+                }
+
+                void WriteFont(unsigned const index)
+                {
+                    Write(m_fonts[index]);
+                    Align(16);
+                    Write(m_fontBits[index], static_cast<size_t>(m_fonts[index].Size));
+                    Align(16);
+                }
+
+                template <typename T>
+                void WriteResource(CommandFileResource const type,
+                                   T const & fields,
+                                   void const * items = nullptr,
+                                   size_t const itemSize = 0)
+                {
+                    CommandFileResourceHeader const header = { type, static_cast<std::uint32_t>((sizeof(T) + itemSize + 3) & ~size_t(3)) };
+                    Write(header);
+                    Write(fields);
+                    Write(items, itemSize);
+                    Align(4);
+                }
+
+                static auto SaveBrush(BrushImpl const & brush) -> SavedBrush
+                {
+                    SavedBrush const result = { brush.Opacity, brush.Transform };
+                    return result;
+                }
+
+                void WriteResource(Resource const & resource)
+                {
+                    if (auto const solid = dynamic_cast<SolidColorBrushImpl const *>(&resource))
+                    {
+                        SavedSolidColorBrush const fields = { SaveBrush(*solid), solid->Color };
+                        WriteResource(CommandFileResource::SolidColorBrush, fields);
+                    }
+                    else if (auto const linear = dynamic_cast<LinearGradientBrushImpl const *>(&resource))
+                    {
+                        auto const & stops = linear->Stops->Stops;
+                        SavedLinearGradientBrush const fields = { SaveBrush(*linear), linear->Properties, linear->Stops->ExtendMode, static_cast<std::uint32_t>(stops.size()) };
+                        WriteResource(CommandFileResource::LinearGradientBrush, fields, stops.data(), stops.size() * sizeof(GradientStop));
+                    }
+                    else if (auto const radial = dynamic_cast<RadialGradientBrushImpl const *>(&resource))
+                    {
+                        auto const & stops = radial->Stops->Stops;
+                        SavedRadialGradientBrush const fields = { SaveBrush(*radial), radial->Properties, radial->Stops->ExtendMode, static_cast<std::uint32_t>(stops.size()) };
+                        WriteResource(CommandFileResource::RadialGradientBrush, fields, stops.data(), stops.size() * sizeof(GradientStop));
+                    }
+                    else if (auto const bitmapBrush = dynamic_cast<BitmapBrushImpl const *>(&resource))
+                    {
+                        SavedBitmapBrush fields;
+                        fields.Brush = SaveBrush(*bitmapBrush);
+                        fields.Properties = bitmapBrush->Properties;
+                        fields.HasBitmap = nullptr != bitmapBrush->Bitmap;
+                        fields.Bitmap = bitmapBrush->Bitmap ? m_hashes[bitmapBrush->Bitmap.Get()] : 0;
+                        WriteResource(CommandFileResource::BitmapBrush, fields);
+                    }
+                    else if (auto const rectangle = dynamic_cast<RectangleGeometryImpl const *>(&resource))
+                    {
+                        WriteResource(CommandFileResource::RectangleGeometry, rectangle->Rect);
+                    }
+                    else if (auto const ellipse = dynamic_cast<EllipseGeometryImpl const *>(&resource))
+                    {
+                        WriteResource(CommandFileResource::EllipseGeometry, ellipse->Ellipse);
+                    }
+                    else if (auto const path = dynamic_cast<GeometryImpl const *>(&resource))
+                    {
+                        SavedPathGeometry const fields = { path->FillMode, static_cast<std::uint32_t>(path->Points.size()), static_cast<std::uint32_t>(path->Verbs.size()) };
+                        std::vector<std::uint8_t> items(path->Points.size() * sizeof(Point2F) + path->Verbs.size());
+
+                        if (!items.empty())
+                        {
+                            memcpy(items.data(), path->Points.data(), path->Points.size() * sizeof(Point2F));
+                            memcpy(items.data() + path->Points.size() * sizeof(Point2F), path->Verbs.data(), path->Verbs.size());
+                        }
+
+                        WriteResource(CommandFileResource::PathGeometry, fields, items.data(), items.size());
+                    }
+                    else if (auto const bitmap = dynamic_cast<BitmapImpl const *>(&resource))
+                    {
+                        WriteResource(CommandFileResource::Bitmap, m_hashes[bitmap]);
+                    }
+                    else if (auto const list = dynamic_cast<CommandListImpl const *>(&resource))
+                    {
+                        WriteResource(CommandFileResource::CommandList, static_cast<std::uint32_t>(m_listIndices[list]));
+                    }
+                    else if (auto const params = dynamic_cast<RenderingParamsImpl const *>(&resource))
+                    {
+                        SavedRenderingParams const fields = { params->Gamma, params->EnhancedContrast, params->ClearTypeLevel, params->PixelGeometry };
+                        WriteResource(CommandFileResource::RenderingParams, fields);
+                    }
+                    else if (auto const geometryFace = dynamic_cast<GeometryFontFaceImpl const *>(&resource))
+                    {
+                        auto const & glyphs = geometryFace->Glyphs;
+                        auto const & points = geometryFace->Points;
+                        auto const & verbs = geometryFace->Verbs;
+                        SavedGeometryFontFace const fields = { geometryFace->Metrics, static_cast<std::uint32_t>(glyphs.size()), static_cast<std::uint32_t>(points.size()), static_cast<std::uint32_t>(verbs.size()) };
+                        auto const glyphBytes = glyphs.size() * sizeof(GeometryFontFaceImpl::Glyph);
+                        auto const pointBytes = points.size() * sizeof(Point2F);
+                        std::vector<std::uint8_t> items(glyphBytes + pointBytes + verbs.size());
+
+                        if (!items.empty())
+                        {
+                            memcpy(items.data(), glyphs.data(), glyphBytes);
+                            memcpy(items.data() + glyphBytes, points.data(), pointBytes);
+                            memcpy(items.data() + glyphBytes + pointBytes, verbs.data(), verbs.size());
+                        }
+
+                        WriteResource(CommandFileResource::GeometryFontFace, fields, items.data(), items.size());
+                    }
+                    else if (auto const face = dynamic_cast<FontFaceImpl const *>(&resource))
+                    {
+                        std::uint8_t const * bits = nullptr;
+                        size_t size = 0;
+                        SavedOpenTypeFontFace fields = {};
+
+                        if (!face->GetFontFile(bits, size, fields.FaceIndex))
+                        {
+                            HR(E_NOTIMPL);
+                        }
+
+                        fields.Font = m_fontHashes[bits];
+                        WriteResource(CommandFileResource::OpenTypeFontFace, fields);
+                    }
+                    else
+                    {
+                        HR(E_NOTIMPL);
+                    }
+                }
+
+                void WriteList(CommandListImpl const & list)
+                {
+                    CommandFileList const header =
+                    {
+                        static_cast<std::uint32_t>(list.Resources.size()),
+                        list.Count,
+                        static_cast<std::uint32_t>(list.Commands.GetSize()),
+                    };
+
+                    Write(header);
+
+                    for (auto const & resource : list.Resources)
+                    {
+                        WriteResource(*resource);
+                    }
+
+                    list.Commands.ForEach([&] (std::uint8_t const * bits) -> unsigned
+                    {
+                        auto const size = reinterpret_cast<Command const *>(bits)->Size;
+                        Write(bits, size);
+                        return size;
+                    });
+                }
+
+            public:
+
+                explicit CommandFileWriter(std::FILE * file) :
+                    m_file(file),
+                    m_offset(0)
+                {}
+
+                void Write(CommandListImpl const & list)
+                {
+                    AddList(list);
+
+                    CommandFileHeader const header =
+                    {
+                        CommandFileMagic,
+                        CommandFileVersion,
+                        CommandFileByteOrder,
+                        static_cast<std::uint32_t>(m_bitmaps.size()),
+                        static_cast<std::uint32_t>(m_fonts.size()),
+                        static_cast<std::uint32_t>(m_lists.size()),
+                    };
+
+                    Write(header);
+
+                    for (auto const bitmap : m_bitmaps)
+                    {
+                        WriteBitmap(*bitmap);
+                    }
+
+                    for (unsigned i = 0; i != m_fonts.size(); ++i)
+                    {
+                        WriteFont(i);
+                    }
+
+                    for (auto const saved : m_lists)
+                    {
+                        WriteList(*saved);
+                    }
+                }
+            };
+
+            // A read-only view of a file that is private to this process, so pages that
+            // are written to are copied rather than changing the file.
+            class MappedFile
+            {
+                std::uint8_t * m_bits;
+                size_t m_size;
+
+                MappedFile(MappedFile const &);
+                MappedFile & operator=(MappedFile const &);
+
+            public:
+
+                MappedFile() :
+                    m_bits(nullptr),
+                    m_size(0)
+                {}
+
+                explicit MappedFile(char const * filename) :
+                    m_bits(nullptr),
+                    m_size(0)
+                {
+                    HR(Open(filename));
+                }
+
+                ~MappedFile()
+                {
+                    if (!m_bits)
+                    {
+                        return;
+                    }
+#ifdef _WIN32
+                    UnmapViewOfFile(m_bits);
+#else
+                    munmap(m_bits, m_size);
+#endif
+                }
+
+                // Returns an error rather than throwing, for files that are expected to be
+                // missing or unreadable at times.
+                auto Open(char const * filename) -> HRESULT
+                {
+                    ASSERT(!m_bits);
+#ifdef _WIN32
+                    auto const file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+                    if (INVALID_HANDLE_VALUE == file)
+                    {
+                        return HRESULT_FROM_WIN32(GetLastError());
+                    }
+
+                    LARGE_INTEGER size = {};
+                    auto const mapping = GetFileSizeEx(file, &size) && 0 < size.QuadPart ? CreateFileMappingW(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr) : nullptr;
+                    auto const error = GetLastError();
+                    CloseHandle(file);
+
+                    if (!mapping)
+                    {
+                        return 0 == size.QuadPart ? WINCODEC_ERR_BADHEADER : HRESULT_FROM_WIN32(error);
+                    }
+
+                    m_bits = static_cast<std::uint8_t *>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+                    auto const mapError = GetLastError();
+                    CloseHandle(mapping);
+
+                    if (!m_bits)
+                    {
+                        return HRESULT_FROM_WIN32(mapError);
+                    }
+
+                    m_size = static_cast<size_t>(size.QuadPart);
+#else
+                    auto const file = open(filename, O_RDONLY);
+
+                    if (-1 == file)
+                    {
+                        return E_FAIL;
+                    }
+
+                    struct stat status;
+                    auto const size = 0 == fstat(file, &status) ? static_cast<size_t>(status.st_size) : 0;
+                    auto const bits = 0 < size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0) : MAP_FAILED;
+                    close(file);
+
+                    if (MAP_FAILED == bits)
+                    {
+                        return 0 == size ? WINCODEC_ERR_BADHEADER : E_FAIL;
+                    }
+
+                    m_bits = static_cast<std::uint8_t *>(bits);
+                    m_size = size;
+#endif
+                    return S_OK;
+                }
+
+                auto GetBits() const -> std::uint8_t *
+                {
+                    return m_bits;
+                }
+
+                auto GetSize() const -> size_t
+                {
+                    return m_size;
+                }
+            };
+
+            // Defined with the faces read from font files.
+            inline auto CreateOpenTypeFontFace(std::shared_ptr<MappedFile> const & file,
+                                               std::uint8_t const * bits,
+                                               size_t size,
+                                               unsigned faceIndex) -> Pointer<FontFaceImpl>;
+
+            // Builds command lists over a mapped file. Everything is checked before it is
+            // used, since replay trusts the commands and resources it is given.
+            class CommandFileReader
+            {
+                enum class Kind
+                {
+                    Brush,
+                    Geometry,
+                    Bitmap,
+                    List,
+                    RenderingParams,
+                    FontFace,
+                };
+
+                std::shared_ptr<MappedFile> m_file;
+                size_t m_offset;
+                std::unordered_map<std::uint64_t, Pointer<BitmapImpl>> m_bitmaps;
+                std::unordered_map<std::uint64_t, std::pair<std::uint8_t const *, size_t>> m_fonts;
+                std::vector<Pointer<CommandListImpl>> m_lists;
+
+                static void Check(bool const condition)
+                {
+                    if (!condition)
+                    {
+                        HR(WINCODEC_ERR_BADHEADER);
+                    }
+                }
+
+                auto Take(size_t const size) -> std::uint8_t *
+                {
+                    Check(size <= m_file->GetSize() - m_offset);
+                    auto const result = m_file->GetBits() + m_offset;
+                    m_offset += size;
+                    return result;
+                }
+
+                template <typename T>
+                auto Read() -> T
+                {
+                    T result;
+                    memcpy(&result, Take(sizeof(T)), sizeof(T));
+                    return result;
+                }
+
+                void Align(size_t const alignment)
+                {
+                    Take((alignment - m_offset % alignment) % alignment);
+                }
+
+                auto FindBitmap(std::uint64_t const hash) const -> Pointer<BitmapImpl>
+                {
+                    auto const result = m_bitmaps.find(hash);
+                    Check(m_bitmaps.end() != result);
+                    return result->second;
+                }
+
+                void ReadBitmap()
+                {
+                    auto const header = Read<CommandFileBitmap>();
+                    auto const format = static_cast<Dxgi::Format>(header.Format);
+                    auto const bytes = GetFormatTraits(format).BytesPerPixel;
+                    Check(0 != bytes && 0 != header.Pitch && header.Width <= header.Pitch / bytes && 0 == header.Pitch % 16);
+                    Align(16);
+                    Check(0 == header.Height || header.Height <= (m_file->GetSize() - m_offset) / header.Pitch);
+                    auto const bits = Take(static_cast<size_t>(header.Pitch) * header.Height);
+
+                    m_bitmaps[header.Hash] = Make<BitmapImpl>(SizeU(header.Width, header.Height),
+                                                                         PixelFormat(format, static_cast<AlphaMode>(header.AlphaMode)),
+                                                                         header.Pitch,
+                                                                         bits);
+                }
+
+                void ReadFont()
+                {
+                    auto const header = Read<CommandFileFont>();
+                    Align(16);
+                    Check(header.Size <= m_file->GetSize() - m_offset);
+                    auto const size = static_cast<size_t>(header.Size);
+                    m_fonts[header.Hash] = std::make_pair(Take(size), size);
+                    Align(16);
+                }
+
+                template <typename T>
+                static auto ReadItems(std::uint8_t const * bits,
+                                      unsigned const count) -> std::vector<T>
+                {
+                    std::vector<T> result(count);
+
+                    if (count)
+                    {
+                        memcpy(result.data(), bits, count * sizeof(T));
+                    }
+
+                    return result;
+                }
+
+                template <typename T>
+                auto ReadGradientBrush(std::uint8_t const * payload,
+                                       size_t const size) -> Pointer<Resource>
+                {
+                    Check(sizeof(typename T::first_type) <= size);
+                    typename T::first_type fields;
+                    memcpy(&fields, payload, sizeof(fields));
+                    Check(fields.StopCount <= (size - sizeof(fields)) / sizeof(GradientStop));
+                    auto const stops = ReadItems<GradientStop>(payload + sizeof(fields), fields.StopCount);
+
+                    return Make<typename T::second_type>(fields.Properties,
+                                                         Make<GradientStopCollectionImpl>(stops.data(), fields.StopCount, fields.ExtendMode),
+                                                         BrushProperties(fields.Brush.Opacity, fields.Brush.Transform));
+                }
+
+                // Each figure begins before anything is added to it and ends before the verbs
+                // do. Adds the number of points the verbs use.
+                static auto CountPathPoints(PathVerb const * verbs,
+                                            size_t const count,
+                                            size_t & used) -> bool
+                {
+                    auto open = false;
+
+                    for (size_t i = 0; i != count; ++i)
+                    {
+                        switch (verbs[i])
+                        {
+                        case PathVerb::Begin:
+                        case PathVerb::BeginHollow: if (open) return false; open = true; used += 1; break;
+                        case PathVerb::Line:        if (!open) return false; used += 1; break;
+                        case PathVerb::Quadratic:   if (!open) return false; used += 2; break;
+                        case PathVerb::Cubic:       if (!open) return false; used += 3; break;
+                        case PathVerb::End:         if (!open) return false; open = false; break;
+                        default:                    return false;
+                        }
+                    }
+
+                    return !open;
+                }
+
+                // The verbs also use up exactly the points there are.
+                static auto IsValidPath(std::vector<Point2F> const & points,
+                                        std::vector<PathVerb> const & verbs) -> bool
+                {
+                    size_t used = 0;
+                    return CountPathPoints(verbs.data(), verbs.size(), used) && used == points.size();
+                }
+
+                auto ReadResource(Kind & kind) -> Pointer<Resource>
+                {
+                    auto const header = Read<CommandFileResourceHeader>();
+                    auto const payload = Take(header.Size);
+                    size_t const size = header.Size;
+
+                    switch (header.Type)
+                    {
+                    case CommandFileResource::SolidColorBrush:
+                    {
+                        Check(sizeof(SavedSolidColorBrush) <= size);
+                        SavedSolidColorBrush fields;
+                        memcpy(&fields, payload, sizeof(fields));
+                        kind = Kind::Brush;
+                        return Make<SolidColorBrushImpl>(fields.Value, BrushProperties(fields.Brush.Opacity, fields.Brush.Transform));
+                    }
+                    case CommandFileResource::LinearGradientBrush:
+                    {
+                        kind = Kind::Brush;
+                        return ReadGradientBrush<std::pair<SavedLinearGradientBrush, LinearGradientBrushImpl>>(payload, size);
+                    }
+                    case CommandFileResource::RadialGradientBrush:
+                    {
+                        kind = Kind::Brush;
+                        return ReadGradientBrush<std::pair<SavedRadialGradientBrush, RadialGradientBrushImpl>>(payload, size);
+                    }
+                    case CommandFileResource::BitmapBrush:
+                    {
+                        Check(sizeof(SavedBitmapBrush) <= size);
+                        SavedBitmapBrush fields;
+                        memcpy(&fields, payload, sizeof(fields));
+                        kind = Kind::Brush;
+                        return Make<BitmapBrushImpl>(fields.HasBitmap ? FindBitmap(fields.Bitmap) : nullptr,
+                                                                 fields.Properties,
+                                                                 BrushProperties(fields.Brush.Opacity, fields.Brush.Transform));
+                    }
+                    case CommandFileResource::RectangleGeometry:
+                    {
+                        Check(sizeof(RectF) <= size);
+                        RectF rect;
+                        memcpy(&rect, payload, sizeof(rect));
+                        kind = Kind::Geometry;
+                        return Make<RectangleGeometryImpl>(rect);
+                    }
+                    case CommandFileResource::EllipseGeometry:
+                    {
+                        Check(sizeof(Ellipse) <= size);
+                        Ellipse ellipse;
+                        memcpy(&ellipse, payload, sizeof(ellipse));
+                        kind = Kind::Geometry;
+                        return Make<EllipseGeometryImpl>(ellipse);
+                    }
+                    case CommandFileResource::PathGeometry:
+                    {
+                        Check(sizeof(SavedPathGeometry) <= size);
+                        SavedPathGeometry fields;
+                        memcpy(&fields, payload, sizeof(fields));
+                        Check(fields.PointCount <= (size - sizeof(fields)) / sizeof(Point2F) &&
+                              fields.VerbCount <= size - sizeof(fields) - fields.PointCount * sizeof(Point2F));
+
+                        auto const geometry = Make<PathGeometryImpl>();
+                        geometry->FillMode = fields.FillMode;
+                        geometry->Points = ReadItems<Point2F>(payload + sizeof(fields), fields.PointCount);
+                        geometry->Verbs = ReadItems<PathVerb>(payload + sizeof(fields) + fields.PointCount * sizeof(Point2F), fields.VerbCount);
+                        geometry->Closed = true;
+                        Check(IsValidPath(geometry->Points, geometry->Verbs));
+                        kind = Kind::Geometry;
+                        return geometry;
+                    }
+                    case CommandFileResource::Bitmap:
+                    {
+                        Check(sizeof(std::uint64_t) <= size);
+                        std::uint64_t hash;
+                        memcpy(&hash, payload, sizeof(hash));
+                        kind = Kind::Bitmap;
+                        return FindBitmap(hash);
+                    }
+                    case CommandFileResource::CommandList:
+                    {
+                        Check(sizeof(std::uint32_t) <= size);
+                        std::uint32_t index;
+                        memcpy(&index, payload, sizeof(index));
+                        Check(index < m_lists.size());
+                        kind = Kind::List;
+                        return m_lists[index];
+                    }
+                    case CommandFileResource::RenderingParams:
+                    {
+                        Check(sizeof(SavedRenderingParams) <= size);
+                        SavedRenderingParams fields;
+                        memcpy(&fields, payload, sizeof(fields));
+                        Check(0.0f < fields.Gamma && 256.0f >= fields.Gamma &&
+                              0.0f <= fields.EnhancedContrast && 1.0e6f > fields.EnhancedContrast &&
+                              0.0f <= fields.ClearTypeLevel && 1.0f >= fields.ClearTypeLevel &&
+                              PixelGeometry::BGR >= fields.PixelGeometry);
+                        kind = Kind::RenderingParams;
+                        return Make<RenderingParamsImpl>(fields.Gamma, fields.EnhancedContrast, fields.ClearTypeLevel, fields.PixelGeometry);
+                    }
+                    case CommandFileResource::GeometryFontFace:
+                    {
+                        Check(sizeof(SavedGeometryFontFace) <= size);
+                        SavedGeometryFontFace fields;
+                        memcpy(&fields, payload, sizeof(fields));
+                        auto const items = payload + sizeof(fields);
+                        auto remaining = size - sizeof(fields);
+                        Check(0 != fields.Metrics.DesignUnitsPerEm && 0xffff >= fields.GlyphCount &&
+                              fields.GlyphCount <= remaining / sizeof(GeometryFontFaceImpl::Glyph));
+                        remaining -= fields.GlyphCount * sizeof(GeometryFontFaceImpl::Glyph);
+                        Check(fields.PointCount <= remaining / sizeof(Point2F) &&
+                              fields.VerbCount <= remaining - fields.PointCount * sizeof(Point2F));
+
+                        auto const face = Make<GeometryFontFaceImpl>();
+                        face->Metrics = fields.Metrics;
+                        face->Glyphs = ReadItems<GeometryFontFaceImpl::Glyph>(items, fields.GlyphCount);
+                        face->Points = ReadItems<Point2F>(items + fields.GlyphCount * sizeof(GeometryFontFaceImpl::Glyph), fields.PointCount);
+                        face->Verbs = ReadItems<PathVerb>(items + fields.GlyphCount * sizeof(GeometryFontFaceImpl::Glyph) + fields.PointCount * sizeof(Point2F), fields.VerbCount);
+
+                        // Each glyph's outline lies within the points and verbs of the face.
+                        for (auto const & glyph : face->Glyphs)
+                        {
+                            size_t used = 0;
+                            Check(glyph.FirstVerb <= fields.VerbCount && glyph.VerbCount <= fields.VerbCount - glyph.FirstVerb &&
+                                  CountPathPoints(face->Verbs.data() + glyph.FirstVerb, glyph.VerbCount, used) &&
+                                  glyph.FirstPoint <= fields.PointCount && used <= fields.PointCount - glyph.FirstPoint);
+                        }
+
+                        kind = Kind::FontFace;
+                        return face;
+                    }
+                    case CommandFileResource::OpenTypeFontFace:
+                    {
+                        Check(sizeof(SavedOpenTypeFontFace) <= size);
+                        SavedOpenTypeFontFace fields;
+                        memcpy(&fields, payload, sizeof(fields));
+                        auto const font = m_fonts.find(fields.Font);
+                        Check(m_fonts.end() != font);
+                        kind = Kind::FontFace;
+                        return CreateOpenTypeFontFace(m_file, font->second.first, font->second.second, fields.FaceIndex);
+                    }
+                    }
+
+                    Check(false);
+                    return nullptr;
+                }
+
+                static auto GetCommandSize(CommandType const type) -> unsigned
+                {
+                    switch (type)
+                    {
+                    case CommandType::SetTransform:           return sizeof(SetTransformCommand);
+                    case CommandType::SetAntialiasMode:       return sizeof(SetAntialiasModeCommand);
+                    case CommandType::Clear:                  return sizeof(ClearCommand);
+                    case CommandType::FillRectangle:          return sizeof(FillRectangleCommand);
+                    case CommandType::FillEllipse:            return sizeof(FillEllipseCommand);
+                    case CommandType::FillGeometry:           return sizeof(FillGeometryCommand);
+                    case CommandType::FillOpacityMask:        return sizeof(FillOpacityMaskCommand);
+                    case CommandType::DrawBitmap:             return sizeof(DrawBitmapCommand);
+                    case CommandType::DrawImage:              return sizeof(DrawImageCommand);
+                    case CommandType::PushAxisAlignedClip:    return sizeof(PushAxisAlignedClipCommand);
+                    case CommandType::PopAxisAlignedClip:     return sizeof(Command);
+                    case CommandType::PushLayer:              return sizeof(PushLayerCommand);
+                    case CommandType::PopLayer:               return sizeof(Command);
+                    case CommandType::FillRectangles:         return sizeof(FillRectanglesCommand);
+                    case CommandType::SetTextAntialiasMode:   return sizeof(SetTextAntialiasModeCommand);
+                    case CommandType::SetTextRenderingParams: return sizeof(SetTextRenderingParamsCommand);
+                    case CommandType::DrawGlyphRun:           return sizeof(DrawGlyphRunCommand);
+                    }
+
+                    return 0;
+                }
+
+                // The size must already be known to lie within the commands.
+                static auto IsValidSize(Command const & command) -> bool
+                {
+                    auto const size = GetCommandSize(command.Type);
+
+                    if (0 == size || command.Size < size)
+                    {
+                        return false;
+                    }
+
+                    if (CommandType::FillRectangles == command.Type)
+                    {
+                        auto const extra = command.Size - size;
+                        return 0 == extra % sizeof(RectF) && static_cast<FillRectanglesCommand const &>(command).Count == extra / sizeof(RectF);
+                    }
+
+                    if (CommandType::DrawGlyphRun == command.Type)
+                    {
+                        auto const & args = static_cast<DrawGlyphRunCommand const &>(command);
+                        return command.Size - size == DrawGlyphRunCommand::GetExtra(args.GlyphCount, 0 != args.HasAdvances, 0 != args.HasOffsets);
+                    }
+
+                    return command.Size == size;
+                }
+
+                static void CheckCommand(Command const & command,
+                                         std::vector<Kind> const & kinds)
+                {
+                    auto const resource = [&] (unsigned const index, Kind const kind, bool const optional)
+                    {
+                        Check((optional && NoResource == index) || (index < kinds.size() && kind == kinds[index]));
+                    };
+
+                    switch (command.Type)
+                    {
+                    case CommandType::FillRectangle:
+                        resource(static_cast<FillRectangleCommand const &>(command).Brush, Kind::Brush, false);
+                        break;
+                    case CommandType::FillRectangles:
+                        resource(static_cast<FillRectanglesCommand const &>(command).Brush, Kind::Brush, false);
+                        break;
+                    case CommandType::FillEllipse:
+                        resource(static_cast<FillEllipseCommand const &>(command).Brush, Kind::Brush, false);
+                        break;
+                    case CommandType::FillGeometry:
+                    {
+                        auto const & args = static_cast<FillGeometryCommand const &>(command);
+                        resource(args.Geometry, Kind::Geometry, false);
+                        resource(args.Brush, Kind::Brush, false);
+                        resource(args.OpacityBrush, Kind::Brush, true);
+                        break;
+                    }
+                    case CommandType::FillOpacityMask:
+                    {
+                        auto const & args = static_cast<FillOpacityMaskCommand const &>(command);
+                        resource(args.Mask, Kind::Bitmap, false);
+                        resource(args.Brush, Kind::Brush, false);
+                        break;
+                    }
+                    case CommandType::DrawBitmap:
+                        resource(static_cast<DrawBitmapCommand const &>(command).Bitmap, Kind::Bitmap, false);
+                        break;
+                    case CommandType::DrawImage:
+                        resource(static_cast<DrawImageCommand const &>(command).List, Kind::List, false);
+                        break;
+                    case CommandType::PushLayer:
+                    {
+                        auto const & args = static_cast<PushLayerCommand const &>(command);
+                        resource(args.GeometricMask, Kind::Geometry, true);
+                        resource(args.OpacityBrush, Kind::Brush, true);
+                        break;
+                    }
+                    case CommandType::SetTextRenderingParams:
+                        resource(static_cast<SetTextRenderingParamsCommand const &>(command).Params, Kind::RenderingParams, true);
+                        break;
+                    case CommandType::DrawGlyphRun:
+                    {
+                        auto const & args = static_cast<DrawGlyphRunCommand const &>(command);
+                        resource(args.FontFace, Kind::FontFace, false);
+                        resource(args.Brush, Kind::Brush, false);
+                        break;
+                    }
+                    default:
+                        break;
+                    }
+                }
+
+                void ReadList()
+                {
+                    auto const header = Read<CommandFileList>();
+                    Check(header.ResourceCount <= (m_file->GetSize() - m_offset) / sizeof(CommandFileResourceHeader));
+                    auto const list = Make<CommandListImpl>();
+                    std::vector<Kind> kinds(header.ResourceCount);
+
+                    for (auto & kind : kinds)
+                    {
+                        list->Resources.push_back(ReadResource(kind));
+                    }
+
+                    auto const bits = Take(header.CommandBytes);
+                    Check(0 == reinterpret_cast<std::uintptr_t>(bits) % alignof(Command));
+                    unsigned count = 0;
+
+                    for (unsigned offset = 0; offset != header.CommandBytes; ++count)
+                    {
+                        Check(sizeof(Command) <= header.CommandBytes - offset);
+                        auto const & command = *reinterpret_cast<Command const *>(bits + offset);
+                        Check(command.Size <= header.CommandBytes - offset && IsValidSize(command));
+                        CheckCommand(command, kinds);
+                        offset += command.Size;
+                    }
+
+                    Check(count == header.CommandCount);
+
+                    if (header.CommandBytes)
+                    {
+                        list->Commands.Borrow(bits, header.CommandBytes);
+                    }
+
+                    list->File = m_file;
+                    list->Count = count;
+                    list->Closed = true;
+                    m_lists.push_back(list);
+                }
+
+            public:
+
+                explicit CommandFileReader(std::shared_ptr<MappedFile> const & file) :
+                    m_file(file),
+                    m_offset(0)
+                {}
+
+                auto Read() -> Pointer<CommandListImpl>
+                {
+                    auto const header = Read<CommandFileHeader>();
+                    Check(CommandFileMagic == header.Magic);
+
+                    if (CommandFileVersion != header.Version || CommandFileByteOrder != header.ByteOrder)
+                    {
+                        HR(WINCODEC_ERR_UNSUPPORTEDVERSION);
+                    }
+
+                    for (unsigned i = 0; i != header.BitmapCount; ++i)
+                    {
+                        ReadBitmap();
+                    }
+
+                    for (unsigned i = 0; i != header.FontCount; ++i)
+                    {
+                        ReadFont();
+                    }
+
+                    for (unsigned i = 0; i != header.ListCount; ++i)
+                    {
+                        ReadList();
+                    }
+
+                    Check(!m_lists.empty());
+                    return m_lists.back();
+                }
+            };
+
+            // Reads big-endian values from font tables where they lie in memory. Reads out
+            // of range return zero, so a malformed font yields empty or partial outlines
+            // rather than reading past its tables.
+            class FontData
+            {
+                std::uint8_t const * m_bits;
+                size_t m_size;
+
+            public:
+
+                FontData() :
+                    m_bits(nullptr),
+                    m_size(0)
+                {}
+
+                FontData(std::uint8_t const * bits,
+                         size_t const size) :
+                    m_bits(bits),
+                    m_size(size)
+                {}
+
+                auto GetBits() const -> std::uint8_t const *
+                {
+                    return m_bits;
+                }
+
+                auto GetSize() const -> size_t
+                {
+                    return m_size;
+                }
+
+                auto IsEmpty() const -> bool
+                {
+                    return 0 == m_size;
+                }
+
+                auto Has(size_t const offset,
+                         size_t const size) const -> bool
+                {
+                    return offset <= m_size && size <= m_size - offset;
+                }
+
+                auto U8(size_t const offset) const -> unsigned
+                {
+                    return offset < m_size ? m_bits[offset] : 0;
+                }
+
+                auto U16(size_t const offset) const -> unsigned
+                {
+                    return Has(offset, 2) ? static_cast<unsigned>(m_bits[offset] << 8 | m_bits[offset + 1]) : 0;
+                }
+
+                auto S16(size_t const offset) const -> int
+                {
+                    return static_cast<std::int16_t>(U16(offset));
+                }
+
+                auto U32(size_t const offset) const -> std::uint32_t
+                {
+                    return Has(offset, 4) ? static_cast<std::uint32_t>(U16(offset)) << 16 | U16(offset + 2) : 0;
+                }
+
+                auto Slice(size_t const offset,
+                           size_t const size) const -> FontData
+                {
+                    return Has(offset, size) ? FontData(m_bits + offset, size) : FontData();
+                }
+
+                auto Slice(size_t const offset) const -> FontData
+                {
+                    return offset <= m_size ? FontData(m_bits + offset, m_size - offset) : FontData();
+                }
+            };
+
+            // An INDEX of the Compact Font Format: a count, offsets and the objects.
+            struct CffIndex
+            {
+                FontData Objects;
+                FontData Offsets;
+                unsigned Count;
+                unsigned OffsetSize;
+
+                CffIndex() :
+                    Count(0),
+                    OffsetSize(0)
+                {}
+
+                // Reads the index at the front of the data and returns its size.
+                auto Read(FontData const & data) -> size_t
+                {
+                    Count = data.U16(0);
+
+                    if (0 == Count)
+                    {
+                        return 2;
+                    }
+
+                    OffsetSize = data.U8(2);
+
+                    if (1 > OffsetSize || 4 < OffsetSize)
+                    {
+                        Count = 0;
+                        return data.GetSize();
+                    }
+
+                    auto const start = 3 + static_cast<size_t>(Count + 1) * OffsetSize;
+                    Offsets = data.Slice(3, start - 3);
+                    auto const end = GetOffset(Count);
+                    Objects = data.Slice(start - 1, end);
+
+                    if (Offsets.IsEmpty() || Objects.IsEmpty())
+                    {
+                        Count = 0;
+                        return data.GetSize();
+                    }
+
+                    return start - 1 + end;
+                }
+
+                auto GetOffset(unsigned const index) const -> size_t
+                {
+                    size_t result = 0;
+
+                    for (unsigned i = 0; i != OffsetSize; ++i)
+                    {
+                        result = result << 8 | Offsets.U8(static_cast<size_t>(index) * OffsetSize + i);
+                    }
+
+                    return result;
+                }
+
+                auto operator[](unsigned const index) const -> FontData
+                {
+                    if (index >= Count)
+                    {
+                        return FontData();
+                    }
+
+                    auto const begin = GetOffset(index);
+                    auto const end = GetOffset(index + 1);
+                    return begin <= end ? Objects.Slice(begin, end - begin) : FontData();
+                }
+
+                // Subroutine numbers are biased so that more of them fit in small operands.
+                auto GetBias() const -> int
+                {
+                    return 1240 > Count ? 107 : 33900 > Count ? 1131 : 32768;
+                }
+            };
+
+            // Appends outlines given in font units, with y up, to a geometry.
+            struct FontOutlineSink
+            {
+                GeometryImpl & Outline;
+                Matrix3x2F Transform;
+                bool Open;
+
+                FontOutlineSink(GeometryImpl & outline,
+                                Matrix3x2F const & transform) :
+                    Outline(outline),
+                    Transform(transform),
+                    Open(false)
+                {}
+
+                void Add(PathVerb const verb)
+                {
+                    Outline.Verbs.push_back(verb);
+                }
+
+                void Add(float const x,
+                         float const y)
+                {
+                    Outline.Points.push_back(Transform.TransformPoint(Point2F(x, y)));
+                }
+
+                void Move(float const x,
+                          float const y)
+                {
+                    Close();
+                    Add(PathVerb::Begin);
+                    Add(x, y);
+                    Open = true;
+                }
+
+                void Line(float const x,
+                          float const y)
+                {
+                    Add(PathVerb::Line);
+                    Add(x, y);
+                }
+
+                void Quadratic(float const x1,
+                               float const y1,
+                               float const x,
+                               float const y)
+                {
+                    Add(PathVerb::Quadratic);
+                    Add(x1, y1);
+                    Add(x, y);
+                }
+
+                void Cubic(float const x1,
+                           float const y1,
+                           float const x2,
+                           float const y2,
+                           float const x,
+                           float const y)
+                {
+                    Add(PathVerb::Cubic);
+                    Add(x1, y1);
+                    Add(x2, y2);
+                    Add(x, y);
+                }
+
+                void Close()
+                {
+                    if (Open)
+                    {
+                        Add(PathVerb::End);
+                        Open = false;
+                    }
+                }
+            };
+
+            // A face read from an OpenType or TrueType file mapped into memory. Only the
+            // table directory and a few headers are read up front. Character maps, metrics,
+            // outlines and kerning are read from the mapping when asked for, so nothing is
+            // copied and pages of the file that are never used are never loaded.
+            struct OpenTypeFontFaceImpl : FontFaceImpl
+            {
+                std::shared_ptr<MappedFile> File;
+                FontData Source;
+                unsigned FaceIndex;
+                unsigned GlyphCount;
+                unsigned HorizontalMetricCount;
+                bool LongOffsets;
+                bool Symbol;
+                FontData CharacterMap;
+                FontData HorizontalMetrics;
+                FontData Locations;
+                FontData Glyphs;
+                FontData Kerning;
+
+                // Compact Font Format outlines, used when there is no glyf table.
+                FontData CompactFont;
+                CffIndex CharStrings;
+                CffIndex GlobalSubroutines;
+                CffIndex LocalSubroutines;
+                std::vector<CffIndex> FontSubroutines;
+                FontData FontSelect;
+
+                // The pair adjustment subtables of the kern feature, in lookup order. Pairs
+                // are taken from the first subtable of each lookup that covers them.
+                struct PairSubtable
+                {
+                    FontData Data;
+                    unsigned Lookup;
+                };
+
+                std::vector<PairSubtable> Pairs;
+
+                static auto MakeTag(char const * name) -> std::uint32_t
+                {
+                    return static_cast<std::uint32_t>(static_cast<std::uint8_t>(name[0])) << 24 |
+                           static_cast<std::uint32_t>(static_cast<std::uint8_t>(name[1])) << 16 |
+                           static_cast<std::uint32_t>(static_cast<std::uint8_t>(name[2])) << 8 |
+                           static_cast<std::uint32_t>(static_cast<std::uint8_t>(name[3]));
+                }
+
+                static void Check(bool const condition)
+                {
+                    if (!condition)
+                    {
+                        HR(DWRITE_E_FILEFORMAT);
+                    }
+                }
+
+                // Returns the offset of the face within a file that may be a collection.
+                static auto GetFaceOffset(FontData const & file,
+                                          unsigned const faceIndex) -> size_t
+                {
+                    if (MakeTag("ttcf") != file.U32(0))
+                    {
+                        if (0 != faceIndex)
+                        {
+                            HR(E_INVALIDARG);
+                        }
+
+                        return 0;
+                    }
+
+                    if (faceIndex >= file.U32(8))
+                    {
+                        HR(E_INVALIDARG);
+                    }
+
+                    return file.U32(12 + 4 * static_cast<size_t>(faceIndex));
+                }
+
+                static auto GetFaceCount(FontData const & file) -> unsigned
+                {
+                    return MakeTag("ttcf") == file.U32(0) ? file.U32(8) : 1;
+                }
+
+                // Returns the table of the face at the offset, or nothing if it has none.
+                static auto FindTable(FontData const & file,
+                                      size_t const offset,
+                                      char const * name) -> FontData
+                {
+                    auto const tag = MakeTag(name);
+                    auto const tableCount = file.U16(offset + 4);
+
+                    for (unsigned i = 0; i != tableCount; ++i)
+                    {
+                        auto const record = offset + 12 + 16 * static_cast<size_t>(i);
+
+                        if (tag == file.U32(record))
+                        {
+                            return file.Slice(file.U32(record + 8), file.U32(record + 12));
+                        }
+                    }
+
+                    return FontData();
+                }
+
+                static auto IsFace(FontData const & file,
+                                   size_t const offset) -> bool
+                {
+                    auto const version = file.U32(offset);
+                    return (0x00010000 == version || MakeTag("OTTO") == version || MakeTag("true") == version) &&
+                           file.Has(offset + 12, 16 * static_cast<size_t>(file.U16(offset + 4)));
+                }
+
+                OpenTypeFontFaceImpl(std::shared_ptr<MappedFile> const & file,
+                                     unsigned const faceIndex) :
+                    OpenTypeFontFaceImpl(file, FontData(file->GetBits(), file->GetSize()), faceIndex)
+                {}
+
+                // The font file may be part of a larger mapping, such as a saved command list.
+                OpenTypeFontFaceImpl(std::shared_ptr<MappedFile> const & file,
+                                     FontData const & data,
+                                     unsigned const faceIndex) :
+                    File(file),
+                    Source(data),
+                    FaceIndex(faceIndex),
+                    GlyphCount(0),
+                    HorizontalMetricCount(0),
+                    LongOffsets(false),
+                    Symbol(false)
+                {
+                    auto const offset = GetFaceOffset(data, faceIndex);
+                    Check(IsFace(data, offset));
+
+                    auto const table = [&] (char const * name) -> FontData
+                    {
+                        return FindTable(data, offset, name);
+                    };
+
+                    auto const head = table("head");
+                    auto const horizontalHeader = table("hhea");
+                    auto const maximumProfile = table("maxp");
+                    Check(head.Has(0, 54) && horizontalHeader.Has(0, 36) && maximumProfile.Has(0, 6));
+
+                    auto const unitsPerEm = head.U16(18);
+                    Check(16 <= unitsPerEm && 16384 >= unitsPerEm);
+                    LongOffsets = 0 != head.S16(50);
+                    GlyphCount = maximumProfile.U16(4);
+                    HorizontalMetricCount = (std::min)(horizontalHeader.U16(34), GlyphCount);
+                    HorizontalMetrics = table("hmtx");
+                    Check(0 != HorizontalMetricCount && HorizontalMetrics.Has(0, 4 * static_cast<size_t>(HorizontalMetricCount)));
+
+                    // Metrics follow DirectWrite: the Windows ascent and descent from OS/2 when
+                    // present, and otherwise the horizontal header.
+                    auto const os2 = table("OS/2");
+                    auto const post = table("post");
+                    Metrics.DesignUnitsPerEm = static_cast<unsigned short>(unitsPerEm);
+                    Metrics.LineGap = static_cast<short>(horizontalHeader.S16(8));
+
+                    if (os2.Has(0, 78))
+                    {
+                        Metrics.Ascent = static_cast<unsigned short>(os2.U16(74));
+                        Metrics.Descent = static_cast<unsigned short>(os2.U16(76));
+                        Metrics.StrikethroughThickness = static_cast<unsigned short>(os2.S16(26));
+                        Metrics.StrikethroughPosition = static_cast<short>(os2.S16(28));
+                        Metrics.LineGap = static_cast<short>((std::max)(0, horizontalHeader.S16(4) - horizontalHeader.S16(6) + horizontalHeader.S16(8) -
+                                                                           static_cast<int>(Metrics.Ascent + Metrics.Descent)));
+                    }
+                    else
+                    {
+                        Metrics.Ascent = static_cast<unsigned short>((std::max)(0, horizontalHeader.S16(4)));
+                        Metrics.Descent = static_cast<unsigned short>((std::max)(0, -horizontalHeader.S16(6)));
+                    }
+
+                    if (os2.Has(0, 90) && 2 <= os2.U16(0))
+                    {
+                        Metrics.xHeight = static_cast<unsigned short>(os2.S16(86));
+                        Metrics.CapHeight = static_cast<unsigned short>(os2.S16(88));
+                    }
+                    else
+                    {
+                        Metrics.xHeight = static_cast<unsigned short>(unitsPerEm / 2);
+                        Metrics.CapHeight = static_cast<unsigned short>(unitsPerEm * 7 / 10);
+                    }
+
+                    if (0 == Metrics.StrikethroughThickness)
+                    {
+                        Metrics.StrikethroughThickness = static_cast<unsigned short>(unitsPerEm / 20);
+                        Metrics.StrikethroughPosition = static_cast<short>(Metrics.xHeight / 2);
+                    }
+
+                    Metrics.UnderlinePosition = static_cast<short>(post.S16(8));
+                    Metrics.UnderlineThickness = static_cast<unsigned short>(post.S16(10));
+
+                    FindCharacterMap(table("cmap"));
+
+                    Glyphs = table("glyf");
+                    Locations = table("loca");
+
+                    if (Glyphs.IsEmpty() || !Locations.Has(0, (static_cast<size_t>(GlyphCount) + 1) * (LongOffsets ? 4 : 2)))
+                    {
+                        Glyphs = FontData();
+                        Locations = FontData();
+                        ReadCompactFont(table("CFF "));
+                    }
+
+                    FindPairs(table("GPOS"));
+
+                    if (Pairs.empty())
+                    {
+                        Kerning = table("kern");
+                    }
+                }
+
+                // Prefers a full Unicode map, then one for the basic multilingual plane and
+                // then a symbol map.
+                void FindCharacterMap(FontData const & table)
+                {
+                    auto best = 0;
+                    auto const count = table.U16(2);
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const platform = table.U16(4 + 8 * i);
+                        auto const encoding = table.U16(6 + 8 * i);
+                        auto const subtable = table.Slice(table.U32(8 + 8 * i));
+                        auto const format = subtable.U16(0);
+                        auto score = 0;
+
+                        if ((3 == platform && 10 == encoding) || (0 == platform && (4 == encoding || 6 == encoding)))
+                        {
+                            score = 12 == format ? 4 : 0;
+                        }
+                        else if ((3 == platform && 1 == encoding) || 0 == platform)
+                        {
+                            score = 4 == format || 12 == format ? 3 : 6 == format ? 2 : 0;
+                        }
+                        else if (3 == platform && 0 == encoding)
+                        {
+                            score = 4 == format ? 1 : 0;
+                        }
+
+                        if (score > best)
+                        {
+                            best = score;
+                            CharacterMap = subtable;
+                            Symbol = 1 == score;
+                        }
+                    }
+                }
+
+                void ReadCompactFont(FontData const & table)
+                {
+                    auto offset = static_cast<size_t>(table.U8(2));
+                    Check(1 == table.U8(0) && 0 != offset);
+
+                    CffIndex names, dictionaries, strings;
+                    offset += names.Read(table.Slice(offset));
+                    offset += dictionaries.Read(table.Slice(offset));
+                    offset += strings.Read(table.Slice(offset));
+                    GlobalSubroutines.Read(table.Slice(offset));
+                    Check(0 != dictionaries.Count);
+                    CompactFont = table;
+
+                    auto const top = dictionaries[0];
+                    auto const charStrings = GetDictionaryValue(top, 17);
+                    Check(0 < charStrings);
+                    CharStrings.Read(table.Slice(static_cast<size_t>(charStrings)));
+                    Check(0 != CharStrings.Count && 2 == GetDictionaryValue(top, 1200 + 6, 2));
+                    LocalSubroutines = ReadPrivateSubroutines(top);
+
+                    auto const fontArray = GetDictionaryValue(top, 1200 + 36, -1);
+
+                    if (0 <= fontArray)
+                    {
+                        CffIndex fonts;
+                        fonts.Read(table.Slice(static_cast<size_t>(fontArray)));
+
+                        for (unsigned i = 0; i != fonts.Count; ++i)
+                        {
+                            FontSubroutines.push_back(ReadPrivateSubroutines(fonts[i]));
+                        }
+
+                        FontSelect = table.Slice(static_cast<size_t>(GetDictionaryValue(top, 1200 + 37)));
+                    }
+                }
+
+                auto ReadPrivateSubroutines(FontData const & dictionary) const -> CffIndex
+                {
+                    double values[2] = {};
+                    CffIndex result;
+
+                    if (2 == GetDictionaryValues(dictionary, 18, values, 2))
+                    {
+                        auto const size = static_cast<size_t>(values[0]);
+                        auto const offset = static_cast<size_t>(values[1]);
+                        auto const subroutines = GetDictionaryValue(CompactFont.Slice(offset, size), 19, 0);
+
+                        if (0 < subroutines)
+                        {
+                            result.Read(CompactFont.Slice(offset + static_cast<size_t>(subroutines)));
+                        }
+                    }
+
+                    return result;
+                }
+
+                // Finds the operands of an operator in a DICT. Escaped operators are numbered
+                // from 1200. Returns the number of operands found, up to the count.
+                static auto GetDictionaryValues(FontData const & dictionary,
+                                                unsigned const op,
+                                                double * values,
+                                                unsigned const count) -> unsigned
+                {
+                    double operands[48];
+                    unsigned depth = 0;
+
+                    for (size_t i = 0; i < dictionary.GetSize(); )
+                    {
+                        auto const b0 = dictionary.U8(i++);
+
+                        if (22 > b0)
+                        {
+                            auto const code = 12 == b0 ? 1200 + dictionary.U8(i++) : b0;
+
+                            if (code == op)
+                            {
+                                auto const result = (std::min)(depth, count);
+                                std::copy(operands, operands + result, values);
+                                return result;
+                            }
+
+                            depth = 0;
+                            continue;
+                        }
+
+                        double value = 0.0;
+
+                        if (28 == b0)
+                        {
+                            value = dictionary.S16(i);
+                            i += 2;
+                        }
+                        else if (29 == b0)
+                        {
+                            value = static_cast<std::int32_t>(dictionary.U32(i));
+                            i += 4;
+                        }
+                        else if (30 == b0)
+                        {
+                            // Real numbers are only skipped, since the operators used here
+                            // take integers.
+                            while (i < dictionary.GetSize() && 0x0f != (dictionary.U8(i) & 0x0f) && 0xf0 != (dictionary.U8(i) & 0xf0))
+                            {
+                                ++i;
+                            }
+
+                            ++i;
+                        }
+                        else if (32 <= b0 && 246 >= b0)
+                        {
+                            value = static_cast<int>(b0) - 139;
+                        }
+                        else if (247 <= b0 && 250 >= b0)
+                        {
+                            value = (static_cast<int>(b0) - 247) * 256 + static_cast<int>(dictionary.U8(i++)) + 108;
+                        }
+                        else if (251 <= b0 && 254 >= b0)
+                        {
+                            value = -(static_cast<int>(b0) - 251) * 256 - static_cast<int>(dictionary.U8(i++)) - 108;
+                        }
+
+                        if (48 > depth)
+                        {
+                            operands[depth++] = value;
+                        }
+                    }
+
+                    return 0;
+                }
+
+                static auto GetDictionaryValue(FontData const & dictionary,
+                                               unsigned const op,
+                                               double const fallback = 0.0) -> double
+                {
+                    double value = fallback;
+                    GetDictionaryValues(dictionary, op, &value, 1);
+                    return value;
+                }
+
+                auto GetGlyphCount() const -> unsigned override
+                {
+                    return GlyphCount;
+                }
+
+                auto GetGlyphIndex(std::uint32_t const codePoint) const -> unsigned short
+                {
+                    auto const & map = CharacterMap;
+                    unsigned result = 0;
+
+                    switch (map.U16(0))
+                    {
+                    case 4:
+                    {
+                        if (0xffff < codePoint)
+                        {
+                            break;
+                        }
+
+                        auto const segments = map.U16(6) / 2;
+                        unsigned low = 0;
+                        unsigned high = segments;
+
+                        while (low < high)
+                        {
+                            auto const middle = (low + high) / 2;
+
+                            if (map.U16(14 + 2 * static_cast<size_t>(middle)) < codePoint)
+                            {
+                                low = middle + 1;
+                            }
+                            else
+                            {
+                                high = middle;
+                            }
+                        }
+
+                        if (low == segments)
+                        {
+                            break;
+                        }
+
+                        auto const start = map.U16(16 + 2 * static_cast<size_t>(segments + low));
+
+                        if (start > codePoint)
+                        {
+                            break;
+                        }
+
+                        auto const delta = map.U16(16 + 2 * static_cast<size_t>(2 * segments + low));
+                        auto const rangeOffset = 16 + 2 * static_cast<size_t>(3 * segments + low);
+                        auto const range = map.U16(rangeOffset);
+
+                        if (0 == range)
+                        {
+                            result = (codePoint + delta) & 0xffff;
+                        }
+                        else
+                        {
+                            result = map.U16(rangeOffset + range + 2 * static_cast<size_t>(codePoint - start));
+                            result = 0 == result ? 0 : (result + delta) & 0xffff;
+                        }
+
+                        break;
+                    }
+                    case 6:
+                    {
+                        auto const first = map.U16(6);
+
+                        if (codePoint >= first && codePoint - first < map.U16(8))
+                        {
+                            result = map.U16(10 + 2 * static_cast<size_t>(codePoint - first));
+                        }
+
+                        break;
+                    }
+                    case 12:
+                    {
+                        std::uint32_t low = 0;
+                        std::uint32_t high = (std::min)(map.U32(12), static_cast<std::uint32_t>((map.GetSize() - 16) / 12));
+
+                        while (low < high)
+                        {
+                            auto const middle = low + (high - low) / 2;
+                            auto const group = 16 + 12 * static_cast<size_t>(middle);
+
+                            if (map.U32(group + 4) < codePoint)
+                            {
+                                low = middle + 1;
+                            }
+                            else
+                            {
+                                high = middle;
+                            }
+                        }
+
+                        auto const group = 16 + 12 * static_cast<size_t>(low);
+
+                        if (map.Has(group, 12) && map.U32(group) <= codePoint && map.U32(group + 4) >= codePoint)
+                        {
+                            result = map.U32(group + 8) + (codePoint - map.U32(group));
+                        }
+
+                        break;
+                    }
+                    }
+
+                    return static_cast<unsigned short>(result < GlyphCount ? result : 0);
+                }
+
+                // Symbol fonts map their characters from U+F000, and are also found from the
+                // Latin-1 characters below U+0100 as DirectWrite does.
+                void GetGlyphIndices(std::uint32_t const * codePoints,
+                                     unsigned const count,
+                                     unsigned short * glyphIndices) const override
+                {
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto result = GetGlyphIndex(codePoints[i]);
+
+                        if (0 == result && Symbol && 0x100 > codePoints[i])
+                        {
+                            result = GetGlyphIndex(0xf000 + codePoints[i]);
+                        }
+
+                        glyphIndices[i] = result;
+                    }
+                }
+
+                auto GetAdvance(unsigned const glyph,
+                                int & leftSideBearing) const -> unsigned
+                {
+                    if (glyph < HorizontalMetricCount)
+                    {
+                        leftSideBearing = HorizontalMetrics.S16(4 * static_cast<size_t>(glyph) + 2);
+                        return HorizontalMetrics.U16(4 * static_cast<size_t>(glyph));
+                    }
+
+                    leftSideBearing = HorizontalMetrics.S16(4 * static_cast<size_t>(HorizontalMetricCount) + 2 * static_cast<size_t>(glyph - HorizontalMetricCount));
+                    return HorizontalMetrics.U16(4 * static_cast<size_t>(HorizontalMetricCount - 1));
+                }
+
+                auto GetGlyphData(unsigned const glyph) const -> FontData
+                {
+                    if (glyph >= GlyphCount)
+                    {
+                        return FontData();
+                    }
+
+                    size_t begin, end;
+
+                    if (LongOffsets)
+                    {
+                        begin = Locations.U32(4 * static_cast<size_t>(glyph));
+                        end = Locations.U32(4 * static_cast<size_t>(glyph) + 4);
+                    }
+                    else
+                    {
+                        begin = 2 * static_cast<size_t>(Locations.U16(2 * static_cast<size_t>(glyph)));
+                        end = 2 * static_cast<size_t>(Locations.U16(2 * static_cast<size_t>(glyph) + 2));
+                    }
+
+                    return begin < end ? Glyphs.Slice(begin, end - begin) : FontData();
+                }
+
+                // The bounds of the glyph in font units, with y up. TrueType glyphs record
+                // them, and compact font glyphs are measured from their control points.
+                auto GetGlyphBounds(unsigned const glyph,
+                                    RectF & bounds) const -> bool
+                {
+                    if (!Glyphs.IsEmpty())
+                    {
+                        auto const data = GetGlyphData(glyph);
+
+                        if (!data.Has(0, 10))
+                        {
+                            return false;
+                        }
+
+                        bounds = RectF(static_cast<float>(data.S16(2)),
+                                       static_cast<float>(data.S16(4)),
+                                       static_cast<float>(data.S16(6)),
+                                       static_cast<float>(data.S16(8)));
+                        return true;
+                    }
+
+                    GeometryImpl outline;
+                    FontOutlineSink sink(outline, Matrix3x2F());
+                    AddCompactGlyph(glyph, sink);
+
+                    if (outline.Points.empty())
+                    {
+                        return false;
+                    }
+
+                    bounds = outline.GetBounds(Matrix3x2F());
+                    return true;
+                }
+
+                auto GetGlyphMetrics(unsigned short const glyph) const -> GlyphMetrics override
+                {
+                    GlyphMetrics result;
+
+                    if (glyph >= GlyphCount)
+                    {
+                        return result;
+                    }
+
+                    int leftSideBearing = 0;
+                    result.AdvanceWidth = GetAdvance(glyph, leftSideBearing);
+                    result.AdvanceHeight = Metrics.Ascent + Metrics.Descent;
+                    result.VerticalOriginY = Metrics.Ascent;
+                    RectF bounds;
+
+                    if (GetGlyphBounds(glyph, bounds))
+                    {
+                        result.LeftSideBearing = Glyphs.IsEmpty() ? static_cast<int>(bounds.Left) : leftSideBearing;
+                        result.RightSideBearing = static_cast<int>(result.AdvanceWidth) - result.LeftSideBearing - static_cast<int>(bounds.Right - bounds.Left);
+                        result.TopSideBearing = Metrics.Ascent - static_cast<int>(bounds.Bottom);
+                        result.BottomSideBearing = Metrics.Descent + static_cast<int>(bounds.Top);
+                    }
+                    else
+                    {
+                        result.RightSideBearing = static_cast<int>(result.AdvanceWidth);
+                        result.TopSideBearing = static_cast<int>(result.AdvanceHeight);
+                    }
+
+                    return result;
+                }
+
+                void AddGlyphOutline(unsigned short const glyph,
+                                     Matrix3x2F const & transform,
+                                     GeometryImpl & outline) const override
+                {
+                    FontOutlineSink sink(outline, Matrix3x2F(1.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f) * transform);
+
+                    if (!Glyphs.IsEmpty())
+                    {
+                        AddTrueTypeGlyph(glyph, sink, 0);
+                    }
+                    else
+                    {
+                        AddCompactGlyph(glyph, sink);
+                    }
+
+                    sink.Close();
+                }
+
+                // Points off the curve are quadratic control points, with a point on the
+                // curve implied halfway between two in a row. The flags, x and y coordinates
+                // are stored apart, so they are read side by side rather than copied out.
+                void AddTrueTypeGlyph(unsigned const glyph,
+                                      FontOutlineSink & sink,
+                                      unsigned const depth) const
+                {
+                    auto const data = GetGlyphData(glyph);
+                    auto const contours = data.S16(0);
+
+                    if (0 > contours)
+                    {
+                        AddCompositeGlyph(data, sink, depth);
+                        return;
+                    }
+
+                    if (0 == contours)
+                    {
+                        return;
+                    }
+
+                    auto const ends = static_cast<size_t>(10);
+                    auto const pointCount = static_cast<size_t>(data.U16(ends + 2 * static_cast<size_t>(contours - 1))) + 1;
+                    auto const flagsOffset = ends + 2 * static_cast<size_t>(contours) + 2 + data.U16(ends + 2 * static_cast<size_t>(contours));
+
+                    // Finds where the coordinates begin by reading the flags once.
+                    auto offset = flagsOffset;
+                    size_t xSize = 0;
+
+                    for (size_t i = 0; i < pointCount && offset < data.GetSize(); )
+                    {
+                        auto const flags = data.U8(offset++);
+                        auto repeat = 1u;
+
+                        if (flags & 8)
+                        {
+                            repeat += data.U8(offset++);
+                        }
+
+                        auto const size = flags & 2 ? 1u : flags & 16 ? 0u : 2u;
+                        xSize += static_cast<size_t>(size) * repeat;
+                        i += repeat;
+                    }
+
+                    auto flagsCursor = flagsOffset;
+                    auto xCursor = offset;
+                    auto yCursor = offset + xSize;
+                    unsigned flags = 0;
+                    unsigned repeat = 0;
+                    auto x = 0;
+                    auto y = 0;
+                    size_t point = 0;
+
+                    auto const next = [&] (bool & onCurve) -> Point2F
+                    {
+                        if (0 == repeat)
+                        {
+                            flags = data.U8(flagsCursor++);
+                            repeat = flags & 8 ? data.U8(flagsCursor++) + 1 : 1;
+                        }
+
+                        --repeat;
+
+                        if (flags & 2)
+                        {
+                            auto const delta = static_cast<int>(data.U8(xCursor++));
+                            x += flags & 16 ? delta : -delta;
+                        }
+                        else if (!(flags & 16))
+                        {
+                            x += data.S16(xCursor);
+                            xCursor += 2;
+                        }
+
+                        if (flags & 4)
+                        {
+                            auto const delta = static_cast<int>(data.U8(yCursor++));
+                            y += flags & 32 ? delta : -delta;
+                        }
+                        else if (!(flags & 32))
+                        {
+                            y += data.S16(yCursor);
+                            yCursor += 2;
+                        }
+
+                        onCurve = 0 != (flags & 1);
+                        return Point2F(static_cast<float>(x), static_cast<float>(y));
+                    };
+
+                    auto const middle = [] (Point2F const & first, Point2F const & second)
+                    {
+                        return Point2F((first.X + second.X) * 0.5f, (first.Y + second.Y) * 0.5f);
+                    };
+
+                    for (auto contour = 0; contour != contours; ++contour)
+                    {
+                        auto const last = static_cast<size_t>(data.U16(ends + 2 * static_cast<size_t>(contour)));
+
+                        if (last < point || last >= pointCount)
+                        {
+                            break;
+                        }
+
+                        Point2F start, firstControl, control;
+                        auto started = false;
+                        auto hasFirstControl = false;
+                        auto pending = false;
+
+                        for (; point <= last; ++point)
+                        {
+                            bool onCurve;
+                            auto const current = next(onCurve);
+
+                            if (!started)
+                            {
+                                if (onCurve)
+                                {
+                                    start = current;
+                                    started = true;
+                                    sink.Move(start.X, start.Y);
+                                }
+                                else if (!hasFirstControl)
+                                {
+                                    firstControl = current;
+                                    hasFirstControl = true;
+                                }
+                                else
+                                {
+                                    start = middle(firstControl, current);
+                                    started = true;
+                                    sink.Move(start.X, start.Y);
+                                    control = current;
+                                    pending = true;
+                                }
+
+                                continue;
+                            }
+
+                            if (onCurve)
+                            {
+                                if (pending)
+                                {
+                                    sink.Quadratic(control.X, control.Y, current.X, current.Y);
+                                }
+                                else
+                                {
+                                    sink.Line(current.X, current.Y);
+                                }
+
+                                pending = false;
+                            }
+                            else
+                            {
+                                if (pending)
+                                {
+                                    auto const between = middle(control, current);
+                                    sink.Quadratic(control.X, control.Y, between.X, between.Y);
+                                }
+
+                                control = current;
+                                pending = true;
+                            }
+                        }
+
+                        if (!started)
+                        {
+                            continue;
+                        }
+
+                        if (hasFirstControl)
+                        {
+                            if (pending)
+                            {
+                                auto const between = middle(control, firstControl);
+                                sink.Quadratic(control.X, control.Y, between.X, between.Y);
+                            }
+
+                            sink.Quadratic(firstControl.X, firstControl.Y, start.X, start.Y);
+                        }
+                        else if (pending)
+                        {
+                            sink.Quadratic(control.X, control.Y, start.X, start.Y);
+                        }
+
+                        sink.Close();
+                    }
+                }
+
+                // Composite glyphs place other glyphs by offsets and optional scaling. Points
+                // matched by number rather than by offset are placed at the origin.
+                void AddCompositeGlyph(FontData const & data,
+                                       FontOutlineSink & sink,
+                                       unsigned const depth) const
+                {
+                    if (8 < depth)
+                    {
+                        return;
+                    }
+
+                    auto const parent = sink.Transform;
+                    size_t offset = 10;
+
+                    for (;;)
+                    {
+                        auto const flags = data.U16(offset);
+                        auto const glyph = data.U16(offset + 2);
+                        offset += 4;
+
+                        if (!data.Has(offset, 2))
+                        {
+                            break;
+                        }
+
+                        float dx = 0.0f, dy = 0.0f;
+
+                        if (flags & 1)
+                        {
+                            dx = static_cast<float>(data.S16(offset));
+                            dy = static_cast<float>(data.S16(offset + 2));
+                            offset += 4;
+                        }
+                        else
+                        {
+                            dx = static_cast<float>(static_cast<std::int8_t>(data.U8(offset)));
+                            dy = static_cast<float>(static_cast<std::int8_t>(data.U8(offset + 1)));
+                            offset += 2;
+                        }
+
+                        if (!(flags & 2))
+                        {
+                            dx = dy = 0.0f;
+                        }
+
+                        auto const f2dot14 = [&] (size_t const at)
+                        {
+                            return data.S16(at) / 16384.0f;
+                        };
+
+                        Matrix3x2F component(1.0f, 0.0f, 0.0f, 1.0f, dx, dy);
+
+                        if (flags & 8)
+                        {
+                            component._11 = component._22 = f2dot14(offset);
+                            offset += 2;
+                        }
+                        else if (flags & 0x40)
+                        {
+                            component._11 = f2dot14(offset);
+                            component._22 = f2dot14(offset + 2);
+                            offset += 4;
+                        }
+                        else if (flags & 0x80)
+                        {
+                            component._11 = f2dot14(offset);
+                            component._12 = f2dot14(offset + 2);
+                            component._21 = f2dot14(offset + 4);
+                            component._22 = f2dot14(offset + 6);
+                            offset += 8;
+                        }
+
+                        sink.Transform = component * parent;
+                        AddTrueTypeGlyph(glyph, sink, depth + 1);
+
+                        if (!(flags & 0x20))
+                        {
+                            break;
+                        }
+                    }
+
+                    sink.Transform = parent;
+                }
+
+                auto GetLocalSubroutines(unsigned const glyph) const -> CffIndex const &
+                {
+                    if (FontSubroutines.empty())
+                    {
+                        return LocalSubroutines;
+                    }
+
+                    unsigned font = 0;
+
+                    if (0 == FontSelect.U8(0))
+                    {
+                        font = FontSelect.U8(1 + static_cast<size_t>(glyph));
+                    }
+                    else if (3 == FontSelect.U8(0))
+                    {
+                        auto const ranges = FontSelect.U16(1);
+
+                        for (unsigned i = 0; i != ranges; ++i)
+                        {
+                            auto const range = 3 + 3 * static_cast<size_t>(i);
+
+                            if (glyph >= FontSelect.U16(range) && glyph < FontSelect.U16(range + 3))
+                            {
+                                font = FontSelect.U8(range + 2);
+                                break;
+                            }
+                        }
+                    }
+
+                    return font < FontSubroutines.size() ? FontSubroutines[font] : LocalSubroutines;
+                }
+
+                void AddCompactGlyph(unsigned const glyph,
+                                     FontOutlineSink & sink) const
+                {
+                    CharStringState state(sink, GetLocalSubroutines(glyph), GlobalSubroutines);
+                    state.Run(CharStrings[glyph], 0);
+                    sink.Close();
+                }
+
+                // Interprets Type 2 charstrings, ignoring hints.
+                struct CharStringState
+                {
+                    FontOutlineSink & Sink;
+                    CffIndex const & Local;
+                    CffIndex const & Global;
+                    float Stack[48];
+                    unsigned Depth;
+                    unsigned Stems;
+                    bool Width;
+                    float X;
+                    float Y;
+
+                    CharStringState(FontOutlineSink & sink,
+                                    CffIndex const & local,
+                                    CffIndex const & global) :
+                        Sink(sink),
+                        Local(local),
+                        Global(global),
+                        Depth(0),
+                        Stems(0),
+                        Width(false),
+                        X(0.0f),
+                        Y(0.0f)
+                    {}
+
+                    void Push(float const value)
+                    {
+                        if (48 > Depth)
+                        {
+                            Stack[Depth++] = value;
+                        }
+                    }
+
+                    // The first operator that clears the stack may be preceded by the advance
+                    // width, which is not needed here since hmtx has it.
+                    auto TakeWidth(bool const odd) -> unsigned
+                    {
+                        auto result = 0u;
+
+                        if (!Width)
+                        {
+                            Width = true;
+
+                            if (odd && 0 != Depth)
+                            {
+                                result = 1;
+                            }
+                        }
+
+                        return result;
+                    }
+
+                    void MoveTo(float const dx,
+                                float const dy)
+                    {
+                        X += dx;
+                        Y += dy;
+                        Sink.Move(X, Y);
+                    }
+
+                    void LineTo(float const dx,
+                                float const dy)
+                    {
+                        X += dx;
+                        Y += dy;
+                        Sink.Line(X, Y);
+                    }
+
+                    void CurveTo(float const dx1,
+                                 float const dy1,
+                                 float const dx2,
+                                 float const dy2,
+                                 float const dx3,
+                                 float const dy3)
+                    {
+                        auto const x1 = X + dx1;
+                        auto const y1 = Y + dy1;
+                        auto const x2 = x1 + dx2;
+                        auto const y2 = y1 + dy2;
+                        X = x2 + dx3;
+                        Y = y2 + dy3;
+                        Sink.Cubic(x1, y1, x2, y2, X, Y);
+                    }
+
+                    // Returns false once the glyph ends.
+                    auto Run(FontData const & code,
+                             unsigned const nesting) -> bool
+                    {
+                        if (10 < nesting)
+                        {
+                            return false;
+                        }
+
+                        for (size_t i = 0; i < code.GetSize(); )
+                        {
+                            auto const b0 = code.U8(i++);
+
+                            if (32 <= b0 || 28 == b0)
+                            {
+                                if (28 == b0)
+                                {
+                                    Push(static_cast<float>(code.S16(i)));
+                                    i += 2;
+                                }
+                                else if (246 >= b0)
+                                {
+                                    Push(static_cast<float>(static_cast<int>(b0) - 139));
+                                }
+                                else if (250 >= b0)
+                                {
+                                    Push(static_cast<float>((static_cast<int>(b0) - 247) * 256 + static_cast<int>(code.U8(i++)) + 108));
+                                }
+                                else if (254 >= b0)
+                                {
+                                    Push(static_cast<float>(-(static_cast<int>(b0) - 251) * 256 - static_cast<int>(code.U8(i++)) - 108));
+                                }
+                                else
+                                {
+                                    Push(static_cast<std::int32_t>(code.U32(i)) / 65536.0f);
+                                    i += 4;
+                                }
+
+                                continue;
+                            }
+
+                            auto const s = Stack;
+                            unsigned k = 0;
+
+                            switch (b0)
+                            {
+                            case 1: // hstem
+                            case 3: // vstem
+                            case 18: // hstemhm
+                            case 23: // vstemhm
+                                k = TakeWidth(0 != (Depth & 1));
+                                Stems += (Depth - k) / 2;
+                                break;
+
+                            case 19: // hintmask
+                            case 20: // cntrmask
+                                k = TakeWidth(0 != (Depth & 1));
+                                Stems += (Depth - k) / 2;
+                                i += (Stems + 7) / 8;
+                                break;
+
+                            case 21: // rmoveto
+                                k = TakeWidth(2 < Depth);
+                                MoveTo(k < Depth ? s[k] : 0.0f, k + 1 < Depth ? s[k + 1] : 0.0f);
+                                break;
+
+                            case 22: // hmoveto
+                                k = TakeWidth(1 < Depth);
+                                MoveTo(k < Depth ? s[k] : 0.0f, 0.0f);
+                                break;
+
+                            case 4: // vmoveto
+                                k = TakeWidth(1 < Depth);
+                                MoveTo(0.0f, k < Depth ? s[k] : 0.0f);
+                                break;
+
+                            case 5: // rlineto
+                                for (; k + 1 < Depth; k += 2)
+                                {
+                                    LineTo(s[k], s[k + 1]);
+                                }
+                                break;
+
+                            case 6: // hlineto
+                            case 7: // vlineto
+                            {
+                                auto horizontal = 6 == b0;
+
+                                for (; k < Depth; ++k, horizontal = !horizontal)
+                                {
+                                    if (horizontal)
+                                    {
+                                        LineTo(s[k], 0.0f);
+                                    }
+                                    else
+                                    {
+                                        LineTo(0.0f, s[k]);
+                                    }
+                                }
+                                break;
+                            }
+
+                            case 8: // rrcurveto
+                                for (; k + 5 < Depth; k += 6)
+                                {
+                                    CurveTo(s[k], s[k + 1], s[k + 2], s[k + 3], s[k + 4], s[k + 5]);
+                                }
+                                break;
+
+                            case 24: // rcurveline
+                                for (; k + 7 < Depth; k += 6)
+                                {
+                                    CurveTo(s[k], s[k + 1], s[k + 2], s[k + 3], s[k + 4], s[k + 5]);
+                                }
+
+                                if (k + 1 < Depth)
+                                {
+                                    LineTo(s[k], s[k + 1]);
+                                }
+                                break;
+
+                            case 25: // rlinecurve
+                                for (; k + 7 < Depth; k += 2)
+                                {
+                                    LineTo(s[k], s[k + 1]);
+                                }
+
+                                if (k + 5 < Depth)
+                                {
+                                    CurveTo(s[k], s[k + 1], s[k + 2], s[k + 3], s[k + 4], s[k + 5]);
+                                }
+                                break;
+
+                            case 26: // vvcurveto
+                            case 27: // hhcurveto
+                            {
+                                auto first = 0.0f;
+
+                                if (Depth & 1)
+                                {
+                                    first = s[k++];
+                                }
+
+                                for (; k + 3 < Depth; k += 4, first = 0.0f)
+                                {
+                                    if (26 == b0)
+                                    {
+                                        CurveTo(first, s[k], s[k + 1], s[k + 2], 0.0f, s[k + 3]);
+                                    }
+                                    else
+                                    {
+                                        CurveTo(s[k], first, s[k + 1], s[k + 2], s[k + 3], 0.0f);
+                                    }
+                                }
+                                break;
+                            }
+
+                            case 30: // vhcurveto
+                            case 31: // hvcurveto
+                            {
+                                auto horizontal = 31 == b0;
+
+                                for (; k + 3 < Depth; k += 4, horizontal = !horizontal)
+                                {
+                                    auto const last = Depth - k == 5 ? s[k + 4] : 0.0f;
+
+                                    if (horizontal)
+                                    {
+                                        CurveTo(s[k], 0.0f, s[k + 1], s[k + 2], last, s[k + 3]);
+                                    }
+                                    else
+                                    {
+                                        CurveTo(0.0f, s[k], s[k + 1], s[k + 2], s[k + 3], last);
+                                    }
+                                }
+                                break;
+                            }
+
+                            case 10: // callsubr
+                            case 29: // callgsubr
+                            {
+                                if (0 == Depth)
+                                {
+                                    return false;
+                                }
+
+                                auto const & subroutines = 10 == b0 ? Local : Global;
+                                auto const index = static_cast<int>(s[--Depth]) + subroutines.GetBias();
+
+                                if (0 > index || !Run(subroutines[static_cast<unsigned>(index)], nesting + 1))
+                                {
+                                    return false;
+                                }
+
+                                continue;
+                            }
+
+                            case 11: // return
+                                return true;
+
+                            case 14: // endchar
+                                TakeWidth(0 != (Depth & 1));
+                                Sink.Close();
+                                return false;
+
+                            case 12:
+                                Flex(code.U8(i++));
+                                break;
+                            }
+
+                            Depth = 0;
+                        }
+
+                        return true;
+                    }
+
+                    void Flex(unsigned const op)
+                    {
+                        auto const s = Stack;
+
+                        switch (op)
+                        {
+                        case 34: // hflex
+                            if (7 <= Depth)
+                            {
+                                CurveTo(s[0], 0.0f, s[1], s[2], s[3], 0.0f);
+                                CurveTo(s[4], 0.0f, s[5], -s[2], s[6], 0.0f);
+                            }
+                            break;
+
+                        case 35: // flex
+                            if (12 <= Depth)
+                            {
+                                CurveTo(s[0], s[1], s[2], s[3], s[4], s[5]);
+                                CurveTo(s[6], s[7], s[8], s[9], s[10], s[11]);
+                            }
+                            break;
+
+                        case 36: // hflex1
+                            if (9 <= Depth)
+                            {
+                                CurveTo(s[0], s[1], s[2], s[3], s[4], 0.0f);
+                                CurveTo(s[5], 0.0f, s[6], s[7], s[8], -(s[1] + s[3] + s[7]));
+                            }
+                            break;
+
+                        case 37: // flex1
+                            if (11 <= Depth)
+                            {
+                                auto const dx = s[0] + s[2] + s[4] + s[6] + s[8];
+                                auto const dy = s[1] + s[3] + s[5] + s[7] + s[9];
+                                auto const horizontal = std::fabs(dx) > std::fabs(dy);
+                                CurveTo(s[0], s[1], s[2], s[3], s[4], s[5]);
+                                CurveTo(s[6], s[7], s[8], s[9], horizontal ? s[10] : -dx, horizontal ? -dy : s[10]);
+                            }
+                            break;
+                        }
+                    }
+                };
+
+                // Reads the classes and coverage tables of OpenType layout.
+                static auto GetCoverageIndex(FontData const & coverage,
+                                             unsigned const glyph) -> int
+                {
+                    if (1 == coverage.U16(0))
+                    {
+                        unsigned low = 0;
+                        unsigned high = coverage.U16(2);
+
+                        while (low < high)
+                        {
+                            auto const middle = (low + high) / 2;
+                            auto const value = coverage.U16(4 + 2 * static_cast<size_t>(middle));
+
+                            if (value == glyph)
+                            {
+                                return static_cast<int>(middle);
+                            }
+
+                            if (value < glyph)
+                            {
+                                low = middle + 1;
+                            }
+                            else
+                            {
+                                high = middle;
+                            }
+                        }
+                    }
+                    else if (2 == coverage.U16(0))
+                    {
+                        unsigned low = 0;
+                        unsigned high = coverage.U16(2);
+
+                        while (low < high)
+                        {
+                            auto const middle = (low + high) / 2;
+                            auto const range = 4 + 6 * static_cast<size_t>(middle);
+
+                            if (coverage.U16(range + 2) < glyph)
+                            {
+                                low = middle + 1;
+                            }
+                            else if (coverage.U16(range) > glyph)
+                            {
+                                high = middle;
+                            }
+                            else
+                            {
+                                return static_cast<int>(coverage.U16(range + 4) + glyph - coverage.U16(range));
+                            }
+                        }
+                    }
+
+                    return -1;
+                }
+
+                static auto GetClass(FontData const & classes,
+                                     unsigned const glyph) -> unsigned
+                {
+                    if (1 == classes.U16(0))
+                    {
+                        auto const first = classes.U16(2);
+
+                        if (glyph >= first && glyph - first < classes.U16(4))
+                        {
+                            return classes.U16(6 + 2 * static_cast<size_t>(glyph - first));
+                        }
+                    }
+                    else if (2 == classes.U16(0))
+                    {
+                        unsigned low = 0;
+                        unsigned high = classes.U16(2);
+
+                        while (low < high)
+                        {
+                            auto const middle = (low + high) / 2;
+                            auto const range = 4 + 6 * static_cast<size_t>(middle);
+
+                            if (classes.U16(range + 2) < glyph)
+                            {
+                                low = middle + 1;
+                            }
+                            else if (classes.U16(range) > glyph)
+                            {
+                                high = middle;
+                            }
+                            else
+                            {
+                                return classes.U16(range + 4);
+                            }
+                        }
+                    }
+
+                    return 0;
+                }
+
+                static auto GetValueSize(unsigned const format) -> size_t
+                {
+                    size_t result = 0;
+
+                    for (auto bits = format & 0xff; 0 != bits; bits &= bits - 1)
+                    {
+                        result += 2;
+                    }
+
+                    return result;
+                }
+
+                // Collects the pair adjustment lookups of every kern feature.
+                void FindPairs(FontData const & table)
+                {
+                    auto const features = table.Slice(table.U16(6));
+                    auto const lookups = table.Slice(table.U16(8));
+                    std::vector<unsigned> indices;
+
+                    for (unsigned i = 0; i != features.U16(0); ++i)
+                    {
+                        auto const record = 2 + 6 * static_cast<size_t>(i);
+
+                        if (MakeTag("kern") != features.U32(record))
+                        {
+                            continue;
+                        }
+
+                        auto const feature = features.Slice(features.U16(record + 4));
+
+                        for (unsigned j = 0; j != feature.U16(2); ++j)
+                        {
+                            indices.push_back(feature.U16(4 + 2 * static_cast<size_t>(j)));
+                        }
+                    }
+
+                    std::sort(indices.begin(), indices.end());
+                    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+                    for (auto const index : indices)
+                    {
+                        auto const lookup = lookups.Slice(lookups.U16(2 + 2 * static_cast<size_t>(index)));
+                        auto const type = lookup.U16(0);
+
+                        for (unsigned j = 0; j != lookup.U16(4); ++j)
+                        {
+                            auto subtable = lookup.Slice(lookup.U16(6 + 2 * static_cast<size_t>(j)));
+
+                            if (9 == type && 1 == subtable.U16(0) && 2 == subtable.U16(2))
+                            {
+                                subtable = subtable.Slice(subtable.U32(4));
+                            }
+                            else if (2 != type)
+                            {
+                                continue;
+                            }
+
+                            if (1 == subtable.U16(0) || 2 == subtable.U16(0))
+                            {
+                                PairSubtable const pair = { subtable, index };
+                                Pairs.push_back(pair);
+                            }
+                        }
+                    }
+                }
+
+                // Returns the advance adjustment of the first glyph of the pair, if the
+                // subtable covers it.
+                static auto GetPairAdjustment(FontData const & subtable,
+                                              unsigned const first,
+                                              unsigned const second,
+                                              int & adjustment) -> bool
+                {
+                    auto const coverage = GetCoverageIndex(subtable.Slice(subtable.U16(2)), first);
+
+                    if (0 > coverage)
+                    {
+                        return false;
+                    }
+
+                    auto const firstFormat = subtable.U16(4);
+                    auto const secondFormat = subtable.U16(6);
+                    auto const recordSize = GetValueSize(firstFormat) + GetValueSize(secondFormat);
+                    auto const advance = GetValueSize(firstFormat & 3);
+
+                    if (1 == subtable.U16(0))
+                    {
+                        if (static_cast<unsigned>(coverage) >= subtable.U16(8))
+                        {
+                            return false;
+                        }
+
+                        auto const set = subtable.Slice(subtable.U16(10 + 2 * static_cast<size_t>(coverage)));
+                        unsigned low = 0;
+                        unsigned high = set.U16(0);
+
+                        while (low < high)
+                        {
+                            auto const middle = (low + high) / 2;
+                            auto const record = 2 + (2 + recordSize) * middle;
+                            auto const glyph = set.U16(record);
+
+                            if (glyph == second)
+                            {
+                                adjustment = firstFormat & 4 ? set.S16(record + 2 + advance) : 0;
+                                return true;
+                            }
+
+                            if (glyph < second)
+                            {
+                                low = middle + 1;
+                            }
+                            else
+                            {
+                                high = middle;
+                            }
+                        }
+
+                        return false;
+                    }
+
+                    auto const firstClass = GetClass(subtable.Slice(subtable.U16(8)), first);
+                    auto const secondClass = GetClass(subtable.Slice(subtable.U16(10)), second);
+
+                    if (firstClass >= subtable.U16(12) || secondClass >= subtable.U16(14))
+                    {
+                        return false;
+                    }
+
+                    auto const record = 16 + recordSize * (static_cast<size_t>(firstClass) * subtable.U16(14) + secondClass);
+                    adjustment = firstFormat & 4 ? subtable.S16(record + advance) : 0;
+                    return true;
+                }
+
+                auto HasKerningPairs() const -> bool override
+                {
+                    return !Pairs.empty() || !Kerning.IsEmpty();
+                }
+
+                auto GetKerning(unsigned const first,
+                                unsigned const second) const -> int
+                {
+                    auto result = 0;
+
+                    if (!Pairs.empty())
+                    {
+                        auto skip = static_cast<unsigned>(-1);
+
+                        for (auto const & pair : Pairs)
+                        {
+                            int adjustment = 0;
+
+                            if (pair.Lookup != skip && GetPairAdjustment(pair.Data, first, second, adjustment))
+                            {
+                                result += adjustment;
+                                skip = pair.Lookup;
+                            }
+                        }
+
+                        return result;
+                    }
+
+                    // The original kern table, with sorted pairs in horizontal subtables.
+                    auto const key = static_cast<std::uint32_t>(first) << 16 | second;
+                    size_t offset = 4;
+
+                    auto const count = 0 == Kerning.U16(0) ? Kerning.U16(2) : 0;
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        // A lone subtable may be longer than its 16-bit length can say.
+                        auto const length = 1 == count ? Kerning.GetSize() - (std::min)(offset, Kerning.GetSize()) : Kerning.U16(offset + 2);
+                        auto const subtable = Kerning.Slice(offset, length);
+                        offset += length;
+                        auto const coverage = subtable.U16(4);
+
+                        if (0x0001 != (coverage & 0xff07))
+                        {
+                            continue;
+                        }
+
+                        unsigned low = 0;
+                        unsigned high = (std::min)(subtable.U16(6), static_cast<unsigned>((subtable.GetSize() - 14) / 6));
+
+                        while (low < high)
+                        {
+                            auto const middle = (low + high) / 2;
+                            auto const value = subtable.U32(14 + 6 * static_cast<size_t>(middle));
+
+                            if (value == key)
+                            {
+                                result = coverage & 8 ? subtable.S16(18 + 6 * static_cast<size_t>(middle)) :
+                                                        result + subtable.S16(18 + 6 * static_cast<size_t>(middle));
+                                break;
+                            }
+
+                            if (value < key)
+                            {
+                                low = middle + 1;
+                            }
+                            else
+                            {
+                                high = middle;
+                            }
+                        }
+                    }
+
+                    return result;
+                }
+
+                void GetKerningPairAdjustments(unsigned short const * glyphIndices,
+                                               unsigned const count,
+                                               int * adjustments) const override
+                {
+                    for (unsigned i = 0; i + 1 < count; ++i)
+                    {
+                        adjustments[i] = GetKerning(glyphIndices[i], glyphIndices[i + 1]);
+                    }
+
+                    if (0 != count)
+                    {
+                        adjustments[count - 1] = 0;
+                    }
+                }
+
+                auto GetFontFile(std::uint8_t const *& bits,
+                                 size_t & size,
+                                 unsigned & faceIndex) const -> bool override
+                {
+                    bits = Source.GetBits();
+                    size = Source.GetSize();
+                    faceIndex = FaceIndex;
+                    return true;
+                }
+            };
+
+            inline auto CreateOpenTypeFontFace(std::shared_ptr<MappedFile> const & file,
+                                               std::uint8_t const * bits,
+                                               size_t const size,
+                                               unsigned const faceIndex) -> Pointer<FontFaceImpl>
+            {
+                return Make<OpenTypeFontFaceImpl>(file, FontData(bits, size), faceIndex);
+            }
+
+
+            // The index of a font collection is saved as it is laid out in memory, so that a
+            // cache file is used where it is mapped. The sections follow the header in this
+            // order, each starting on an eight byte boundary. Strings are UTF-16 and are
+            // given by their offsets into the characters, and paths by theirs into the path
+            // bytes. Each family owns a range of the fonts and of the names.
+            std::uint32_t const FontIndexMagic = 0x49464b4b; // KKFI
+            std::uint32_t const FontIndexVersion = 1;
+
+            struct FontIndexHeader
+            {
+                std::uint32_t Magic;
+                std::uint32_t Version;
+                std::uint32_t ByteOrder;
+                std::uint32_t FileCount;
+                std::uint32_t FontCount;
+                std::uint32_t FamilyCount;
+                std::uint32_t NameCount;
+                std::uint32_t SlotCount;
+                std::uint32_t CharacterCount;
+                std::uint32_t PathBytes;
+            };
+
+            // Files are known by their modification times and sizes, and any change to
+            // either makes the cache stale.
+            struct FontIndexFile
+            {
+                std::uint64_t Modified;
+                std::uint64_t Size;
+                std::uint32_t Path;
+                std::uint32_t PathLength;
+            };
+
+            struct FontIndexFont
+            {
+                std::uint32_t File;
+                std::uint32_t FaceIndex;
+                std::uint16_t Weight;
+                std::uint16_t Stretch;
+                std::uint16_t Style;
+                std::uint16_t Reserved;
+            };
+
+            struct FontIndexFamily
+            {
+                std::uint32_t FirstFont;
+                std::uint32_t FontCount;
+                std::uint32_t FirstName;
+                std::uint32_t NameCount;
+            };
+
+            struct FontIndexName
+            {
+                std::uint32_t Locale;
+                std::uint32_t LocaleLength;
+                std::uint32_t String;
+                std::uint32_t StringLength;
+            };
+
+            // An open addressed hash table over every family name in every locale. Empty
+            // slots have no family.
+            struct FontIndexSlot
+            {
+                std::uint32_t Hash;
+                std::uint32_t Family;
+                std::uint32_t Name;
+            };
+
+            std::uint32_t const NoFontFamily = ~0u;
+
+            struct FontIndexLayout
+            {
+                size_t Files;
+                size_t Fonts;
+                size_t Families;
+                size_t Names;
+                size_t Slots;
+                size_t Characters;
+                size_t Paths;
+                size_t Size;
+
+                explicit FontIndexLayout(FontIndexHeader const & header)
+                {
+                    auto offset = static_cast<size_t>(0);
+
+                    auto const next = [&] (size_t const count, size_t const size) -> size_t
+                    {
+                        offset = (offset + 7) & ~static_cast<size_t>(7);
+                        auto const result = offset;
+                        offset += count * size;
+                        return result;
+                    };
+
+                    next(1, sizeof(FontIndexHeader));
+                    Files = next(header.FileCount, sizeof(FontIndexFile));
+                    Fonts = next(header.FontCount, sizeof(FontIndexFont));
+                    Families = next(header.FamilyCount, sizeof(FontIndexFamily));
+                    Names = next(header.NameCount, sizeof(FontIndexName));
+                    Slots = next(header.SlotCount, sizeof(FontIndexSlot));
+                    Characters = next(header.CharacterCount, sizeof(char16_t));
+                    Paths = next(header.PathBytes, 1);
+                    Size = next(0, 0);
+                }
+            };
+
+            // Names match without regard to the case of Latin letters.
+            inline auto FoldFontName(char16_t const c) -> char16_t
+            {
+                return ('A' <= c && 'Z' >= c) || (0xc0 <= c && 0xde >= c && 0xd7 != c) ? static_cast<char16_t>(c + 0x20) : c;
+            }
+
+            inline auto HashFontName(char16_t const * name,
+                                     size_t const length) -> std::uint32_t
+            {
+                std::uint32_t hash = 0x811c9dc5;
+
+                for (size_t i = 0; i != length; ++i)
+                {
+                    hash = (hash ^ FoldFontName(name[i])) * 0x01000193;
+                }
+
+                return hash;
+            }
+
+            inline auto EqualFontNames(char16_t const * first,
+                                       char16_t const * second,
+                                       size_t const length) -> bool
+            {
+                for (size_t i = 0; i != length; ++i)
+                {
+                    if (FoldFontName(first[i]) != FoldFontName(second[i]))
+                    {
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+
+            inline auto ToUtf16(wchar_t const * string) -> std::u16string
+            {
+                std::u16string result;
+
+                for (; *string; ++string)
+                {
+                    auto const c = static_cast<std::uint32_t>(*string);
+
+                    if (0xffff < c)
+                    {
+                        result.push_back(static_cast<char16_t>(0xd7c0 + (c >> 10)));
+                        result.push_back(static_cast<char16_t>(0xdc00 | (c & 0x3ff)));
+                    }
+                    else
+                    {
+                        result.push_back(static_cast<char16_t>(c));
+                    }
+                }
+
+                return result;
+            }
+
+            // Copies UTF-16 to a null-terminated buffer of wide characters, returning the
+            // length. Surrogate pairs are joined where wide characters hold whole code points.
+            inline auto FromUtf16(char16_t const * string,
+                                  unsigned const length,
+                                  wchar_t * buffer,
+                                  unsigned const count) -> unsigned
+            {
+                unsigned result = 0;
+
+                for (unsigned i = 0; i != length; ++i)
+                {
+                    std::uint32_t c = string[i];
+
+                    if (2 < sizeof(wchar_t) && 0xd800 <= c && 0xdc00 > c && i + 1 != length && 0xdc00 <= string[i + 1] && 0xe000 > string[i + 1])
+                    {
+                        c = 0x10000 + ((c - 0xd800) << 10) + (string[++i] - 0xdc00);
+                    }
+
+                    if (buffer)
+                    {
+                        if (result + 1 >= count)
+                        {
+                            HR(E_INVALIDARG);
+                        }
+
+                        buffer[result] = static_cast<wchar_t>(c);
+                    }
+
+                    ++result;
+                }
+
+                if (buffer)
+                {
+                    if (result >= count)
+                    {
+                        HR(E_INVALIDARG);
+                    }
+
+                    buffer[result] = 0;
+                }
+
+                return result;
+            }
+
+            // The modification time and size of a file, or zeros if it can't be found.
+            inline void GetFileStamp(char const * filename,
+                                     std::uint64_t & modified,
+                                     std::uint64_t & size)
+            {
+                modified = 0;
+                size = 0;
+#ifdef _WIN32
+                WIN32_FILE_ATTRIBUTE_DATA data;
+
+                if (GetFileAttributesExA(filename, GetFileExInfoStandard, &data))
+                {
+                    modified = static_cast<std::uint64_t>(data.ftLastWriteTime.dwHighDateTime) << 32 | data.ftLastWriteTime.dwLowDateTime;
+                    size = static_cast<std::uint64_t>(data.nFileSizeHigh) << 32 | data.nFileSizeLow;
+                }
+#else
+                struct stat status;
+
+                if (0 == stat(filename, &status))
+                {
+#ifdef __APPLE__
+                    auto const & time = status.st_mtimespec;
+#else
+                    auto const & time = status.st_mtim;
+#endif
+                    modified = static_cast<std::uint64_t>(time.tv_sec) * 1000000000 + static_cast<std::uint64_t>(time.tv_nsec);
+                    size = static_cast<std::uint64_t>(status.st_size);
+                }
+#endif
+            }
+
+            // The locale names of the Windows language identifiers that fonts commonly
+            // name their families in.
+            inline auto GetFontLocaleName(unsigned const language) -> char const *
+            {
+                struct Locale
+                {
+                    unsigned short Language;
+                    char const * Name;
+                };
+
+                static Locale const locales[] =
+                {
+                    { 0x0401, "ar-sa" }, { 0x0402, "bg-bg" }, { 0x0403, "ca-es" }, { 0x0404, "zh-tw" },
+                    { 0x0405, "cs-cz" }, { 0x0406, "da-dk" }, { 0x0407, "de-de" }, { 0x0408, "el-gr" },
+                    { 0x0409, "en-us" }, { 0x040a, "es-es" }, { 0x040b, "fi-fi" }, { 0x040c, "fr-fr" },
+                    { 0x040d, "he-il" }, { 0x040e, "hu-hu" }, { 0x0410, "it-it" }, { 0x0411, "ja-jp" },
+                    { 0x0412, "ko-kr" }, { 0x0413, "nl-nl" }, { 0x0414, "nb-no" }, { 0x0415, "pl-pl" },
+                    { 0x0416, "pt-br" }, { 0x0418, "ro-ro" }, { 0x0419, "ru-ru" }, { 0x041a, "hr-hr" },
+                    { 0x041b, "sk-sk" }, { 0x041d, "sv-se" }, { 0x041e, "th-th" }, { 0x041f, "tr-tr" },
+                    { 0x0421, "id-id" }, { 0x0422, "uk-ua" }, { 0x0424, "sl-si" }, { 0x0425, "et-ee" },
+                    { 0x0426, "lv-lv" }, { 0x0427, "lt-lt" }, { 0x042a, "vi-vn" }, { 0x0439, "hi-in" },
+                    { 0x0804, "zh-cn" }, { 0x0809, "en-gb" }, { 0x080a, "es-mx" }, { 0x0816, "pt-pt" },
+                    { 0x0c04, "zh-hk" }, { 0x0c0a, "es-es" }, { 0x1004, "zh-sg" }, { 0x1404, "zh-mo" },
+                };
+
+                for (auto const & locale : locales)
+                {
+                    if (language == locale.Language)
+                    {
+                        return locale.Name;
+                    }
+                }
+
+                return nullptr;
+            }
+
+            // Scans font files into an index. Faces are grouped into families by their
+            // typographic family names where they have them, as DirectWrite does, and
+            // otherwise by their family names. A family takes the names of its faces in
+            // every locale they give. Files that can't be read are kept in the index with
+            // no faces, so that a cache still matches them until they change.
+            class FontIndexBuilder
+            {
+                struct Family
+                {
+                    std::u16string Key;
+                    std::vector<std::pair<std::u16string, std::u16string>> Names;
+                    std::vector<FontIndexFont> Fonts;
+                };
+
+                std::vector<FontIndexFile> m_files;
+                std::string m_paths;
+                std::vector<Family> m_families;
+                std::unordered_map<std::u16string, unsigned> m_keys;
+
+                // Reads the family names of a face, preferring those of the Windows platform.
+                static void ReadNames(FontData const & table,
+                                      std::vector<std::pair<std::u16string, std::u16string>> & names)
+                {
+                    auto const count = table.U16(2);
+                    auto const strings = table.Slice(table.U16(4));
+
+                    for (auto const nameId : { 16u, 1u })
+                    {
+                        for (auto const platform : { 3u, 0u, 1u })
+                        {
+                            for (unsigned i = 0; i != count; ++i)
+                            {
+                                auto const record = 6 + 12 * static_cast<size_t>(i);
+
+                                if (platform != table.U16(record) || nameId != table.U16(record + 6))
+                                {
+                                    continue;
+                                }
+
+                                auto const encoding = table.U16(record + 2);
+                                auto const language = table.U16(record + 4);
+                                auto const length = table.U16(record + 8);
+                                auto const string = strings.Slice(table.U16(record + 10), length);
+                                char const * locale = "en-us";
+
+                                if (3 == platform)
+                                {
+                                    locale = 0 == encoding || 1 == encoding || 10 == encoding ? GetFontLocaleName(language) : nullptr;
+                                }
+                                else if (1 == platform && (0 != encoding || 0 != language))
+                                {
+                                    locale = nullptr;
+                                }
+
+                                if (!locale || string.IsEmpty())
+                                {
+                                    continue;
+                                }
+
+                                std::u16string name;
+
+                                if (1 == platform)
+                                {
+                                    for (unsigned j = 0; j != length; ++j)
+                                    {
+                                        name.push_back(static_cast<char16_t>(string.U8(j)));
+                                    }
+                                }
+                                else
+                                {
+                                    for (unsigned j = 0; j + 1 < length; j += 2)
+                                    {
+                                        name.push_back(static_cast<char16_t>(string.U16(j)));
+                                    }
+                                }
+
+                                std::u16string const localeName(locale, locale + strlen(locale));
+
+                                auto const found = std::find_if(names.begin(), names.end(), [&] (std::pair<std::u16string, std::u16string> const & existing)
+                                {
+                                    return existing.first == localeName;
+                                });
+
+                                if (names.end() == found)
+                                {
+                                    names.emplace_back(localeName, name);
+                                }
+                            }
+
+                            if (!names.empty())
+                            {
+                                return;
+                            }
+                        }
+                    }
+                }
+
+                void AddFace(FontData const & file,
+                             unsigned const fileIndex,
+                             unsigned const faceIndex)
+                {
+                    auto const offset = OpenTypeFontFaceImpl::GetFaceOffset(file, faceIndex);
+
+                    if (!OpenTypeFontFaceImpl::IsFace(file, offset))
+                    {
+                        return;
+                    }
+
+                    std::vector<std::pair<std::u16string, std::u16string>> names;
+                    ReadNames(OpenTypeFontFaceImpl::FindTable(file, offset, "name"), names);
+
+                    if (names.empty())
+                    {
+                        return;
+                    }
+
+                    auto const english = std::find_if(names.begin(), names.end(), [] (std::pair<std::u16string, std::u16string> const & name)
+                    {
+                        return u"en-us" == name.first;
+                    });
+
+                    auto key = (names.end() != english ? english : names.begin())->second;
+                    std::transform(key.begin(), key.end(), key.begin(), FoldFontName);
+                    auto const found = m_keys.find(key);
+                    auto index = static_cast<unsigned>(m_families.size());
+
+                    if (m_keys.end() == found)
+                    {
+                        m_keys.emplace(key, index);
+                        m_families.emplace_back();
+                        m_families.back().Key = key;
+                    }
+                    else
+                    {
+                        index = found->second;
+                    }
+
+                    auto & family = m_families[index];
+
+                    for (auto const & name : names)
+                    {
+                        auto const existing = std::find_if(family.Names.begin(), family.Names.end(), [&] (std::pair<std::u16string, std::u16string> const & other)
+                        {
+                            return other.first == name.first;
+                        });
+
+                        if (family.Names.end() == existing)
+                        {
+                            family.Names.push_back(name);
+                        }
+                    }
+
+                    // Weight, stretch and style come from the OS/2 table, with italic and
+                    // oblique selections.
+                    auto const os2 = OpenTypeFontFaceImpl::FindTable(file, offset, "OS/2");
+                    auto const selection = os2.U16(62);
+
+                    FontIndexFont font = {};
+                    font.File = fileIndex;
+                    font.FaceIndex = faceIndex;
+                    font.Weight = static_cast<std::uint16_t>(os2.Has(0, 8) ? (std::min)(999u, (std::max)(1u, os2.U16(4))) : 400);
+                    font.Stretch = static_cast<std::uint16_t>(os2.Has(0, 8) ? (std::min)(9u, (std::max)(1u, os2.U16(6))) : 5);
+                    font.Style = static_cast<std::uint16_t>(selection & 0x200 ? 1 : selection & 1 ? 2 : 0);
+                    family.Fonts.push_back(font);
+                }
+
+            public:
+
+                void AddFile(char const * filename)
+                {
+                    auto const fileIndex = static_cast<unsigned>(m_files.size());
+                    FontIndexFile record = {};
+                    GetFileStamp(filename, record.Modified, record.Size);
+                    record.Path = static_cast<std::uint32_t>(m_paths.size());
+                    record.PathLength = static_cast<std::uint32_t>(strlen(filename));
+                    m_paths.append(filename);
+                    m_files.push_back(record);
+
+                    MappedFile mapped;
+
+                    if (0 == record.Size || S_OK != mapped.Open(filename))
+                    {
+                        return;
+                    }
+
+                    FontData const file(mapped.GetBits(), mapped.GetSize());
+                    auto const faceCount = OpenTypeFontFaceImpl::GetFaceCount(file);
+
+                    // A collection without room for the offsets of its faces is corrupt.
+                    if (!file.Has(12, 4 * static_cast<size_t>(faceCount)))
+                    {
+                        return;
+                    }
+
+                    for (unsigned faceIndex = 0; faceIndex != faceCount; ++faceIndex)
+                    {
+                        AddFace(file, fileIndex, faceIndex);
+                    }
+                }
+
+                // Lays the index out in storage of 64-bit words, so that it's aligned as a
+                // mapped file would be.
+                void Build(std::vector<std::uint64_t> & storage) const
+                {
+                    FontIndexHeader header = {};
+                    header.Magic = FontIndexMagic;
+                    header.Version = FontIndexVersion;
+                    header.ByteOrder = CommandFileByteOrder;
+                    header.FileCount = static_cast<std::uint32_t>(m_files.size());
+                    header.FamilyCount = static_cast<std::uint32_t>(m_families.size());
+                    header.PathBytes = static_cast<std::uint32_t>(m_paths.size());
+
+                    for (auto const & family : m_families)
+                    {
+                        header.FontCount += static_cast<std::uint32_t>(family.Fonts.size());
+                        header.NameCount += static_cast<std::uint32_t>(family.Names.size());
+
+                        for (auto const & name : family.Names)
+                        {
+                            header.CharacterCount += static_cast<std::uint32_t>(name.first.size() + name.second.size());
+                        }
+                    }
+
+                    header.SlotCount = 8;
+
+                    while (header.SlotCount < 2 * header.NameCount)
+                    {
+                        header.SlotCount *= 2;
+                    }
+
+                    FontIndexLayout const layout(header);
+                    storage.assign((layout.Size + 7) / 8, 0);
+                    auto const bits = reinterpret_cast<std::uint8_t *>(storage.data());
+                    auto const files = reinterpret_cast<FontIndexFile *>(bits + layout.Files);
+                    auto const fonts = reinterpret_cast<FontIndexFont *>(bits + layout.Fonts);
+                    auto const families = reinterpret_cast<FontIndexFamily *>(bits + layout.Families);
+                    auto const names = reinterpret_cast<FontIndexName *>(bits + layout.Names);
+                    auto const slots = reinterpret_cast<FontIndexSlot *>(bits + layout.Slots);
+                    auto const characters = reinterpret_cast<char16_t *>(bits + layout.Characters);
+                    memcpy(bits, &header, sizeof(header));
+                    std::copy(m_files.begin(), m_files.end(), files);
+                    std::copy(m_paths.begin(), m_paths.end(), reinterpret_cast<char *>(bits + layout.Paths));
+
+                    for (unsigned i = 0; i != header.SlotCount; ++i)
+                    {
+                        slots[i].Family = NoFontFamily;
+                    }
+
+                    std::uint32_t font = 0;
+                    std::uint32_t name = 0;
+                    std::uint32_t character = 0;
+
+                    for (unsigned i = 0; i != m_families.size(); ++i)
+                    {
+                        auto const & family = m_families[i];
+                        families[i].FirstFont = font;
+                        families[i].FontCount = static_cast<std::uint32_t>(family.Fonts.size());
+                        families[i].FirstName = name;
+                        families[i].NameCount = static_cast<std::uint32_t>(family.Names.size());
+                        std::copy(family.Fonts.begin(), family.Fonts.end(), fonts + font);
+                        font += families[i].FontCount;
+
+                        for (auto const & localized : family.Names)
+                        {
+                            auto & record = names[name];
+                            record.Locale = character;
+                            record.LocaleLength = static_cast<std::uint32_t>(localized.first.size());
+                            character = static_cast<std::uint32_t>(std::copy(localized.first.begin(), localized.first.end(), characters + character) - characters);
+                            record.String = character;
+                            record.StringLength = static_cast<std::uint32_t>(localized.second.size());
+                            character = static_cast<std::uint32_t>(std::copy(localized.second.begin(), localized.second.end(), characters + character) - characters);
+
+                            // The first family to give a name keeps it.
+                            auto const string = characters + record.String;
+                            auto const hash = HashFontName(string, record.StringLength);
+
+                            for (auto slot = hash & (header.SlotCount - 1);; slot = (slot + 1) & (header.SlotCount - 1))
+                            {
+                                if (NoFontFamily == slots[slot].Family)
+                                {
+                                    slots[slot].Hash = hash;
+                                    slots[slot].Family = i;
+                                    slots[slot].Name = name;
+                                    break;
+                                }
+
+                                auto const & other = names[slots[slot].Name];
+
+                                if (hash == slots[slot].Hash &&
+                                    other.StringLength == record.StringLength &&
+                                    EqualFontNames(characters + other.String, string, record.StringLength))
+                                {
+                                    break;
+                                }
+                            }
+
+                            ++name;
+                        }
+                    }
+                }
+            };
+
+            // A collection reads its index where it lies, whether it was just built or
+            // mapped from a cache file. A mapped index is checked once, as a whole, before
+            // it is used.
+            struct FontCollectionImpl : Resource
+            {
+                std::vector<std::uint64_t> Storage;
+                std::shared_ptr<MappedFile> File;
+                FontIndexHeader Header;
+                FontIndexFile const * Files;
+                FontIndexFont const * Fonts;
+                FontIndexFamily const * Families;
+                FontIndexName const * Names;
+                FontIndexSlot const * Slots;
+                char16_t const * Characters;
+                char const * Paths;
+
+                FontCollectionImpl() :
+                    Header(),
+                    Files(nullptr),
+                    Fonts(nullptr),
+                    Families(nullptr),
+                    Names(nullptr),
+                    Slots(nullptr),
+                    Characters(nullptr),
+                    Paths(nullptr)
+                {}
+
+                auto Attach(std::uint8_t const * bits,
+                            size_t const size) -> bool
+                {
+                    if (sizeof(FontIndexHeader) > size)
+                    {
+                        return false;
+                    }
+
+                    FontIndexHeader header;
+                    memcpy(&header, bits, sizeof(header));
+
+                    if (FontIndexMagic != header.Magic ||
+                        FontIndexVersion != header.Version ||
+                        CommandFileByteOrder != header.ByteOrder ||
+                        0 == header.SlotCount ||
+                        0 != (header.SlotCount & (header.SlotCount - 1)) ||
+                        size / sizeof(FontIndexFile) < header.FileCount ||
+                        size / sizeof(FontIndexFont) < header.FontCount ||
+                        size / sizeof(FontIndexFamily) < header.FamilyCount ||
+                        size / sizeof(FontIndexName) < header.NameCount ||
+                        size / sizeof(FontIndexSlot) < header.SlotCount ||
+                        size / sizeof(char16_t) < header.CharacterCount ||
+                        size < header.PathBytes)
+                    {
+                        return false;
+                    }
+
+                    FontIndexLayout const layout(header);
+
+                    if (layout.Size > size)
+                    {
+                        return false;
+                    }
+
+                    auto const files = reinterpret_cast<FontIndexFile const *>(bits + layout.Files);
+                    auto const fonts = reinterpret_cast<FontIndexFont const *>(bits + layout.Fonts);
+                    auto const families = reinterpret_cast<FontIndexFamily const *>(bits + layout.Families);
+                    auto const names = reinterpret_cast<FontIndexName const *>(bits + layout.Names);
+                    auto const slots = reinterpret_cast<FontIndexSlot const *>(bits + layout.Slots);
+
+                    auto const within = [] (std::uint32_t const first, std::uint32_t const count, std::uint32_t const limit)
+                    {
+                        return first <= limit && count <= limit - first;
+                    };
+
+                    for (unsigned i = 0; i != header.FileCount; ++i)
+                    {
+                        if (!within(files[i].Path, files[i].PathLength, header.PathBytes))
+                        {
+                            return false;
+                        }
+                    }
+
+                    for (unsigned i = 0; i != header.FontCount; ++i)
+                    {
+                        if (fonts[i].File >= header.FileCount)
+                        {
+                            return false;
+                        }
+                    }
+
+                    for (unsigned i = 0; i != header.FamilyCount; ++i)
+                    {
+                        if (!within(families[i].FirstFont, families[i].FontCount, header.FontCount) ||
+                            !within(families[i].FirstName, families[i].NameCount, header.NameCount))
+                        {
+                            return false;
+                        }
+                    }
+
+                    for (unsigned i = 0; i != header.NameCount; ++i)
+                    {
+                        if (!within(names[i].Locale, names[i].LocaleLength, header.CharacterCount) ||
+                            !within(names[i].String, names[i].StringLength, header.CharacterCount))
+                        {
+                            return false;
+                        }
+                    }
+
+                    // Lookups stop at an empty slot, so there must be one.
+                    auto empty = false;
+
+                    for (unsigned i = 0; i != header.SlotCount; ++i)
+                    {
+                        if (NoFontFamily == slots[i].Family)
+                        {
+                            empty = true;
+                        }
+                        else if (slots[i].Family >= header.FamilyCount || slots[i].Name >= header.NameCount)
+                        {
+                            return false;
+                        }
+                    }
+
+                    if (!empty)
+                    {
+                        return false;
+                    }
+
+                    Header = header;
+                    Files = files;
+                    Fonts = fonts;
+                    Families = families;
+                    Names = names;
+                    Slots = slots;
+                    Characters = reinterpret_cast<char16_t const *>(bits + layout.Characters);
+                    Paths = reinterpret_cast<char const *>(bits + layout.Paths);
+                    return true;
+                }
+
+                // Whether the index was made from these files as they are now.
+                auto Matches(char const * const * filenames,
+                             unsigned const count) const -> bool
+                {
+                    if (count != Header.FileCount)
+                    {
+                        return false;
+                    }
+
+                    for (unsigned i = 0; i != count; ++i)
+                    {
+                        auto const & file = Files[i];
+                        std::uint64_t modified, size;
+                        GetFileStamp(filenames[i], modified, size);
+
+                        if (file.PathLength != strlen(filenames[i]) ||
+                            0 != memcmp(Paths + file.Path, filenames[i], file.PathLength) ||
+                            file.Modified != modified ||
+                            file.Size != size)
+                        {
+                            return false;
+                        }
+                    }
+
+                    return true;
+                }
+
+                auto GetPath(unsigned const file) const -> std::string
+                {
+                    return std::string(Paths + Files[file].Path, Files[file].PathLength);
+                }
+
+                auto FindFamily(wchar_t const * familyName) const -> std::uint32_t
+                {
+                    auto const name = ToUtf16(familyName);
+                    auto const hash = HashFontName(name.data(), name.size());
+
+                    for (auto slot = hash & (Header.SlotCount - 1);; slot = (slot + 1) & (Header.SlotCount - 1))
+                    {
+                        auto const & entry = Slots[slot];
+
+                        if (NoFontFamily == entry.Family)
+                        {
+                            return NoFontFamily;
+                        }
+
+                        auto const & other = Names[entry.Name];
+
+                        if (hash == entry.Hash &&
+                            other.StringLength == name.size() &&
+                            EqualFontNames(Characters + other.String, name.data(), name.size()))
+                        {
+                            return entry.Family;
+                        }
+                    }
+                }
+            };
+
+            // The names of a family, one for each locale.
+            struct LocalizedStringsImpl : Resource
+            {
+                Pointer<FontCollectionImpl> Collection;
+                unsigned FirstName;
+                unsigned Count;
+            };
+
+            struct FontFamilyImpl : Resource
+            {
+                Pointer<FontCollectionImpl> Collection;
+                unsigned Index;
+            };
+
+            struct FontImpl : Resource
+            {
+                Pointer<FontCollectionImpl> Collection;
+                unsigned Index;
+            };
+
+        } // Details
+
+        // Saves a closed command list along with everything it refers to. Bitmaps are
+        // saved once for each distinct set of pixels, and font files once for each
+        // distinct file.
+        inline void SaveCommandList(CommandList const & list,
+                                    char const * filename)
+        {
+            if (!list->Closed)
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            std::unique_ptr<std::FILE, int (*)(std::FILE *)> file(Details::OpenFile(filename, "wb"), &std::fclose);
+
+            if (!file)
+            {
+                HR(E_FAIL);
+            }
+
+            Details::CommandFileWriter(file.get()).Write(*list.Get());
+
+            if (0 != std::fclose(file.release()))
+            {
+                HR(E_FAIL);
+            }
+        }
+
+        // Maps a saved command list into memory. Commands, bitmap pixels and font files are
+        // used where they lie in the file rather than being copied.
+        inline auto LoadCommandList(char const * filename) -> CommandList
+        {
+            auto const file = std::make_shared<Details::MappedFile>(filename);
+            return CommandList(Details::CommandFileReader(file).Read());
+        }
+
+        // Maps an OpenType or TrueType font file, or a face of a collection, into memory.
+        // Tables are read in place for as long as the face is held.
+        inline auto CreateFontFace(char const * filename,
+                                   unsigned const faceIndex = 0) -> FontFace
+        {
+            auto const file = std::make_shared<Details::MappedFile>(filename);
+            return FontFace(Details::Make<Details::OpenTypeFontFaceImpl>(file, faceIndex));
+        }
+
+        enum class FontWeight
+        {
+            Thin       = 100,
+            ExtraLight = 200,
+            UltraLight = 200,
+            Light      = 300,
+            SemiLight  = 350,
+            Normal     = 400,
+            Regular    = 400,
+            Medium     = 500,
+            DemiBold   = 600,
+            SemiBold   = 600,
+            Bold       = 700,
+            ExtraBold  = 800,
+            UltraBold  = 800,
+            Black      = 900,
+            Heavy      = 900,
+            ExtraBlack = 950,
+            UltraBlack = 950,
+        };
+
+        enum class FontStretch
+        {
+            Undefined      = 0,
+            UltraCondensed = 1,
+            ExtraCondensed = 2,
+            Condensed      = 3,
+            SemiCondensed  = 4,
+            Normal         = 5,
+            Medium         = 5,
+            SemiExpanded   = 6,
+            Expanded       = 7,
+            ExtraExpanded  = 8,
+            UltraExpanded  = 9,
+        };
+
+        enum class FontStyle
+        {
+            Normal  = 0,
+            Oblique = 1,
+            Italic  = 2,
+        };
+
+        struct LocalizedStrings : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(LocalizedStrings, Details::Object, Details::LocalizedStringsImpl)
+
+            auto GetCount() const -> unsigned;
+
+            auto FindLocaleName(wchar_t const * localeName,
+                                unsigned & index) const -> bool;
+
+            auto GetLocaleNameLength(unsigned index) const -> unsigned;
+
+            void GetLocaleName(unsigned index,
+                               wchar_t * localeName,
+                               unsigned count) const;
+
+            auto GetStringLength(unsigned index) const -> unsigned;
+
+            void GetString(unsigned index,
+                           wchar_t * string,
+                           unsigned count) const;
+
+            template <unsigned Count>
+            void GetLocaleName(unsigned index,
+                               wchar_t (&localeName)[Count]) const
+            {
+                GetLocaleName(index, localeName, Count);
+            }
+
+            template <unsigned Count>
+            void GetString(unsigned index,
+                           wchar_t (&string)[Count]) const
+            {
+                GetString(index, string, Count);
+            }
+
+        private:
+
+            auto GetName(unsigned index) const -> Details::FontIndexName const &;
+        };
+
+        struct Font : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(Font, Details::Object, Details::FontImpl)
+
+            auto GetWeight() const -> FontWeight;
+            auto GetStretch() const -> FontStretch;
+            auto GetStyle() const -> FontStyle;
+
+            // Maps the file of the font.
+            auto CreateFontFace() const -> FontFace;
+        };
+
+        struct FontFamily : Details::Object
+        {
+            KENNYKERR_CPU_DEFINE_CLASS(FontFamily, Details::Object, Details::FontFamilyImpl)
+
+            auto GetFamilyNames() const -> LocalizedStrings;
+            auto GetFontCount() const -> unsigned;
+            auto GetFont(unsigned index) const -> Font;
+
+            auto GetFirstMatchingFont(FontWeight weight,
+                                      FontStretch stretch,
+                                      FontStyle style) const -> Font;
+        };
+
+        struct FontCollection : Details::Object
+        {
+            class iterator
+            {
+                unsigned m_index;
+                FontCollection const * m_container;
+
+            public:
+
+                iterator(unsigned index = 0,
+                         FontCollection const * container = nullptr);
+
+                auto operator ++() -> iterator &;
+                auto operator *() const -> FontFamily;
+
+                auto operator ==(iterator const & other) const -> bool;
+                auto operator !=(iterator const & other) const -> bool;
+            };
+
+            auto begin() const -> iterator;
+            auto end() const   -> iterator;
+
+            KENNYKERR_CPU_DEFINE_CLASS(FontCollection, Details::Object, Details::FontCollectionImpl)
+
+            auto GetFontFamilyCount() const -> unsigned;
+            auto GetFontFamily(unsigned index) const -> FontFamily;
+
+            // Finds a family by any of its names, in any locale, without regard to case.
+            auto FindFamilyName(wchar_t const * familyName,
+                                unsigned & index) const -> bool;
+        };
+
+        inline auto LocalizedStrings::GetName(unsigned const index) const -> Details::FontIndexName const &
+        {
+            if (index >= (*this)->Count)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            return (*this)->Collection->Names[(*this)->FirstName + index];
+        }
+
+        inline auto LocalizedStrings::GetCount() const -> unsigned
+        {
+            return (*this)->Count;
+        }
+
+        inline auto LocalizedStrings::FindLocaleName(wchar_t const * localeName,
+                                                     unsigned & index) const -> bool
+        {
+            auto const locale = Details::ToUtf16(localeName);
+            auto const & collection = *(*this)->Collection;
+
+            for (index = 0; index != (*this)->Count; ++index)
+            {
+                auto const & name = GetName(index);
+
+                if (name.LocaleLength == locale.size() &&
+                    Details::EqualFontNames(collection.Characters + name.Locale, locale.data(), locale.size()))
+                {
+                    return true;
+                }
+            }
+
+            index = 0;
+            return false;
+        }
+
+        inline auto LocalizedStrings::GetLocaleNameLength(unsigned const index) const -> unsigned
+        {
+            auto const & name = GetName(index);
+            return Details::FromUtf16((*this)->Collection->Characters + name.Locale, name.LocaleLength, nullptr, 0);
+        }
+
+        inline void LocalizedStrings::GetLocaleName(unsigned const index,
+                                                    wchar_t * localeName,
+                                                    unsigned const count) const
+        {
+            auto const & name = GetName(index);
+            Details::FromUtf16((*this)->Collection->Characters + name.Locale, name.LocaleLength, localeName, count);
+        }
+
+        inline auto LocalizedStrings::GetStringLength(unsigned const index) const -> unsigned
+        {
+            auto const & name = GetName(index);
+            return Details::FromUtf16((*this)->Collection->Characters + name.String, name.StringLength, nullptr, 0);
+        }
+
+        inline void LocalizedStrings::GetString(unsigned const index,
+                                                wchar_t * string,
+                                                unsigned const count) const
+        {
+            auto const & name = GetName(index);
+            Details::FromUtf16((*this)->Collection->Characters + name.String, name.StringLength, string, count);
+        }
+
+        inline auto Font::GetWeight() const -> FontWeight
+        {
+            return static_cast<FontWeight>((*this)->Collection->Fonts[(*this)->Index].Weight);
+        }
+
+        inline auto Font::GetStretch() const -> FontStretch
+        {
+            return static_cast<FontStretch>((*this)->Collection->Fonts[(*this)->Index].Stretch);
+        }
+
+        inline auto Font::GetStyle() const -> FontStyle
+        {
+            return static_cast<FontStyle>((*this)->Collection->Fonts[(*this)->Index].Style);
+        }
+
+        inline auto Font::CreateFontFace() const -> FontFace
+        {
+            auto const & collection = *(*this)->Collection;
+            auto const & font = collection.Fonts[(*this)->Index];
+            return Cpu::CreateFontFace(collection.GetPath(font.File).c_str(), font.FaceIndex);
+        }
+
+        inline auto FontFamily::GetFamilyNames() const -> LocalizedStrings
+        {
+            auto const & family = (*this)->Collection->Families[(*this)->Index];
+            auto const result = Details::Make<Details::LocalizedStringsImpl>();
+            result->Collection = (*this)->Collection;
+            result->FirstName = family.FirstName;
+            result->Count = family.NameCount;
+            return LocalizedStrings(result);
+        }
+
+        inline auto FontFamily::GetFontCount() const -> unsigned
+        {
+            return (*this)->Collection->Families[(*this)->Index].FontCount;
+        }
+
+        inline auto FontFamily::GetFont(unsigned const index) const -> Font
+        {
+            auto const & family = (*this)->Collection->Families[(*this)->Index];
+
+            if (index >= family.FontCount)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            auto const result = Details::Make<Details::FontImpl>();
+            result->Collection = (*this)->Collection;
+            result->Index = family.FirstFont + index;
+            return Font(result);
+        }
+
+        // Stretch matters most, then style, then weight, with an oblique font standing
+        // in for an italic one and the reverse.
+        inline auto FontFamily::GetFirstMatchingFont(FontWeight const weight,
+                                                     FontStretch const stretch,
+                                                     FontStyle const style) const -> Font
+        {
+            auto const & collection = *(*this)->Collection;
+            auto const & family = collection.Families[(*this)->Index];
+
+            if (0 == family.FontCount)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            unsigned best = 0;
+            auto bestScore = ~0u;
+
+            for (unsigned i = 0; i != family.FontCount; ++i)
+            {
+                auto const & font = collection.Fonts[family.FirstFont + i];
+                auto const styleDistance = static_cast<unsigned>(style) == font.Style ? 0u :
+                                           FontStyle::Normal != style && 0 != font.Style ? 1u : 2u;
+
+                auto const score = static_cast<unsigned>(std::abs(static_cast<int>(stretch) - font.Stretch)) * 100000 +
+                                   styleDistance * 10000 +
+                                   static_cast<unsigned>(std::abs(static_cast<int>(weight) - font.Weight));
+
+                if (score < bestScore)
+                {
+                    best = i;
+                    bestScore = score;
+                }
+            }
+
+            return GetFont(best);
+        }
+
+        inline FontCollection::iterator::iterator(unsigned const index,
+                                                  FontCollection const * container) :
+            m_index(index),
+            m_container(container)
+        {}
+
+        inline auto FontCollection::iterator::operator *() const -> FontFamily
+        {
+            return m_container->GetFontFamily(m_index);
+        }
+
+        inline auto FontCollection::iterator::operator ++() -> iterator &
+        {
+            ++m_index;
+            return *this;
+        }
+
+        inline auto FontCollection::iterator::operator ==(iterator const & other) const -> bool
+        {
+            return m_index == other.m_index;
+        }
+
+        inline auto FontCollection::iterator::operator !=(iterator const & other) const -> bool
+        {
+            return !(*this == other);
+        }
+
+        inline auto FontCollection::begin() const -> iterator
+        {
+            return iterator(0, this);
+        }
+
+        inline auto FontCollection::end() const -> iterator
+        {
+            return iterator(GetFontFamilyCount(), this);
+        }
+
+        inline auto FontCollection::GetFontFamilyCount() const -> unsigned
+        {
+            return (*this)->Header.FamilyCount;
+        }
+
+        inline auto FontCollection::GetFontFamily(unsigned const index) const -> FontFamily
+        {
+            if (index >= (*this)->Header.FamilyCount)
+            {
+                HR(E_INVALIDARG);
+            }
+
+            auto const result = Details::Make<Details::FontFamilyImpl>();
+            result->Collection = Share();
+            result->Index = index;
+            return FontFamily(result);
+        }
+
+        inline auto FontCollection::FindFamilyName(wchar_t const * familyName,
+                                                   unsigned & index) const -> bool
+        {
+            auto const family = (*this)->FindFamily(familyName);
+            index = Details::NoFontFamily == family ? 0 : family;
+            return Details::NoFontFamily != family;
+        }
+
+        // Indexes the families of the font files. With a cache file, an index saved for the
+        // same files, unchanged since, is mapped rather than scanning them, and otherwise
+        // the index is saved there for next time. The cache is only an optimization, so
+        // failing to read or write it is not an error.
+        inline auto CreateFontCollection(char const * const * filenames,
+                                         unsigned const count,
+                                         char const * cacheFilename = nullptr) -> FontCollection
+        {
+            auto const result = Details::Make<Details::FontCollectionImpl>();
+
+            if (cacheFilename)
+            {
+                auto const file = std::make_shared<Details::MappedFile>();
+
+                if (S_OK == file->Open(cacheFilename) &&
+                    result->Attach(file->GetBits(), file->GetSize()) &&
+                    result->Matches(filenames, count))
+                {
+                    result->File = file;
+                    return FontCollection(result);
+                }
+            }
+
+            Details::FontIndexBuilder builder;
+
+            for (unsigned i = 0; i != count; ++i)
+            {
+                builder.AddFile(filenames[i]);
+            }
+
+            builder.Build(result->Storage);
+            auto const bits = reinterpret_cast<std::uint8_t const *>(result->Storage.data());
+            auto const size = result->Storage.size() * sizeof(std::uint64_t);
+            VERIFY(result->Attach(bits, size));
+
+            // The index is written beside the cache and moved into place, so that another
+            // process never maps half of it.
+            if (cacheFilename)
+            {
+                auto const temporary = std::string(cacheFilename) + ".tmp";
+                auto const file = Details::OpenFile(temporary.c_str(), "wb");
+
+                if (file)
+                {
+                    auto saved = size == std::fwrite(bits, 1, size, file);
+                    saved = 0 == std::fclose(file) && saved;
+#ifdef _WIN32
+                    if (saved)
+                    {
+                        std::remove(cacheFilename);
+                    }
+#endif
+                    if (!saved || 0 != std::rename(temporary.c_str(), cacheFilename))
+                    {
+                        std::remove(temporary.c_str());
+                    }
+                }
+            }
+
+            return FontCollection(result);
+        }
+
+        struct CommandTiming
+        {
+            char const * Name;
+            double Seconds;
+        };
+
+        // Replays a closed command list onto a target the given number of times, each
+        // between BeginDraw and EndDraw, and adds up the time each command takes.
+        inline void ProfileCommandList(CommandList const & list,
+                                       RenderTarget const & target,
+                                       unsigned const iterations,
+                                       std::vector<CommandTiming> & timings)
+        {
+            if (!list->Closed)
+            {
+                HR(D2DERR_WRONG_STATE);
+            }
+
+            timings.clear();
+
+            list->Commands.ForEach([&] (std::uint8_t const * bits) -> unsigned
+            {
+                auto const & command = *reinterpret_cast<Details::Command const *>(bits);
+                CommandTiming const timing = { Details::GetCommandName(command.Type), 0.0 };
+                timings.push_back(timing);
+                return command.Size;
+            });
+
+            for (unsigned i = 0; i != iterations; ++i)
+            {
+                target.BeginDraw();
+                Details::TargetSinkImpl sink(*target.Get());
+                sink.BeginDraw();
+                auto state = Details::BeginReplay(sink, Matrix3x2F());
+                auto timing = timings.begin();
+
+                list->Commands.ForEach([&] (std::uint8_t const * bits) -> unsigned
+                {
+                    auto const & command = *reinterpret_cast<Details::Command const *>(bits);
+                    auto const start = std::chrono::steady_clock::now();
+                    Details::ReplayCommand(*list.Get(), command, sink, state);
+                    (timing++)->Seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    return command.Size;
+                });
+
+                sink.EndDraw();
+                HR(target.EndDraw());
+            }
+        }
+
+#ifdef _WIN32
+        // Presents only the rectangles the last frame of the target drew into, once its
+        // pixels have been copied to the back buffer. A full frame is presented whole.
+        inline auto Present(Dxgi::SwapChain1 const & swapChain,
+                            RenderTarget const & target,
+                            unsigned const sync = 1,
+                            Dxgi::Present const flags = Dxgi::Present::None) -> HRESULT
+        {
+            auto const & dirty = target->Dirty;
+            auto const whole = target->GetTargetRect();
+            RECT rects[Details::DirtyRegion::MaximumCount];
+            auto count = dirty.GetCount();
+
+            // A frame that drew nothing leaves the back buffer as it was.
+            if (0 == count)
+            {
+                return S_OK;
+            }
+
+            for (unsigned i = 0; i != count; ++i)
+            {
+                rects[i].left = dirty[i].Left;
+                rects[i].top = dirty[i].Top;
+                rects[i].right = dirty[i].Right;
+                rects[i].bottom = dirty[i].Bottom;
+            }
+
+            if (1 == count &&
+                whole.Left == dirty[0].Left && whole.Top == dirty[0].Top &&
+                whole.Right == dirty[0].Right && whole.Bottom == dirty[0].Bottom)
+            {
+                count = 0;
+            }
+
+            return swapChain.Present1(sync, flags, rects, count);
+        }
+#endif
+
+    } // Cpu
+
+} // KennyKerr
@@ -2963,6 +2963,11 @@ namespace KennyKerr
 
             void SetRotation(ModeRotation mode) const;
             auto GetRotation() const -> ModeRotation;
+
+            auto Present1(unsigned const sync,
+                          Dxgi::Present const flags,
+                          RECT const * dirtyRects,
+                          unsigned const count) const -> HRESULT;
         };
 
         struct Resource : Details::Object
@@ -6104,6 +6109,20 @@ namespace KennyKerr
             return result;
         }
 
+        inline auto SwapChain1::Present1(unsigned const sync,
+                                         Dxgi::Present const flags,
+                                         RECT const * dirtyRects,
+                                         unsigned const count) const -> HRESULT
+        {
+            DXGI_PRESENT_PARAMETERS parameters = {};
+            parameters.DirtyRectsCount = count;
+            parameters.pDirtyRects = const_cast<RECT *>(dirtyRects);
+
+            return (*this)->Present1(sync,
+                                     static_cast<unsigned>(flags),
+                                     &parameters);
+        }
+
         inline auto Resource::GetSharedHandle() const -> HANDLE
         {
             HANDLE result;